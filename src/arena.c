@@ -0,0 +1,143 @@
+#include "arena.h"
+#include "common.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+struct _arena_chunk {
+    struct _arena_chunk *next;
+    size_t              size;
+    char                data[];
+};
+
+struct _arena {
+    struct _arena_chunk *head;
+    struct _arena_chunk *current;
+    size_t              pos;
+    size_t              chunk_size;
+    // Bytes handed out from the chunks before the current one
+    size_t              used;
+};
+
+static struct _arena_chunk *_create_chunk(size_t size);
+
+
+arena_t *arena_create(size_t chunk_size) {
+    arena_t *arena;
+
+    arena = (arena_t*) calloc(1, sizeof(arena_t));
+    if (arena == NULL) {
+        error("Error allocating arena memory");
+        return NULL;
+    }
+    arena->chunk_size = ARENA_ALIGN(chunk_size);
+    arena->head = _create_chunk(arena->chunk_size);
+    if (arena->head == NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->current = arena->head;
+    return arena;
+}
+
+int arena_destroy(arena_t *arena) {
+    struct _arena_chunk *chunk, *next;
+
+    for (chunk = arena->head; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(arena);
+    return 0;
+}
+
+/*
+ * Give all the memory back at once. Nothing is freed, the chunks are
+ * used again from the first one.
+ */
+void arena_reset(arena_t *arena) {
+    arena->current = arena->head;
+    arena->pos = 0;
+    arena->used = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    struct _arena_chunk *chunk, *prev;
+    void                *res;
+
+    size = ARENA_ALIGN(size);
+    if (arena->pos + size > arena->current->size) {
+        // Move on to the next chunk that is large enough, the ones
+        // skipped are only used again after a reset.
+        prev = arena->current;
+        for (chunk = prev->next; chunk != NULL && chunk->size < size; chunk = chunk->next) {
+            prev = chunk;
+        }
+        if (chunk == NULL) {
+            chunk = _create_chunk(MAX(arena->chunk_size, size));
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = prev->next;
+            prev->next = chunk;
+        }
+        arena->used += arena->pos;
+        arena->current = chunk;
+        arena->pos = 0;
+    }
+    res = arena->current->data + arena->pos;
+    arena->pos += size;
+    return res;
+}
+
+char *arena_strdup(arena_t *arena, const char *str) {
+    size_t  len = strlen(str) + 1;
+    char    *res;
+
+    res = (char*) arena_alloc(arena, len);
+    if (res != NULL) {
+        memcpy(res, str, len);
+    }
+    return res;
+}
+
+char *arena_vprintf(arena_t *arena, const char *fmt, va_list ap) {
+    va_list ap2;
+    char    *res;
+    int     len;
+
+    va_copy(ap2, ap);
+    len = vsnprintf(NULL, 0, fmt, ap2);
+    va_end(ap2);
+    if (len < 0) {
+        return NULL;
+    }
+    res = (char*) arena_alloc(arena, len + 1);
+    if (res != NULL) {
+        vsnprintf(res, len + 1, fmt, ap);
+    }
+    return res;
+}
+
+/*
+ * Bytes handed out since the last reset, including the padding.
+ */
+size_t arena_used(arena_t *arena) {
+    return arena->used + arena->pos;
+}
+
+static struct _arena_chunk *_create_chunk(size_t size) {
+    struct _arena_chunk *chunk;
+
+    chunk = (struct _arena_chunk*) malloc(sizeof(struct _arena_chunk) + size);
+    if (chunk == NULL) {
+        error("Error allocating arena memory");
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}
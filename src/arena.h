@@ -0,0 +1,25 @@
+#ifndef __ARENA_H
+
+#define __ARENA_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+struct _arena;
+
+/*
+ * A bump allocator for memory that lives as long as a request. The
+ * memory is handed out from chunks that are kept when the arena is
+ * reset, so once warmed up it does not call malloc any more.
+ */
+typedef struct _arena arena_t;
+
+arena_t     *arena_create(size_t chunk_size);
+int          arena_destroy(arena_t *arena);
+void         arena_reset(arena_t *arena);
+void        *arena_alloc(arena_t *arena, size_t size);
+char        *arena_strdup(arena_t *arena, const char *str);
+char        *arena_vprintf(arena_t *arena, const char *fmt, va_list ap);
+size_t       arena_used(arena_t *arena);
+
+#endif /* end of include guard: __ARENA_H */
@@ -43,6 +43,7 @@ int main(int argc, char *argv[]) {
         error("Error creating server\n");
         return 1;
     }
+    server->argv = argv;
 
     if (opt->is_conf_test) {
         print_conf_details(server);
@@ -17,6 +17,12 @@ struct _buffer {
     int         tail;
 };
 
+struct _shared_buffer {
+    int         refcount;
+    size_t      size;
+    byte_t      data[];
+};
+
 __inline__ static void _do_put(buffer_t *buf, byte_t *data, size_t len);
 __inline__ static void _do_get(buffer_t *buf, byte_t *target, size_t len);
 __inline__ static void _do_consume(buffer_t *buf, size_t len, consumer_func func, void *args);
@@ -44,6 +50,44 @@ buffer_t *buffer_create(size_t size) {
 }
 
 
+/*
+ * Move the content into a buffer of a different capacity. Returns the
+ * new buffer (the old one is freed), or NULL if the content does not
+ * fit or there is no memory, in which case the old buffer is intact.
+ */
+buffer_t *buffer_resize(buffer_t *buf, size_t size) {
+    buffer_t    *new_buf;
+    size_t      len = buf->size;
+
+    if (size < len) {
+        return NULL;
+    }
+    new_buf = buffer_create(size);
+    if (new_buf == NULL) {
+        return NULL;
+    }
+    buffer_get(buf, len, new_buf->data, size);
+    new_buf->size = len;
+    new_buf->tail = len % size;
+    free(buf);
+    return new_buf;
+}
+
+
+size_t buffer_capacity(buffer_t *buf) {
+    return buf->capacity;
+}
+
+
+/*
+ * Drop the content, the memory is kept for reuse.
+ */
+void buffer_clear(buffer_t *buf) {
+    buf->size = 0;
+    buf->head = 0;
+    buf->tail = 0;
+}
+
 int buffer_destroy(buffer_t *buf) {
     if (buf == NULL)
         return -1;
@@ -87,6 +131,10 @@ int buffer_put(buffer_t *buf, void *data, size_t len) {
 ssize_t buffer_fill(buffer_t *buf, int fd) {
     ssize_t  n, iovcnt;
     struct iovec iov[2];
+
+    if (buffer_is_full(buf)) {
+        return 0;
+    }
     
     iov[0].iov_base = buf->data + buf->tail;
     if (buf->head > buf->tail) {
@@ -228,7 +276,7 @@ int buffer_locate(buffer_t *buf, char *delimiter) {
         delim_len = strlen(delimiter);
         memcpy(tmp, buf->data + buf->capacity - delim_len, delim_len);
         memcpy(tmp + delim_len, buf->data, delim_len);
-        tmp[delim_len * 2 + 1] = '\0';
+        tmp[delim_len * 2] = '\0';
         sub = strstr(tmp, delimiter);
         if (sub != NULL) {
             idx = buf->capacity - delim_len - buf->head + (sub - tmp);
@@ -249,6 +297,99 @@ finish:
     return idx;
 }
 
+/*
+ * Describe len bytes of the buffer content, starting skip bytes after
+ * the head, with at most 2 iovecs (the content may wrap around). The
+ * buffer itself is not modified.
+ */
+int buffer_iovec(buffer_t *buf, size_t skip, size_t len, struct iovec *iov) {
+    size_t  start, first;
+
+    if (skip + len > buf->size) {
+        len = buf->size > skip ? buf->size - skip : 0;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    start = (buf->head + skip) % buf->capacity;
+    first = MIN(len, buf->capacity - start);
+    iov[0].iov_base = buf->data + start;
+    iov[0].iov_len = first;
+    if (first == len) {
+        return 1;
+    }
+    iov[1].iov_base = buf->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+
+/*
+ * Rotate the content so that it starts at the beginning of the memory
+ * and is contiguous. Returns a pointer to the content, or NULL if there
+ * is no memory for the rotation (the buffer is intact then).
+ */
+void *buffer_linearize(buffer_t *buf) {
+    byte_t  *tmp;
+    size_t  first;
+
+    if (buf->size == 0 || buf->head + buf->size <= buf->capacity) {
+        return buf->data + buf->head;
+    }
+    first = buf->capacity - buf->head;
+    tmp = (byte_t*) malloc(buf->tail);
+    if (tmp == NULL) {
+        return NULL;
+    }
+    memcpy(tmp, buf->data, buf->tail);
+    memmove(buf->data, buf->data + buf->head, first);
+    memcpy(buf->data + first, tmp, buf->tail);
+    free(tmp);
+    buf->head = 0;
+    buf->tail = buf->size % buf->capacity;
+    return buf->data;
+}
+
+shared_buffer_t *shared_buffer_create(const void *data, size_t len) {
+    shared_buffer_t  *sbuf;
+
+    sbuf = (shared_buffer_t*) malloc(sizeof(shared_buffer_t) + len);
+    if (sbuf == NULL) {
+        error("Error allocating shared buffer memory");
+        return NULL;
+    }
+    sbuf->refcount = 1;
+    sbuf->size = len;
+    memcpy(sbuf->data, data, len);
+    return sbuf;
+}
+
+shared_buffer_t *shared_buffer_ref(shared_buffer_t *sbuf) {
+    sbuf->refcount++;
+    return sbuf;
+}
+
+/*
+ * Release a reference. Returns 1 if this was the last one and the
+ * memory has been freed.
+ */
+int shared_buffer_unref(shared_buffer_t *sbuf) {
+    if (--sbuf->refcount > 0) {
+        return 0;
+    }
+    free(sbuf);
+    return 1;
+}
+
+const char *shared_buffer_data(shared_buffer_t *sbuf) {
+    return (const char*) sbuf->data;
+}
+
+size_t shared_buffer_size(shared_buffer_t *sbuf) {
+    return sbuf->size;
+}
+
 __inline__ static void _do_put(buffer_t *buf, byte_t *data, size_t len) {
     memcpy(buf->data + buf->tail, data, len);
     buf->size += len;
@@ -3,15 +3,27 @@
 #define __BUFFER_H
 
 #include <unistd.h>
+#include <sys/uio.h>
 
 struct _buffer;
+struct _shared_buffer;
 
 typedef struct _buffer buffer_t;
 
+/*
+ * An immutable, reference counted chunk of memory. It could be queued
+ * by many streams at the same time without being copied, and is freed
+ * when the last reference is released.
+ */
+typedef struct _shared_buffer shared_buffer_t;
+
 typedef void (*consumer_func)(void *data, size_t len, void *args);
 
 buffer_t    *buffer_create(size_t size);
+buffer_t    *buffer_resize(buffer_t *buf, size_t size);
+size_t       buffer_capacity(buffer_t *buf);
 int          buffer_destroy(buffer_t *buf);
+void         buffer_clear(buffer_t *buf);
 int          buffer_is_full(buffer_t *buf);
 int          buffer_is_empty(buffer_t *buf);
 int          buffer_put(buffer_t *buf, void *data, size_t len);
@@ -21,5 +33,13 @@ ssize_t      buffer_fill(buffer_t *buf, int fd);
 ssize_t      buffer_flush(buffer_t *buf, int fd);
 size_t       buffer_consume(buffer_t *buf, size_t len, consumer_func cb, void *args);
 int          buffer_locate(buffer_t *buf, char *delimiter);
+int          buffer_iovec(buffer_t *buf, size_t skip, size_t len, struct iovec *iov);
+void        *buffer_linearize(buffer_t *buf);
+
+shared_buffer_t *shared_buffer_create(const void *data, size_t len);
+shared_buffer_t *shared_buffer_ref(shared_buffer_t *sbuf);
+int              shared_buffer_unref(shared_buffer_t *sbuf);
+const char      *shared_buffer_data(shared_buffer_t *sbuf);
+size_t           shared_buffer_size(shared_buffer_t *sbuf);
 
 #endif /* end of include guard: __BUFFER_H */
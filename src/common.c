@@ -3,8 +3,12 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-inline void strlowercase(const char *src, char *dst, size_t n) {
+void strlowercase(const char *src, char *dst, size_t n) {
     int i;
     const char *p;
     for (i = 0, p = src;
@@ -43,30 +47,116 @@ int current_http_date(char *dst, size_t len) {
     return 0;
 }
 
-int path_starts_with(const char* prefix, const char* path) {
-    int match_count;
+str_t str_from_cstr(const char *s) {
+    str_t   str;
 
-    if (path == NULL || prefix ==  NULL)
-        return 0;
+    str.ptr = s;
+    str.len = s != NULL ? strlen(s) : 0;
+    return str;
+}
+
+int str_equals(str_t a, str_t b) {
+    return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+int str_case_equals(str_t a, str_t b) {
+    return a.len == b.len && strncasecmp(a.ptr, b.ptr, a.len) == 0;
+}
 
-    match_count = 0;
+/*
+ * Is the token one of the comma separated list of a header value, as in
+ * "Connection: keep-alive, Upgrade"? Compared without regard to case.
+ */
+int has_token(const char *list, const char *token) {
+    size_t  len = strlen(token);
+    const char *p = list;
 
-    while (*path != '\0' && *prefix != '\0' && *path == *prefix) {
-        match_count++;
-        path++;
-        prefix++;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        if (strncasecmp(p, token, len) == 0
+            && (p[len] == '\0' || p[len] == ',' || p[len] == ' ')) {
+            return 1;
+        }
+        while (*p != '\0' && *p != ',') {
+            p++;
+        }
     }
+    return 0;
+}
 
-    if (*prefix == '\0'
-        && (*path == '\0' || *path == '/' || *(prefix-1) == '/'))
-        return match_count; 
-    else 
+/*
+ * Is the entity tag one of the list of an If-None-Match header? This is
+ * the weak comparison, a W/ on either side is not looked at, and "*"
+ * matches any tag.
+ */
+int etag_matches(const char *list, const char *etag) {
+    const char  *p = list, *end;
+    size_t      len;
+
+    if (strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+    }
+    len = strlen(etag);
+    while (*p != '\0') {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        // A quoted tag may have a comma in it
+        if (*p == '"' && (end = strchr(p + 1, '"')) != NULL) {
+            end++;
+        } else {
+            end = p + strcspn(p, ", ");
+        }
+        if ((size_t) (end - p) == len && strncmp(p, etag, len) == 0) {
+            return 1;
+        }
+        p = end;
+        while (*p != '\0' && *p != ',') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+int path_starts_with(const char* prefix, const char* path) {
+    if (path == NULL || prefix ==  NULL)
+        return 0;
+    return path_starts_with_str(str_from_cstr(prefix), str_from_cstr(path));
+}
+
+/*
+ * Returns the length of the prefix if the path is in it, that is if the
+ * prefix matches up to a '/' in the path, 0 otherwise.
+ */
+int path_starts_with_str(str_t prefix, str_t path) {
+    if (prefix.len == 0 || prefix.len > path.len
+        || memcmp(prefix.ptr, path.ptr, prefix.len) != 0)
+        return 0;
+
+    if (prefix.len == path.len
+        || path.ptr[prefix.len] == '/'
+        || prefix.ptr[prefix.len - 1] == '/')
+        return prefix.len;
+    else
         return 0;
 }
 
 
 char* url_decode(char *dst, const char *src) {
     char a, b;
+
+    // Nothing escaped, usually
+    if (dst == src && strchr(src, '%') == NULL) {
+        return dst + strlen(dst) + 1;
+    }
     while (*src) {
         if ((*src == '%') &&
             ((a = src[1]) && (b = src[2])) &&
@@ -92,3 +182,139 @@ char* url_decode(char *dst, const char *src) {
     *dst++ = '\0';
     return dst;
 }
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/*
+ * A path without escapes, "//" or dot segments is left as it is. Any
+ * '/' followed by '/' or '.' takes the slow path, even when harmless.
+ */
+static int _path_is_canonical(const char *p, const char *end) {
+#ifdef __SSE2__
+    __m128i     pct = _mm_set1_epi8('%'), slash = _mm_set1_epi8('/');
+    __m128i     dot = _mm_set1_epi8('.'), v, next, m;
+
+    // The next byte is loaded along, hence one more than a block
+    for (; end - p > 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i*) p);
+        next = _mm_loadu_si128((const __m128i*) (p + 1));
+        m = _mm_and_si128(_mm_cmpeq_epi8(v, slash),
+                          _mm_or_si128(_mm_cmpeq_epi8(next, slash),
+                                       _mm_cmpeq_epi8(next, dot)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, pct));
+        if (_mm_movemask_epi8(m) != 0) {
+            return 0;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '%'
+            || (*p == '/' && p + 1 < end && (p[1] == '/' || p[1] == '.'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Decode a request path in place and normalize it in the same pass:
+ * "//" becomes "/", "." segments are dropped and ".." removes the
+ * segment before it. Returns the new length, or -1 if the path does
+ * not start with '/', climbs above the root, or holds an escaped NUL.
+ */
+ssize_t url_normalize_path(char *path, size_t len) {
+    char    *r = path + 1, *w = path + 1, *end = path + len, *seg = path;
+    int     c, hi, lo;
+
+    if (len == 0 || *path != '/') {
+        return -1;
+    }
+    if (_path_is_canonical(path, end)) {
+        return len;
+    }
+    // seg is the '/' before the segment being written
+    for (;;) {
+        if (r < end) {
+            c = (unsigned char) *r++;
+            if (c == '%' && end - r >= 2
+                && (hi = hex_value(r[0])) >= 0 && (lo = hex_value(r[1])) >= 0) {
+                c = (hi << 4) | lo;
+                r += 2;
+                if (c == '\0') {
+                    return -1;
+                }
+            }
+        } else {
+            c = '\0';
+        }
+        if (c != '/' && c != '\0') {
+            *w++ = c;
+            continue;
+        }
+        if (w - seg == 2 && seg[1] == '.') {
+            w = seg + 1;
+        } else if (w - seg == 3 && seg[1] == '.' && seg[2] == '.') {
+            if (seg == path) {
+                return -1;
+            }
+            for (seg--; *seg != '/'; seg--);
+            w = seg + 1;
+        }
+        if (c == '\0') {
+            break;
+        }
+        // An empty segment is dropped
+        if (w != seg + 1) {
+            seg = w;
+            *w++ = '/';
+        }
+    }
+    *w = '\0';
+    return w - path;
+}
+
+void size_hist_add(size_hist_t *hist, size_t size) {
+    int i = 0;
+
+    while (i < SIZE_HIST_BUCKETS - 1
+           && size > ((size_t) 1 << (SIZE_HIST_MIN_SHIFT + i))) {
+        i++;
+    }
+    hist->buckets[i]++;
+    hist->count++;
+
+    if (hist->count >= SIZE_HIST_DECAY) {
+        hist->count = 0;
+        for (i = 0; i < SIZE_HIST_BUCKETS; i++) {
+            hist->buckets[i] /= 2;
+            hist->count += hist->buckets[i];
+        }
+    }
+}
+
+/*
+ * Returns the upper bound of the bucket where the given percentile of
+ * the samples falls, or 0 if there is no sample yet.
+ */
+size_t size_hist_percentile(const size_hist_t *hist, int percentile) {
+    unsigned long  sum = 0, target;
+    int i;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+    target = ((unsigned long) hist->count * percentile + 99) / 100;
+    for (i = 0; i < SIZE_HIST_BUCKETS - 1; i++) {
+        sum += hist->buckets[i];
+        if (sum >= target) {
+            break;
+        }
+    }
+    return (size_t) 1 << (SIZE_HIST_MIN_SHIFT + i);
+}
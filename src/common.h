@@ -6,6 +6,7 @@
 #define _BSD_SOURCE
 
 #include <stddef.h>
+#include <sys/types.h>
 #include <time.h>
 
 enum _return_status {
@@ -15,6 +16,7 @@ enum _return_status {
 };
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define _BREEZE_NAME "breeze/0.1.0"
 
@@ -44,7 +46,47 @@ enum _return_status {
 #define END_CONF_HANDLE()                                               \
     else {warn("Unknown config option %s with type %d", name, val->type); } }
 
-inline void strlowercase(const char *src, char *dst, size_t n);
+/*
+ * Histogram of sizes with power-of-two buckets. Bucket i counts the
+ * sizes no larger than 2^(SIZE_HIST_MIN_SHIFT + i); the last bucket
+ * counts everything above. Old samples decay so that the histogram
+ * follows the recent traffic.
+ */
+#define SIZE_HIST_BUCKETS    16
+#define SIZE_HIST_MIN_SHIFT  8
+#define SIZE_HIST_DECAY      65536
+
+typedef struct _size_hist {
+    unsigned int    buckets[SIZE_HIST_BUCKETS];
+    unsigned int    count;
+} size_hist_t;
+
+void   size_hist_add(size_hist_t *hist, size_t size);
+size_t size_hist_percentile(const size_hist_t *hist, int percentile);
+
+/*
+ * A slice of a string, it is not necessarily NUL-terminated. Used where
+ * the length is already known, to save the strlen and the copy needed
+ * to terminate a token.
+ */
+typedef struct _str {
+    const char  *ptr;
+    size_t      len;
+} str_t;
+
+// A slice of a string literal
+#define STR(lit)    ((str_t) {(lit), sizeof(lit) - 1})
+
+str_t  str_from_cstr(const char *s);
+int    str_equals(str_t a, str_t b);
+int    str_case_equals(str_t a, str_t b);
+
+void   strlowercase(const char *src, char *dst, size_t n);
+
+int    has_token(const char *list, const char *token);
+int    etag_matches(const char *list, const char *etag);
+// The value of a hex digit, -1 if it is not one
+int    hex_value(char c);
 
 void format_http_date(const time_t *time, char *dst, size_t len);
 
@@ -53,7 +95,10 @@ int  parse_http_date(const char* str, time_t *time);
 int  current_http_date(char *dst, size_t len);
 
 int  path_starts_with(const char *prefix, const char *path);
+int  path_starts_with_str(str_t prefix, str_t path);
 
 char* url_decode(char *dst, const char *src);
 
+ssize_t url_normalize_path(char *path, size_t len);
+
 #endif /* end of include guard: __COMMON_H */
@@ -0,0 +1,71 @@
+#include "filter.h"
+#include "filter_gzip.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const output_filter_t *filters[] = {
+    &filter_gzip
+};
+
+const output_filter_t *find_filter(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        if (strcmp(name, filters[i]->name) == 0) {
+            return filters[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Build the chain of a location from the names of its filters, in the
+ * order the body goes through them. Each filter reads its options from
+ * the location object.
+ */
+filter_chain_t *filter_chain_parse(json_value *names, json_value *location) {
+    filter_chain_t          *chain;
+    const output_filter_t   *filter;
+    json_value              *val;
+    unsigned int            i;
+
+    if (names->type != json_array || names->u.array.length > MAX_FILTERS) {
+        error("'filters' must be an array of at most %d names", MAX_FILTERS);
+        return NULL;
+    }
+    chain = (filter_chain_t*) calloc(1, sizeof(filter_chain_t));
+    if (chain == NULL) {
+        error("Error allocating memory for the filter chain");
+        return NULL;
+    }
+    for (i = 0; i < names->u.array.length; i++) {
+        val = names->u.array.values[i];
+        if (val->type != json_string
+            || (filter = find_filter(val->u.string.ptr)) == NULL) {
+            error("Unknown filter: %s",
+                  val->type == json_string ? val->u.string.ptr : "(not a string)");
+            filter_chain_destroy(chain);
+            return NULL;
+        }
+        chain->filters[chain->count] = filter;
+        chain->confs[chain->count] = filter->create != NULL ? filter->create(location) : NULL;
+        chain->count++;
+    }
+    return chain;
+}
+
+int filter_chain_destroy(filter_chain_t *chain) {
+    int i;
+
+    if (chain == NULL) {
+        return 0;
+    }
+    for (i = 0; i < chain->count; i++) {
+        if (chain->filters[i]->destroy != NULL) {
+            chain->filters[i]->destroy(chain->confs[i]);
+        }
+    }
+    free(chain);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef __FILTER_H_
+#define __FILTER_H_
+
+#include "http.h"
+#include "json.h"
+
+const output_filter_t *find_filter(const char *name);
+
+filter_chain_t *filter_chain_parse(json_value *names, json_value *location);
+int             filter_chain_destroy(filter_chain_t *chain);
+
+#endif /* __FILTER_H_ */
@@ -0,0 +1,215 @@
+#include "filter_gzip.h"
+#include "common.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#define GZIP_OUT_SIZE   8192
+
+typedef struct _gzip_state {
+    z_stream    zs;
+    char        out[GZIP_OUT_SIZE];
+} gzip_state_t;
+
+static void *filter_gzip_conf_create(json_value *location);
+static void  filter_gzip_conf_destroy(void *conf);
+static int   filter_gzip_init(filter_t *filter, request_t *req, response_t *resp);
+static int   filter_gzip_write(filter_t *filter, const char *data, size_t len);
+static int   filter_gzip_flush(filter_t *filter);
+static int   filter_gzip_end(filter_t *filter);
+static void  filter_gzip_cleanup(filter_t *filter);
+
+output_filter_t filter_gzip = {
+    "gzip",
+    filter_gzip_conf_create,
+    filter_gzip_conf_destroy,
+    filter_gzip_init,
+    filter_gzip_write,
+    filter_gzip_flush,
+    filter_gzip_end,
+    filter_gzip_cleanup
+};
+
+static const char *compressible_types[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "image/svg+xml",
+    NULL
+};
+
+static void *filter_gzip_conf_create(json_value *location) {
+    filter_gzip_conf_t  *conf;
+    DECLARE_CONF_VARIABLES()
+
+    conf = (filter_gzip_conf_t*) calloc(1, sizeof(filter_gzip_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+    conf->level = Z_DEFAULT_COMPRESSION;
+    conf->min_length = 256;
+
+    for (i = 0; i < location->u.object.length; i++) {
+        name = location->u.object.values[i].name;
+        val = location->u.object.values[i].value;
+        if (val->type != json_integer) {
+            continue;
+        }
+        if (strcmp(name, "gzip_level") == 0) {
+            conf->level = val->u.integer;
+        } else if (strcmp(name, "gzip_min_length") == 0) {
+            conf->min_length = val->u.integer;
+        }
+    }
+    if (conf->level != Z_DEFAULT_COMPRESSION && (conf->level < 1 || conf->level > 9)) {
+        warn("Invalid gzip_level %d, using the default", conf->level);
+        conf->level = Z_DEFAULT_COMPRESSION;
+    }
+    return conf;
+}
+
+static void filter_gzip_conf_destroy(void *conf) {
+    free(conf);
+}
+
+static int _is_compressible(const char *type) {
+    const char  **p;
+
+    if (type == NULL) {
+        return 0;
+    }
+    for (p = compressible_types; *p != NULL; p++) {
+        if (strncasecmp(type, *p, strlen(*p)) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether gzip is among the codings of an Accept-Encoding value, and
+ * not refused with a q of 0.
+ */
+static int _accepts_gzip(const char *value) {
+    const char  *p = value, *token;
+    size_t      len;
+
+    while (p != NULL && *p != '\0') {
+        p += strspn(p, " \t,");
+        token = p;
+        len = strcspn(p, " \t,;");
+        p += len;
+        if ((len == 4 && strncasecmp(token, "gzip", 4) == 0)
+            || (len == 1 && *token == '*')) {
+            p += strspn(p, " \t");
+            if (*p == ';') {
+                p += 1 + strspn(p + 1, " \t");
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    return strtod(p + 2, NULL) > 0;
+                }
+            }
+            return 1;
+        }
+        p = strchr(p, ',');
+    }
+    return 0;
+}
+
+static int filter_gzip_init(filter_t *filter, request_t *req, response_t *resp) {
+    filter_gzip_conf_t  *conf = (filter_gzip_conf_t*) filter->conf;
+    gzip_state_t        *gz;
+    const char          *value;
+    char                *etag;
+
+    if (conf == NULL || resp->status.code != 200
+        || strcmp(req->method, "HEAD") == 0
+        || response_get_header_id(resp, HTTP_HEADER_CONTENT_ENCODING) != NULL
+        || (resp->content_length >= 0 && resp->content_length < conf->min_length)
+        || !_is_compressible(response_get_header_id(resp, HTTP_HEADER_CONTENT_TYPE))) {
+        return 1;
+    }
+    // Caches must tell the clients that take gzip from the others
+    response_set_header_id_str(resp, HTTP_HEADER_VARY, STR("Accept-Encoding"));
+    value = request_get_header_id(req, HTTP_HEADER_ACCEPT_ENCODING);
+    if (value == NULL || !_accepts_gzip(value)) {
+        return 1;
+    }
+
+    gz = (gzip_state_t*) response_alloc(resp, sizeof(gzip_state_t));
+    if (gz == NULL) {
+        return 1;
+    }
+    bzero(&gz->zs, sizeof(z_stream));
+    // 16 more window bits for the gzip wrapper
+    if (deflateInit2(&gz->zs, conf->level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        error("Error initializing gzip stream");
+        return 1;
+    }
+    filter->data = gz;
+
+    response_set_header_id_str(resp, HTTP_HEADER_CONTENT_ENCODING, STR("gzip"));
+    resp->content_length = -1;
+    // The compressed body is not the same bytes any more
+    value = response_get_header_id(resp, HTTP_HEADER_ETAG);
+    if (value != NULL && strncmp(value, "W/", 2) != 0
+        && (etag = response_alloc(resp, strlen(value) + 3)) != NULL) {
+        strcpy(etag, "W/");
+        strcpy(etag + 2, value);
+        response_set_header_id(resp, HTTP_HEADER_ETAG, etag);
+    }
+    return 0;
+}
+
+/*
+ * Run deflate on the pending input, what comes out is passed on as the
+ * output buffer fills.
+ */
+static int _deflate(filter_t *filter, int flush) {
+    gzip_state_t    *gz = (gzip_state_t*) filter->data;
+    size_t          n;
+    int             rc;
+
+    do {
+        gz->zs.next_out = (Bytef*) gz->out;
+        gz->zs.avail_out = GZIP_OUT_SIZE;
+        rc = deflate(&gz->zs, flush);
+        if (rc == Z_STREAM_ERROR) {
+            error("Error compressing the body");
+            return -1;
+        }
+        n = GZIP_OUT_SIZE - gz->zs.avail_out;
+        if (n > 0 && filter_write(filter, gz->out, n) < 0) {
+            return -1;
+        }
+    } while (gz->zs.avail_out == 0);
+    return 0;
+}
+
+static int filter_gzip_write(filter_t *filter, const char *data, size_t len) {
+    gzip_state_t    *gz = (gzip_state_t*) filter->data;
+
+    gz->zs.next_in = (Bytef*) data;
+    gz->zs.avail_in = len;
+    return _deflate(filter, Z_NO_FLUSH);
+}
+
+static int filter_gzip_flush(filter_t *filter) {
+    return _deflate(filter, Z_SYNC_FLUSH);
+}
+
+static int filter_gzip_end(filter_t *filter) {
+    return _deflate(filter, Z_FINISH);
+}
+
+static void filter_gzip_cleanup(filter_t *filter) {
+    gzip_state_t    *gz = (gzip_state_t*) filter->data;
+
+    if (gz != NULL) {
+        deflateEnd(&gz->zs);
+        filter->data = NULL;
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef __FILTER_GZIP_H_
+#define __FILTER_GZIP_H_
+
+#include "http.h"
+
+typedef struct _filter_gzip_conf {
+    // zlib level, 1 to 9
+    int     level;
+    // A body known to be shorter is not worth compressing
+    int     min_length;
+} filter_gzip_conf_t;
+
+extern output_filter_t filter_gzip;
+
+#endif /* __FILTER_GZIP_H_ */
@@ -0,0 +1,566 @@
+#include "hpack.h"
+#include "common.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+typedef unsigned char byte_t;
+
+typedef struct _hpack_field {
+    const char  *name;
+    const char  *value;
+} hpack_field_t;
+
+typedef struct _hpack_entry {
+    char    *name;
+    size_t  name_len;
+    char    *value;
+    size_t  value_len;
+} hpack_entry_t;
+
+struct _hpack_table {
+    // A ring of the entries, the newest one at first
+    hpack_entry_t   *entries;
+    int             max_entries;
+    int             first;
+    int             count;
+    // The size of an entry is its name and value plus 32
+    size_t          size;
+    size_t          max_size;
+    // The peer may shrink the table, but never grow it beyond this
+    size_t          limit;
+    // Size of a decoded header list, counted as the entries, past which
+    // the fields are not passed on, 0 for no limit
+    size_t          max_list_size;
+
+    // The decoded strings of a header block
+    char            *scratch;
+    size_t          scratch_cap;
+};
+
+#define ENTRY_OVERHEAD      32
+#define STATIC_TABLE_SIZE   61
+#define HUFFMAN_EOS         256
+#define HUFFMAN_MAX_LEN     30
+
+/*
+ * The static table, RFC 7541 Appendix A.
+ */
+static const hpack_field_t static_table[STATIC_TABLE_SIZE] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/*
+ * Code lengths of the Huffman code, RFC 7541 Appendix B, the last one
+ * is EOS. The code is canonical, so the codes follow from the lengths.
+ */
+static const byte_t huffman_lens[HUFFMAN_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static int hpack_initialized = 0;
+
+// The symbols ordered by their codes, and for each code length the
+// first code, the end of the codes and the offset of the symbols
+static uint16_t huffman_symbols[HUFFMAN_EOS + 1];
+static uint32_t huffman_first[HUFFMAN_MAX_LEN + 1];
+static uint32_t huffman_limit[HUFFMAN_MAX_LEN + 1];
+static uint16_t huffman_offset[HUFFMAN_MAX_LEN + 1];
+
+// Index in the static table of the names of the standard headers
+static byte_t static_name_index[HTTP_HEADER_COUNT];
+
+static void init_hpack();
+static int  _decode_int(const byte_t **p, const byte_t *end,
+                        int prefix, size_t *value);
+static int  _decode_string(hpack_table_t *table, const byte_t **p,
+                           const byte_t *end, size_t *pos,
+                           char **str, size_t *len);
+static int  _lookup(hpack_table_t *table, size_t index,
+                    const char **name, size_t *name_len,
+                    const char **value, size_t *value_len);
+static int  _insert(hpack_table_t *table, const char *name, size_t name_len,
+                    const char *value, size_t value_len);
+static void _evict(hpack_table_t *table, size_t size);
+static size_t _encode_int(byte_t *buf, byte_t first, int prefix, size_t value);
+
+
+hpack_table_t *hpack_table_create(size_t max_size) {
+    hpack_table_t   *table;
+
+    if (hpack_initialized == 0) {
+        init_hpack();
+    }
+    table = (hpack_table_t*) calloc(1, sizeof(hpack_table_t));
+    if (table == NULL) {
+        error("Error allocating HPACK table");
+        return NULL;
+    }
+    table->max_entries = max_size / ENTRY_OVERHEAD + 1;
+    table->entries = (hpack_entry_t*) calloc(table->max_entries, sizeof(hpack_entry_t));
+    if (table->entries == NULL) {
+        error("Error allocating HPACK table");
+        free(table);
+        return NULL;
+    }
+    table->max_size = max_size;
+    table->limit = max_size;
+    return table;
+}
+
+int hpack_table_destroy(hpack_table_t *table) {
+    _evict(table, table->max_size + 1);
+    free(table->entries);
+    free(table->scratch);
+    free(table);
+    return 0;
+}
+
+/*
+ * A few bytes of a header block may refer to a large entry of the table
+ * again and again, what the decoded fields add up to is limited here.
+ */
+void hpack_table_limit_list(hpack_table_t *table, size_t max_list_size) {
+    table->max_list_size = max_list_size;
+}
+
+/*
+ * Decode a complete header block, the handler is called with each field
+ * in order. Returns -1 if the block is malformed, the table can not be
+ * used any more then. Returns 1 if the fields are larger than the limit
+ * of the table, those past it are not passed on.
+ */
+int hpack_decode(hpack_table_t *table, const char *data, size_t len,
+                 hpack_field_handler handler, void *args) {
+    const byte_t    *p = (const byte_t*) data, *end = p + len;
+    const char      *name, *value;
+    char            *str;
+    size_t          index, name_len, value_len, pos, cap, list_size = 0;
+    int             indexing;
+
+    // A Huffman string decodes to at most 8/5 of its size, so all the
+    // strings of a field fit in this.
+    cap = len * 8 / 5 + 2;
+    if (cap > table->scratch_cap) {
+        str = (char*) realloc(table->scratch, cap);
+        if (str == NULL) {
+            error("Error allocating HPACK buffer");
+            return -1;
+        }
+        table->scratch = str;
+        table->scratch_cap = cap;
+    }
+
+    while (p < end) {
+        pos = 0;
+        if (*p & 0x80) {
+            // Indexed field
+            if (_decode_int(&p, end, 7, &index) < 0
+                || _lookup(table, index, &name, &name_len, &value, &value_len) < 0) {
+                return -1;
+            }
+        } else if ((*p & 0xe0) == 0x20) {
+            // Dynamic table size update
+            if (_decode_int(&p, end, 5, &index) < 0 || index > table->limit) {
+                return -1;
+            }
+            table->max_size = index;
+            _evict(table, 0);
+            continue;
+        } else {
+            // A literal field, with incremental indexing or not
+            indexing = (*p & 0xc0) == 0x40;
+            if (_decode_int(&p, end, indexing ? 6 : 4, &index) < 0) {
+                return -1;
+            }
+            if (index == 0) {
+                if (_decode_string(table, &p, end, &pos, &str, &name_len) < 0) {
+                    return -1;
+                }
+                name = str;
+            } else if (_lookup(table, index, &name, &name_len, NULL, NULL) < 0) {
+                return -1;
+            }
+            if (_decode_string(table, &p, end, &pos, &str, &value_len) < 0) {
+                return -1;
+            }
+            value = str;
+            if (indexing && _insert(table, name, name_len, value, value_len) < 0) {
+                return -1;
+            }
+        }
+        // The fields past the limit are still decoded, to keep the
+        // table in step with the peer
+        list_size += name_len + value_len + ENTRY_OVERHEAD;
+        if (table->max_list_size == 0 || list_size <= table->max_list_size) {
+            handler(args, name, name_len, value, value_len);
+        }
+    }
+    return table->max_list_size > 0 && list_size > table->max_list_size;
+}
+
+/*
+ * Decode a Huffman encoded string, returns the decoded length or -1 if
+ * it is malformed or does not fit.
+ */
+ssize_t hpack_huffman_decode(const char *src, size_t len,
+                             char *dst, size_t capacity) {
+    const byte_t    *p = (const byte_t*) src, *end = p + len;
+    uint64_t        acc = 0;
+    uint32_t        code;
+    size_t          n = 0;
+    int             bits = 0, l, sym;
+
+    if (hpack_initialized == 0) {
+        init_hpack();
+    }
+    while (p < end) {
+        acc = (acc << 8) | *p++;
+        bits += 8;
+        // Take the symbols whose code is complete
+        while (bits >= 5) {
+            for (l = 5; l <= bits && l <= HUFFMAN_MAX_LEN; l++) {
+                code = (acc >> (bits - l)) & ((1u << l) - 1);
+                if (code < huffman_limit[l]) {
+                    break;
+                }
+            }
+            if (l > bits) {
+                break;
+            }
+            if (l > HUFFMAN_MAX_LEN) {
+                return -1;
+            }
+            sym = huffman_symbols[huffman_offset[l] + code - huffman_first[l]];
+            if (sym == HUFFMAN_EOS || n >= capacity) {
+                return -1;
+            }
+            dst[n++] = (char) sym;
+            bits -= l;
+        }
+        acc &= ((uint64_t) 1 << bits) - 1;
+    }
+    // The padding is the beginning of EOS, all ones and shorter than a byte
+    if (bits > 7 || acc != ((uint64_t) 1 << bits) - 1) {
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * Encode the :status field, returns the length. The buffer should have
+ * room for HPACK_FIELD_MAX(0, 3) bytes.
+ */
+size_t hpack_encode_status(char *buf, int code) {
+    byte_t  *p = (byte_t*) buf;
+    int     i;
+
+    for (i = 7; i < 14; i++) {
+        if (atoi(static_table[i].value) == code) {
+            return _encode_int(p, 0x80, 7, i + 1);
+        }
+    }
+    // Literal without indexing, with the name of :status 200
+    p[0] = 0x08;
+    p[1] = 3;
+    p[2] = '0' + code / 100 % 10;
+    p[3] = '0' + code / 10 % 10;
+    p[4] = '0' + code % 10;
+    return 5;
+}
+
+/*
+ * Encode a header field as a literal that is not indexed, so that the
+ * peer keeps no state for us. The name is lowercased, Huffman coding is
+ * not used. The buffer should have room for HPACK_FIELD_MAX bytes.
+ */
+size_t hpack_encode_field(char *buf, http_header_id_e id,
+                          const char *name, size_t name_len,
+                          const char *value, size_t value_len) {
+    byte_t  *p = (byte_t*) buf;
+    size_t  n, i;
+
+    if (hpack_initialized == 0) {
+        init_hpack();
+    }
+    if (id != HTTP_HEADER_UNKNOWN && static_name_index[id] > 0) {
+        n = _encode_int(p, 0x00, 4, static_name_index[id]);
+    } else {
+        p[0] = 0x00;
+        n = 1 + _encode_int(p + 1, 0x00, 7, name_len);
+        for (i = 0; i < name_len; i++) {
+            p[n++] = tolower((byte_t) name[i]);
+        }
+    }
+    n += _encode_int(p + n, 0x00, 7, value_len);
+    memcpy(p + n, value, value_len);
+    return n + value_len;
+}
+
+static void init_hpack() {
+    http_header_id_e    id;
+    uint32_t            code = 0;
+    int                 i, l, n = 0;
+
+    // Assign the canonical codes length by length
+    for (l = 1; l <= HUFFMAN_MAX_LEN; l++) {
+        huffman_first[l] = code;
+        huffman_offset[l] = n;
+        for (i = 0; i <= HUFFMAN_EOS; i++) {
+            if (huffman_lens[i] == l) {
+                huffman_symbols[n++] = i;
+                code++;
+            }
+        }
+        huffman_limit[l] = code;
+        code <<= 1;
+    }
+
+    for (i = 0; i < STATIC_TABLE_SIZE; i++) {
+        id = http_header_lookup(static_table[i].name, strlen(static_table[i].name));
+        if (id != HTTP_HEADER_UNKNOWN && static_name_index[id] == 0) {
+            static_name_index[id] = i + 1;
+        }
+    }
+    hpack_initialized = 1;
+}
+
+static int _decode_int(const byte_t **p, const byte_t *end,
+                       int prefix, size_t *value) {
+    size_t  max = (1 << prefix) - 1, v;
+    int     shift = 0;
+    byte_t  b;
+
+    if (*p >= end) {
+        return -1;
+    }
+    v = *(*p)++ & max;
+    if (v == max) {
+        do {
+            // Nothing we accept needs more than 4 more bytes
+            if (*p >= end || shift > 21) {
+                return -1;
+            }
+            b = *(*p)++;
+            v += (size_t) (b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+    *value = v;
+    return 0;
+}
+
+/*
+ * Decode a string into the scratch buffer at pos, it is terminated
+ * there for the convenience of the handler.
+ */
+static int _decode_string(hpack_table_t *table, const byte_t **p,
+                          const byte_t *end, size_t *pos,
+                          char **str, size_t *len) {
+    char        *dst = table->scratch + *pos;
+    size_t      n;
+    ssize_t     decoded;
+    int         huffman;
+
+    if (*p >= end) {
+        return -1;
+    }
+    huffman = **p & 0x80;
+    if (_decode_int(p, end, 7, &n) < 0 || n > (size_t) (end - *p)) {
+        return -1;
+    }
+    if (huffman) {
+        decoded = hpack_huffman_decode((const char*) *p, n, dst,
+                                       table->scratch_cap - *pos - 1);
+        if (decoded < 0) {
+            return -1;
+        }
+    } else {
+        memcpy(dst, *p, n);
+        decoded = n;
+    }
+    *p += n;
+    dst[decoded] = '\0';
+    *str = dst;
+    *len = decoded;
+    *pos += decoded + 1;
+    return 0;
+}
+
+static int _lookup(hpack_table_t *table, size_t index,
+                   const char **name, size_t *name_len,
+                   const char **value, size_t *value_len) {
+    hpack_entry_t   *entry;
+
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= STATIC_TABLE_SIZE) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        if (value != NULL) {
+            *value = static_table[index - 1].value;
+            *value_len = strlen(*value);
+        }
+        return 0;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= table->count) {
+        return -1;
+    }
+    entry = table->entries + (table->first + index) % table->max_entries;
+    *name = entry->name;
+    *name_len = entry->name_len;
+    if (value != NULL) {
+        *value = entry->value;
+        *value_len = entry->value_len;
+    }
+    return 0;
+}
+
+static int _insert(hpack_table_t *table, const char *name, size_t name_len,
+                   const char *value, size_t value_len) {
+    hpack_entry_t   *entry;
+    size_t          size = name_len + value_len + ENTRY_OVERHEAD;
+    char            *mem;
+
+    if (size > table->max_size) {
+        // Too big for the table, which is emptied
+        _evict(table, table->max_size + 1);
+        return 0;
+    }
+    // The name could be one of the entries evicted to make room
+    mem = (char*) malloc(name_len + value_len + 2);
+    if (mem == NULL) {
+        error("Error allocating HPACK table entry");
+        return -1;
+    }
+    memcpy(mem, name, name_len);
+    mem[name_len] = '\0';
+    memcpy(mem + name_len + 1, value, value_len);
+    mem[name_len + 1 + value_len] = '\0';
+    _evict(table, size);
+
+    table->first = (table->first + table->max_entries - 1) % table->max_entries;
+    entry = table->entries + table->first;
+    entry->name = mem;
+    entry->name_len = name_len;
+    entry->value = mem + name_len + 1;
+    entry->value_len = value_len;
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+/*
+ * Evict the oldest entries until there is room for size more bytes.
+ */
+static void _evict(hpack_table_t *table, size_t size) {
+    hpack_entry_t   *entry;
+
+    while (table->count > 0
+           && (table->size + size > table->max_size
+               || table->count >= table->max_entries)) {
+        entry = table->entries + (table->first + table->count - 1) % table->max_entries;
+        table->size -= entry->name_len + entry->value_len + ENTRY_OVERHEAD;
+        free(entry->name);
+        entry->name = NULL;
+        table->count--;
+    }
+}
+
+static size_t _encode_int(byte_t *buf, byte_t first, int prefix, size_t value) {
+    size_t  max = (1 << prefix) - 1, n = 0;
+
+    if (value < max) {
+        buf[0] = first | value;
+        return 1;
+    }
+    buf[n++] = first | max;
+    value -= max;
+    while (value >= 0x80) {
+        buf[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[n++] = value;
+    return n;
+}
@@ -0,0 +1,45 @@
+#ifndef __HPACK_H
+
+#define __HPACK_H
+
+#include "http_headers.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+// Size of the decoding table we announce, the default of HTTP/2
+#define HPACK_TABLE_SIZE    4096
+
+/*
+ * Room needed to encode a header field, see hpack_encode_field.
+ */
+#define HPACK_FIELD_MAX(name_len, value_len)    ((name_len) + (value_len) + 12)
+
+struct _hpack_table;
+
+/*
+ * The decoding state of the header blocks sent by a peer: the dynamic
+ * table it fills with the fields it refers to later.
+ */
+typedef struct _hpack_table hpack_table_t;
+
+/*
+ * Called with each field of a decoded header block, the name and the
+ * value are only valid during the call.
+ */
+typedef void (*hpack_field_handler)(void *args,
+                                    const char *name, size_t name_len,
+                                    const char *value, size_t value_len);
+
+hpack_table_t *hpack_table_create(size_t max_size);
+int            hpack_table_destroy(hpack_table_t *table);
+void           hpack_table_limit_list(hpack_table_t *table, size_t max_list_size);
+int            hpack_decode(hpack_table_t *table, const char *data, size_t len,
+                            hpack_field_handler handler, void *args);
+ssize_t        hpack_huffman_decode(const char *src, size_t len,
+                                    char *dst, size_t capacity);
+size_t         hpack_encode_status(char *buf, int code);
+size_t         hpack_encode_field(char *buf, http_header_id_e id,
+                                  const char *name, size_t name_len,
+                                  const char *value, size_t value_len);
+
+#endif /* end of include guard: __HPACK_H */
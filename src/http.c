@@ -1,42 +1,59 @@
 #include "common.h"
 #include "http.h"
+#include "http2.h"
+#include "hpack.h"
 #include "log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+typedef enum _body_state {
+    BODY_UNREAD = 0,
+    BODY_READING,
+    BODY_DONE,
+} body_state_e;
 
 typedef enum _parser_state {
     PARSER_STATE_BAD_REQUEST = -1,
-    PARSER_STATE_COMPLETE = 0,
-    PARSER_STATE_METHOD,
-    PARSER_STATE_PATH,
-    PARSER_STATE_QUERY_STR,
-    PARSER_STATE_VERSION,
-    PARSER_STATE_HEADER_NAME,
-    PARSER_STATE_HEADER_COLON,
-    PARSER_STATE_HEADER_VALUE,
-    PARSER_STATE_HEADER_CR,
-    PARSER_STATE_HEADER_LF,
-    PARSER_STATE_HEADER_COMPLETE_CR,
+    PARSER_STATE_REQUEST_LINE = 0,
+    PARSER_STATE_HEADERS,
+    PARSER_STATE_COMPLETE,
 } parser_state_e;
 
+#define CONTINUE_LINE   "HTTP/1.1 100 Continue\r\n\r\n"
 
-typedef void (*http_header_callback)(request_t *req, http_header_t *header);
 
-typedef struct _header_command {
-    char                   *lower_name;
-    http_header_callback   callback;
-} header_command_t;
+typedef int (*http_header_callback)(request_t *req, http_header_t *header);
+typedef const char* (*scan_func)(const char *p, const char *end, char a, char b);
 
-static struct hsearch_data std_headers_hash;
-static int std_headers_hash_initialized = 0;
+static int http_initialized = 0;
 
 static http_version_e _resolve_http_version(const char* version_str);
-static int init_std_headers_hash();
-static void handle_common_header(request_t *req, int header_index);
+static int  handle_common_header(request_t *req, int header_index);
+static int  _check_body_framing(request_t *req);
 static void set_common_headers(response_t *resp);
+static void init_http();
+static void init_status_cache();
 static void on_write_finished(iostream_t *stream);
+static int  _filter_start(request_t *req, response_t *resp);
+static void _filter_cleanup(response_t *resp);
+static void _on_body_data(iostream_t *stream, void *data, size_t len);
+static void _on_body_end(iostream_t *stream, void *data, size_t len);
+static void _on_chunk_size(iostream_t *stream, void *data, size_t len);
+static void _on_chunk_end(iostream_t *stream, void *data, size_t len);
+static void _on_chunk_crlf(iostream_t *stream, void *data, size_t len);
+static void _on_chunk_trailer(iostream_t *stream, void *data, size_t len);
+static void _on_empty_body(ioloop_t *loop, void *args);
+static void _finish_body(connection_t *conn);
+static int  _parse_chunk_size(const char *line, size_t *size);
+static void _refuse_chunked_body(connection_t *conn, handler_func handler);
+static int  _bad_chunk_handler(request_t *req, response_t *resp, handler_ctx_t *ctx);
+static int  _too_large_handler(request_t *req, response_t *resp, handler_ctx_t *ctx);
 
 inline static const char* str_http_ver(http_version_e ver) {
     switch (ver) {
@@ -61,240 +78,331 @@ request_t* request_create(connection_t *conn) {
         return NULL;
     }
     bzero(req, sizeof(request_t));
-    if (hcreate_r(MAX_HEADER_SIZE, &req->_header_hash) == 0) {
-        error("Error creating header hash table");
-        free(req);
-        return NULL;
-    }
     req->_conn = conn;
     return req;
 }
 
 int request_reset(request_t *req) {
     connection_t *conn = req->_conn;
-    hdestroy_r(&req->_header_hash);
+    char         *block = req->_block;
+    size_t       block_cap = req->_block_cap;
+
     bzero(req, sizeof(request_t));
-    if (hcreate_r(MAX_HEADER_SIZE, &req->_header_hash) == 0) {
-        error("Error creating header hash table");
-        return -1;
-    }    
     req->_conn = conn;
+    // The header block is kept for the next request
+    req->_block = block;
+    req->_block_cap = block_cap;
     return 0;
 }
 
 int request_destroy(request_t *req) {
-    hdestroy_r(&req->_header_hash);
+    free(req->_block);
     free(req);
     return 0;
 }
 
-const char*  request_get_header(request_t *request, const char *header_name) {
-    ENTRY          item, *ret;
-    char           header_name_lower[64];
+/*
+ * Find a header in the header list: the standard headers through their
+ * slots, the others by scanning the list.
+ */
+static http_header_t* _find_header(http_header_t *headers, size_t count,
+                                   unsigned char *slots, str_t name) {
+    http_header_id_e    id;
+    size_t              i;
+
+    id = http_header_lookup(name.ptr, name.len);
+    if (id != HTTP_HEADER_UNKNOWN) {
+        return slots[id] > 0 ? headers + slots[id] - 1 : NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (headers[i].id == HTTP_HEADER_UNKNOWN
+            && headers[i].name_len == name.len
+            && strncasecmp(headers[i].name, name.ptr, name.len) == 0) {
+            return headers + i;
+        }
+    }
+    return NULL;
+}
 
-    strlowercase(header_name, header_name_lower, 64);
-    item.key = header_name_lower;
+static str_t _header_value(http_header_t *header) {
+    str_t   value = {NULL, 0};
 
-    if (hsearch_r(item, FIND, &ret, &request->_header_hash) == 0) {
-        return NULL;
+    if (header != NULL) {
+        value.ptr = header->value;
+        value.len = header->value_len;
     }
+    return value;
+}
 
-    return ((http_header_t*) ret->data)->value;
+const char*  request_get_header(request_t *request, const char *header_name) {
+    return request_get_header_str(request, str_from_cstr(header_name)).ptr;
+}
+
+const char*  request_get_header_id(request_t *request, http_header_id_e id) {
+    return request_get_header_id_str(request, id).ptr;
 }
 
-#define START_NEW_TOKEN(tok, req)                       \
-    (tok = (req)->_buffer + (req)->_buf_idx)
+str_t request_get_header_str(request_t *request, str_t name) {
+    return _header_value(_find_header(request->headers, request->header_count,
+                                      request->_header_slots, name));
+}
 
-#define FILL_NEXT_CHAR(req, ch)                         \
-    ((req)->_buffer[req->_buf_idx++] = (ch))
+str_t request_get_header_id_str(request_t *request, http_header_id_e id) {
+    unsigned char   slot = request->_header_slots[id];
+    return _header_value(slot > 0 ? request->headers + slot - 1 : NULL);
+}
 
-#define FINISH_CUR_TOKEN(req)                           \
-    ((req)->_buffer[(req)->_buf_idx++] = '\0' )
+/*
+ * Find the first byte equal to a or b in [p, end), returns end if there
+ * is none. The header block is scanned with these, 16 or 32 bytes at a
+ * time when the CPU allows.
+ */
+static const char* _scan_scalar(const char *p, const char *end, char a, char b) {
+    for (; p < end; p++) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
 
-#define EXPECT_CHAR(state, ch, expected_ch, next_state) \
-    if ((ch) == (expected_ch)) {                        \
-        state = (next_state);                           \
-    } else {                                            \
-        state = PARSER_STATE_BAD_REQUEST;               \
+#ifdef __SSE2__
+static const char* _scan_sse2(const char *p, const char *end, char a, char b) {
+    __m128i     va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+    int         mask;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i*) p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                              _mm_cmpeq_epi8(v, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
     }
+    return _scan_scalar(p, end, a, b);
+}
 
+__attribute__((target("avx2")))
+static const char* _scan_avx2(const char *p, const char *end, char a, char b) {
+    __m256i     va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), v;
+    unsigned    mask;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i*) p);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                                    _mm256_cmpeq_epi8(v, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    // Avoid the AVX to SSE transition penalty in the tail
+    _mm256_zeroupper();
+    return _scan_sse2(p, end, a, b);
+}
+#endif
 
-int request_parse_headers(request_t *req,
-                          const char *data,
-                          const size_t data_len,
-                          size_t *consumed) {
-    http_version_e      ver;
-    int                 i, rc;
-    char                ch;
-    char                *cur_token = req->_buffer;
-    parser_state_e      state = PARSER_STATE_METHOD;
+static scan_func _scan = _scan_scalar;
 
-    req->_buffer[0] = '\0';
-    req->_buf_idx = 0;
-    req->header_count = 0;
+static void init_scanner() {
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    _scan = __builtin_cpu_supports("avx2") ? _scan_avx2 : _scan_sse2;
+#endif
+}
 
-    if (std_headers_hash_initialized == 0) {
-        init_std_headers_hash();
+#define REBASE(ptr, from, to)                           \
+    if ((ptr) != NULL) {                                \
+        (ptr) = (to) + ((ptr) - (from));                \
     }
 
-    for (i = 0; i < data_len;){
-
-        if (state == PARSER_STATE_COMPLETE ||
-             state == PARSER_STATE_BAD_REQUEST) {
-            break;
-        } 
-        ch = data[i++];
-
-        switch(state) {
-
-            case PARSER_STATE_METHOD:
-                if (ch == ' ') {
-                    FINISH_CUR_TOKEN(req);
-                    req->method = cur_token;
-                    state = PARSER_STATE_PATH;
-                    START_NEW_TOKEN(cur_token, req);
-                } else if (ch < 'A' || ch > 'Z') {
-                    state = PARSER_STATE_BAD_REQUEST;
-                } else {
-                    FILL_NEXT_CHAR(req, ch);
-                }
-                break;
+/*
+ * Make room for len more bytes in the header block. Tokens already
+ * sliced out of it are moved along when it is reallocated.
+ */
+static int _request_reserve(request_t *req, size_t len) {
+    char    *block;
+    size_t  cap, i;
 
-            case PARSER_STATE_PATH:
-                if (ch == '?') {
-                    FINISH_CUR_TOKEN(req);
-                    req->path = cur_token;
-                    state = PARSER_STATE_QUERY_STR;
-                    START_NEW_TOKEN(cur_token, req);
-                } else if (ch == ' ') {
-                    FINISH_CUR_TOKEN(req);
-                    req->path = cur_token;
-                    state = PARSER_STATE_VERSION;
-                    START_NEW_TOKEN(cur_token, req);
-                } else {
-                    FILL_NEXT_CHAR(req, ch);
-                }
-                break;
+    if (req->_block_len + len < req->_block_cap) {
+        return 0;
+    }
+    cap = MAX(req->_block_cap, REQUEST_BUFFER_SIZE);
+    while (cap <= req->_block_len + len) {
+        cap *= 2;
+    }
+    block = (char*) realloc(req->_block, cap);
+    if (block == NULL) {
+        error("Error allocating request header block");
+        return -1;
+    }
+    if (req->_block != NULL && block != req->_block) {
+        REBASE(req->method, req->_block, block);
+        REBASE(req->path, req->_block, block);
+        REBASE(req->query_str, req->_block, block);
+        REBASE(req->host, req->_block, block);
+        for (i = 0; i < req->header_count; i++) {
+            REBASE(req->headers[i].name, req->_block, block);
+            REBASE(req->headers[i].value, req->_block, block);
+        }
+    }
+    req->_block = block;
+    req->_block_cap = cap;
+    return 0;
+}
 
-            case PARSER_STATE_QUERY_STR:
-                if (ch == ' ') {
-                    FINISH_CUR_TOKEN(req);
-                    req->query_str = cur_token;
-                    state = PARSER_STATE_VERSION;
-                    START_NEW_TOKEN(cur_token, req);
-                } else {
-                    FILL_NEXT_CHAR(req, ch);
-                }
-                break;
+static int _parse_request_line(request_t *req, char *p, char *end) {
+    char        *sp, *q;
 
-            case PARSER_STATE_VERSION:
-                switch (ch) {
-                    // For HTTP part in the request line, e.g. GET / HTTP/1.1
-                    case 'H':
-                    case 'T':
-                    case 'P':
-
-                    // Currently only 0.9, 1.0 and 1.1 are supported.
-                    case '0':
-                    case '1':
-                    case '9':
-                    case '.':
-                        FILL_NEXT_CHAR(req, ch);
-                        break;
-
-                    case '/':
-                        FINISH_CUR_TOKEN(req);
-                        if (strcmp("HTTP", cur_token) != 0) {
-                            state = PARSER_STATE_BAD_REQUEST;
-                            break;
-                        }
-                        START_NEW_TOKEN(cur_token, req);
-                        break;
-
-                    case '\r':
-                        FINISH_CUR_TOKEN(req);
-                        ver = _resolve_http_version(cur_token);
-                        if (ver == HTTP_VERSION_UNKNOW) {
-                            state = PARSER_STATE_BAD_REQUEST;
-                            break;
-                        }
-                        req->version = ver;
-                        state = PARSER_STATE_HEADER_CR;
-                        START_NEW_TOKEN(cur_token, req);
-                        break;
-                }
-                break;
+    sp = (char*) _scan(p, end, ' ', ' ');
+    if (sp == p || sp == end) {
+        return -1;
+    }
+    for (q = p; q < sp; q++) {
+        if (*q < 'A' || *q > 'Z') {
+            return -1;
+        }
+    }
+    *sp = '\0';
+    req->method = p;
 
-            case PARSER_STATE_HEADER_NAME:
-                if (ch == ':') {
-                    FINISH_CUR_TOKEN(req);
-                    req->headers[req->header_count].name = cur_token;
-                    state = PARSER_STATE_HEADER_COLON;
-                    START_NEW_TOKEN(cur_token, req);
-                } else {
-                    FILL_NEXT_CHAR(req, ch);
-                }
-                break;
+    p = sp + 1;
+    q = (char*) _scan(p, end, '?', ' ');
+    if (q == p || q == end) {
+        return -1;
+    }
+    req->path = p;
+    if (*q == '?') {
+        *q = '\0';
+        p = q + 1;
+        q = (char*) _scan(p, end, ' ', ' ');
+        if (q == end) {
+            return -1;
+        }
+        req->query_str = p;
+    }
+    *q = '\0';
 
-            case PARSER_STATE_HEADER_COLON:
-                EXPECT_CHAR(state, ch, ' ', PARSER_STATE_HEADER_VALUE);
-                break;
+    // Only HTTP/0.9, 1.0 and 1.1 are supported
+    p = q + 1;
+    if (end - p != 8 || strncmp(p, "HTTP/", 5) != 0) {
+        return -1;
+    }
+    *end = '\0';
+    req->version = _resolve_http_version(p + 5);
+    // Until a Connection header says otherwise
+    req->connection = req->version == HTTP_VERSION_1_1 ? CONN_KEEP_ALIVE : CONN_CLOSE;
+    return req->version == HTTP_VERSION_UNKNOW ? -1 : 0;
+}
 
-            case PARSER_STATE_HEADER_VALUE:
-                if (ch == '\r') {
-                    FINISH_CUR_TOKEN(req);
-                    req->headers[req->header_count].value = cur_token;
-                    handle_common_header(req, req->header_count);
-                    req->header_count++;
-                    state = PARSER_STATE_HEADER_CR;
-                    START_NEW_TOKEN(cur_token, req);
-                } else {
-                    FILL_NEXT_CHAR(req, ch);
-                }
-                break;
+static int _parse_header_line(request_t *req, char *p, char *colon, char *end) {
+    http_header_t   *header;
 
-            case PARSER_STATE_HEADER_CR:
-                EXPECT_CHAR(state, ch, '\n', PARSER_STATE_HEADER_LF);
-                break;
+    if (colon == p || colon[-1] == ' ' || colon[-1] == '\t') {
+        return -1;
+    }
+    if (req->header_count >= MAX_HEADER_SIZE) {
+        // Too many to be stored
+        return -1;
+    }
+    header = req->headers + req->header_count;
+    *colon = '\0';
+    header->name = p;
+    header->name_len = colon - p;
+    header->id = http_header_lookup(header->name, header->name_len);
+
+    for (p = colon + 1; p < end && (*p == ' ' || *p == '\t'); p++);
+    for (; end > p && (end[-1] == ' ' || end[-1] == '\t'); end--);
+    *end = '\0';
+    header->value = p;
+    header->value_len = end - p;
+
+    if (handle_common_header(req, req->header_count) < 0) {
+        return -1;
+    }
+    req->header_count++;
+    return 0;
+}
 
-            case PARSER_STATE_HEADER_LF:
-                // Another CR after a header LF, meanning the header end is met.
-                if (ch == '\r') { 
-                    state = PARSER_STATE_HEADER_COMPLETE_CR; 
-                } else { 
-                    state = PARSER_STATE_HEADER_NAME; 
-                    FILL_NEXT_CHAR(req, ch);
-                }
-                break;
+/*
+ * Parse the request header block. The data is appended to the header
+ * block of the request, where the tokens are terminated in place; the
+ * parsing is resumed from the last incomplete line on the next call.
+ */
+int request_parse_headers(request_t *req,
+                          const char *data,
+                          const size_t data_len,
+                          size_t *consumed) {
+    char        *p, *end, *colon, *eol, *line_end;
+    size_t      prev_len = req->_block_len;
 
-            case PARSER_STATE_HEADER_COMPLETE_CR:
-                EXPECT_CHAR(state, ch, '\n', PARSER_STATE_COMPLETE);
-                break;
+    *consumed = 0;
+    if (http_initialized == 0) {
+        init_http();
+    }
+    if (req->_parse_state == PARSER_STATE_COMPLETE) {
+        return STATUS_COMPLETE;
+    }
+    if (req->_parse_state == PARSER_STATE_BAD_REQUEST
+        || _request_reserve(req, data_len) < 0) {
+        return STATUS_ERROR;
+    }
+    memcpy(req->_block + req->_block_len, data, data_len);
+    req->_block_len += data_len;
+
+    p = req->_block + req->_parse_pos;
+    end = req->_block + req->_block_len;
+    while (p < end) {
+        if (req->_parse_state == PARSER_STATE_REQUEST_LINE) {
+            colon = NULL;
+            eol = (char*) _scan(p, end, '\n', '\n');
+        } else {
+            colon = (char*) _scan(p, end, ':', '\n');
+            eol = (colon == end || *colon == '\n')
+                ? colon : (char*) _scan(colon + 1, end, '\n', '\n');
+            if (eol == colon) {
+                colon = NULL;
+            }
+        }
+        if (eol == end) {
+            break;
+        }
+        line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
 
-            default:
-                error("Unexpected state: %d", state);
+        if (req->_parse_state == PARSER_STATE_REQUEST_LINE) {
+            if (_parse_request_line(req, p, line_end) < 0) {
+                req->_parse_state = PARSER_STATE_BAD_REQUEST;
                 break;
-
+            }
+            req->_parse_state = PARSER_STATE_HEADERS;
+        } else if (line_end == p) {
+            // An empty line, the header end is met.
+            req->_parse_state = _check_body_framing(req) < 0
+                ? PARSER_STATE_BAD_REQUEST : PARSER_STATE_COMPLETE;
+            p = eol + 1;
+            break;
+        } else if (colon == NULL
+                   || _parse_header_line(req, p, colon, line_end) < 0) {
+            req->_parse_state = PARSER_STATE_BAD_REQUEST;
+            break;
         }
+        p = eol + 1;
     }
+    req->_parse_pos = p - req->_block;
 
-    *consumed = i;
-
-    switch (state) {
+    switch (req->_parse_state) {
         case PARSER_STATE_COMPLETE:
-            rc = STATUS_COMPLETE;
-            break;
+            // Data following the header block is not ours
+            *consumed = req->_parse_pos - prev_len;
+            req->_block_len = req->_parse_pos;
+            return STATUS_COMPLETE;
 
         case PARSER_STATE_BAD_REQUEST:
-            rc = STATUS_ERROR;
-            break;
+            return STATUS_ERROR;
 
         default:
-            rc = STATUS_INCOMPLETE;
-            break;
+            *consumed = data_len;
+            return STATUS_INCOMPLETE;
     }
-
-    return rc;
 }
 
 static http_version_e _resolve_http_version(const char* version_str) {
@@ -309,417 +417,1545 @@ static http_version_e _resolve_http_version(const char* version_str) {
     return HTTP_VERSION_UNKNOW;
 }
 
-static void _handle_content_len(request_t *req, http_header_t *header) {
-    size_t   content_length;
+/*
+ * Only digits are taken, a value read differently by a proxy in front
+ * could hide a request in the body. Repeating the header is fine as
+ * long as the value is the same.
+ */
+static int _handle_content_len(request_t *req, http_header_t *header) {
+    size_t      content_length = 0;
+    const char  *p;
 
-    content_length = (size_t) atol(header->value);
+    if (header->value_len == 0) {
+        return -1;
+    }
+    for (p = header->value; p < header->value + header->value_len; p++) {
+        if (*p < '0' || *p > '9'
+            || content_length > ((size_t) -1 - (*p - '0')) / 10) {
+            return -1;
+        }
+        content_length = content_length * 10 + (*p - '0');
+    }
+    if (req->_header_slots[HTTP_HEADER_CONTENT_LENGTH] != 0
+        && req->content_length != content_length) {
+        return -1;
+    }
     req->content_length = content_length;
+    return 0;
+}
+
+static int _handle_transfer_encoding(request_t *req, http_header_t *header) {
+    const char  *last, *end = header->value + header->value_len;
+
+    // Chunked is always the last coding applied, the lines of the
+    // header are one list
+    last = memrchr(header->value, ',', header->value_len);
+    last = last == NULL ? header->value : last + 1;
+    for (; last < end && (*last == ' ' || *last == '\t'); last++);
+    req->chunked = end - last == 7 && strncasecmp(last, "chunked", 7) == 0;
+    return 0;
 }
 
-static void _handle_host(request_t *req, http_header_t *header) {
+/*
+ * The body of a request has one length. Without chunked as the last
+ * coding there is no telling where it ends, and with Content-Length
+ * too a proxy in front may have read it differently, both are refused.
+ */
+static int _check_body_framing(request_t *req) {
+    if (req->_header_slots[HTTP_HEADER_TRANSFER_ENCODING] == 0) {
+        return 0;
+    }
+    if (!req->chunked || req->_header_slots[HTTP_HEADER_CONTENT_LENGTH] != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int _handle_host(request_t *req, http_header_t *header) {
     req->host = header->value;
+    return 0;
 }
 
-static void _handle_connection(request_t *req, http_header_t *header) {
-    if (strcasecmp("keep-alive", header->value) == 0) {
-        req->connection = CONN_KEEP_ALIVE;
-    } else {
+static int _handle_expect(request_t *req, http_header_t *header) {
+    req->expect_continue = strcasecmp(header->value, "100-continue") == 0 ? 1 : -1;
+    return 0;
+}
+
+static int _handle_connection(request_t *req, http_header_t *header) {
+    // Other options, e.g. Upgrade, leave the default of the version
+    if (has_token(header->value, "close")) {
         req->connection = CONN_CLOSE;
+    } else if (has_token(header->value, "keep-alive")) {
+        req->connection = CONN_KEEP_ALIVE;
     }
+    return 0;
 }
 
-static header_command_t std_headers[] = {
-    { "accept", NULL },
-    { "accept-charset", NULL },
-    { "accept-datetime", NULL },
-    { "accept-encoding", NULL },
-    { "accept-language", NULL },
-    { "accept-ranges", NULL },
-    { "access-control-allow-origin", NULL },
-    { "age", NULL },
-    { "allow", NULL },
-    { "authorization", NULL },
-    { "cache-control", NULL },
-    { "connection", _handle_connection },
-    { "content-disposition", NULL },
-    { "content-encoding", NULL },
-    { "content-language", NULL },
-    { "content-length", _handle_content_len },
-    { "content-location", NULL },
-    { "content-md5", NULL },
-    { "content-range", NULL },
-    { "content-security-policy", NULL },
-    { "content-type", NULL },
-    { "cookie", NULL },
-    { "dnt", NULL },
-    { "date", NULL },
-    { "etag", NULL },
-    { "expect", NULL },
-    { "expires", NULL },
-    { "from", NULL },
-    { "front-end-https", NULL },
-    { "host", _handle_host },
-    { "if-match", NULL },
-    { "if-modified-since", NULL },
-    { "if-none-match", NULL },
-    { "if-range", NULL },
-    { "if-unmodified-since", NULL },
-    { "last-modified", NULL },
-    { "link", NULL },
-    { "location", NULL },
-    { "max-forwards", NULL },
-    { "origin", NULL },
-    { "p3p", NULL },
-    { "pragma", NULL },
-    { "proxy-authenticate", NULL },
-    { "proxy-authorization", NULL },
-    { "proxy-connection", NULL },
-    { "range", NULL },
-    { "referer", NULL },
-    { "refresh", NULL },
-    { "retry-after", NULL },
-    { "server", NULL },
-    { "set-cookie", NULL },
-    { "status", NULL },
-    { "strict-transport-security", NULL },
-    { "te", NULL },
-    { "trailer", NULL },
-    { "transfer-encoding", NULL },
-    { "upgrade", NULL },
-    { "user-agent", NULL },
-    { "vary", NULL },
-    { "via", NULL },
-    { "www-authenticate", NULL },
-    { "warning", NULL },
-    { "x-att-deviceid", NULL },
-    { "x-content-security-policy", NULL },
-    { "x-content-type-options", NULL },
-    { "x-forwarded-for", NULL },
-    { "x-forwarded-proto", NULL },
-    { "x-frame-options", NULL },
-    { "x-powered-by", NULL },
-    { "x-requested-with", NULL },
-    { "x-wap-profile", NULL },
-    { "x-webkit-csp", NULL },
-    { "x-xss-protection", NULL },
-    { "x-ua-compatible", NULL },
+static http_header_callback header_callbacks[HTTP_HEADER_COUNT] = {
+    [HTTP_HEADER_CONNECTION] = _handle_connection,
+    [HTTP_HEADER_CONTENT_LENGTH] = _handle_content_len,
+    [HTTP_HEADER_EXPECT] = _handle_expect,
+    [HTTP_HEADER_HOST] = _handle_host,
+    [HTTP_HEADER_TRANSFER_ENCODING] = _handle_transfer_encoding,
 };
 
-static int init_std_headers_hash() {
-    int i;
-    size_t size;
-    ENTRY item, *ret;
-
-    size = sizeof(std_headers)/sizeof(std_headers[0]);
+static int handle_common_header(request_t *req, int header_index) {
+    http_header_t   *header = req->headers + header_index;
 
-    bzero(&std_headers_hash, sizeof(struct hsearch_data));
-    if (hcreate_r(sizeof(std_headers) * 2, &std_headers_hash) == 0) {
-        error("Error creating standard headers hash");
+    if (header->id == HTTP_HEADER_UNKNOWN) {
+        return 0;
+    }
+    if (header_callbacks[header->id] != NULL
+        && header_callbacks[header->id](req, header) < 0) {
         return -1;
     }
-    for (i = 0; i < size; i++) {
-        item.key = std_headers[i].lower_name;
-        item.data = std_headers[i].callback;
-        if (hsearch_r(item, ENTER, &ret, &std_headers_hash) == 0) {
-            error("Error entering standard header %s to hash", item.key);
-        }
+    // The first one wins when a header is repeated
+    if (req->_header_slots[header->id] == 0) {
+        req->_header_slots[header->id] = header_index + 1;
     }
-    std_headers_hash_initialized = 1;
     return 0;
 }
 
-static void handle_common_header(request_t *req, int header_index) {
-    ENTRY           ent, *ret;
-    http_header_t  *header;
-    char            header_lowercase[64];
-    http_header_callback callback = NULL;
+/*
+ * Copy a token to the end of the header block, returns where it is
+ * there or NULL if there is no memory.
+ */
+static char* _request_copy(request_t *req, const char *data, size_t len) {
+    char    *p;
 
-    header = req->headers + header_index;
-    strlowercase(header->name, header_lowercase, 64);
-    ent.key = header_lowercase;
-    if (hsearch_r(ent, FIND, &ret, &std_headers_hash) == 0) {
-        return;
+    if (_request_reserve(req, len + 1) < 0) {
+        return NULL;
     }
+    p = req->_block + req->_block_len;
+    memcpy(p, data, len);
+    p[len] = '\0';
+    req->_block_len += len + 1;
+    return p;
+}
+
+/*
+ * The setters below build a request that does not come as an HTTP/1
+ * header block, the strings are copied into the header block.
+ */
+int request_set_method(request_t *req, const char *method, size_t len) {
+    char    *p;
 
-    callback = (http_header_callback) ret->data;
-    if (callback != NULL) {
-        callback(req, header);
+    if ((p = _request_copy(req, method, len)) == NULL) {
+        return -1;
     }
+    req->method = p;
+    return 0;
+}
 
-    ent.key = ret->key;
-    ent.data = header;
+int request_set_path(request_t *req, const char *path, size_t len) {
+    char    *p, *q;
 
-    hsearch_r(ent, ENTER, &ret, &req->_header_hash);
+    if ((p = _request_copy(req, path, len)) == NULL) {
+        return -1;
+    }
+    req->path = p;
+    q = memchr(p, '?', len);
+    if (q != NULL) {
+        *q = '\0';
+        req->query_str = q + 1;
+    }
+    return 0;
 }
 
+int request_add_header(request_t *req,
+                       const char *name, size_t name_len,
+                       const char *value, size_t value_len) {
+    http_header_t       *header;
+    http_header_id_e    id;
+    char                *p;
+
+    id = http_header_lookup(name, name_len);
+    if (id == HTTP_HEADER_COOKIE && req->_header_slots[id] > 0) {
+        // HTTP/2 sends each cookie as a field of its own, they are
+        // joined back into one header. The value is extended where it
+        // is, once moved to the end of the block if something came
+        // after it.
+        header = req->headers + req->_header_slots[id] - 1;
+        if (header->value + header->value_len + 1 != req->_block + req->_block_len) {
+            if (_request_reserve(req, header->value_len + 1) < 0) {
+                return -1;
+            }
+            p = req->_block + req->_block_len;
+            memcpy(p, header->value, header->value_len + 1);
+            header->value = p;
+            req->_block_len += header->value_len + 1;
+        }
+        if (_request_reserve(req, value_len + 2) < 0) {
+            return -1;
+        }
+        p = header->value + header->value_len;
+        memcpy(p, "; ", 2);
+        memcpy(p + 2, value, value_len);
+        p[value_len + 2] = '\0';
+        header->value_len += value_len + 2;
+        req->_block_len += value_len + 2;
+        return 0;
+    }
 
-// HTTP common status codes
+    if (req->header_count >= MAX_HEADER_SIZE
+        || _request_reserve(req, name_len + value_len + 2) < 0) {
+        return -1;
+    }
+    header = req->headers + req->header_count;
+    header->name = _request_copy(req, name, name_len);
+    header->name_len = name_len;
+    header->value = _request_copy(req, value, value_len);
+    header->value_len = value_len;
+    header->id = id;
+    if (handle_common_header(req, req->header_count) < 0) {
+        return -1;
+    }
+    req->header_count++;
+    return 0;
+}
 
-// 1xx informational
-http_status_t STATUS_CONTINUE = {100, "Continue"};
+/*
+ * Serve the request from the location of another path, as if the client
+ * had asked for it, without going back to the client. The headers and
+ * the body of the request are kept, and so is the query string unless
+ * the uri has one. The headers already set on the response are kept
+ * too, e.g. a Content-Disposition for a download. Returns the result of
+ * the server handler, the caller should return it.
+ */
+int request_internal_redirect(request_t *req, response_t *resp,
+                              handler_ctx_t *ctx, const char *uri) {
+    server_t    *server = req->_conn->server;
 
-// 2xx success
-http_status_t STATUS_OK = {200, "OK"};
-http_status_t STATUS_CREATED = {201, "Created"};
-http_status_t STATUS_ACCEPTED = {202, "Accepted"};
-http_status_t STATUS_NO_CONTENT = {204, "No Content"};
-http_status_t STATUS_PARTIAL_CONTENT = {206, "Partial Content"};
+    if (resp->_header_sent) {
+        error("Internal redirect to %s after the response was sent", uri);
+        connection_close(req->_conn);
+        return HANDLER_DONE;
+    }
+    if (req->internal_redirects >= MAX_INTERNAL_REDIRECTS) {
+        error("Too many internal redirects, the last one to %s", uri);
+        return response_send_status(resp, STATUS_INTERNAL_ERROR);
+    }
+    if (uri[0] != '/' || request_set_path(req, uri, strlen(uri)) < 0
+        || request_decode_url(req) < 0) {
+        error("Invalid internal redirect: %s", uri);
+        return response_send_status(resp, STATUS_INTERNAL_ERROR);
+    }
+    req->internal_redirects++;
+    req->_query_index = NULL;
+
+    // The new location starts afresh
+    context_reset(ctx);
+    ctx->conf = server->handler_conf;
+    resp->filter_chain = NULL;
+    return server->handler(req, resp, ctx);
+}
 
-// 3xx redirection
-http_status_t STATUS_MOVED = {301, "Moved Permanently"};
-http_status_t STATUS_FOUND = {302, "Found"};
-http_status_t STATUS_SEE_OTHER = {303, "See Other"};
-http_status_t STATUS_NOT_MODIFIED = {304, "Not Modified"};
+/*
+ * Decode the path in place and normalize it, so that it can not climb
+ * above the root. The query string is left escaped, its parameters are
+ * decoded by request_get_query_param. Returns -1 if the path is not
+ * acceptable.
+ */
+int request_decode_url(request_t *req) {
+    ssize_t len;
+
+    len = url_normalize_path(req->path, strlen(req->path));
+    if (len < 0) {
+        return -1;
+    }
+    req->path_len = len;
+    return 0;
+}
 
-// 4xx client errors
-http_status_t STATUS_BAD_REQUEST = {400, "Bad Request"};
-http_status_t STATUS_UNAUTHORIZED = {401, "Unauthorized"};
-http_status_t STATUS_FORBIDDEN = {403, "Forbidden"};
-http_status_t STATUS_NOT_FOUND = {404, "Not Found"};
-http_status_t STATUS_METHOD_NOT_ALLOWED = {405, "Method Not Allowed"};
-http_status_t STATUS_RANGE_NOT_SATISFIABLE = {416, "Range Not Satisfiable"};
+/*
+ * The query parameters and the cookies are looked up through an open
+ * addressing hash table, built on the first lookup. The keys and the
+ * values point into a copy of the source in the arena.
+ */
+struct _param {
+    const char  *key;
+    size_t      key_len;
+    const char  *value;
+};
 
-// 5xx server errors
-http_status_t STATUS_INTERNAL_ERROR = {500, "Internal Server Error"};
-http_status_t STATUS_NOT_IMPLEMENTED = {501, "Not Implemented"};
-http_status_t STATUS_BAD_GATEWAY = {502, "Bad Gateway"};
-http_status_t STATUS_SERVICE_UNAVAILABLE = {503, "Service Unavailable"};
-http_status_t STATUS_GATEWAY_TIMEOUT = {504, "Gateway Timeout"};
+struct _param_index {
+    struct _param   *slots;
+    size_t          mask;
+};
 
+static size_t _param_hash(const char *key, size_t len) {
+    size_t  h = 2166136261u;
 
-response_t* response_create(connection_t *conn) {
-    response_t   *resp;
+    while (len-- > 0) {
+        h = (h ^ (unsigned char) *key++) * 16777619u;
+    }
+    return h;
+}
 
-    resp = (response_t*) calloc(1, sizeof(response_t));
-    if (resp == NULL) {
+static param_index_t* _param_index_create(arena_t *arena, size_t count) {
+    param_index_t   *index;
+    size_t          size = 4;
+
+    // Keep the table at most half full
+    while (size < count * 2) {
+        size <<= 1;
+    }
+    index = (param_index_t*) arena_alloc(arena, sizeof(param_index_t));
+    if (index == NULL) {
         return NULL;
     }
-
-    bzero(resp, sizeof(response_t));
-    if (hcreate_r(MAX_HEADER_SIZE, &resp->_header_hash) == 0) {
-        error("Error creating header hash table");
-        free(resp);
+    index->slots = (struct _param*) arena_alloc(arena, size * sizeof(struct _param));
+    if (index->slots == NULL) {
         return NULL;
     }
-
-    resp->_conn = conn;
-    // Content Length of -1 means we do not handle content length
-    resp->content_length = -1;
-    resp->connection = CONN_KEEP_ALIVE;
-    return resp;
+    bzero(index->slots, size * sizeof(struct _param));
+    index->mask = size - 1;
+    return index;
 }
 
-int response_reset(response_t *resp) {
-    connection_t  *conn = resp->_conn;
-    hdestroy_r(&resp->_header_hash);
-    bzero(resp, sizeof(response_t));
-    if (hcreate_r(MAX_HEADER_SIZE, &resp->_header_hash) == 0) {
-        error("Error creating header hash table");
-        return -1;
+/*
+ * The first occurrence of a key wins, like in most frameworks.
+ */
+static void _param_index_add(param_index_t *index, const char *key,
+                             size_t key_len, const char *value) {
+    struct _param   *slot;
+    size_t          i;
+
+    i = _param_hash(key, key_len) & index->mask;
+    for (;; i = (i + 1) & index->mask) {
+        slot = index->slots + i;
+        if (slot->key == NULL) {
+            break;
+        }
+        if (slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0) {
+            return;
+        }
     }
-    resp->_conn = conn;
-    resp->content_length = -1;
-    resp->connection = CONN_KEEP_ALIVE;
-    return 0;
+    slot->key = key;
+    slot->key_len = key_len;
+    slot->value = value;
 }
 
-int response_destroy(response_t *resp) {
-    hdestroy_r(&resp->_header_hash);
-    free(resp);
-    return 0;
-}
+static const char* _param_index_get(param_index_t *index, const char *key) {
+    struct _param   *slot;
+    size_t          key_len = strlen(key);
+    size_t          i;
 
-const char* response_get_header(response_t *resp, const char *header_name) {
-    ENTRY          item, *ret;
-    char           header_name_lower[64];
+    i = _param_hash(key, key_len) & index->mask;
+    for (;; i = (i + 1) & index->mask) {
+        slot = index->slots + i;
+        if (slot->key == NULL) {
+            return NULL;
+        }
+        if (slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0) {
+            return slot->value;
+        }
+    }
+}
 
-    strlowercase(header_name, header_name_lower, 64);
-    item.key = header_name_lower;
+static size_t _count_char(const char *p, char c) {
+    size_t  n = 1;
 
-    if (hsearch_r(item, FIND, &ret, &resp->_header_hash) == 0) {
-        return NULL;
+    while ((p = strchr(p, c)) != NULL) {
+        n++;
+        p++;
     }
+    return n;
+}
+
+static char* _query_unescape(char *p) {
+    char    *c;
 
-    return ((http_header_t*) ret->data)->value;
+    for (c = p; *c; c++) {
+        if (*c == '+') {
+            *c = ' ';
+        }
+    }
+    return url_decode(p, p);
 }
 
-char* response_alloc(response_t *resp, size_t n) {
-    char *res;
-    if (resp->_buf_idx + n > RESPONSE_BUFFER_SIZE) {
+/*
+ * "a=1&b=2", the keys and the values are unescaped, a key without '='
+ * has an empty value.
+ */
+static param_index_t* _build_query_index(request_t *req) {
+    param_index_t   *index;
+    char            *buf, *p, *amp, *eq;
+    char            *key_end;
+
+    buf = arena_strdup(req->_conn->arena, req->query_str);
+    if (buf == NULL) {
+        return NULL;
+    }
+    index = _param_index_create(req->_conn->arena, _count_char(buf, '&'));
+    if (index == NULL) {
         return NULL;
     }
-    res = resp->_buffer + resp->_buf_idx;
-    resp->_buf_idx += n;
-    return res;
+    for (p = buf; p != NULL; p = amp) {
+        amp = strchr(p, '&');
+        if (amp != NULL) {
+            *amp++ = '\0';
+        }
+        eq = strchr(p, '=');
+        if (eq != NULL) {
+            *eq++ = '\0';
+        }
+        if (*p == '\0') {
+            continue;
+        }
+        key_end = _query_unescape(p) - 1;
+        if (eq != NULL) {
+            _query_unescape(eq);
+        }
+        _param_index_add(index, p, key_end - p, eq != NULL ? eq : "");
+    }
+    return index;
 }
 
-int response_set_header(response_t *resp, char *header_name, char *header_value) {
-    ENTRY          ent, *ret;
-    http_header_t  *header;
-    char           header_lowercase[64];
-    char           *keybuf;
-    size_t         n;
+/*
+ * "a=1; b=2", the values are taken as they are, only the quotes around
+ * them are removed.
+ */
+static param_index_t* _build_cookie_index(request_t *req, const char *cookie) {
+    param_index_t   *index;
+    char            *buf, *p, *semi, *eq, *end;
 
-    if (resp->_header_sent) {
-        return -1;
+    buf = arena_strdup(req->_conn->arena, cookie);
+    if (buf == NULL) {
+        return NULL;
     }
-    strlowercase(header_name, header_lowercase, 64);
-    ent.key = header_lowercase;
-    if (hsearch_r(ent, FIND, &ret, &resp->_header_hash) != 0) {
-        header = (http_header_t*) ret->data;
-        header->value = header_value;
-        return 0;
+    index = _param_index_create(req->_conn->arena, _count_char(buf, ';'));
+    if (index == NULL) {
+        return NULL;
     }
-
-    header = resp->headers + resp->header_count++;
-    header->name = header_name;
-    header->value = header_value;
-
-    if (hsearch_r(ent, FIND, &ret, &std_headers_hash) != 0) {
-        ent.key = ret->key;
-    } else {
-        n = strlen(header_lowercase) + 1;
-        keybuf = response_alloc(resp, n);
-        if (keybuf == NULL) {
-            return -1;
+    for (p = buf; p != NULL; p = semi) {
+        semi = strchr(p, ';');
+        if (semi != NULL) {
+            *semi++ = '\0';
+        }
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        eq = strchr(p, '=');
+        if (eq == NULL || eq == p) {
+            continue;
         }
-        ent.key = strncpy(keybuf, header_lowercase, n);
+        *eq++ = '\0';
+        end = eq + strlen(eq);
+        while (end > eq && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+        if (end - eq >= 2 && *eq == '"' && end[-1] == '"') {
+            eq++;
+            end--;
+        }
+        *end = '\0';
+        _param_index_add(index, p, strlen(p), eq);
     }
-    ent.data = header;
-    if (hsearch_r(ent, ENTER, &ret, &resp->_header_hash) == 0) {
-        return -1;
+    return index;
+}
+
+const char* request_get_query_param(request_t *req, const char *name) {
+    if (req->_query_index == NULL) {
+        if (req->query_str == NULL || req->_conn == NULL) {
+            return NULL;
+        }
+        req->_query_index = _build_query_index(req);
+        if (req->_query_index == NULL) {
+            return NULL;
+        }
     }
-    return 0;
+    return _param_index_get(req->_query_index, name);
+}
+
+const char* request_get_cookie(request_t *req, const char *name) {
+    const char  *cookie;
+
+    if (req->_cookie_index == NULL) {
+        cookie = request_get_header_id(req, HTTP_HEADER_COOKIE);
+        if (cookie == NULL || req->_conn == NULL) {
+            return NULL;
+        }
+        req->_cookie_index = _build_cookie_index(req, cookie);
+        if (req->_cookie_index == NULL) {
+            return NULL;
+        }
+    }
+    return _param_index_get(req->_cookie_index, name);
+}
+
+int request_has_body(request_t *req) {
+    if (req->_conn != NULL && req->_conn->h2_stream != NULL) {
+        return http2_has_body(req->_conn->h2_stream);
+    }
+    return req->chunked || req->content_length > 0;
+}
+
+/*
+ * Stream the request body to on_data piece by piece, then run the next
+ * handler. Only the read buffer is used, a consumer that can not keep
+ * up should pause the body, which stops reading from the socket.
+ */
+int request_read_body(request_t *req, body_handler on_data, handler_func next_handler) {
+    connection_t    *conn = req->_conn;
+    int             rc;
+
+    if (req->_body_state != BODY_UNREAD) {
+        return -1;
+    }
+    req->_body_state = BODY_READING;
+    req->_body_handler = on_data;
+    req->_body_next = next_handler;
+
+    // The client waits for our go before it sends the body. Once the
+    // response has been sent it is too late, the connection is closed
+    // instead, see set_common_headers.
+    if (req->expect_continue > 0
+        && !conn->response->_header_sent && request_has_body(req)) {
+        req->expect_continue = 0;
+        if (conn->h2_stream != NULL) {
+            rc = http2_send_continue(conn->h2_stream);
+        } else {
+            rc = iostream_write(conn->stream, CONTINUE_LINE,
+                                sizeof(CONTINUE_LINE) - 1, NULL);
+        }
+        if (rc < 0) {
+            connection_close(conn);
+            return -1;
+        }
+    }
+
+    if (conn->h2_stream != NULL) {
+        rc = http2_read_body(conn->h2_stream);
+    } else if (req->chunked) {
+        rc = iostream_read_until(conn->stream, "\r\n", _on_chunk_size);
+    } else if (req->content_length > 0) {
+        rc = iostream_read_bytes(conn->stream, req->content_length,
+                                 _on_body_end, _on_body_data);
+    } else {
+        rc = ioloop_add_callback(conn->stream->ioloop, _on_empty_body, conn);
+    }
+    if (rc < 0) {
+        connection_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+int request_pause_body(request_t *req) {
+    if (req->_conn->h2_stream != NULL) {
+        return http2_pause_body(req->_conn->h2_stream);
+    }
+    return iostream_pause_read(req->_conn->stream);
+}
+
+int request_resume_body(request_t *req) {
+    if (req->_conn->h2_stream != NULL) {
+        return http2_resume_body(req->_conn->h2_stream);
+    }
+    return iostream_resume_read(req->_conn->stream);
+}
+
+/*
+ * Drop the body the handler did not read, so that it is not taken for
+ * the next request. Returns 1 if the request will be finished again
+ * once the body is drained, 0 if there is nothing to drain.
+ */
+int request_discard_body(request_t *req) {
+    if (!request_has_body(req) || req->_body_state == BODY_DONE) {
+        return 0;
+    }
+    if (req->_body_state == BODY_READING) {
+        return 1;
+    }
+    return request_read_body(req, NULL, NULL) < 0 ? -1 : 1;
+}
+
+/*
+ * Pass a piece of the body to the consumer, the HTTP/2 streams feed
+ * their DATA frames through this too.
+ */
+void request_feed_body(request_t *req, const char *data, size_t len) {
+    connection_t  *conn = req->_conn;
+
+    if (req->_body_handler != NULL) {
+        req->_body_handler(req, conn->response, conn->context, data, len);
+    }
+}
+
+void request_end_body(request_t *req) {
+    _finish_body(req->_conn);
+}
+
+static void _on_body_data(iostream_t *stream, void *data, size_t len) {
+    connection_t  *conn = (connection_t*) stream->user_data;
+
+    request_feed_body(conn->request, (char*) data, len);
+}
+
+static void _on_body_end(iostream_t *stream, void *data, size_t len) {
+    _finish_body((connection_t*) stream->user_data);
+}
+
+static void _on_empty_body(ioloop_t *loop, void *args) {
+    _finish_body((connection_t*) args);
+}
+
+static void _on_chunk_size(iostream_t *stream, void *data, size_t len) {
+    connection_t  *conn = (connection_t*) stream->user_data;
+    request_t     *req = conn->request;
+    char          *line = (char*) data;
+    size_t        size, max = conn->server->max_body_size;
+
+    if (len < 3 || line[len - 1] != '\n' || _parse_chunk_size(line, &size) < 0) {
+        _refuse_chunked_body(conn, _bad_chunk_handler);
+        return;
+    }
+    // The size of a chunked body is only known as it comes, it is
+    // refused at the first chunk that goes past the limit.
+    if (max > 0 && size > max - req->_body_read) {
+        _refuse_chunked_body(conn, _too_large_handler);
+        return;
+    }
+    req->_body_read += size;
+    if (size == 0) {
+        iostream_read_until(stream, "\r\n", _on_chunk_trailer);
+    } else {
+        iostream_read_bytes(stream, size, _on_chunk_end, _on_body_data);
+    }
+}
+
+/*
+ * The size of a chunk is hex digits only, without sign, prefix or
+ * leading space, as a proxy in front may read it strictly. Only
+ * whitespace before a chunk extension may follow.
+ */
+static int _parse_chunk_size(const char *line, size_t *size) {
+    const char  *p = line;
+    size_t      n = 0;
+    int         digit;
+
+    for (; (digit = hex_value(*p)) >= 0; p++) {
+        if (n > ((size_t) -1) >> 4) {
+            return -1;
+        }
+        n = (n << 4) | digit;
+    }
+    if (p == line) {
+        return -1;
+    }
+    if (*p == ' ' || *p == '\t') {
+        for (; *p == ' ' || *p == '\t'; p++);
+        if (*p != ';') {
+            return -1;
+        }
+    } else if (*p != ';' && *p != '\r') {
+        return -1;
+    }
+    *size = n;
+    return 0;
+}
+
+static void _on_chunk_end(iostream_t *stream, void *data, size_t len) {
+    iostream_read_bytes(stream, 2, _on_chunk_crlf, NULL);
+}
+
+static void _on_chunk_crlf(iostream_t *stream, void *data, size_t len) {
+    if (len != 2 || memcmp(data, "\r\n", 2) != 0) {
+        _refuse_chunked_body((connection_t*) stream->user_data, _bad_chunk_handler);
+        return;
+    }
+    iostream_read_until(stream, "\r\n", _on_chunk_size);
+}
+
+static void _on_chunk_trailer(iostream_t *stream, void *data, size_t len) {
+    connection_t  *conn = (connection_t*) stream->user_data;
+
+    if (len == 2) {
+        // The empty line after the trailers, trailer fields are ignored
+        _finish_body(conn);
+    } else if (len > 2 && ((char*) data)[len - 1] == '\n') {
+        iostream_read_until(stream, "\r\n", _on_chunk_trailer);
+    } else {
+        connection_close(conn);
+    }
+}
+
+static void _refuse_chunked_body(connection_t *conn, handler_func handler) {
+    // The rest of the body is not read, the connection can not be
+    // used for another request.
+    conn->request->_body_state = BODY_DONE;
+    if (conn->response->_header_sent) {
+        connection_close(conn);
+        return;
+    }
+    connection_run_handler(conn, handler);
+}
+
+static int _bad_chunk_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->connection = CONN_CLOSE;
+    return response_send_status(resp, STATUS_BAD_REQUEST);
+}
+
+static int _too_large_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->connection = CONN_CLOSE;
+    return response_send_status(resp, STATUS_PAYLOAD_TOO_LARGE);
+}
+
+static void _finish_body(connection_t *conn) {
+    request_t     *req = conn->request;
+    handler_func  next = req->_body_next;
+
+    req->_body_state = BODY_DONE;
+    if (next != NULL) {
+        connection_run_handler(conn, next);
+    } else {
+        // The body was discarded after the response
+        connection_finish_current_request(conn);
+    }
+}
+
+
+// HTTP common status codes
+
+// 1xx informational
+http_status_t STATUS_CONTINUE = {100, "Continue"};
+http_status_t STATUS_EARLY_HINTS = {103, "Early Hints"};
+
+// 2xx success
+http_status_t STATUS_OK = {200, "OK"};
+http_status_t STATUS_CREATED = {201, "Created"};
+http_status_t STATUS_ACCEPTED = {202, "Accepted"};
+http_status_t STATUS_NO_CONTENT = {204, "No Content"};
+http_status_t STATUS_PARTIAL_CONTENT = {206, "Partial Content"};
+
+// 3xx redirection
+http_status_t STATUS_MOVED = {301, "Moved Permanently"};
+http_status_t STATUS_FOUND = {302, "Found"};
+http_status_t STATUS_SEE_OTHER = {303, "See Other"};
+http_status_t STATUS_NOT_MODIFIED = {304, "Not Modified"};
+
+// 4xx client errors
+http_status_t STATUS_BAD_REQUEST = {400, "Bad Request"};
+http_status_t STATUS_UNAUTHORIZED = {401, "Unauthorized"};
+http_status_t STATUS_FORBIDDEN = {403, "Forbidden"};
+http_status_t STATUS_NOT_FOUND = {404, "Not Found"};
+http_status_t STATUS_METHOD_NOT_ALLOWED = {405, "Method Not Allowed"};
+http_status_t STATUS_PAYLOAD_TOO_LARGE = {413, "Payload Too Large"};
+http_status_t STATUS_RANGE_NOT_SATISFIABLE = {416, "Range Not Satisfiable"};
+http_status_t STATUS_EXPECTATION_FAILED = {417, "Expectation Failed"};
+
+// 5xx server errors
+http_status_t STATUS_INTERNAL_ERROR = {500, "Internal Server Error"};
+http_status_t STATUS_NOT_IMPLEMENTED = {501, "Not Implemented"};
+http_status_t STATUS_BAD_GATEWAY = {502, "Bad Gateway"};
+http_status_t STATUS_SERVICE_UNAVAILABLE = {503, "Service Unavailable"};
+http_status_t STATUS_GATEWAY_TIMEOUT = {504, "Gateway Timeout"};
+
+
+/*
+ * The status lines and the status pages never change, so each one is
+ * rendered only once and then shared by all the responses. A status
+ * is only cached under the message it was first seen with.
+ */
+#define MAX_STATUS_CODE     600
+#define MAX_STATUS_LINE     128
+#define HTTP_VERSION_SLOTS  3
+
+static struct {
+    const char      *msg;
+    char            *lines[HTTP_VERSION_SLOTS];
+    size_t          line_lens[HTTP_VERSION_SLOTS];
+    shared_buffer_t *page;
+} status_cache[MAX_STATUS_CODE];
+
+// The common statuses are rendered up front
+static http_status_t *cached_statuses[] = {
+    &STATUS_OK, &STATUS_NO_CONTENT, &STATUS_PARTIAL_CONTENT,
+    &STATUS_MOVED, &STATUS_FOUND, &STATUS_NOT_MODIFIED,
+    &STATUS_BAD_REQUEST, &STATUS_FORBIDDEN, &STATUS_NOT_FOUND,
+    &STATUS_METHOD_NOT_ALLOWED, &STATUS_RANGE_NOT_SATISFIABLE,
+    &STATUS_INTERNAL_ERROR, &STATUS_NOT_IMPLEMENTED, &STATUS_BAD_GATEWAY,
+    &STATUS_SERVICE_UNAVAILABLE, &STATUS_GATEWAY_TIMEOUT,
+};
+
+static int _version_slot(http_version_e ver) {
+    switch (ver) {
+    case HTTP_VERSION_0_9:
+        return 0;
+
+    case HTTP_VERSION_1_0:
+        return 1;
+
+    default:
+        return 2;
+    }
+}
+
+static int _status_cacheable(http_status_t status) {
+    if (status.code < 0 || status.code >= MAX_STATUS_CODE) {
+        return 0;
+    }
+    if (status_cache[status.code].msg == NULL) {
+        status_cache[status.code].msg = status.msg;
+    }
+    return status_cache[status.code].msg == status.msg;
+}
+
+/*
+ * Returns the status line, buf is only used for the statuses that
+ * could not be cached.
+ */
+static const char *get_status_line(http_status_t status, http_version_e ver,
+                                   char *buf, size_t *len) {
+    int     slot = _version_slot(ver);
+    char    *line;
+    int     n;
+
+    if (_status_cacheable(status) && status_cache[status.code].lines[slot] != NULL) {
+        *len = status_cache[status.code].line_lens[slot];
+        return status_cache[status.code].lines[slot];
+    }
+    n = snprintf(buf, MAX_STATUS_LINE, "HTTP/%s %d %s\r\n",
+                 str_http_ver(ver), status.code, status.msg);
+    if (n >= MAX_STATUS_LINE) {
+        n = MAX_STATUS_LINE - 1;
+    }
+    *len = n;
+    if (_status_cacheable(status) && (line = strdup(buf)) != NULL) {
+        status_cache[status.code].lines[slot] = line;
+        status_cache[status.code].line_lens[slot] = n;
+    }
+    return buf;
+}
+
+response_t* response_create(connection_t *conn) {
+    response_t   *resp;
+
+    resp = (response_t*) calloc(1, sizeof(response_t));
+    if (resp == NULL) {
+        return NULL;
+    }
+
+    bzero(resp, sizeof(response_t));
+    resp->_conn = conn;
+    // Content Length of -1 means we do not handle content length
+    resp->content_length = -1;
+    resp->connection = CONN_KEEP_ALIVE;
+    return resp;
+}
+
+int response_reset(response_t *resp) {
+    connection_t  *conn = resp->_conn;
+    _filter_cleanup(resp);
+    bzero(resp, sizeof(response_t));
+    resp->_conn = conn;
+    resp->content_length = -1;
+    resp->connection = CONN_KEEP_ALIVE;
+    return 0;
+}
+
+int response_destroy(response_t *resp) {
+    _filter_cleanup(resp);
+    free(resp);
+    return 0;
+}
+
+const char* response_get_header(response_t *resp, const char *header_name) {
+    return response_get_header_str(resp, str_from_cstr(header_name)).ptr;
+}
+
+const char* response_get_header_id(response_t *resp, http_header_id_e id) {
+    return response_get_header_id_str(resp, id).ptr;
+}
+
+str_t response_get_header_str(response_t *resp, str_t name) {
+    return _header_value(_find_header(resp->headers, resp->header_count,
+                                      resp->_header_slots, name));
+}
+
+str_t response_get_header_id_str(response_t *resp, http_header_id_e id) {
+    unsigned char   slot = resp->_header_slots[id];
+    return _header_value(slot > 0 ? resp->headers + slot - 1 : NULL);
+}
+
+/*
+ * Allocate memory that lives until the request is finished, there is
+ * no need to free it.
+ */
+char* response_alloc(response_t *resp, size_t n) {
+    return (char*) arena_alloc(resp->_conn->arena, n);
+}
+
+static http_header_t* _add_header(response_t *resp, str_t name,
+                                  http_header_id_e id) {
+    http_header_t  *header;
+
+    if (resp->header_count >= MAX_HEADER_SIZE) {
+        return NULL;
+    }
+    header = resp->headers + resp->header_count++;
+    header->name = (char*) name.ptr;
+    header->name_len = name.len;
+    header->id = id;
+    if (id != HTTP_HEADER_UNKNOWN) {
+        resp->_header_slots[id] = resp->header_count;
+    }
+    return header;
+}
+
+int response_set_header(response_t *resp, char *header_name, char *header_value) {
+    return response_set_header_str(resp, str_from_cstr(header_name),
+                                   str_from_cstr(header_value));
+}
+
+int response_set_header_id(response_t *resp, http_header_id_e id, char *header_value) {
+    return response_set_header_id_str(resp, id, str_from_cstr(header_value));
+}
+
+int response_set_header_str(response_t *resp, str_t name, str_t value) {
+    http_header_t      *header;
+    http_header_id_e   id;
+
+    if (resp->_header_sent) {
+        return -1;
+    }
+    id = http_header_lookup(name.ptr, name.len);
+    if (id != HTTP_HEADER_UNKNOWN) {
+        return response_set_header_id_str(resp, id, value);
+    }
+    header = _find_header(resp->headers, resp->header_count,
+                          resp->_header_slots, name);
+    if (header == NULL) {
+        header = _add_header(resp, name, HTTP_HEADER_UNKNOWN);
+        if (header == NULL) {
+            return -1;
+        }
+    }
+    header->value = (char*) value.ptr;
+    header->value_len = value.len;
+    return 0;
+}
+
+int response_set_header_id_str(response_t *resp, http_header_id_e id, str_t value) {
+    http_header_t  *header;
+    unsigned char  slot;
+    str_t          name;
+
+    if (resp->_header_sent) {
+        return -1;
+    }
+    slot = resp->_header_slots[id];
+    if (slot > 0) {
+        header = resp->headers + slot - 1;
+    } else {
+        name.ptr = http_header_names[id];
+        name.len = http_header_lens[id];
+        header = _add_header(resp, name, id);
+        if (header == NULL) {
+            return -1;
+        }
+    }
+    header->value = (char*) value.ptr;
+    header->value_len = value.len;
+    return 0;
 }
 
 int response_set_header_printf(response_t *resp, char* name,
                                const char *fmt, ...) {
-    char *buf = resp->_buffer + resp->_buf_idx;
-    size_t max_len = RESPONSE_BUFFER_SIZE - resp->_buf_idx;
-    int len = 0, res;
+    char *buf;
     va_list ap;
     va_start(ap, fmt);
-    len = vsnprintf(buf, max_len, fmt, ap);
+    buf = arena_vprintf(resp->_conn->arena, fmt, ap);
     va_end(ap);
-    res = response_set_header(resp, name, buf);
-    if (res == 0) {
-        // Only truly allocate the buffer when the operation succeeds.
-        resp->_buf_idx += (len + 1);
+    if (buf == NULL) {
+        return -1;
+    }
+    return response_set_header(resp, name, buf);
+}
+
+int response_remove_header_str(response_t *resp, str_t name) {
+    http_header_t   *header;
+    size_t          i;
+
+    if (resp->_header_sent) {
+        return -1;
+    }
+    header = _find_header(resp->headers, resp->header_count,
+                          resp->_header_slots, name);
+    if (header == NULL) {
+        return 0;
+    }
+    i = header - resp->headers;
+    if (header->id != HTTP_HEADER_UNKNOWN) {
+        resp->_header_slots[header->id] = 0;
+    }
+    memmove(header, header + 1, (resp->header_count - i - 1) * sizeof(http_header_t));
+    resp->header_count--;
+    // The headers after it moved down
+    for (header = resp->headers + i; i < resp->header_count; i++, header++) {
+        if (header->id != HTTP_HEADER_UNKNOWN) {
+            resp->_header_slots[header->id] = i + 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Responses with these status codes never have a body.
+ */
+static int _status_has_body(int code) {
+    return code >= 200 && code != 204 && code != 304;
+}
+
+/*
+ * Format a non-negative number in decimal, returns the length.
+ */
+static size_t _format_number(char *buf, long n) {
+    char    tmp[24];
+    size_t  len = 0, i;
+
+    do {
+        tmp[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    for (i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
     }
-    return res;
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * The Date header only changes once a second.
+ */
+static const char *current_date() {
+    static char     date[32];
+    static time_t   date_time;
+    time_t          now = time(NULL);
+
+    if (now != date_time) {
+        format_http_date(&now, date, sizeof(date));
+        date_time = now;
+    }
+    return date;
 }
 
 static void set_common_headers(response_t *resp) {
-    char *keybuf, *tmbuf;
-    size_t len = resp->content_length;
-    int n;
+    str_t   value;
+    char    *keybuf;
     
-    if (len >= 0) {
-        keybuf = resp->_buffer + resp->_buf_idx;
-        n = snprintf(keybuf,
-                     RESPONSE_BUFFER_SIZE - resp->_buf_idx,
-                     "%ld",
-                     resp->content_length);
-
-        resp->_buf_idx += (n + 1);
-        response_set_header(resp, "Content-Length", keybuf);
+    if (resp->content_length >= 0) {
+        keybuf = response_alloc(resp, 24);
+        if (keybuf != NULL) {
+            value.ptr = keybuf;
+            value.len = _format_number(keybuf, resp->content_length);
+            response_set_header_id_str(resp, HTTP_HEADER_CONTENT_LENGTH, value);
+        }
+    } else if (!_status_has_body(resp->status.code)) {
+        // Nothing to delimit
+    } else if (resp->_conn->h2_stream != NULL) {
+        // The end of the stream ends the body
+    } else if (resp->version == HTTP_VERSION_1_1) {
+        // Length unknown, send the body in chunks to keep the
+        // connection alive
+        response_set_header_id_str(resp, HTTP_HEADER_TRANSFER_ENCODING, STR("chunked"));
+        resp->_chunked = 1;
     } else {
-        // No Content-Length header set, set connection header
-        // to close
-        // TODO Support chunked transfer encoding
+        // The end of the body can only be told by closing the connection
+        resp->connection = CONN_CLOSE;
+    }
+
+    // Refused before the client sent the body, it is not going to come
+    if (resp->_conn->h2_stream == NULL && resp->_conn->request->expect_continue > 0
+        && request_has_body(resp->_conn->request)) {
         resp->connection = CONN_CLOSE;
     }
 
     switch(resp->connection) {
     case CONN_KEEP_ALIVE:
         //TODO Handle keep-alive time
-        response_set_header(resp, "Connection", "keep-alive");
+        response_set_header_id_str(resp, HTTP_HEADER_CONNECTION, STR("keep-alive"));
         break;
 
     default:
-        response_set_header(resp, "Connection", "close");
+        response_set_header_id_str(resp, HTTP_HEADER_CONNECTION, STR("close"));
         break;
     }
 
-    response_set_header(resp, "Server", _BREEZE_NAME);
-    tmbuf = response_alloc(resp, 32);
-    if (current_http_date(tmbuf, 32) == 0) {
-        response_set_header(resp, "Date", tmbuf);
+    response_set_header_id_str(resp, HTTP_HEADER_SERVER, STR(_BREEZE_NAME));
+    response_set_header_id(resp, HTTP_HEADER_DATE, (char*) current_date());
+}
+
+/*
+ * Copy the header lines and the empty line after them into memory from
+ * the arena, returns the length or -1 if there is no memory.
+ */
+static ssize_t _serialize_headers(response_t *resp, char **out) {
+    http_header_t  *header;
+    size_t         i, pos = 0, name_len, value_len;
+    char           *buf;
+
+    for (i = 0; i < resp->header_count; i++) {
+        header = resp->headers + i;
+        pos += header->name_len + header->value_len + 4;
+    }
+    buf = response_alloc(resp, pos + 2);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    pos = 0;
+    for (i = 0; i < resp->header_count; i++) {
+        header = resp->headers + i;
+        name_len = header->name_len;
+        value_len = header->value_len;
+        memcpy(buf + pos, header->name, name_len);
+        pos += name_len;
+        buf[pos++] = ':';
+        buf[pos++] = ' ';
+        memcpy(buf + pos, header->value, value_len);
+        pos += value_len;
+        buf[pos++] = '\r';
+        buf[pos++] = '\n';
     }
+    buf[pos++] = '\r';
+    buf[pos++] = '\n';
+    *out = buf;
+    return pos;
 }
 
 int response_send_headers(response_t *resp, handler_func next_handler) {
-    char           buffer[RESPONSE_BUFFER_SIZE];
-    int            i, n, buf_len = 0;
-    http_header_t  *header;
+    char           *buffer;
+    char           line_buf[MAX_STATUS_LINE];
+    struct iovec   iov[2];
+    ssize_t        n;
 
     if (resp->_header_sent) {
         return -1;
     }
     
+    if (_filter_start(resp->_conn->request, resp) < 0) {
+        return -1;
+    }
     set_common_headers(resp);
-    // Write status line
-    n = snprintf(buffer,
-                 RESPONSE_BUFFER_SIZE,
-                 "HTTP/%s %d %s\r\n",
-                 str_http_ver(resp->version),
-                 resp->status.code,
-                 resp->status.msg);
-    buf_len += n;
-
-    // Write headers
-    for (i = 0; i < resp->header_count; i++) {
-        header = resp->headers + i;
-        n = snprintf(buffer + buf_len,
-                     RESPONSE_BUFFER_SIZE - buf_len,
-                     "%s: %s\r\n",
-                     header->name,
-                     header->value);
-        buf_len += n;
+    if (resp->_conn->h2_stream != NULL) {
+        resp->_next_handler = next_handler;
+        if (http2_send_headers(resp->_conn->h2_stream, resp) < 0) {
+            return -1;
+        }
+        resp->_header_sent = 1;
+        return 0;
     }
-
-    // Empty line between headers and body
-    buffer[buf_len++] = '\r';
-    buffer[buf_len++] = '\n';
+    n = _serialize_headers(resp, &buffer);
+    if (n < 0) {
+        return -1;
+    }
+    // The status line is shared, only the headers are built here
+    iov[0].iov_base = (char*) get_status_line(resp->status, resp->version,
+                                              line_buf, &iov[0].iov_len);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = n;
 
     resp->_next_handler = next_handler;
-    if (iostream_write(resp->_conn->stream, buffer, buf_len, on_write_finished) < 0) {
+    if (iostream_writev(resp->_conn->stream, iov, 2, on_write_finished) < 0) {
         return -1;
     }
     resp->_header_sent = 1;
     return 0;
 }
 
+#define EARLY_HINTS_LINE    "HTTP/1.1 103 Early Hints\r\n"
+#define LINK_PREFIX         "Link: "
+
+/*
+ * Serialize the Link header values given, e.g.
+ * "</app.css>; rel=preload; as=style", once for all the requests.
+ */
+early_hints_t *early_hints_create(const char **links, size_t count) {
+    early_hints_t   *hints;
+    size_t          h1_len, h2_len, i, len;
+    char            *p;
+
+    if (count == 0) {
+        return NULL;
+    }
+    h1_len = sizeof(EARLY_HINTS_LINE) - 1 + 2;
+    h2_len = 5;
+    for (i = 0; i < count; i++) {
+        len = strlen(links[i]);
+        if (len == 0 || strpbrk(links[i], "\r\n") != NULL) {
+            error("Invalid early hint: '%s'", links[i]);
+            return NULL;
+        }
+        h1_len += sizeof(LINK_PREFIX) - 1 + len + 2;
+        h2_len += HPACK_FIELD_MAX(4, len);
+    }
+
+    hints = (early_hints_t*) malloc(sizeof(early_hints_t) + h1_len + h2_len);
+    if (hints == NULL) {
+        error("Error allocating memory for early hints");
+        return NULL;
+    }
+    p = (char*) (hints + 1);
+    hints->h1.ptr = p;
+    memcpy(p, EARLY_HINTS_LINE, sizeof(EARLY_HINTS_LINE) - 1);
+    p += sizeof(EARLY_HINTS_LINE) - 1;
+    for (i = 0; i < count; i++) {
+        len = strlen(links[i]);
+        memcpy(p, LINK_PREFIX, sizeof(LINK_PREFIX) - 1);
+        p += sizeof(LINK_PREFIX) - 1;
+        memcpy(p, links[i], len);
+        p += len;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    hints->h1.len = p - hints->h1.ptr;
+
+    hints->h2.ptr = p;
+    p += hpack_encode_status(p, STATUS_EARLY_HINTS.code);
+    for (i = 0; i < count; i++) {
+        p += hpack_encode_field(p, HTTP_HEADER_LINK, "link", 4,
+                                links[i], strlen(links[i]));
+    }
+    hints->h2.len = p - hints->h2.ptr;
+    return hints;
+}
+
+int early_hints_destroy(early_hints_t *hints) {
+    free(hints);
+    return 0;
+}
+
+/*
+ * Tell the client what it could fetch while the response is being
+ * prepared. Nothing is sent once the headers are, nor to an HTTP/1.0
+ * client which does not know interim responses.
+ */
+int response_send_early_hints(response_t *resp, const early_hints_t *hints) {
+    connection_t    *conn = resp->_conn;
+
+    if (hints == NULL || resp->_header_sent) {
+        return 0;
+    }
+    if (conn->h2_stream != NULL) {
+        return http2_send_interim(conn->h2_stream, hints->h2.ptr, hints->h2.len);
+    }
+    if (conn->request->version < HTTP_VERSION_1_1) {
+        return 0;
+    }
+    return iostream_write(conn->stream, (void*) hints->h1.ptr, hints->h1.len, NULL);
+}
+
+#define MAX_CHUNK_HEADER_SIZE   20
+// A file is read into the output filters in blocks of this size
+#define FILTER_BLOCK_SIZE       16384
+
+/*
+ * Format the size line of a chunk, returns its length.
+ */
+static size_t _format_chunk_header(char *buf, size_t size) {
+    return snprintf(buf, MAX_CHUNK_HEADER_SIZE, "%zx\r\n", size);
+}
+
+/*
+ * The body after the output filters, or without them.
+ */
+static int _sink_write(response_t *resp, const char *data, size_t data_len) {
+    char            chunk_header[MAX_CHUNK_HEADER_SIZE];
+    struct iovec    iov[3];
+    int             iovcnt = 0;
+
+    if (resp->_conn->h2_stream != NULL) {
+        if (http2_write(resp->_conn->h2_stream, data, data_len) < 0) {
+            connection_close(resp->_conn);
+            return -1;
+        }
+        return 0;
+    }
+    if (resp->_chunked && data_len > 0) {
+        // The chunk framing goes around the data without copying it
+        iov[iovcnt].iov_base = chunk_header;
+        iov[iovcnt++].iov_len = _format_chunk_header(chunk_header, data_len);
+    }
+    iov[iovcnt].iov_base = (char*) data;
+    iov[iovcnt++].iov_len = data_len;
+    if (resp->_chunked && data_len > 0) {
+        iov[iovcnt].iov_base = "\r\n";
+        iov[iovcnt++].iov_len = 2;
+    }
+    if (iostream_writev(resp->_conn->stream, iov, iovcnt, on_write_finished) < 0) {
+        connection_close(resp->_conn);
+        return -1;
+    }
+    return 0;
+}
+
+static int _sink_write_shared(response_t *resp, shared_buffer_t *sbuf) {
+    iostream_t  *stream = resp->_conn->stream;
+    char        chunk_header[MAX_CHUNK_HEADER_SIZE];
+    int         chunked = resp->_chunked && shared_buffer_size(sbuf) > 0;
+
+    if (resp->_conn->h2_stream != NULL) {
+        if (http2_write_shared(resp->_conn->h2_stream, sbuf) < 0) {
+            connection_close(resp->_conn);
+            return -1;
+        }
+        return 0;
+    }
+    if ((chunked
+         && iostream_write(stream, chunk_header,
+                           _format_chunk_header(chunk_header, shared_buffer_size(sbuf)),
+                           on_write_finished) < 0)
+        || iostream_write_shared(stream, sbuf, on_write_finished) < 0
+        || (chunked && iostream_write(stream, "\r\n", 2, on_write_finished) < 0)) {
+        connection_close(resp->_conn);
+        return -1;
+    }
+    return 0;
+}
+
+static int _sink_send_file(response_t *resp, int fd, size_t offset, size_t size) {
+    if (resp->_conn->h2_stream != NULL) {
+        if (http2_send_file(resp->_conn->h2_stream, fd, offset, size) < 0) {
+            connection_close(resp->_conn);
+            return -1;
+        }
+        return 0;
+    }
+    if (iostream_sendfile(resp->_conn->stream, fd,
+                          offset, size, on_write_finished) < 0) {
+        connection_close(resp->_conn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set up the stages of the chain that take part in this response, in
+ * the order of the location. The stages without a write hook only get
+ * to change the headers.
+ */
+static int _filter_start(request_t *req, response_t *resp) {
+    const filter_chain_t    *chain = resp->filter_chain;
+    filter_t                *filter, **tail = &resp->_filter;
+    int                     i;
+
+    if (chain == NULL) {
+        return 0;
+    }
+    for (i = 0; i < chain->count; i++) {
+        filter = (filter_t*) response_alloc(resp, sizeof(filter_t));
+        if (filter == NULL) {
+            return -1;
+        }
+        bzero(filter, sizeof(filter_t));
+        filter->def = chain->filters[i];
+        filter->conf = chain->confs[i];
+        filter->resp = resp;
+        if (filter->def->init(filter, req, resp) != 0
+            || filter->def->write == NULL) {
+            continue;
+        }
+        *tail = filter;
+        tail = &filter->next;
+    }
+    return 0;
+}
+
+static int _filter_pass(response_t *resp, filter_t *filter,
+                        const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (filter == NULL) {
+        resp->_filter_output++;
+        return _sink_write(resp, data, len);
+    }
+    return filter->def->write(filter, data, len);
+}
+
+/*
+ * Pass data on from a stage to the rest of the chain.
+ */
+int filter_write(filter_t *filter, const char *data, size_t len) {
+    return _filter_pass(filter->resp, filter->next, data, len);
+}
+
+/*
+ * The next handler only runs once a write is done, so something must
+ * have been written. The stages are flushed in order until it is.
+ */
+static int _filter_settle(response_t *resp, unsigned int output) {
+    filter_t    *filter;
+
+    for (filter = resp->_filter;
+         filter != NULL && resp->_filter_output == output;
+         filter = filter->next) {
+        if (filter->def->flush != NULL && filter->def->flush(filter) < 0) {
+            return -1;
+        }
+    }
+    if (resp->_filter_output == output) {
+        error("Output filters passed nothing on");
+        return -1;
+    }
+    return 0;
+}
+
+static int _filter_feed(response_t *resp, const char *data, size_t len) {
+    unsigned int    output = resp->_filter_output;
+
+    if (resp->_filter_left > 0) {
+        // Still reading a file
+        return -1;
+    }
+    if (_filter_pass(resp, resp->_filter, data, len) < 0
+        || _filter_settle(resp, output) < 0) {
+        connection_close(resp->_conn);
+        return -1;
+    }
+    return 0;
+}
+
+static int _filter_pump_handler(request_t *req, response_t *resp, handler_ctx_t *ctx);
+
+/*
+ * Read the file into the chain until something comes out of it. The
+ * next block is only read once that has been written, then the next
+ * handler of the file runs.
+ */
+static int _filter_pump(response_t *resp) {
+    static char     block[FILTER_BLOCK_SIZE];
+    unsigned int    output = resp->_filter_output;
+    ssize_t         n;
+
+    while (resp->_filter_left > 0 && resp->_filter_output == output) {
+        n = pread(resp->_filter_fd, block, MIN(resp->_filter_left, FILTER_BLOCK_SIZE),
+                  resp->_filter_offset);
+        if (n <= 0) {
+            error("Error reading the file to filter");
+            goto ERROR;
+        }
+        resp->_filter_offset += n;
+        resp->_filter_left -= n;
+        if (_filter_pass(resp, resp->_filter, block, n) < 0) {
+            goto ERROR;
+        }
+    }
+    if (_filter_settle(resp, output) < 0) {
+        goto ERROR;
+    }
+    resp->_next_handler = resp->_filter_left > 0 ? _filter_pump_handler
+                                                 : resp->_filter_next;
+    return 0;
+
+    ERROR:
+    resp->_filter_left = 0;
+    connection_close(resp->_conn);
+    return -1;
+}
+
+static int _filter_pump_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    _filter_pump(resp);
+    return HANDLER_UNFISHED;
+}
+
+/*
+ * The stages pass on what they hold back, in order, so that the tail
+ * of one goes through the next ones.
+ */
+static int _filter_end(response_t *resp) {
+    filter_t    *filter;
+
+    if (resp->_filter_ended) {
+        return 0;
+    }
+    resp->_filter_ended = 1;
+    for (filter = resp->_filter; filter != NULL; filter = filter->next) {
+        if (filter->def->end != NULL && filter->def->end(filter) < 0) {
+            connection_close(resp->_conn);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void _filter_cleanup(response_t *resp) {
+    filter_t    *filter;
+
+    for (filter = resp->_filter; filter != NULL; filter = filter->next) {
+        if (filter->def->cleanup != NULL) {
+            filter->def->cleanup(filter);
+        }
+    }
+    resp->_filter = NULL;
+}
+
 int response_write(response_t *resp,
                    char *data, size_t data_len,
                    handler_func next_handler) {
-    if (!resp->_header_sent) {
+    if (!resp->_header_sent || resp->_chunked_end) {
         return -1;
     }
     resp->_next_handler = next_handler;
-    if (iostream_write(resp->_conn->stream,
-                       data, data_len, on_write_finished) < 0) {
-        connection_close(resp->_conn);
+    // Nothing for the filters, only the next handler is to be run
+    if (resp->_filter != NULL && data_len > 0) {
+        return _filter_feed(resp, data, data_len);
+    }
+    return _sink_write(resp, data, data_len);
+}
+
+/*
+ * Write an immutable shared buffer as (part of) the body. The buffer
+ * is queued by reference, so the same one can be sent on any number
+ * of connections without copying.
+ */
+int response_write_shared(response_t *resp,
+                          shared_buffer_t *sbuf,
+                          handler_func next_handler) {
+    if (!resp->_header_sent || resp->_chunked_end) {
         return -1;
     }
-    return 0;
+    resp->_next_handler = next_handler;
+    if (resp->_filter != NULL) {
+        return _filter_feed(resp, shared_buffer_data(sbuf), shared_buffer_size(sbuf));
+    }
+    return _sink_write_shared(resp, sbuf);
 }
 
+/*
+ * The file is sent as it is unless a stage transforms the body, it is
+ * then read in blocks. Either way the file must stay open until the
+ * next handler runs.
+ */
 int response_send_file(response_t *resp,
                        int fd,
                        size_t offset,
                        size_t size,
                        handler_func next_handler) {
-    if (!resp->_header_sent) {
+    if (!resp->_header_sent || resp->_chunked_end) {
         return -1;
     }
-    resp->_next_handler = next_handler;
-    if (iostream_sendfile(resp->_conn->stream, fd,
-                          offset, size, on_write_finished) < 0) {
-        connection_close(resp->_conn);
+    if (resp->_filter != NULL) {
+        if (resp->_filter_left > 0 || size == 0) {
+            return -1;
+        }
+        resp->_filter_fd = fd;
+        resp->_filter_offset = offset;
+        resp->_filter_left = size;
+        resp->_filter_next = next_handler;
+        return _filter_pump(resp);
+    }
+    // Nothing can be written after a file until it is sent, so the
+    // file could not be framed as a chunk. Set content_length instead.
+    if (resp->_chunked) {
         return -1;
     }
-    return 0;
+    resp->_next_handler = next_handler;
+    return _sink_send_file(resp, fd, offset, size);
 }
 
 const char *status_msg_template = "<html>"
@@ -734,24 +1970,96 @@ const char *status_msg_template = "<html>"
     "</body>"
     "</html>";
 
-int response_send_status(response_t *resp, http_status_t status) {
-    size_t len = 0;
+/*
+ * Returns a new reference to the page of the status, the caller should
+ * release it when done.
+ */
+static shared_buffer_t *get_status_page(http_status_t status) {
+    shared_buffer_t *page;
     char   buf[1024];
+    int    len;
+
+    if (_status_cacheable(status) && status_cache[status.code].page != NULL) {
+        return shared_buffer_ref(status_cache[status.code].page);
+    }
+
+    len = snprintf(buf, 1024, status_msg_template,
+                   status.code, status.msg,
+                   status.code, status.msg,
+                   _BREEZE_NAME);
+    page = shared_buffer_create(buf, len);
+    if (page == NULL) {
+        return NULL;
+    }
+    if (_status_cacheable(status)) {
+        status_cache[status.code].page = shared_buffer_ref(page);
+    }
+    return page;
+}
+
+static void init_status_cache() {
+    char            buf[MAX_STATUS_LINE];
+    size_t          i, len;
+    http_status_t   status;
+
+    for (i = 0; i < sizeof(cached_statuses) / sizeof(http_status_t*); i++) {
+        status = *cached_statuses[i];
+        get_status_line(status, HTTP_VERSION_1_0, buf, &len);
+        get_status_line(status, HTTP_VERSION_1_1, buf, &len);
+        if (status.code >= 400) {
+            shared_buffer_unref(get_status_page(status));
+        }
+    }
+}
+
+static void init_http() {
+    init_scanner();
+    init_status_cache();
+    http_initialized = 1;
+}
+
+int response_send_status(response_t *resp, http_status_t status) {
+    shared_buffer_t *page;
     
     resp->status = status;
-    response_set_header(resp, "Content-Type", "text/html");
-    snprintf(buf, 1024, status_msg_template,
-             status.code, status.msg,
-             status.code, status.msg,
-             _BREEZE_NAME);
-    len = strlen(buf);
-
-    resp->content_length = len;
+    response_set_header_id(resp, HTTP_HEADER_CONTENT_TYPE, "text/html");
+    page = get_status_page(status);
+    if (page == NULL) {
+        connection_close(resp->_conn);
+        return HANDLER_DONE;
+    }
+
+    resp->content_length = shared_buffer_size(page);
     response_send_headers(resp, NULL);
-    response_write(resp, buf, len, NULL);
+    response_write_shared(resp, page, NULL);
+    shared_buffer_unref(page);
     return HANDLER_DONE;
 }
 
+/*
+ * Called when the handler is done with the response, ends a chunked
+ * body with the last chunk, or the HTTP/2 stream.
+ */
+int response_end(response_t *resp) {
+    // The handler is done, what is written from here does not resume it
+    resp->_next_handler = NULL;
+    if (resp->_filter != NULL && _filter_end(resp) < 0) {
+        return -1;
+    }
+    if (resp->_conn->h2_stream != NULL) {
+        return http2_end(resp->_conn->h2_stream);
+    }
+    if (!resp->_chunked || !resp->_header_sent || resp->_chunked_end) {
+        return 0;
+    }
+    resp->_chunked_end = 1;
+    if (iostream_write(resp->_conn->stream, "0\r\n\r\n", 5, on_write_finished) < 0) {
+        connection_close(resp->_conn);
+        return -1;
+    }
+    return 0;
+}
+
 static void on_write_finished(iostream_t *stream) {
     connection_t  *conn;
     handler_func  handler;
@@ -765,29 +2073,7 @@ static void on_write_finished(iostream_t *stream) {
         connection_run_handler(conn, handler);
     }
     if (resp->_done) {
-        switch (resp->connection) {
-        case CONN_CLOSE:
-            connection_close(conn);
-            break;
-
-        case CONN_KEEP_ALIVE:
-        default:
-            if (request_reset(conn->request) < 0) {
-                connection_close(conn);
-                break;
-            }
-            if (response_reset(conn->response) < 0) {
-                connection_close(conn);
-                break;
-            }
-            if (context_reset(conn->context) < 0) {
-                connection_close(conn);
-                break;
-            }
-            conn->context->conf = conn->server->handler_conf;
-            connection_run(conn);
-            break;
-        }
+        connection_finish_current_request(conn);
     }
 }
 
@@ -797,8 +2083,7 @@ handler_ctx_t* context_create() {
 }
 
 int context_reset(handler_ctx_t *ctx) {
-    ctx->_stat_top = 0;
-    ctx->conf = NULL;
+    bzero(ctx, sizeof(handler_ctx_t));
     return 0;
 }
 
@@ -807,26 +2092,38 @@ int context_destroy(handler_ctx_t *ctx) {
     return 0;
 }
 
-int context_push(handler_ctx_t *ctx, ctx_state_t stat) {
-    if (ctx->_stat_top >= MAX_STATE_STACK_SIZE) {
-        return -1;
+/*
+ * The locals of a coroutine handler, allocated zeroed on the first call
+ * and the same memory on the next ones. They live until the request is
+ * finished.
+ */
+void* coro_locals(handler_ctx_t *ctx, response_t *resp, size_t size) {
+    if (ctx->_coro_locals == NULL) {
+        ctx->_coro_locals = response_alloc(resp, size);
+        if (ctx->_coro_locals != NULL) {
+            bzero(ctx->_coro_locals, size);
+        }
     }
-    ctx->_stat_stack[ctx->_stat_top] = stat;
-    ctx->_stat_top++;
-    return 0;
+    return ctx->_coro_locals;
 }
 
-ctx_state_t* context_pop(handler_ctx_t *ctx) {
-    if (ctx->_stat_top <= 0) {
-        return NULL;
-    }
-    ctx->_stat_top--;
-    return &ctx->_stat_stack[ctx->_stat_top];
+/*
+ * The next handler given to the operations a coroutine waits for, it
+ * enters the coroutine again.
+ */
+int coro_resume(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    ctx->_coro_chunk.ptr = NULL;
+    ctx->_coro_chunk.len = 0;
+    return ctx->_coro(req, resp, ctx);
 }
 
-ctx_state_t* context_peek(handler_ctx_t *ctx) {
-    if (ctx->_stat_top <= 0) {
-        return NULL;
-    }
-    return &ctx->_stat_stack[ctx->_stat_top - 1];
+static void _coro_on_body(request_t *req, response_t *resp, handler_ctx_t *ctx,
+                          const char *data, size_t len) {
+    ctx->_coro_chunk.ptr = data;
+    ctx->_coro_chunk.len = len;
+    ctx->_coro(req, resp, ctx);
+}
+
+int coro_read_body(request_t *req) {
+    return request_read_body(req, _coro_on_body, coro_resume);
 }
@@ -5,7 +5,8 @@
 #include "json.h"
 #include "ioloop.h"
 #include "iostream.h"
-#include <search.h>
+#include "arena.h"
+#include "http_headers.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -13,9 +14,10 @@
 #include <time.h>
 
 #define REQUEST_BUFFER_SIZE     2048
-#define RESPONSE_BUFFER_SIZE    2048
+#define ARENA_CHUNK_SIZE        4096
 #define MAX_HEADER_SIZE         25
-#define MAX_STATE_STACK_SIZE    256
+#define MAX_INTERNAL_REDIRECTS  10
+#define MAX_LISTENERS           16
 
 /*
  * HTTP request/response
@@ -24,15 +26,21 @@ typedef struct _request         request_t;
 typedef struct _response        response_t;
 typedef struct _http_header     http_header_t;
 typedef struct _http_status     http_status_t;
-typedef union  _ctx_state       ctx_state_t;
 typedef struct _handler_ctx     handler_ctx_t;
-typedef struct _state_node        ctx_node_t;
+typedef struct _param_index     param_index_t;
+typedef struct _early_hints     early_hints_t;
+typedef struct _output_filter   output_filter_t;
+typedef struct _filter          filter_t;
+typedef struct _filter_chain    filter_chain_t;
 
 /*
  * HTTP server/connection
  */
 typedef struct _server server_t;
 typedef struct _connection connection_t;
+typedef struct _conn_pool conn_pool_t;
+typedef struct _h2_session h2_session_t;
+typedef struct _h2_stream  h2_stream_t;
 
 enum _handler_result {
     HANDLER_DONE,
@@ -44,27 +52,69 @@ enum _handler_result {
  */
 typedef int (*handler_func)(request_t *request, response_t *response, handler_ctx_t *ctx);
 
+/*
+ * Request body consumer, called with each piece of the body as it
+ * arrives. The data is only valid during the call.
+ */
+typedef void (*body_handler)(request_t *request, response_t *response,
+                             handler_ctx_t *ctx, const char *data, size_t len);
+
 request_t*   request_create(connection_t *conn);
 int          request_reset(request_t *req);
 int          request_destroy(request_t *request);
 const char*  request_get_header(request_t *request, const char *header_name);
+const char*  request_get_header_id(request_t *request, http_header_id_e id);
+str_t        request_get_header_str(request_t *request, str_t name);
+str_t        request_get_header_id_str(request_t *request, http_header_id_e id);
 int          request_parse_headers(request_t *request,
                                    const char *data,
                                    const size_t data_len,
                                    size_t *consumed);
+int          request_decode_url(request_t *request);
+const char*  request_get_query_param(request_t *request, const char *name);
+const char*  request_get_cookie(request_t *request, const char *name);
+int          request_has_body(request_t *request);
+int          request_read_body(request_t *request,
+                               body_handler on_data,
+                               handler_func next_handler);
+int          request_pause_body(request_t *request);
+int          request_resume_body(request_t *request);
+int          request_discard_body(request_t *request);
+int          request_set_method(request_t *request, const char *method, size_t len);
+int          request_set_path(request_t *request, const char *path, size_t len);
+int          request_add_header(request_t *request,
+                                const char *name, size_t name_len,
+                                const char *value, size_t value_len);
+int          request_internal_redirect(request_t *request, response_t *response,
+                                       handler_ctx_t *ctx, const char *uri);
+void         request_feed_body(request_t *request, const char *data, size_t len);
+void         request_end_body(request_t *request);
 
 response_t*    response_create(connection_t *conn);
 int            response_reset(response_t *resp);
 int            response_destroy(response_t *response);
 const char*    response_get_header(response_t *response, const char *header_name);
+const char*    response_get_header_id(response_t *response, http_header_id_e id);
 int            response_set_header(response_t *response, char *name, char *value);
+int            response_set_header_id(response_t *response, http_header_id_e id, char *value);
+str_t          response_get_header_str(response_t *response, str_t name);
+str_t          response_get_header_id_str(response_t *response, http_header_id_e id);
+// The slices are kept as they are, the memory must stay valid until
+// the headers are sent. The values are not NUL-terminated then.
+int            response_set_header_str(response_t *response, str_t name, str_t value);
+int            response_set_header_id_str(response_t *response, http_header_id_e id,
+                                          str_t value);
 int            response_set_header_printf(response_t *response, char* name,
                                           const char *fmt, ...);
+int            response_remove_header_str(response_t *response, str_t name);
 char*          response_alloc(response_t *response, size_t n);
 int            response_write(response_t *response,
                               char *data,
                               size_t data_len,
                               handler_func next_handler);
+int            response_write_shared(response_t *response,
+                                     shared_buffer_t *sbuf,
+                                     handler_func next_handler);
 int            response_send_file(response_t *response,
                                   int fd,
                                   size_t offset,
@@ -72,20 +122,32 @@ int            response_send_file(response_t *response,
                                   handler_func next_handler);
 int            response_send_status(response_t *response, http_status_t status);
 int            response_send_headers(response_t *response, handler_func next_handler);
+int            response_send_early_hints(response_t *response, const early_hints_t *hints);
+int            response_end(response_t *response);
+
+early_hints_t* early_hints_create(const char **links, size_t count);
+int            early_hints_destroy(early_hints_t *hints);
+
+int            filter_write(filter_t *filter, const char *data, size_t len);
 
 handler_ctx_t* context_create();
 int            context_destroy(handler_ctx_t *ctx);
 int            context_reset(handler_ctx_t *ctx);
-int            context_push(handler_ctx_t *ctx, ctx_state_t stat);
-ctx_state_t*   context_pop(handler_ctx_t *ctx);
-ctx_state_t*   context_peek(handler_ctx_t *ctx);
+
+void*          coro_locals(handler_ctx_t *ctx, response_t *resp, size_t size);
+int            coro_resume(request_t *req, response_t *resp, handler_ctx_t *ctx);
+int            coro_read_body(request_t *request);
 
 connection_t*  connection_accept(server_t *server, int listen_fd); 
+connection_t*  connection_alloc(server_t *server);
+void           connection_release(connection_t *conn);
+void           connection_pool_destroy(conn_pool_t *pool);
 int            connection_close(connection_t *conn);
 int            connection_destroy(connection_t *conn);
 int            connection_run(connection_t *conn);
 int            connection_finish_current_request(connection_t *conn);
 void           connection_run_handler(connection_t *conn, handler_func handler);
+handler_func   connection_request_handler(connection_t *conn, int bad_path);
 
 server_t*      server_create();
 server_t*      server_parse_conf(char *confile);
@@ -97,6 +159,7 @@ int            server_stop(server_t *server);
 
 // 1xx informational
 extern http_status_t STATUS_CONTINUE;
+extern http_status_t STATUS_EARLY_HINTS;
 
 // 2xx success
 extern http_status_t STATUS_OK;
@@ -117,7 +180,9 @@ extern http_status_t STATUS_UNAUTHORIZED;
 extern http_status_t STATUS_FORBIDDEN;
 extern http_status_t STATUS_NOT_FOUND;
 extern http_status_t STATUS_METHOD_NOT_ALLOWED;
+extern http_status_t STATUS_PAYLOAD_TOO_LARGE;
 extern http_status_t STATUS_RANGE_NOT_SATISFIABLE;
+extern http_status_t STATUS_EXPECTATION_FAILED;
 
 // 5xx server errors
 extern http_status_t STATUS_INTERNAL_ERROR;
@@ -131,7 +196,8 @@ typedef enum {
     HTTP_VERSION_UNKNOW = -1,
     HTTP_VERSION_0_9 = 9,
     HTTP_VERSION_1_0 = 10,
-    HTTP_VERSION_1_1 = 11
+    HTTP_VERSION_1_1 = 11,
+    HTTP_VERSION_2_0 = 20
 } http_version_e;
 
 typedef enum _http_methods {
@@ -154,23 +220,85 @@ typedef enum _connection_opt {
 struct _http_header {
     char    *name;
     char    *value;
-};
-
-union _ctx_state {
-    void      *as_ptr;
-    long long as_long;
-    int       as_int;
-    char      *as_str;
+    size_t  name_len;
+    size_t  value_len;
+    http_header_id_e    id;
 };
 
 struct _handler_ctx {
-    ctx_state_t       _stat_stack[MAX_STATE_STACK_SIZE];
-    int               _stat_top;
     void              *conf;
+
+    // State of the coroutine handler, see CORO_BEGIN
+    handler_func      _coro;
+    int               _coro_line;
+    int               _coro_failed;
+    void              *_coro_locals;
+    str_t             _coro_chunk;
 };
 
+/*
+ * Coroutine handlers. A handler written between CORO_BEGIN and CORO_END
+ * waits for a write, a file or a piece of the body with CORO_AWAIT and
+ * goes on right after it once it is done, instead of being split into
+ * a handler for every step:
+ *
+ *     state = coro_locals(ctx, resp, sizeof(*state));
+ *     CORO_BEGIN(ctx, my_handler);
+ *     CORO_AWAIT(ctx, response_send_headers(resp, coro_resume));
+ *     CORO_AWAIT(ctx, response_send_file(resp, state->fd, 0, n, coro_resume));
+ *     close(state->fd);
+ *     CORO_END(ctx);
+ *
+ * The handler is entered again at every step, so its local variables
+ * are lost across a wait. What has to survive goes in the memory from
+ * coro_locals. The waits can not be inside a switch statement.
+ */
+#define CORO_BEGIN(ctx, self)                           \
+    (ctx)->_coro = (self);                              \
+    switch ((ctx)->_coro_line) {                        \
+    case 0:
+
+// op is called with coro_resume as its next handler. If it fails, the
+// handler goes on right away with CORO_FAILED set.
+#define CORO_AWAIT(ctx, op)                             \
+    do {                                                \
+        (ctx)->_coro_line = __LINE__;                   \
+        (ctx)->_coro_failed = 0;                        \
+        if ((op) >= 0) {                                \
+            return HANDLER_UNFISHED;                    \
+        }                                               \
+        (ctx)->_coro_failed = 1;                        \
+    case __LINE__:;                                     \
+    } while (0)
+
+// Wait for the next piece of the request body. The chunk is only valid
+// until the next wait, its ptr is NULL once all of the body has been
+// read. Nothing else can be waited for until then.
+#define CORO_AWAIT_BODY(ctx, req, chunk)                \
+    do {                                                \
+        (ctx)->_coro_line = __LINE__;                   \
+        (ctx)->_coro_failed = 0;                        \
+        if ((ctx)->_coro_chunk.ptr != NULL              \
+            || coro_read_body(req) >= 0) {              \
+            return HANDLER_UNFISHED;                    \
+        }                                               \
+        (ctx)->_coro_failed = 1;                        \
+    case __LINE__:                                      \
+        (chunk) = (ctx)->_coro_chunk;                   \
+    } while (0)
+
+#define CORO_FAILED(ctx)    ((ctx)->_coro_failed)
+
+#define CORO_END(ctx)                                   \
+    }                                                   \
+    (ctx)->_coro_line = 0;                              \
+    return HANDLER_DONE
+
 struct _request {
+    // Decoded and normalized, see request_decode_url
     char                    *path;
+    size_t                  path_len;
+    // Still escaped, see request_get_query_param
     char                    *query_str;
     char                    *method;
     http_version_e          version;
@@ -178,8 +306,14 @@ struct _request {
     char                    *host;
     size_t                  content_length;
     connection_opt_e        connection;
-
-    char                    *body;
+    // Transfer-Encoding: chunked, content_length is not used then
+    int                     chunked;
+    // Expect: 100-continue, 1 until the client is told to go on, -1 if
+    // it expects something else
+    int                     expect_continue;
+    // Times the request was handed to another location by the server,
+    // see request_internal_redirect
+    int                     internal_redirects;
 
     // Unresolved headers of the request
     http_header_t           headers[MAX_HEADER_SIZE];
@@ -187,11 +321,85 @@ struct _request {
 
     connection_t            *_conn;
 
-    struct hsearch_data     _header_hash;
+    // Index + 1 of the standard headers in the list, 0 if absent
+    unsigned char           _header_slots[HTTP_HEADER_COUNT];
+
+    // The header block, all the tokens above are slices of it
+    char                    *_block;
+    size_t                  _block_len;
+    size_t                  _block_cap;
+    size_t                  _parse_pos;
+    int                     _parse_state;
+
+    // Body reading state
+    int                     _body_state;
+    // Bytes of a chunked body seen so far, checked against max_body_size
+    size_t                  _body_read;
+    body_handler            _body_handler;
+    handler_func            _body_next;
+
+    // Built from the arena on the first lookup, NULL until then
+    param_index_t           *_query_index;
+    param_index_t           *_cookie_index;
+};
+
+/*
+ * A 103 response with a Link header per hint, serialized once for
+ * each protocol. The slices point into the same allocation.
+ */
+struct _early_hints {
+    // The whole interim response of HTTP/1.1
+    str_t         h1;
+    // The HPACK header block of HTTP/2
+    str_t         h2;
+};
+
+#define MAX_FILTERS     8
+
+/*
+ * A stage of the output filter chain, between the response and the
+ * connection. The body goes through the stages in order, each passes
+ * what it makes of it on with filter_write. A file is given to a stage
+ * in blocks read one downstream write at a time, and sent without
+ * being read when no stage transforms the body.
+ */
+struct _output_filter {
+    char            *name;
+    // The configuration of a location, from its JSON object
+    void*           (*create)(json_value *location);
+    void            (*destroy)(void *conf);
+    // Before the headers are sent, which the stage can change. Returns
+    // 0 to take part in the response, 1 to stay out of it.
+    int             (*init)(filter_t *filter, request_t *req, response_t *resp);
+    // Each call must pass something on, or hold data that flush
+    // passes on. The data is only valid during the call.
+    int             (*write)(filter_t *filter, const char *data, size_t len);
+    int             (*flush)(filter_t *filter);
+    // The end of the body, what is held back is passed on
+    int             (*end)(filter_t *filter);
+    // When the response is done with, even if it was never ended
+    void            (*cleanup)(filter_t *filter);
+};
+
+/*
+ * The stages of a location, only the ones it configures.
+ */
+struct _filter_chain {
+    const output_filter_t   *filters[MAX_FILTERS];
+    void                    *confs[MAX_FILTERS];
+    int                     count;
+};
 
-    // All the request header fields' are stored in this buffer 
-    char                    _buffer[REQUEST_BUFFER_SIZE];
-    int                     _buf_idx;
+/*
+ * A stage taking part in a response, from the arena.
+ */
+struct _filter {
+    const output_filter_t   *def;
+    void                    *conf;
+    // State of the stage, set by init
+    void                    *data;
+    response_t              *resp;
+    struct _filter          *next;
 };
 
 struct _http_status {
@@ -214,26 +422,92 @@ struct _response {
     http_header_t        headers[MAX_HEADER_SIZE];
     size_t               header_count;
 
-    struct hsearch_data  _header_hash;
+    unsigned char        _header_slots[HTTP_HEADER_COUNT];
 
-    char                 _buffer[RESPONSE_BUFFER_SIZE];
-    size_t               _buf_idx;
     int                  _header_sent;
     connection_t         *_conn;
     size_t               *_size_written;
     // This response is done?
     int                  _done;
+    // The body is sent in chunks, and the last chunk has been sent?
+    int                  _chunked;
+    int                  _chunked_end;
 
     // Next handler to call after current write finishes
     handler_func         _next_handler;
+
+    // The output filters of the location, and the stages taking part
+    // once the headers are sent
+    const filter_chain_t *filter_chain;
+    filter_t             *_filter;
+    int                  _filter_ended;
+    // Pieces that went past the last stage
+    unsigned int         _filter_output;
+    // A file read in blocks into the first stage
+    int                  _filter_fd;
+    size_t               _filter_offset;
+    size_t               _filter_left;
+    handler_func         _filter_next;
 };
 
 typedef enum _server_state {
     SERVER_INIT = 0,
     SERVER_RUNNING,
+    // No longer accepting, the connections left are being finished
+    SERVER_STOPPING,
     SERVER_STOPPED
 } server_state;
 
+typedef struct _server_stats {
+    unsigned long   conn_accepted;
+    unsigned long   conn_active;
+    // Connections answered with 503 and closed right away under load
+    unsigned long   conn_shed;
+    // Times accepting was paused at worker_connections
+    unsigned long   accept_pauses;
+
+    // Observed sizes of request headers and of the response data that
+    // had to be buffered, used to size the buffers of new connections.
+    size_hist_t     header_sizes;
+    size_hist_t     burst_sizes;
+    unsigned long   samples;
+    size_t          read_buf_size;
+    size_t          write_buf_size;
+} server_stats_t;
+
+struct _pooled_conn;
+struct _conn_batch;
+
+/*
+ * Connections are allocated in batches, together with the objects of
+ * their requests, and recycled once closed, see connection_alloc.
+ */
+struct _conn_pool {
+    struct _pooled_conn     *free;
+    struct _conn_batch      *batches;
+    size_t                  size;
+    size_t                  free_count;
+};
+
+/*
+ * A socket the server accepts connections on. The options left 0 are
+ * those of the server.
+ */
+typedef struct _listener {
+    server_t                *server;
+    // As configured, a Unix socket is "unix:" followed by its path
+    char                    address[128];
+    struct sockaddr_storage sockaddr;
+    socklen_t               socklen;
+    int                     fd;
+
+    int                     backlog;
+    int                     defer_accept;
+    int                     fastopen;
+    // An IPv6 socket takes IPv4 connections too unless set
+    int                     ipv6only;
+} listener_t;
+
 struct _server {
     handler_func    handler;
     void            *handler_conf;
@@ -243,13 +517,59 @@ struct _server {
     char            *logfile;
     char            *pidfile;
     int             loglevel;
+    // Worker processes forked by a master process, 0 to serve from a
+    // single process
+    int             workers;
+    // Command line the process was started with, run again for a
+    // binary upgrade
+    char            **argv;
 
     server_state    state;
-    int             listen_fd;
     ioloop_t        *ioloop;
 
+    listener_t      listeners[MAX_LISTENERS];
+    int             listener_count;
+    // Listened on when no listener is configured
     char            *addr;
     unsigned short   port;
+    int             backlog;
+    // Seconds a connection may stay silent before accepted, 0 disables
+    // TCP_DEFER_ACCEPT
+    int             defer_accept;
+    // Queue length of TCP Fast Open, 0 disables it
+    int             fastopen;
+    // Connections accepted in a row before the others get a turn
+    int             accept_budget;
+
+    // Connections of this process, and of all its workers together,
+    // past which new ones are answered with 503, 0 for no limit
+    unsigned long   worker_connections;
+    unsigned long   max_connections;
+    // At worker_connections, stop accepting instead
+    int             overload_pause;
+    // Handler of the listeners taken out of the ioloop while accepting
+    // is paused, and the events they are added back with
+    io_handler      paused_accept;
+    unsigned int    listen_events;
+    // Active connections of each worker, in memory shared by them
+    unsigned long   *conn_counts;
+    int             worker_slot;
+
+    // New connections start with buffers big enough for this
+    // percentile of the observed traffic, 0 disables learning.
+    int             buffer_percentile;
+    size_t          read_buf_min;
+    size_t          read_buf_max;
+    size_t          write_buf_min;
+    size_t          write_buf_max;
+
+    // Requests with a larger Content-Length are refused before their
+    // body is sent, 0 for no limit
+    size_t          max_body_size;
+
+    server_stats_t  stats;
+    conn_pool_t     conn_pool;
+    iostream_pool_t stream_pool;
 };
 
 typedef enum _connection_state {
@@ -261,13 +581,25 @@ typedef enum _connection_state {
 struct _connection {
     server_t           *server;
     iostream_t         *stream;
-    char               remote_ip[20];
+    char               remote_ip[INET6_ADDRSTRLEN];
     unsigned short     remote_port;
+    // Address family of the listener, the TCP options are not set on
+    // the connections of a Unix socket
+    sa_family_t        family;
     conn_stat_e        state;
 
     request_t          *request;
     response_t         *response;
     handler_ctx_t      *context;
+
+    // Scratch memory of the current request, reset when it is finished
+    arena_t            *arena;
+
+    // Set once the connection speaks HTTP/2
+    h2_session_t       *h2;
+    // Set on the connection of an HTTP/2 stream, which shares the
+    // iostream with the others
+    h2_stream_t        *h2_stream;
 };
 
 
@@ -0,0 +1,1560 @@
+#include "common.h"
+#include "http2.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+
+#define H2_FRAME_HEADER_SIZE    9
+#define H2_DEFAULT_FRAME_SIZE   16384
+#define H2_MAX_FRAME_SIZE       16777215
+#define H2_DEFAULT_WINDOW       65535
+#define H2_MAX_WINDOW           0x7fffffff
+#define H2_MAX_STREAMS          100
+#define H2_MAX_HEADER_BLOCK     65536
+// Decoded size of the header list of a request, counted as for
+// SETTINGS_MAX_HEADER_LIST_SIZE
+#define H2_MAX_HEADER_LIST      65536
+#define H2_MAX_SETTINGS_HEADER  512
+
+// Our SETTINGS: at most 100 streams and headers of H2_MAX_HEADER_LIST
+#define H2_SETTINGS_PAYLOAD     "\0\x03\0\0\0\x64" "\0\x06\0\x01\0\0"
+#define H2_SETTINGS_LEN         12
+
+// Pending DATA of a stream
+#define H2_MAX_QUEUE            16
+
+// A round of writes carries at most this much DATA, taken from the
+// streams in turn, so that one big response does not hold up the others
+#define H2_ROUND_SIZE           65536
+#define H2_ROUND_FRAMES         16
+
+enum _h2_frame_type {
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+};
+
+enum _h2_frame_flag {
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20,
+};
+
+enum _h2_error {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM,
+};
+
+enum _h2_setting {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+/*
+ * A piece of the response body, a shared buffer or a part of a file.
+ */
+typedef struct _h2_data {
+    shared_buffer_t *sbuf;
+    int             fd;
+    size_t          offset;
+    size_t          len;
+} h2_data_t;
+
+struct _h2_stream {
+    unsigned int    id;
+    h2_session_t    *session;
+    connection_t    *conn;
+    h2_stream_t     *next;
+
+    long            send_window;
+    long            recv_window;
+    size_t          recv_consumed;
+
+    h2_data_t       queue[H2_MAX_QUEUE];
+    int             queue_head;
+    int             queue_len;
+    int             end_queued;
+    int             end_sent;
+
+    // The response waits for what it wrote to be sent, which happens
+    // in this round at the earliest
+    int             waiting;
+    unsigned long   wait_round;
+
+    // The request body received before it is read, or while paused
+    char            *body;
+    size_t          body_len;
+    size_t          body_cap;
+    int             has_body;
+    int             body_reading;
+    int             body_paused;
+    int             body_ended;
+    int             deliver;
+
+    // The header block had a regular field, or a field we refuse
+    int             fields_started;
+    int             malformed;
+
+    // A HEAD request, its response has no DATA
+    int             head;
+
+    // END_STREAM received
+    int             remote_closed;
+    int             reset;
+    int             finished;
+};
+
+struct _h2_session {
+    connection_t    *conn;
+    hpack_table_t   *decoder;
+
+    // The open streams, in the order they are served
+    h2_stream_t     *streams;
+    int             stream_count;
+    unsigned int    last_stream_id;
+
+    // Settings of the peer
+    size_t          max_frame_size;
+    long            initial_window;
+
+    long            send_window;
+    long            recv_window;
+    size_t          recv_consumed;
+
+    // The frame being read
+    int             frame_type;
+    int             frame_flags;
+    unsigned int    frame_stream;
+    size_t          frame_len;
+
+    // A header block continued in CONTINUATION frames
+    char            *block;
+    size_t          block_len;
+    size_t          block_cap;
+    unsigned int    block_stream;
+    int             block_end_stream;
+    int             in_block;
+
+    // Frames to send ahead of the DATA of the next round
+    char            *out;
+    size_t          out_len;
+    size_t          out_cap;
+
+    // The upgraded request, served once the client preface is read
+    h2_stream_t     *upgraded;
+
+    unsigned long   round;
+    int             writing;
+    int             scheduled;
+    // No new streams are taken
+    int             goaway;
+    // A connection error was sent, close once it is written
+    int             closing;
+    int             destroyed;
+};
+
+static h2_session_t* _session_create(connection_t *conn);
+static void _session_error(h2_session_t *session, int code);
+static void _schedule(h2_session_t *session);
+static void _process(ioloop_t *loop, void *args);
+static void _flush(h2_session_t *session);
+static void _on_written(iostream_t *stream);
+static void _complete_streams(h2_session_t *session);
+static int  _append(h2_session_t *session, const char *data, size_t len);
+static int  _append_frame(h2_session_t *session, int type, int flags,
+                          unsigned int id, const char *payload, size_t len);
+static int  _append_headers(h2_session_t *session, unsigned int id,
+                            const char *block, size_t len);
+static void _send_rst(h2_session_t *session, unsigned int id, int code);
+static int  _apply_settings(h2_session_t *session, const unsigned char *p, size_t len);
+static void _on_preface(iostream_t *stream, void *data, size_t len);
+static void _read_frame(h2_session_t *session);
+static void _on_frame_header(iostream_t *stream, void *data, size_t len);
+static void _on_frame_payload(iostream_t *stream, void *data, size_t len);
+static void _handle_frame(h2_session_t *session, const unsigned char *p, size_t len);
+static void _on_header_block(h2_session_t *session);
+static void _on_field(void *args, const char *name, size_t name_len,
+                      const char *value, size_t value_len);
+static void _ignore_field(void *args, const char *name, size_t name_len,
+                          const char *value, size_t value_len);
+static h2_stream_t* _stream_create(h2_session_t *session, unsigned int id);
+static void _stream_free(h2_stream_t *stream);
+static h2_stream_t* _find_stream(h2_session_t *session, unsigned int id);
+static void _run_stream(h2_stream_t *stream);
+static void _reset(h2_stream_t *stream, int code);
+static void _drop_output(h2_stream_t *stream);
+static int  _queue_data(h2_stream_t *stream, shared_buffer_t *sbuf,
+                        int fd, size_t offset, size_t len);
+static void _wait_output(h2_stream_t *stream);
+static void _deliver_body(h2_stream_t *stream);
+static void _consume_window(h2_session_t *session, h2_stream_t *stream, size_t len);
+
+#define _get_u32(p) \
+    (((unsigned int) (p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+
+#define _drained(stream)                                                \
+    ((stream)->queue_len == 0                                           \
+     && ((stream)->reset || !(stream)->end_queued || (stream)->end_sent))
+
+static void _put_u32(unsigned char *p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void _frame_header(unsigned char *p, size_t len, int type, int flags,
+                          unsigned int id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    _put_u32(p + 5, id & H2_MAX_WINDOW);
+}
+
+
+/*
+ * Start HTTP/2 on a connection that sent the beginning of the preface
+ * instead of a request.
+ */
+int http2_start(connection_t *conn) {
+    h2_session_t    *session;
+
+    session = _session_create(conn);
+    if (session == NULL) {
+        connection_close(conn);
+        return -1;
+    }
+    if (iostream_read_bytes(conn->stream, HTTP2_PREFACE_LEN - HTTP2_PREFACE_HEAD_LEN,
+                            _on_preface, NULL) < 0) {
+        connection_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Does the request ask to switch to h2c? Only requests without a body
+ * are upgraded, the others are served over HTTP/1.1.
+ */
+int http2_wants_upgrade(request_t *req) {
+    const char  *upgrade;
+
+    if (req->version != HTTP_VERSION_1_1 || request_has_body(req)) {
+        return 0;
+    }
+    upgrade = request_get_header_id(req, HTTP_HEADER_UPGRADE);
+    return upgrade != NULL && has_token(upgrade, "h2c")
+        && request_get_header(req, "HTTP2-Settings") != NULL;
+}
+
+static ssize_t _base64url_decode(const char *src, unsigned char *dst, size_t capacity) {
+    unsigned int    acc = 0;
+    size_t          n = 0;
+    int             bits = 0, v;
+
+    for (; *src != '\0' && *src != '='; src++) {
+        if (*src >= 'A' && *src <= 'Z') {
+            v = *src - 'A';
+        } else if (*src >= 'a' && *src <= 'z') {
+            v = *src - 'a' + 26;
+        } else if (*src >= '0' && *src <= '9') {
+            v = *src - '0' + 52;
+        } else if (*src == '-') {
+            v = 62;
+        } else if (*src == '_') {
+            v = 63;
+        } else {
+            return -1;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= capacity) {
+                return -1;
+            }
+            dst[n++] = acc >> bits;
+            acc &= (1 << bits) - 1;
+        }
+    }
+    return n;
+}
+
+/*
+ * Switch to HTTP/2 after a request asking for it, the request becomes
+ * stream 1. Returns -1 if the upgrade is not possible, the request is
+ * served over HTTP/1.1 then.
+ */
+int http2_upgrade(connection_t *conn) {
+    static const char   *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    h2_session_t        *session;
+    h2_stream_t         *stream;
+    request_t           *req, tmp;
+    unsigned char       settings[H2_MAX_SETTINGS_HEADER];
+    ssize_t             n;
+
+    n = _base64url_decode(request_get_header(conn->request, "HTTP2-Settings"),
+                          settings, sizeof(settings));
+    if (n < 0 || n % 6 != 0) {
+        return -1;
+    }
+    session = _session_create(conn);
+    if (session == NULL) {
+        return -1;
+    }
+    // The 101 response goes ahead of our SETTINGS
+    session->out_len = 0;
+    if (_append(session, switching, strlen(switching)) < 0
+        || _append_frame(session, H2_SETTINGS, 0, 0,
+                         H2_SETTINGS_PAYLOAD, H2_SETTINGS_LEN) < 0) {
+        connection_close(conn);
+        return 0;
+    }
+    if (_apply_settings(session, settings, n) != H2_NO_ERROR) {
+        _session_error(session, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    if (iostream_read_bytes(conn->stream, HTTP2_PREFACE_LEN, _on_preface, NULL) < 0
+        || (stream = _stream_create(session, 1)) == NULL) {
+        connection_close(conn);
+        return 0;
+    }
+    session->last_stream_id = 1;
+
+    // The request is taken over by the stream, which is half closed.
+    // The objects stay with their pooled connections, only what they
+    // hold is swapped.
+    req = stream->conn->request;
+    tmp = *req;
+    *req = *conn->request;
+    *conn->request = tmp;
+    req->_conn = stream->conn;
+    conn->request->_conn = conn;
+    stream->remote_closed = 1;
+    session->upgraded = stream;
+    return 0;
+}
+
+int http2_session_destroy(h2_session_t *session) {
+    session->destroyed = 1;
+    while (session->streams != NULL) {
+        _stream_free(session->streams);
+    }
+    hpack_table_destroy(session->decoder);
+    free(session->block);
+    free(session->out);
+    session->conn->h2 = NULL;
+    // A pending _process frees it
+    if (!session->scheduled) {
+        free(session);
+    }
+    return 0;
+}
+
+/*
+ * The HEADERS frames of the response. Fields about the connection have
+ * no meaning on a stream and are left out.
+ */
+int http2_send_headers(h2_stream_t *stream, response_t *resp) {
+    http_header_t   *header;
+    size_t          i, size, len;
+    char            *buf;
+
+    size = HPACK_FIELD_MAX(0, 3);
+    for (i = 0; i < resp->header_count; i++) {
+        header = resp->headers + i;
+        size += HPACK_FIELD_MAX(header->name_len, header->value_len);
+    }
+    buf = response_alloc(resp, size);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    len = hpack_encode_status(buf, resp->status.code);
+    for (i = 0; i < resp->header_count; i++) {
+        header = resp->headers + i;
+        switch (header->id) {
+        case HTTP_HEADER_CONNECTION:
+        case HTTP_HEADER_PROXY_CONNECTION:
+        case HTTP_HEADER_TRANSFER_ENCODING:
+        case HTTP_HEADER_UPGRADE:
+            continue;
+
+        case HTTP_HEADER_UNKNOWN:
+            if (strcasecmp(header->name, "Keep-Alive") == 0) {
+                continue;
+            }
+            break;
+
+        default:
+            break;
+        }
+        len += hpack_encode_field(buf + len, header->id,
+                                  header->name, header->name_len,
+                                  header->value, header->value_len);
+    }
+    if (!stream->reset && _append_headers(stream->session, stream->id, buf, len) < 0) {
+        return -1;
+    }
+    _wait_output(stream);
+    return 0;
+}
+
+int http2_write(h2_stream_t *stream, const char *data, size_t len) {
+    shared_buffer_t *sbuf;
+    int             rc;
+
+    if (len == 0) {
+        // Nothing to send, the handler goes on once the output queued
+        // before is out
+        if (stream->end_queued) {
+            return -1;
+        }
+        _wait_output(stream);
+        return 0;
+    }
+    sbuf = shared_buffer_create(data, len);
+    if (sbuf == NULL) {
+        return -1;
+    }
+    rc = _queue_data(stream, sbuf, -1, 0, len);
+    shared_buffer_unref(sbuf);
+    return rc;
+}
+
+int http2_write_shared(h2_stream_t *stream, shared_buffer_t *sbuf) {
+    return _queue_data(stream, sbuf, -1, 0, shared_buffer_size(sbuf));
+}
+
+int http2_send_file(h2_stream_t *stream, int fd, size_t offset, size_t len) {
+    return _queue_data(stream, NULL, fd, offset, len);
+}
+
+/*
+ * The response is complete, END_STREAM goes with its last DATA frame.
+ */
+int http2_end(h2_stream_t *stream) {
+    if (!stream->conn->response->_header_sent) {
+        // Nothing was sent, there is no response to end
+        _reset(stream, H2_INTERNAL_ERROR);
+        return 0;
+    }
+    if (!stream->end_queued) {
+        stream->end_queued = 1;
+        _schedule(stream->session);
+    }
+    return 0;
+}
+
+int http2_has_body(h2_stream_t *stream) {
+    return stream->has_body;
+}
+
+/*
+ * The DATA frames received so far are delivered from the ioloop, the
+ * following ones as they arrive.
+ */
+int http2_read_body(h2_stream_t *stream) {
+    stream->body_reading = 1;
+    stream->deliver = 1;
+    _schedule(stream->session);
+    return 0;
+}
+
+/*
+ * The interim 100 response of a request with Expect: 100-continue.
+ */
+int http2_send_continue(h2_stream_t *stream) {
+    char    buf[8];
+    size_t  len;
+
+    len = hpack_encode_status(buf, 100);
+    return http2_send_interim(stream, buf, len);
+}
+
+/*
+ * Send a header block of an informational response, which does not
+ * end the stream.
+ */
+int http2_send_interim(h2_stream_t *stream, const char *block, size_t len) {
+    if (stream->reset) {
+        return 0;
+    }
+    return _append_headers(stream->session, stream->id, block, len);
+}
+
+/*
+ * A paused body is held in the stream, and the peer is told to stop
+ * sending once our window is used up.
+ */
+int http2_pause_body(h2_stream_t *stream) {
+    stream->body_paused = 1;
+    return 0;
+}
+
+int http2_resume_body(h2_stream_t *stream) {
+    stream->body_paused = 0;
+    stream->deliver = 1;
+    _schedule(stream->session);
+    return 0;
+}
+
+int http2_reset_stream(h2_stream_t *stream) {
+    _reset(stream, H2_INTERNAL_ERROR);
+    return 0;
+}
+
+/*
+ * The handler is done with the stream, it is freed once the rest of its
+ * output is sent.
+ */
+int http2_finish_stream(h2_stream_t *stream) {
+    // What is left of the body is dropped
+    if (stream->body_len > 0) {
+        _consume_window(stream->session, stream, stream->body_len);
+        stream->body_len = 0;
+    }
+    stream->finished = 1;
+    _schedule(stream->session);
+    return 0;
+}
+
+static h2_session_t* _session_create(connection_t *conn) {
+    h2_session_t    *session;
+
+    session = (h2_session_t*) calloc(1, sizeof(h2_session_t));
+    if (session == NULL) {
+        error("Error allocating HTTP/2 session");
+        return NULL;
+    }
+    session->decoder = hpack_table_create(HPACK_TABLE_SIZE);
+    if (session->decoder == NULL) {
+        free(session);
+        return NULL;
+    }
+    hpack_table_limit_list(session->decoder, H2_MAX_HEADER_LIST);
+    session->conn = conn;
+    session->max_frame_size = H2_DEFAULT_FRAME_SIZE;
+    session->initial_window = H2_DEFAULT_WINDOW;
+    session->send_window = H2_DEFAULT_WINDOW;
+    session->recv_window = H2_DEFAULT_WINDOW;
+    conn->h2 = session;
+
+    if (_append_frame(session, H2_SETTINGS, 0, 0,
+                      H2_SETTINGS_PAYLOAD, H2_SETTINGS_LEN) < 0) {
+        http2_session_destroy(session);
+        return NULL;
+    }
+    debug("HTTP/2 started on connection %s:%d", conn->remote_ip, conn->remote_port);
+    return session;
+}
+
+/*
+ * Tell the peer about a connection error, then close the connection.
+ */
+static void _session_error(h2_session_t *session, int code) {
+    unsigned char   payload[8];
+
+    if (session->closing) {
+        return;
+    }
+    warn("HTTP/2 connection error %d from %s", code, session->conn->remote_ip);
+    _put_u32(payload, session->last_stream_id);
+    _put_u32(payload + 4, code);
+    _append_frame(session, H2_GOAWAY, 0, 0, (char*) payload, 8);
+    session->goaway = 1;
+    session->closing = 1;
+    _schedule(session);
+}
+
+static void _schedule(h2_session_t *session) {
+    if (session->scheduled || session->destroyed) {
+        return;
+    }
+    if (ioloop_add_callback(session->conn->stream->ioloop, _process, session) < 0) {
+        error("Error scheduling HTTP/2 output");
+        connection_close(session->conn);
+        return;
+    }
+    session->scheduled = 1;
+}
+
+static void _process(ioloop_t *loop, void *args) {
+    h2_session_t    *session = (h2_session_t*) args;
+    h2_stream_t     *stream, *next;
+
+    session->scheduled = 0;
+    if (session->destroyed) {
+        free(session);
+        return;
+    }
+    for (stream = session->streams; stream != NULL; stream = next) {
+        next = stream->next;
+        if (stream->deliver) {
+            stream->deliver = 0;
+            _deliver_body(stream);
+        }
+    }
+    _flush(session);
+}
+
+/*
+ * Write a round: the pending control and HEADERS frames, then DATA
+ * frames taken from the streams in turn, as far as the flow control
+ * windows allow. A part of a file is sent by sendfile and ends the
+ * round, nothing can be written after it until it is done.
+ */
+static void _flush(h2_session_t *session) {
+    iostream_t      *io = session->conn->stream;
+    struct iovec    iov[H2_ROUND_FRAMES * 2 + 1];
+    unsigned char   headers[H2_ROUND_FRAMES][H2_FRAME_HEADER_SIZE];
+    shared_buffer_t *sent[H2_ROUND_FRAMES];
+    h2_stream_t     *stream, *tail, *file_stream = NULL;
+    h2_data_t       *data, file;
+    size_t          budget = H2_ROUND_SIZE, n;
+    int             iovcnt = 0, frames = 0, nsent = 0, progress, flags, rc, i;
+
+    if (session->writing || session->destroyed) {
+        return;
+    }
+    if (session->out_len > 0) {
+        iov[iovcnt].iov_base = session->out;
+        iov[iovcnt++].iov_len = session->out_len;
+    }
+
+    do {
+        progress = 0;
+        for (stream = session->streams;
+             stream != NULL && !session->closing
+                 && frames < H2_ROUND_FRAMES && file_stream == NULL;
+             stream = stream->next) {
+            if (stream->reset) {
+                continue;
+            }
+            if (stream->queue_len > 0) {
+                data = stream->queue + stream->queue_head;
+                n = MIN(data->len, session->max_frame_size);
+                n = MIN(n, budget);
+                n = MIN((long) n, MAX(stream->send_window, 0));
+                n = MIN((long) n, MAX(session->send_window, 0));
+                if (n == 0) {
+                    continue;
+                }
+                flags = n == data->len && stream->queue_len == 1 && stream->end_queued
+                    ? H2_FLAG_END_STREAM : 0;
+                _frame_header(headers[frames], n, H2_DATA, flags, stream->id);
+                iov[iovcnt].iov_base = headers[frames];
+                iov[iovcnt++].iov_len = H2_FRAME_HEADER_SIZE;
+                if (data->sbuf != NULL) {
+                    iov[iovcnt].iov_base = (char*) shared_buffer_data(data->sbuf) + data->offset;
+                    iov[iovcnt++].iov_len = n;
+                } else {
+                    file = *data;
+                    file.len = n;
+                    file_stream = stream;
+                }
+                data->offset += n;
+                data->len -= n;
+                stream->send_window -= n;
+                session->send_window -= n;
+                budget -= n;
+                if (data->len == 0) {
+                    // Released once it has been written
+                    if (data->sbuf != NULL) {
+                        sent[nsent++] = data->sbuf;
+                    }
+                    stream->queue_head = (stream->queue_head + 1) % H2_MAX_QUEUE;
+                    stream->queue_len--;
+                }
+            } else if (stream->end_queued && !stream->end_sent) {
+                flags = H2_FLAG_END_STREAM;
+                _frame_header(headers[frames], 0, H2_DATA, flags, stream->id);
+                iov[iovcnt].iov_base = headers[frames];
+                iov[iovcnt++].iov_len = H2_FRAME_HEADER_SIZE;
+            } else {
+                continue;
+            }
+            if (flags & H2_FLAG_END_STREAM) {
+                stream->end_sent = 1;
+            }
+            frames++;
+            progress = 1;
+        }
+    } while (progress && budget > 0 && frames < H2_ROUND_FRAMES && file_stream == NULL);
+
+    // The next round starts with the next stream
+    if (session->streams != NULL && session->streams->next != NULL) {
+        stream = session->streams;
+        session->streams = stream->next;
+        stream->next = NULL;
+        for (tail = session->streams; tail->next != NULL; tail = tail->next);
+        tail->next = stream;
+    }
+
+    if (iovcnt == 0) {
+        if (session->closing) {
+            connection_close(session->conn);
+        } else {
+            // Nothing to send, the waiting streams may be done
+            _complete_streams(session);
+        }
+        return;
+    }
+
+    session->round++;
+    session->writing = 1;
+    if (file_stream != NULL) {
+        // Held back to go out with the file
+        iostream_cork(io);
+    }
+    rc = iostream_writev(io, iov, iovcnt, _on_written);
+    session->out_len = 0;
+    if (rc >= 0 && file_stream != NULL) {
+        rc = iostream_sendfile(io, file.fd, file.offset, file.len, _on_written);
+        iostream_uncork(io, NULL);
+    }
+    for (i = 0; i < nsent; i++) {
+        shared_buffer_unref(sent[i]);
+    }
+    if (rc < 0) {
+        connection_close(session->conn);
+    }
+}
+
+static void _on_written(iostream_t *io) {
+    connection_t    *conn = (connection_t*) io->user_data;
+    h2_session_t    *session = conn->h2;
+
+    if (session == NULL) {
+        return;
+    }
+    session->writing = 0;
+    if (!session->closing) {
+        _complete_streams(session);
+    }
+    _flush(session);
+}
+
+/*
+ * Run the next handler of the streams whose output has been sent, and
+ * free the streams that are finished.
+ */
+static void _complete_streams(h2_session_t *session) {
+    h2_stream_t     *stream, *next;
+    response_t      *resp;
+    handler_func    handler;
+
+    for (stream = session->streams; stream != NULL; stream = next) {
+        next = stream->next;
+        if (!_drained(stream)) {
+            continue;
+        }
+        if (stream->finished) {
+            // The rest of an unread body is drained first, as over HTTP/1
+            if (stream->remote_closed) {
+                _stream_free(stream);
+            }
+            continue;
+        }
+        resp = stream->conn->response;
+        if (stream->waiting
+            && (stream->reset || stream->wait_round <= session->round)) {
+            stream->waiting = 0;
+            handler = resp->_next_handler;
+            if (handler != NULL) {
+                connection_run_handler(stream->conn, handler);
+            }
+        }
+        // A reset stream will not get the rest of its body either
+        if (!stream->waiting && (resp->_done || stream->reset)) {
+            connection_finish_current_request(stream->conn);
+        }
+    }
+}
+
+static int _append(h2_session_t *session, const char *data, size_t len) {
+    char    *out;
+    size_t  cap;
+
+    if (session->out_len + len > session->out_cap) {
+        cap = MAX(session->out_cap * 2, session->out_len + len);
+        cap = MAX(cap, 1024);
+        out = (char*) realloc(session->out, cap);
+        if (out == NULL) {
+            error("Error allocating HTTP/2 output buffer");
+            return -1;
+        }
+        session->out = out;
+        session->out_cap = cap;
+    }
+    memcpy(session->out + session->out_len, data, len);
+    session->out_len += len;
+    return 0;
+}
+
+static int _append_frame(h2_session_t *session, int type, int flags,
+                         unsigned int id, const char *payload, size_t len) {
+    unsigned char   header[H2_FRAME_HEADER_SIZE];
+
+    if (session->destroyed) {
+        return -1;
+    }
+    _frame_header(header, len, type, flags, id);
+    if (_append(session, (char*) header, H2_FRAME_HEADER_SIZE) < 0
+        || (len > 0 && _append(session, payload, len) < 0)) {
+        return -1;
+    }
+    _schedule(session);
+    return 0;
+}
+
+/*
+ * A header block in a HEADERS frame, and CONTINUATION frames for what
+ * does not fit in it.
+ */
+static int _append_headers(h2_session_t *session, unsigned int id,
+                           const char *block, size_t len) {
+    size_t  n;
+    int     type = H2_HEADERS;
+
+    do {
+        n = MIN(len, session->max_frame_size);
+        if (_append_frame(session, type, n == len ? H2_FLAG_END_HEADERS : 0,
+                          id, block, n) < 0) {
+            return -1;
+        }
+        block += n;
+        len -= n;
+        type = H2_CONTINUATION;
+    } while (len > 0);
+    return 0;
+}
+
+static void _send_rst(h2_session_t *session, unsigned int id, int code) {
+    unsigned char   payload[4];
+
+    _put_u32(payload, code);
+    _append_frame(session, H2_RST_STREAM, 0, id, (char*) payload, 4);
+}
+
+/*
+ * Returns the error code of an invalid setting, or H2_NO_ERROR.
+ */
+static int _apply_settings(h2_session_t *session, const unsigned char *p, size_t len) {
+    h2_stream_t     *stream;
+    unsigned int    id, value;
+    long            delta;
+
+    for (; len >= 6; p += 6, len -= 6) {
+        id = (p[0] << 8) | p[1];
+        value = _get_u32(p + 2);
+        switch (id) {
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return H2_PROTOCOL_ERROR;
+            }
+            break;
+
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            delta = (long) value - session->initial_window;
+            session->initial_window = value;
+            for (stream = session->streams; stream != NULL; stream = stream->next) {
+                stream->send_window += delta;
+            }
+            break;
+
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE) {
+                return H2_PROTOCOL_ERROR;
+            }
+            session->max_frame_size = value;
+            break;
+
+        default:
+            // Our encoder does not use the dynamic table, and we never
+            // push, so the other settings do not matter.
+            break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+static void _on_preface(iostream_t *io, void *data, size_t len) {
+    connection_t    *conn = (connection_t*) io->user_data;
+    h2_session_t    *session = conn->h2;
+    h2_stream_t     *stream = session->upgraded;
+
+    if (memcmp(data, HTTP2_PREFACE + HTTP2_PREFACE_LEN - len, len) != 0) {
+        connection_close(conn);
+        return;
+    }
+    _read_frame(session);
+    if (stream != NULL) {
+        session->upgraded = NULL;
+        _run_stream(stream);
+    }
+}
+
+static void _read_frame(h2_session_t *session) {
+    if (session->closing) {
+        return;
+    }
+    if (iostream_read_bytes(session->conn->stream, H2_FRAME_HEADER_SIZE,
+                            _on_frame_header, NULL) < 0) {
+        connection_close(session->conn);
+    }
+}
+
+static void _on_frame_header(iostream_t *io, void *data, size_t len) {
+    connection_t        *conn = (connection_t*) io->user_data;
+    h2_session_t        *session = conn->h2;
+    const unsigned char *p = (const unsigned char*) data;
+    size_t              length;
+
+    length = (p[0] << 16) | (p[1] << 8) | p[2];
+    session->frame_type = p[3];
+    session->frame_flags = p[4];
+    session->frame_stream = _get_u32(p + 5) & H2_MAX_WINDOW;
+
+    session->frame_len = length;
+
+    if (length > H2_DEFAULT_FRAME_SIZE) {
+        _session_error(session, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    // Nothing can come between the frames of a header block
+    if (session->in_block != (session->frame_type == H2_CONTINUATION)
+        || (session->in_block && session->frame_stream != session->block_stream)) {
+        _session_error(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (length == 0) {
+        _handle_frame(session, NULL, 0);
+        _read_frame(session);
+    } else if (iostream_read_bytes(io, length, _on_frame_payload, NULL) < 0) {
+        connection_close(conn);
+    }
+}
+
+static void _on_frame_payload(iostream_t *io, void *data, size_t len) {
+    connection_t    *conn = (connection_t*) io->user_data;
+    h2_session_t    *session = conn->h2;
+
+    // Short only if the read buffer can not hold a frame
+    if (len != session->frame_len) {
+        _session_error(session, H2_INTERNAL_ERROR);
+        return;
+    }
+    _handle_frame(session, (const unsigned char*) data, len);
+    _read_frame(session);
+}
+
+static int _append_block(h2_session_t *session, const unsigned char *p, size_t len) {
+    char    *block;
+    size_t  cap;
+
+    if (session->block_len + len > H2_MAX_HEADER_BLOCK) {
+        return -1;
+    }
+    if (session->block_len + len > session->block_cap) {
+        cap = MAX(session->block_cap * 2, session->block_len + len);
+        block = (char*) realloc(session->block, cap);
+        if (block == NULL) {
+            return -1;
+        }
+        session->block = block;
+        session->block_cap = cap;
+    }
+    memcpy(session->block + session->block_len, p, len);
+    session->block_len += len;
+    return 0;
+}
+
+/*
+ * Strip the padding of a DATA or HEADERS frame, returns -1 if it is
+ * longer than the frame.
+ */
+static int _strip_padding(h2_session_t *session, const unsigned char **p, size_t *len) {
+    size_t  pad;
+
+    if (!(session->frame_flags & H2_FLAG_PADDED)) {
+        return 0;
+    }
+    if (*len < 1 || (pad = (*p)[0]) > *len - 1) {
+        return -1;
+    }
+    (*p)++;
+    *len -= pad + 1;
+    return 0;
+}
+
+static void _handle_data(h2_session_t *session, const unsigned char *p, size_t len) {
+    h2_stream_t     *stream;
+    size_t          frame_len = len, cap;
+    char            *body;
+
+    if (session->frame_stream == 0 || _strip_padding(session, &p, &len) < 0) {
+        _session_error(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+    session->recv_window -= frame_len;
+    if (session->recv_window < 0) {
+        _session_error(session, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+
+    stream = _find_stream(session, session->frame_stream);
+    if (stream == NULL || stream->remote_closed) {
+        if (session->frame_stream > session->last_stream_id) {
+            _session_error(session, H2_PROTOCOL_ERROR);
+            return;
+        }
+        // Only the connection window counts for a closed stream
+        _consume_window(session, NULL, frame_len);
+        if (stream != NULL && !stream->reset) {
+            _reset(stream, H2_STREAM_CLOSED);
+        }
+        return;
+    }
+    stream->recv_window -= frame_len;
+    if (stream->recv_window < 0) {
+        _consume_window(session, NULL, frame_len);
+        _reset(stream, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    if (session->frame_flags & H2_FLAG_END_STREAM) {
+        stream->remote_closed = 1;
+    }
+    if (stream->finished) {
+        // Not wanted any more
+        _consume_window(session, stream, frame_len);
+        if (stream->remote_closed) {
+            _schedule(session);
+        }
+        return;
+    }
+    // The padding is consumed right away
+    _consume_window(session, stream, frame_len - len);
+
+    if (len > 0 && stream->body_reading && !stream->body_paused && stream->body_len == 0) {
+        request_feed_body(stream->conn->request, (const char*) p, len);
+        _consume_window(session, stream, len);
+    } else if (len > 0) {
+        if (stream->body_len + len > stream->body_cap) {
+            cap = MAX(stream->body_cap * 2, stream->body_len + len);
+            body = (char*) realloc(stream->body, cap);
+            if (body == NULL) {
+                _consume_window(session, NULL, len);
+                _reset(stream, H2_INTERNAL_ERROR);
+                return;
+            }
+            stream->body = body;
+            stream->body_cap = cap;
+        }
+        memcpy(stream->body + stream->body_len, p, len);
+        stream->body_len += len;
+    }
+    if (stream->remote_closed) {
+        _deliver_body(stream);
+    }
+}
+
+static void _handle_headers(h2_session_t *session, const unsigned char *p, size_t len) {
+    if (session->frame_stream == 0 || _strip_padding(session, &p, &len) < 0) {
+        _session_error(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (session->frame_flags & H2_FLAG_PRIORITY) {
+        // Priorities are not used
+        if (len < 5) {
+            _session_error(session, H2_PROTOCOL_ERROR);
+            return;
+        }
+        p += 5;
+        len -= 5;
+    }
+    session->block_len = 0;
+    session->block_stream = session->frame_stream;
+    session->block_end_stream = session->frame_flags & H2_FLAG_END_STREAM;
+    if (_append_block(session, p, len) < 0) {
+        _session_error(session, H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    if (session->frame_flags & H2_FLAG_END_HEADERS) {
+        _on_header_block(session);
+    } else {
+        session->in_block = 1;
+    }
+}
+
+static void _handle_continuation(h2_session_t *session, const unsigned char *p, size_t len) {
+    if (_append_block(session, p, len) < 0) {
+        _session_error(session, H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    if (session->frame_flags & H2_FLAG_END_HEADERS) {
+        session->in_block = 0;
+        _on_header_block(session);
+    }
+}
+
+static void _handle_rst_stream(h2_session_t *session, const unsigned char *p, size_t len) {
+    h2_stream_t     *stream;
+
+    if (len != 4) {
+        _session_error(session, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    if (session->frame_stream == 0 || session->frame_stream > session->last_stream_id) {
+        _session_error(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+    stream = _find_stream(session, session->frame_stream);
+    if (stream != NULL && !stream->reset) {
+        debug("HTTP/2 stream %u reset by peer: %u", stream->id, _get_u32(p));
+        stream->reset = 1;
+        stream->remote_closed = 1;
+        stream->body_len = 0;
+        _drop_output(stream);
+        _schedule(session);
+    }
+}
+
+static void _handle_settings(h2_session_t *session, const unsigned char *p, size_t len) {
+    int     rc;
+
+    if (session->frame_stream != 0) {
+        _session_error(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (session->frame_flags & H2_FLAG_ACK) {
+        if (len != 0) {
+            _session_error(session, H2_FRAME_SIZE_ERROR);
+        }
+        return;
+    }
+    if (len % 6 != 0) {
+        _session_error(session, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    rc = _apply_settings(session, p, len);
+    if (rc != H2_NO_ERROR) {
+        _session_error(session, rc);
+        return;
+    }
+    _append_frame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static void _handle_ping(h2_session_t *session, const unsigned char *p, size_t len) {
+    if (session->frame_stream != 0) {
+        _session_error(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (len != 8) {
+        _session_error(session, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    if (!(session->frame_flags & H2_FLAG_ACK)) {
+        _append_frame(session, H2_PING, H2_FLAG_ACK, 0, (const char*) p, 8);
+    }
+}
+
+static void _handle_window_update(h2_session_t *session, const unsigned char *p, size_t len) {
+    h2_stream_t     *stream;
+    long            increment;
+
+    if (len != 4) {
+        _session_error(session, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    increment = _get_u32(p) & H2_MAX_WINDOW;
+    if (session->frame_stream == 0) {
+        if (increment == 0) {
+            _session_error(session, H2_PROTOCOL_ERROR);
+        } else if (session->send_window + increment > H2_MAX_WINDOW) {
+            _session_error(session, H2_FLOW_CONTROL_ERROR);
+        } else {
+            session->send_window += increment;
+            _schedule(session);
+        }
+        return;
+    }
+    stream = _find_stream(session, session->frame_stream);
+    if (stream == NULL || stream->reset) {
+        return;
+    }
+    if (increment == 0) {
+        _reset(stream, H2_PROTOCOL_ERROR);
+    } else if (stream->send_window + increment > H2_MAX_WINDOW) {
+        _reset(stream, H2_FLOW_CONTROL_ERROR);
+    } else {
+        stream->send_window += increment;
+        _schedule(session);
+    }
+}
+
+static void _handle_frame(h2_session_t *session, const unsigned char *p, size_t len) {
+    switch (session->frame_type) {
+    case H2_DATA:
+        _handle_data(session, p, len);
+        break;
+
+    case H2_HEADERS:
+        _handle_headers(session, p, len);
+        break;
+
+    case H2_PRIORITY:
+        if (session->frame_stream == 0) {
+            _session_error(session, H2_PROTOCOL_ERROR);
+        } else if (len != 5) {
+            _session_error(session, H2_FRAME_SIZE_ERROR);
+        }
+        break;
+
+    case H2_RST_STREAM:
+        _handle_rst_stream(session, p, len);
+        break;
+
+    case H2_SETTINGS:
+        _handle_settings(session, p, len);
+        break;
+
+    case H2_PUSH_PROMISE:
+        // Only servers push
+        _session_error(session, H2_PROTOCOL_ERROR);
+        break;
+
+    case H2_PING:
+        _handle_ping(session, p, len);
+        break;
+
+    case H2_GOAWAY:
+        session->goaway = 1;
+        if (session->stream_count == 0) {
+            session->closing = 1;
+            _schedule(session);
+        }
+        break;
+
+    case H2_WINDOW_UPDATE:
+        _handle_window_update(session, p, len);
+        break;
+
+    case H2_CONTINUATION:
+        _handle_continuation(session, p, len);
+        break;
+
+    default:
+        // Unknown frames are ignored
+        break;
+    }
+}
+
+static void _on_header_block(h2_session_t *session) {
+    h2_stream_t     *stream;
+    request_t       *req;
+    unsigned int    id = session->block_stream;
+
+    stream = _find_stream(session, id);
+    if (stream != NULL) {
+        // Trailers, they end the body and their fields are dropped
+        if (hpack_decode(session->decoder, session->block, session->block_len,
+                         _ignore_field, NULL) < 0) {
+            _session_error(session, H2_COMPRESSION_ERROR);
+        } else if (!session->block_end_stream || stream->remote_closed) {
+            _reset(stream, H2_PROTOCOL_ERROR);
+        } else {
+            stream->remote_closed = 1;
+            _deliver_body(stream);
+            _schedule(session);
+        }
+        return;
+    }
+    if (id % 2 == 0 || id <= session->last_stream_id) {
+        _session_error(session, id % 2 == 0 ? H2_PROTOCOL_ERROR : H2_STREAM_CLOSED);
+        return;
+    }
+    session->last_stream_id = id;
+
+    if (session->goaway || session->stream_count >= H2_MAX_STREAMS
+        || (stream = _stream_create(session, id)) == NULL) {
+        // The block is decoded all the same to keep the table in sync
+        if (hpack_decode(session->decoder, session->block, session->block_len,
+                         _ignore_field, NULL) < 0) {
+            _session_error(session, H2_COMPRESSION_ERROR);
+        } else {
+            _send_rst(session, id, H2_REFUSED_STREAM);
+        }
+        return;
+    }
+    switch (hpack_decode(session->decoder, session->block, session->block_len,
+                         _on_field, stream)) {
+    case 0:
+        break;
+    case 1:
+        // Too large, the fields past the limit were not taken
+        stream->malformed = 1;
+        break;
+    default:
+        _stream_free(stream);
+        _session_error(session, H2_COMPRESSION_ERROR);
+        return;
+    }
+    req = stream->conn->request;
+    stream->remote_closed = session->block_end_stream;
+    stream->has_body = !stream->remote_closed;
+    if (stream->malformed || req->method == NULL || req->path == NULL
+        || request_decode_url(req) < 0) {
+        _send_rst(session, id, H2_PROTOCOL_ERROR);
+        stream->remote_closed = 1;
+        _stream_free(stream);
+        return;
+    }
+    _run_stream(stream);
+}
+
+static void _on_field(void *args, const char *name, size_t name_len,
+                      const char *value, size_t value_len) {
+    h2_stream_t     *stream = (h2_stream_t*) args;
+    request_t       *req = stream->conn->request;
+    int             rc = -1;
+
+    if (stream->malformed) {
+        return;
+    }
+    if (name_len > 0 && name[0] == ':') {
+        // The pseudo fields come first
+        if (stream->fields_started) {
+            rc = -1;
+        } else if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+            rc = request_set_method(req, value, value_len);
+        } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+            rc = request_set_path(req, value, value_len);
+        } else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+            rc = request_add_header(req, "Host", 4, value, value_len);
+        } else if (name_len == 7 && memcmp(name, ":scheme", 7) == 0) {
+            rc = 0;
+        }
+    } else {
+        stream->fields_started = 1;
+        rc = request_add_header(req, name, name_len, value, value_len);
+    }
+    if (rc < 0) {
+        stream->malformed = 1;
+    }
+}
+
+static void _ignore_field(void *args, const char *name, size_t name_len,
+                          const char *value, size_t value_len) {
+}
+
+/*
+ * A stream has a connection of its own, to hold the request, response
+ * and handler context. It shares the iostream with the others.
+ */
+static h2_stream_t* _stream_create(h2_session_t *session, unsigned int id) {
+    connection_t    *parent = session->conn, *conn;
+    h2_stream_t     *stream, **tail;
+
+    stream = (h2_stream_t*) calloc(1, sizeof(h2_stream_t));
+    conn = stream != NULL ? connection_alloc(parent->server) : NULL;
+    if (conn == NULL) {
+        error("Error allocating HTTP/2 stream");
+        free(stream);
+        return NULL;
+    }
+    conn->stream = parent->stream;
+    memcpy(conn->remote_ip, parent->remote_ip, sizeof(conn->remote_ip));
+    conn->remote_port = parent->remote_port;
+    conn->family = parent->family;
+    conn->h2_stream = stream;
+
+    stream->id = id;
+    stream->session = session;
+    stream->conn = conn;
+    stream->send_window = session->initial_window;
+    stream->recv_window = H2_DEFAULT_WINDOW;
+    for (tail = &session->streams; *tail != NULL; tail = &(*tail)->next);
+    *tail = stream;
+    session->stream_count++;
+    return stream;
+}
+
+static void _stream_free(h2_stream_t *stream) {
+    h2_session_t    *session = stream->session;
+    connection_t    *conn = stream->conn;
+    h2_stream_t     **p;
+
+    for (p = &session->streams; *p != stream; p = &(*p)->next);
+    *p = stream->next;
+    session->stream_count--;
+
+    if (!stream->remote_closed && !stream->reset) {
+        // The request is not wanted any more
+        _send_rst(session, stream->id, H2_NO_ERROR);
+    }
+    _drop_output(stream);
+    free(stream->body);
+    connection_release(conn);
+    free(stream);
+
+    if (session->goaway && session->stream_count == 0 && !session->destroyed) {
+        session->closing = 1;
+        _schedule(session);
+    }
+}
+
+static h2_stream_t* _find_stream(h2_session_t *session, unsigned int id) {
+    h2_stream_t     *stream;
+
+    for (stream = session->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static void _run_stream(h2_stream_t *stream) {
+    connection_t    *conn = stream->conn;
+    request_t       *req = conn->request;
+
+    req->version = HTTP_VERSION_2_0;
+    stream->head = strcmp(req->method, "HEAD") == 0;
+    conn->response->version = HTTP_VERSION_2_0;
+    conn->context->conf = conn->server->handler_conf;
+    connection_run_handler(conn, connection_request_handler(conn, 0));
+}
+
+/*
+ * Reset a stream, what it still writes is dropped until its handler is
+ * done with it.
+ */
+static void _reset(h2_stream_t *stream, int code) {
+    if (stream->reset) {
+        return;
+    }
+    _send_rst(stream->session, stream->id, code);
+    stream->reset = 1;
+    stream->remote_closed = 1;
+    stream->body_len = 0;
+    _drop_output(stream);
+}
+
+static void _drop_output(h2_stream_t *stream) {
+    h2_data_t   *data;
+
+    while (stream->queue_len > 0) {
+        data = stream->queue + stream->queue_head;
+        if (data->sbuf != NULL) {
+            shared_buffer_unref(data->sbuf);
+        }
+        stream->queue_head = (stream->queue_head + 1) % H2_MAX_QUEUE;
+        stream->queue_len--;
+    }
+}
+
+static int _queue_data(h2_stream_t *stream, shared_buffer_t *sbuf,
+                       int fd, size_t offset, size_t len) {
+    h2_data_t   *data;
+
+    if (len == 0 || stream->end_queued || stream->queue_len >= H2_MAX_QUEUE) {
+        return -1;
+    }
+    if (!stream->reset && !stream->head) {
+        data = stream->queue + (stream->queue_head + stream->queue_len) % H2_MAX_QUEUE;
+        data->sbuf = sbuf != NULL ? shared_buffer_ref(sbuf) : NULL;
+        data->fd = fd;
+        data->offset = offset;
+        data->len = len;
+        stream->queue_len++;
+    }
+    _wait_output(stream);
+    return 0;
+}
+
+static void _wait_output(h2_stream_t *stream) {
+    stream->waiting = 1;
+    stream->wait_round = stream->session->round + 1;
+    _schedule(stream->session);
+}
+
+static void _deliver_body(h2_stream_t *stream) {
+    request_t   *req = stream->conn->request;
+    size_t      len;
+
+    if (!stream->body_reading || stream->reset) {
+        return;
+    }
+    if (stream->body_len > 0 && !stream->body_paused) {
+        len = stream->body_len;
+        stream->body_len = 0;
+        request_feed_body(req, stream->body, len);
+        _consume_window(stream->session, stream, len);
+    }
+    if (stream->remote_closed && stream->body_len == 0
+        && !stream->body_ended && !stream->reset) {
+        stream->body_ended = 1;
+        stream->body_reading = 0;
+        request_end_body(req);
+    }
+}
+
+/*
+ * Give the peer back the window of the data we are done with, once half
+ * of the window is used.
+ */
+static void _consume_window(h2_session_t *session, h2_stream_t *stream, size_t len) {
+    unsigned char   payload[4];
+
+    session->recv_consumed += len;
+    if (session->recv_consumed >= H2_DEFAULT_WINDOW / 2) {
+        _put_u32(payload, session->recv_consumed);
+        _append_frame(session, H2_WINDOW_UPDATE, 0, 0, (char*) payload, 4);
+        session->recv_window += session->recv_consumed;
+        session->recv_consumed = 0;
+    }
+    if (stream == NULL || stream->remote_closed) {
+        return;
+    }
+    stream->recv_consumed += len;
+    if (stream->recv_consumed >= H2_DEFAULT_WINDOW / 2) {
+        _put_u32(payload, stream->recv_consumed);
+        _append_frame(session, H2_WINDOW_UPDATE, 0, stream->id, (char*) payload, 4);
+        stream->recv_window += stream->recv_consumed;
+        stream->recv_consumed = 0;
+    }
+}
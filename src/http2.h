@@ -0,0 +1,44 @@
+#ifndef __HTTP2_H
+
+#define __HTTP2_H
+
+#include "http.h"
+#include "hpack.h"
+
+/*
+ * HTTP/2 over cleartext TCP (h2c), either started with the connection
+ * preface right away or by upgrading an HTTP/1.1 request.
+ *
+ * Each stream gets a connection of its own, with the request, response
+ * and handler context of a HTTP/1 connection, so the handlers serve it
+ * unchanged. The response functions turn what they send into frames.
+ */
+
+// The connection preface starts like a request header block, the part
+// after it is read once it is recognized.
+#define HTTP2_PREFACE           "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN       24
+#define HTTP2_PREFACE_HEAD_LEN  18
+
+int     http2_start(connection_t *conn);
+int     http2_wants_upgrade(request_t *req);
+int     http2_upgrade(connection_t *conn);
+int     http2_session_destroy(h2_session_t *session);
+
+int     http2_send_headers(h2_stream_t *stream, response_t *resp);
+int     http2_write(h2_stream_t *stream, const char *data, size_t len);
+int     http2_write_shared(h2_stream_t *stream, shared_buffer_t *sbuf);
+int     http2_send_file(h2_stream_t *stream, int fd, size_t offset, size_t len);
+int     http2_end(h2_stream_t *stream);
+
+int     http2_has_body(h2_stream_t *stream);
+int     http2_read_body(h2_stream_t *stream);
+int     http2_send_continue(h2_stream_t *stream);
+int     http2_send_interim(h2_stream_t *stream, const char *block, size_t len);
+int     http2_pause_body(h2_stream_t *stream);
+int     http2_resume_body(h2_stream_t *stream);
+
+int     http2_reset_stream(h2_stream_t *stream);
+int     http2_finish_stream(h2_stream_t *stream);
+
+#endif /* end of include guard: __HTTP2_H */
@@ -1,4 +1,5 @@
 #include "http.h"
+#include "http2.h"
 #include "common.h"
 #include "log.h"
 #include <stdio.h>
@@ -15,71 +16,275 @@
 #include <arpa/inet.h>
 
 static void _connection_close_handler(iostream_t *stream);
+static void _close_after_flush(iostream_t *stream);
+static void _resume_accept(server_t *server);
+static void _set_remote_address(connection_t *conn, struct sockaddr *addr);
 static void _on_http_header_data(iostream_t *stream, void *data, size_t len);
-static void _set_tcp_nodelay(int fd);
+static int  _bad_request_handler(request_t *req, response_t *resp, handler_ctx_t *ctx);
+static int  _expectation_failed_handler(request_t *req, response_t *resp,
+                                        handler_ctx_t *ctx);
+static int  _too_large_handler(request_t *req, response_t *resp, handler_ctx_t *ctx);
+static void _record_header_size(server_t *server, size_t size);
+static void _record_burst_size(server_t *server, size_t size);
+static void _update_buffer_sizes(server_t *server);
+static int  _accel_redirect(connection_t *conn);
+static void _shrink_pool(conn_pool_t *pool, struct _conn_batch *batch);
+
+// Is another complete request header waiting in the read buffer?
+#define has_pipelined_request(conn) \
+    (iostream_locate((conn)->stream, "\r\n\r\n") >= 0)
+
+// Connections are allocated this many at a time
+#define CONN_POOL_BATCH         32
+// A batch all free is given back past this many free connections
+#define CONN_POOL_IDLE_MAX      (4 * CONN_POOL_BATCH)
+// A recycled connection drops an arena that grew past this
+#define CONN_ARENA_KEEP         (16 * 1024)
+
+// Recompute the learned buffer sizes every N samples
+#define BUF_LEARN_INTERVAL      64
+
+// How deep the handlers may nest when the writes they start complete
+// right away, see connection_run_handler
+#define MAX_INLINE_DEPTH        8
+
+static int inline_depth = 0;
+
+// The response header of a handler handing the request over
+#define ACCEL_REDIRECT          "X-Accel-Redirect"
 
 connection_t* connection_accept(server_t *server, int listen_fd) {
     connection_t *conn;
     iostream_t   *stream;
     socklen_t    addr_len;
     int          conn_fd;
-    struct sockaddr_in remote_addr;
+    struct sockaddr_storage remote_addr;
 
         // -------- Accepting connection ----------------------------
-    addr_len = sizeof(struct sockaddr_in);
-    conn_fd = accept(listen_fd, (struct sockaddr*) &remote_addr, &addr_len);
+    addr_len = sizeof(struct sockaddr_storage);
+    // TCP_NODELAY and the other options of the listener are inherited
+    conn_fd = accept4(listen_fd, (struct sockaddr*) &remote_addr, &addr_len,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (conn_fd == -1) {
         if (errno != EAGAIN && errno != EWOULDBLOCK)
             error("Error accepting new connection");
         return NULL;
     }
 
-    conn = (connection_t*) calloc(1, sizeof(connection_t));
+    conn = connection_alloc(server);
     if (conn == NULL) {
         goto error;
     }
-    bzero(conn, sizeof(connection_t));
 
-    if (set_nonblocking(conn_fd) < 0) {
-        error("Error configuring Non-blocking");
-        goto error;
-    }
-
-    _set_tcp_nodelay(conn_fd);
-    stream = iostream_create(server->ioloop, conn_fd, 10240, 40960, conn);
+    stream = iostream_create_pooled(&server->stream_pool, server->ioloop,
+                                    conn_fd, server->stats.read_buf_size,
+                                    server->stats.write_buf_size, conn);
     if (stream == NULL) {
         goto error;
     }
-    
+    iostream_set_buffer_limits(stream, server->read_buf_max, server->write_buf_max);
+
     iostream_set_close_handler(stream, _connection_close_handler);
 
-    conn->server = server;
     conn->stream = stream;
-    inet_ntop(AF_INET, &remote_addr.sin_addr, conn->remote_ip, 20);
-    conn->remote_port = remote_addr.sin_port;
-    conn->state = CONN_ACTIVE;
-    conn->request  = request_create(conn);
-    conn->response = response_create(conn);
-    conn->context = context_create();
+    _set_remote_address(conn, (struct sockaddr*) &remote_addr);
+    server->stats.conn_accepted++;
+    server->stats.conn_active++;
+    if (server->conn_counts != NULL) {
+        server->conn_counts[server->worker_slot] = server->stats.conn_active;
+    }
     
     return conn;
 
     error:
     close(conn_fd);
     if (conn != NULL)
-        free(conn);
+        connection_release(conn);
     return NULL;
 }
 
+/*
+ * A connection with its request, response and handler context next to
+ * it, as the pool lays them out.
+ */
+typedef struct _pooled_conn {
+    connection_t        conn;
+    request_t           request;
+    response_t          response;
+    handler_ctx_t       context;
+    struct _pooled_conn *next_free;
+    struct _conn_batch  *batch;
+} pooled_conn_t;
+
+typedef struct _conn_batch {
+    struct _conn_batch  *next;
+    // Connections of the batch in use
+    int                 used;
+    pooled_conn_t       conns[CONN_POOL_BATCH];
+} conn_batch_t;
+
+static int _grow_pool(conn_pool_t *pool) {
+    conn_batch_t    *batch;
+    pooled_conn_t   *pc;
+    int             i;
+
+    batch = (conn_batch_t*) calloc(1, sizeof(conn_batch_t));
+    if (batch == NULL) {
+        error("Error allocating memory for connections");
+        return -1;
+    }
+    for (i = CONN_POOL_BATCH - 1; i >= 0; i--) {
+        pc = batch->conns + i;
+        pc->conn.request = &pc->request;
+        pc->conn.response = &pc->response;
+        pc->conn.context = &pc->context;
+        pc->request._conn = &pc->conn;
+        pc->response._conn = &pc->conn;
+        pc->batch = batch;
+        response_reset(&pc->response);
+        pc->next_free = pool->free;
+        pool->free = pc;
+    }
+    batch->next = pool->batches;
+    pool->batches = batch;
+    pool->size += CONN_POOL_BATCH;
+    pool->free_count += CONN_POOL_BATCH;
+    return 0;
+}
+
+/*
+ * A connection of the server from its pool, with the request, response,
+ * handler context and arena ready. The memory of the ones closed is
+ * reused as it is, only reset.
+ */
+connection_t* connection_alloc(server_t *server) {
+    conn_pool_t     *pool = &server->conn_pool;
+    pooled_conn_t   *pc;
+
+    if (pool->free == NULL && _grow_pool(pool) < 0) {
+        return NULL;
+    }
+    pc = pool->free;
+    if (pc->conn.arena == NULL
+        && (pc->conn.arena = arena_create(ARENA_CHUNK_SIZE)) == NULL) {
+        return NULL;
+    }
+    pool->free = pc->next_free;
+    pool->free_count--;
+    pc->batch->used++;
+    pc->next_free = NULL;
+    pc->conn.server = server;
+    pc->conn.state = CONN_ACTIVE;
+    return &pc->conn;
+}
+
+/*
+ * Give a connection back to the pool of its server. The header block
+ * of the request and the arena are kept, unless the arena grew larger
+ * than a connection usually needs.
+ */
+void connection_release(connection_t *conn) {
+    pooled_conn_t   *pc = (pooled_conn_t*) conn;
+    conn_pool_t     *pool = &conn->server->conn_pool;
+    arena_t         *arena = conn->arena;
+
+    request_reset(conn->request);
+    response_reset(conn->response);
+    context_reset(conn->context);
+    if (arena_used(arena) > CONN_ARENA_KEEP) {
+        arena_destroy(arena);
+        arena = NULL;
+    } else {
+        arena_reset(arena);
+    }
+
+    bzero(conn, sizeof(connection_t));
+    conn->request = &pc->request;
+    conn->response = &pc->response;
+    conn->context = &pc->context;
+    conn->arena = arena;
+    pc->next_free = pool->free;
+    pool->free = pc;
+    pool->free_count++;
+    if (--pc->batch->used == 0 && pool->free_count > CONN_POOL_IDLE_MAX) {
+        _shrink_pool(pool, pc->batch);
+    }
+}
+
+static void _free_batch(conn_batch_t *batch) {
+    pooled_conn_t   *pc;
+    int             i;
+
+    for (i = 0; i < CONN_POOL_BATCH; i++) {
+        pc = batch->conns + i;
+        response_reset(&pc->response);
+        free(pc->request._block);
+        if (pc->conn.arena != NULL) {
+            arena_destroy(pc->conn.arena);
+        }
+    }
+    free(batch);
+}
+
+/*
+ * Free a batch none of whose connections is in use, after a burst of
+ * connections is over.
+ */
+static void _shrink_pool(conn_pool_t *pool, conn_batch_t *batch) {
+    conn_batch_t    **bp;
+    pooled_conn_t   **pp;
+
+    for (bp = &pool->batches; *bp != batch; bp = &(*bp)->next);
+    *bp = batch->next;
+    for (pp = &pool->free; *pp != NULL; ) {
+        if ((*pp)->batch == batch) {
+            *pp = (*pp)->next_free;
+        } else {
+            pp = &(*pp)->next_free;
+        }
+    }
+    pool->size -= CONN_POOL_BATCH;
+    pool->free_count -= CONN_POOL_BATCH;
+    _free_batch(batch);
+}
+
+void connection_pool_destroy(conn_pool_t *pool) {
+    conn_batch_t    *batch;
+
+    while ((batch = pool->batches) != NULL) {
+        pool->batches = batch->next;
+        _free_batch(batch);
+    }
+    bzero(pool, sizeof(conn_pool_t));
+}
+
 int connection_close(connection_t *conn) {
+    // Only the stream is closed, the others go on
+    if (conn->h2_stream != NULL) {
+        return http2_reset_stream(conn->h2_stream);
+    }
     return iostream_close(conn->stream);
 }
 
 int connection_destroy(connection_t *conn) {
-    request_destroy(conn->request);
-    response_destroy(conn->response);
-    context_destroy(conn->context);
-    free(conn);
+    server_t    *server = conn->server;
+
+    server->stats.conn_active--;
+    if (server->conn_counts != NULL) {
+        server->conn_counts[server->worker_slot] = server->stats.conn_active;
+    }
+    if (conn->h2 != NULL) {
+        http2_session_destroy(conn->h2);
+    }
+    connection_release(conn);
+    if (server->paused_accept != NULL
+        && server->stats.conn_active < server->worker_connections) {
+        _resume_accept(server);
+    }
+    // A stopping server is done with its last connection
+    if (server->state == SERVER_STOPPING && server->stats.conn_active == 0) {
+        ioloop_stop(server->ioloop);
+    }
     return 0;
 }
 
@@ -93,6 +298,7 @@ static void _on_http_header_data(iostream_t *stream, void *data, size_t len) {
     request_t      *req;
     response_t     *resp;
     size_t         consumed;
+    int            bad_path;
 
     conn = (connection_t*) stream->user_data;
     req = conn->request;
@@ -103,51 +309,209 @@ static void _on_http_header_data(iostream_t *stream, void *data, size_t len) {
         return;
     }
 
-    if (request_parse_headers(req, (char*)data, len, &consumed)
-        != STATUS_COMPLETE) {
+    // A client with prior knowledge of HTTP/2 starts with its preface
+    if (len == HTTP2_PREFACE_HEAD_LEN && memcmp(data, HTTP2_PREFACE, len) == 0) {
+        http2_start(conn);
+        return;
+    }
+
+    _record_header_size(conn->server, len);
+    switch (request_parse_headers(req, (char*)data, len, &consumed)) {
+    case STATUS_COMPLETE:
+        break;
+    case STATUS_ERROR:
+        // What follows can not be told apart from this request
+        resp->version = req->version == HTTP_VERSION_1_0 ? HTTP_VERSION_1_0
+                                                         : HTTP_VERSION_1_1;
+        resp->connection = CONN_CLOSE;
+        connection_run_handler(conn, _bad_request_handler);
+        return;
+    default:
         connection_close(conn);
         return;
     }
 
-    // URL Decode
-    url_decode(req->path, req->path);
-    if (req->query_str != NULL) {
-        url_decode(req->query_str, req->query_str);   
+    bad_path = request_decode_url(req) < 0;
+    if (!bad_path && http2_wants_upgrade(req) && http2_upgrade(conn) == 0) {
+        return;
     }
 
-    // Handle HTTP keep-alive
-    if (req->version < HTTP_VERSION_1_1 && req->connection != CONN_KEEP_ALIVE) {
-        // For HTTP/1.0, default behaviour is not keep-alive unless
-        // otherwise specified in request's Connection header.
+    // HTTP/1.1 keeps the connection alive unless the client asks to
+    // close it, HTTP/1.0 only when asked to
+    resp->connection = req->connection;
+    // The clients of a stopping server go after their current request
+    if (conn->server->state == SERVER_STOPPING) {
         resp->connection = CONN_CLOSE;
-    } else if (req->version == HTTP_VERSION_1_1 && req->connection != CONN_CLOSE) {
-        // For HTTP/1.1, default behaviour is enabling keep-alive
-        // unless specified explicitly.
-        resp->connection = CONN_KEEP_ALIVE;
+    }
+
+    // Hold the response back while more pipelined requests are waiting,
+    // all of their responses are then sent together.
+    if (resp->connection == CONN_KEEP_ALIVE && has_pipelined_request(conn)) {
+        iostream_cork(stream);
     }
 
     // TODO Handle Unknown HTTP version
     resp->version = req->version;
     // Reset handler configuration
     conn->context->conf = conn->server->handler_conf;
-    connection_run_handler(conn, conn->server->handler);
+    connection_run_handler(conn, connection_request_handler(conn, bad_path));
+}
+
+/*
+ * The handler of a request whose header is complete. The requests that
+ * can be refused from their header alone are answered right away, so
+ * that a client waiting for 100 Continue does not send the body at all.
+ * The others go to the server handler, which sends 100 Continue by
+ * reading the body, or refuses it with a response of its own.
+ */
+handler_func connection_request_handler(connection_t *conn, int bad_path) {
+    request_t   *req = conn->request;
+    size_t      max = conn->server->max_body_size;
+
+    // An HTTP/1.0 client does not know about the expectation
+    if (req->version < HTTP_VERSION_1_1) {
+        req->expect_continue = 0;
+    }
+    if (bad_path) {
+        return _bad_request_handler;
+    } else if (req->expect_continue < 0) {
+        return _expectation_failed_handler;
+    } else if (max > 0 && !req->chunked && req->content_length > max) {
+        return _too_large_handler;
+    }
+    return conn->server->handler;
+}
+
+static int _bad_request_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    return response_send_status(resp, STATUS_BAD_REQUEST);
+}
+
+static int _expectation_failed_handler(request_t *req, response_t *resp,
+                                       handler_ctx_t *ctx) {
+    return response_send_status(resp, STATUS_EXPECTATION_FAILED);
+}
+
+static int _too_large_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    // The body may be on its way, it is not worth reading
+    resp->connection = CONN_CLOSE;
+    return response_send_status(resp, STATUS_PAYLOAD_TOO_LARGE);
+}
+
+/*
+ * Called when the response is done and all of it has been written.
+ */
+int connection_finish_current_request(connection_t *conn) {
+    if (conn->h2_stream != NULL) {
+        return http2_finish_stream(conn->h2_stream);
+    }
+    _record_burst_size(conn->server, conn->stream->write_buf_peak);
+    conn->stream->write_buf_peak = 0;
+
+    switch (conn->response->connection) {
+    case CONN_CLOSE:
+        iostream_uncork(conn->stream, _close_after_flush);
+        break;
+
+    case CONN_KEEP_ALIVE:
+    default:
+        switch (request_discard_body(conn->request)) {
+        case 0:
+            break;
+        case 1:
+            // Finished again once the body is drained
+            return 0;
+        default:
+            return -1;
+        }
+        if (request_reset(conn->request) < 0) {
+            connection_close(conn);
+            break;
+        }
+        if (response_reset(conn->response) < 0) {
+            connection_close(conn);
+            break;
+        }
+        if (context_reset(conn->context) < 0) {
+            connection_close(conn);
+            break;
+        }
+        arena_reset(conn->arena);
+        // Streaming mode is per location, do not leak it to the
+        // next request on this connection.
+        iostream_set_notsent_lowat(conn->stream, 0);
+        conn->context->conf = conn->server->handler_conf;
+        if (!has_pipelined_request(conn)) {
+            iostream_uncork(conn->stream, NULL);
+        }
+        connection_run(conn);
+        break;
+    }
+    return 0;
 }
 
+/*
+ * A write that completes right away has its callback run here once the
+ * handler returns, rather than on the next round of the ioloop. A small
+ * response is then finished, and the connection reset, in the same
+ * dispatch. The callback runs the next handler through here again, so
+ * the nesting is bounded, past it the callbacks go through the ioloop.
+ */
 void connection_run_handler(connection_t *conn, handler_func handler) {
     request_t   *req;
     response_t  *resp;
     handler_ctx_t *ctx;
-    int          res;
+    int          res, held = 0, prev = 0;
 
     req = conn->request;
     resp = conn->response;
     ctx = conn->context;
 
+    // The streams of HTTP/2 share the iostream, their output is
+    // scheduled by the session
+    if (conn->h2_stream == NULL && inline_depth < MAX_INLINE_DEPTH) {
+        held = 1;
+        prev = iostream_hold_finish(conn->stream, 1);
+    }
+
     res = handler(req, resp, ctx);
+    while (res == HANDLER_DONE && !resp->_header_sent
+           && response_get_header_str(resp, STR(ACCEL_REDIRECT)).ptr != NULL) {
+        res = _accel_redirect(conn);
+    }
 
     if (res == HANDLER_DONE) {
         resp->_done = 1;
+        response_end(resp);
+    }
+
+    if (held) {
+        iostream_hold_finish(conn->stream, prev);
+        inline_depth++;
+        iostream_finish_write(conn->stream);
+        inline_depth--;
+    }
+}
+
+/*
+ * A handler done without a response of its own can hand the request
+ * over to another location by naming it in X-Accel-Redirect, as a
+ * backend does. The header is not sent to the client.
+ */
+static int _accel_redirect(connection_t *conn) {
+    response_t  *resp = conn->response;
+    str_t       value;
+    char        *uri;
+
+    value = response_get_header_str(resp, STR(ACCEL_REDIRECT));
+    uri = response_alloc(resp, value.len + 1);
+    if (uri == NULL) {
+        connection_close(conn);
+        return HANDLER_UNFISHED;
     }
+    memcpy(uri, value.ptr, value.len);
+    uri[value.len] = '\0';
+    response_remove_header_str(resp, STR(ACCEL_REDIRECT));
+    return request_internal_redirect(conn->request, resp, conn->context, uri);
 }
 
 static void _connection_close_handler(iostream_t *stream) {
@@ -156,7 +520,88 @@ static void _connection_close_handler(iostream_t *stream) {
     connection_destroy(conn);
 }
 
-static void _set_tcp_nodelay(int fd) {
-    int enable = 1;
-    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&enable, sizeof(enable));
+static void _close_after_flush(iostream_t *stream) {
+    connection_close((connection_t*) stream->user_data);
+}
+
+/*
+ * Accept again after accepting was paused at worker_connections. The
+ * connections that waited meanwhile are reported as the listener is
+ * added back.
+ */
+static void _resume_accept(server_t *server) {
+    io_handler  handler = server->paused_accept;
+    listener_t  *listener;
+    int         i;
+
+    server->paused_accept = NULL;
+    if (server->state != SERVER_RUNNING) {
+        return;
+    }
+    for (i = 0; i < server->listener_count; i++) {
+        listener = server->listeners + i;
+        if (ioloop_add_handler(server->ioloop, listener->fd,
+                               server->listen_events, handler, listener) < 0) {
+            error("Error resuming accepting connections on %s",
+                  listener->address);
+        }
+    }
+}
+
+static void _set_remote_address(connection_t *conn, struct sockaddr *addr) {
+    conn->family = addr->sa_family;
+    switch (addr->sa_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &((struct sockaddr_in*) addr)->sin_addr,
+                  conn->remote_ip, sizeof(conn->remote_ip));
+        conn->remote_port = ntohs(((struct sockaddr_in*) addr)->sin_port);
+        break;
+
+    case AF_INET6:
+        inet_ntop(AF_INET6, &((struct sockaddr_in6*) addr)->sin6_addr,
+                  conn->remote_ip, sizeof(conn->remote_ip));
+        conn->remote_port = ntohs(((struct sockaddr_in6*) addr)->sin6_port);
+        break;
+
+    default:
+        // Clients of a Unix socket have no address
+        strcpy(conn->remote_ip, "unix");
+        conn->remote_port = 0;
+        break;
+    }
+}
+
+static void _record_header_size(server_t *server, size_t size) {
+    size_hist_add(&server->stats.header_sizes, size);
+    if (++server->stats.samples % BUF_LEARN_INTERVAL == 0) {
+        _update_buffer_sizes(server);
+    }
+}
+
+static void _record_burst_size(server_t *server, size_t size) {
+    size_hist_add(&server->stats.burst_sizes, size);
+    if (++server->stats.samples % BUF_LEARN_INTERVAL == 0) {
+        _update_buffer_sizes(server);
+    }
+}
+
+static void _update_buffer_sizes(server_t *server) {
+    server_stats_t *stats = &server->stats;
+    size_t          sz;
+
+    if (server->buffer_percentile <= 0) {
+        return;
+    }
+    if (stats->header_sizes.count > 0) {
+        sz = size_hist_percentile(&stats->header_sizes, server->buffer_percentile);
+        sz = MAX(sz, server->read_buf_min);
+        stats->read_buf_size = MIN(sz, server->read_buf_max);
+    }
+    if (stats->burst_sizes.count > 0) {
+        sz = size_hist_percentile(&stats->burst_sizes, server->buffer_percentile);
+        sz = MAX(sz, server->write_buf_min);
+        stats->write_buf_size = MIN(sz, server->write_buf_max);
+    }
+    debug("Learned buffer sizes: read %zu, write %zu",
+          stats->read_buf_size, stats->write_buf_size);
 }
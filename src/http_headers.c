@@ -0,0 +1,217 @@
+/* Generated by tools/gen_http_headers.py, do not edit. */
+
+#include "http_headers.h"
+#include <stdint.h>
+#include <strings.h>
+
+#define HEADER_HASH_SEED    2166136825u
+#define HEADER_HASH_BITS    9
+#define HEADER_MAX_LEN      27
+
+const char *http_header_names[HTTP_HEADER_COUNT] = {
+    "Accept",
+    "Accept-Charset",
+    "Accept-Datetime",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Accept-Ranges",
+    "Access-Control-Allow-Origin",
+    "Age",
+    "Allow",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Disposition",
+    "Content-Encoding",
+    "Content-Language",
+    "Content-Length",
+    "Content-Location",
+    "Content-MD5",
+    "Content-Range",
+    "Content-Security-Policy",
+    "Content-Type",
+    "Cookie",
+    "DNT",
+    "Date",
+    "ETag",
+    "Expect",
+    "Expires",
+    "From",
+    "Front-End-Https",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Last-Modified",
+    "Link",
+    "Location",
+    "Max-Forwards",
+    "Origin",
+    "P3P",
+    "Pragma",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "Proxy-Connection",
+    "Range",
+    "Referer",
+    "Refresh",
+    "Retry-After",
+    "Server",
+    "Set-Cookie",
+    "Status",
+    "Strict-Transport-Security",
+    "TE",
+    "Trailer",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "Vary",
+    "Via",
+    "WWW-Authenticate",
+    "Warning",
+    "X-ATT-DeviceId",
+    "X-Content-Security-Policy",
+    "X-Content-Type-Options",
+    "X-Forwarded-For",
+    "X-Forwarded-Proto",
+    "X-Frame-Options",
+    "X-Powered-By",
+    "X-Requested-With",
+    "X-WAP-Profile",
+    "X-WebKit-CSP",
+    "X-XSS-Protection",
+    "X-UA-Compatible",
+};
+
+const size_t http_header_lens[HTTP_HEADER_COUNT] = {
+    6,
+    14,
+    15,
+    15,
+    15,
+    13,
+    27,
+    3,
+    5,
+    13,
+    13,
+    10,
+    19,
+    16,
+    16,
+    14,
+    16,
+    11,
+    13,
+    23,
+    12,
+    6,
+    3,
+    4,
+    4,
+    6,
+    7,
+    4,
+    15,
+    4,
+    8,
+    17,
+    13,
+    8,
+    19,
+    13,
+    4,
+    8,
+    12,
+    6,
+    3,
+    6,
+    18,
+    19,
+    16,
+    5,
+    7,
+    7,
+    11,
+    6,
+    10,
+    6,
+    25,
+    2,
+    7,
+    17,
+    7,
+    10,
+    4,
+    3,
+    16,
+    7,
+    14,
+    25,
+    22,
+    15,
+    17,
+    15,
+    12,
+    16,
+    13,
+    12,
+    16,
+    15,
+};
+
+static const signed char header_slots[1 << HEADER_HASH_BITS] = {
+    -1, -1, 49, -1, -1, -1, -1, -1, 22, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, 28, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    27, -1, 64, -1, 29, -1, -1, 4, -1, -1, 15, -1, -1, 46, -1, -1,
+    -1, 11, -1, -1, -1, -1, -1, 66, -1, 45, -1, -1, -1, -1, 59, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 13, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 54, -1, -1, -1, -1,
+    -1, -1, -1, -1, 9, 62, -1, 0, -1, -1, -1, -1, -1, -1, -1, -1,
+    41, -1, 25, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 24, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 73, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 53, -1, -1, -1, -1, -1, 6, -1, 19, -1, -1, -1, -1, -1, 65,
+    -1, -1, -1, -1, 51, -1, -1, -1, -1, -1, -1, -1, -1, 35, -1, -1,
+    -1, 3, 50, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 33, -1, 40,
+    -1, -1, -1, -1, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 63, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 57, -1, -1, -1,
+    -1, -1, -1, -1, -1, 26, -1, 71, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 34, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 8,
+    -1, -1, -1, -1, -1, 72, -1, -1, -1, -1, 1, 44, -1, -1, -1, 17,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 21, -1, -1, 10,
+    -1, -1, 67, -1, -1, -1, -1, -1, -1, 48, -1, -1, -1, -1, -1, -1,
+    -1, 55, -1, -1, 38, -1, -1, -1, -1, -1, 47, -1, 42, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 32, -1, -1, -1, -1, 37,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    60, -1, -1, 18, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 58,
+    23, -1, -1, -1, -1, -1, 68, -1, -1, -1, 70, -1, -1, 69, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, 39, 36, -1, -1, -1, 16, -1, -1, -1,
+    -1, -1, -1, -1, 56, 30, -1, -1, -1, -1, -1, -1, 7, -1, -1, -1,
+    -1, 31, -1, -1, -1, -1, -1, 20, 5, -1, 43, -1, -1, -1, -1, 52,
+    -1, -1, -1, -1, 61, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+http_header_id_e http_header_lookup(const char *name, size_t len) {
+    uint32_t    h = HEADER_HASH_SEED;
+    size_t      i;
+    int         id;
+
+    if (len > HEADER_MAX_LEN) {
+        return HTTP_HEADER_UNKNOWN;
+    }
+    for (i = 0; i < len; i++) {
+        h = (h ^ ((unsigned char) name[i] | 0x20)) * 16777619u;
+    }
+    id = header_slots[h >> (32 - HEADER_HASH_BITS)];
+    if (id < 0 || http_header_lens[id] != len
+        || strncasecmp(name, http_header_names[id], len) != 0) {
+        return HTTP_HEADER_UNKNOWN;
+    }
+    return (http_header_id_e) id;
+}
@@ -0,0 +1,96 @@
+/* Generated by tools/gen_http_headers.py, do not edit. */
+
+#ifndef __HTTP_HEADERS_H
+#define __HTTP_HEADERS_H
+
+#include <stddef.h>
+
+typedef enum _http_header_id {
+    HTTP_HEADER_UNKNOWN = -1,
+    HTTP_HEADER_ACCEPT = 0,
+    HTTP_HEADER_ACCEPT_CHARSET = 1,
+    HTTP_HEADER_ACCEPT_DATETIME = 2,
+    HTTP_HEADER_ACCEPT_ENCODING = 3,
+    HTTP_HEADER_ACCEPT_LANGUAGE = 4,
+    HTTP_HEADER_ACCEPT_RANGES = 5,
+    HTTP_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN = 6,
+    HTTP_HEADER_AGE = 7,
+    HTTP_HEADER_ALLOW = 8,
+    HTTP_HEADER_AUTHORIZATION = 9,
+    HTTP_HEADER_CACHE_CONTROL = 10,
+    HTTP_HEADER_CONNECTION = 11,
+    HTTP_HEADER_CONTENT_DISPOSITION = 12,
+    HTTP_HEADER_CONTENT_ENCODING = 13,
+    HTTP_HEADER_CONTENT_LANGUAGE = 14,
+    HTTP_HEADER_CONTENT_LENGTH = 15,
+    HTTP_HEADER_CONTENT_LOCATION = 16,
+    HTTP_HEADER_CONTENT_MD5 = 17,
+    HTTP_HEADER_CONTENT_RANGE = 18,
+    HTTP_HEADER_CONTENT_SECURITY_POLICY = 19,
+    HTTP_HEADER_CONTENT_TYPE = 20,
+    HTTP_HEADER_COOKIE = 21,
+    HTTP_HEADER_DNT = 22,
+    HTTP_HEADER_DATE = 23,
+    HTTP_HEADER_ETAG = 24,
+    HTTP_HEADER_EXPECT = 25,
+    HTTP_HEADER_EXPIRES = 26,
+    HTTP_HEADER_FROM = 27,
+    HTTP_HEADER_FRONT_END_HTTPS = 28,
+    HTTP_HEADER_HOST = 29,
+    HTTP_HEADER_IF_MATCH = 30,
+    HTTP_HEADER_IF_MODIFIED_SINCE = 31,
+    HTTP_HEADER_IF_NONE_MATCH = 32,
+    HTTP_HEADER_IF_RANGE = 33,
+    HTTP_HEADER_IF_UNMODIFIED_SINCE = 34,
+    HTTP_HEADER_LAST_MODIFIED = 35,
+    HTTP_HEADER_LINK = 36,
+    HTTP_HEADER_LOCATION = 37,
+    HTTP_HEADER_MAX_FORWARDS = 38,
+    HTTP_HEADER_ORIGIN = 39,
+    HTTP_HEADER_P3P = 40,
+    HTTP_HEADER_PRAGMA = 41,
+    HTTP_HEADER_PROXY_AUTHENTICATE = 42,
+    HTTP_HEADER_PROXY_AUTHORIZATION = 43,
+    HTTP_HEADER_PROXY_CONNECTION = 44,
+    HTTP_HEADER_RANGE = 45,
+    HTTP_HEADER_REFERER = 46,
+    HTTP_HEADER_REFRESH = 47,
+    HTTP_HEADER_RETRY_AFTER = 48,
+    HTTP_HEADER_SERVER = 49,
+    HTTP_HEADER_SET_COOKIE = 50,
+    HTTP_HEADER_STATUS = 51,
+    HTTP_HEADER_STRICT_TRANSPORT_SECURITY = 52,
+    HTTP_HEADER_TE = 53,
+    HTTP_HEADER_TRAILER = 54,
+    HTTP_HEADER_TRANSFER_ENCODING = 55,
+    HTTP_HEADER_UPGRADE = 56,
+    HTTP_HEADER_USER_AGENT = 57,
+    HTTP_HEADER_VARY = 58,
+    HTTP_HEADER_VIA = 59,
+    HTTP_HEADER_WWW_AUTHENTICATE = 60,
+    HTTP_HEADER_WARNING = 61,
+    HTTP_HEADER_X_ATT_DEVICEID = 62,
+    HTTP_HEADER_X_CONTENT_SECURITY_POLICY = 63,
+    HTTP_HEADER_X_CONTENT_TYPE_OPTIONS = 64,
+    HTTP_HEADER_X_FORWARDED_FOR = 65,
+    HTTP_HEADER_X_FORWARDED_PROTO = 66,
+    HTTP_HEADER_X_FRAME_OPTIONS = 67,
+    HTTP_HEADER_X_POWERED_BY = 68,
+    HTTP_HEADER_X_REQUESTED_WITH = 69,
+    HTTP_HEADER_X_WAP_PROFILE = 70,
+    HTTP_HEADER_X_WEBKIT_CSP = 71,
+    HTTP_HEADER_X_XSS_PROTECTION = 72,
+    HTTP_HEADER_X_UA_COMPATIBLE = 73,
+    HTTP_HEADER_COUNT
+} http_header_id_e;
+
+extern const char   *http_header_names[HTTP_HEADER_COUNT];
+extern const size_t http_header_lens[HTTP_HEADER_COUNT];
+
+/*
+ * Find the ID of a standard header by its name, case insensitively.
+ * Returns HTTP_HEADER_UNKNOWN for the other headers.
+ */
+http_header_id_e http_header_lookup(const char *name, size_t len);
+
+#endif /* end of include guard: __HTTP_HEADERS_H */
@@ -16,19 +16,99 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <fcntl.h>
+#include <time.h>
 
 #define MAX_CONNECTIONS 1024000
-#define MAX_BACKLOG 128
+#define DEFAULT_BACKLOG 511
+#define DEFAULT_ACCEPT_BUDGET 64
 
+// Seconds a stopping worker waits for its connections to finish
+#define WORKER_SHUTDOWN_TIMEOUT 30
+// A worker that dies sooner than this many seconds after it started is
+// started again after a delay, doubled each time up to the max
+#define WORKER_MIN_UPTIME       5
+#define WORKER_RESPAWN_MAX      32
+// Listen sockets handed over to the new binary on upgrade, separated by
+// commas
+#define LISTEN_FD_ENV "BREEZE_LISTEN_FD"
 
+// Sent as it is to the connections refused under load
+static const char overload_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 5\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+#define DEFAULT_READ_BUF_SIZE   10240
+#define DEFAULT_WRITE_BUF_SIZE  40960
+#define DEFAULT_BUF_PERCENTILE  95
+#define MIN_READ_BUF_SIZE       1024
+#define MAX_READ_BUF_SIZE       65536
+#define MIN_WRITE_BUF_SIZE      4096
+#define MAX_WRITE_BUF_SIZE      262144
+
+
+static int _server_listen(server_t *server);
+static int _open_listener(server_t *server, listener_t *listener);
+static int _is_listening_on(int fd, listener_t *listener);
+static void _remove_stale_socket(struct sockaddr_un *addr);
+static void _close_listeners(server_t *server);
 static int _server_init(server_t *server);
+static int _watch_listeners(server_t *server);
+static int _overloaded(server_t *server);
+static int _shed_connection(server_t *server, int listen_fd);
+static int _run_master(server_t *server);
+static int _spawn_worker(server_t *server, int slot);
+static int _run_worker(server_t *server);
+static void _worker_signal_handler(ioloop_t *loop, int fd,
+                                   unsigned int events, void *args);
+static void _stop_gracefully(server_t *server);
+static int _reap_children(server_t *server);
+static void _respawn_worker(server_t *server, int slot, time_t now);
+static int _respawn_timeout(server_t *server);
+static time_t _monotonic_time();
+static void _signal_workers(server_t *server, int sig);
+static void _upgrade_binary(server_t *server);
+static int _daemonize();
+static int _write_pidfile(const char *path);
+static void _remove_pidfile();
 static int _configure_server(server_t *server, json_value *conf_obj);
+static int _parse_listeners(server_t *server, json_value *val);
+static int _parse_listener(server_t *server, json_value *val);
+static int _parse_address(listener_t *listener, const char *address);
 static void _server_connection_handler(ioloop_t *loop,
                                        int listen_fd,
                                        unsigned int events,
                                        void *args);
+static void _accept_more(ioloop_t *loop, void *args);
+static void _set_listen_option(int fd, int level, int name, int value,
+                               const char *desc);
+
+// Process of each worker slot of the master, 0 when not running
+static pid_t    *worker_pids = NULL;
+
+// Restarts of the worker of a slot, see _respawn_worker
+typedef struct _respawn {
+    time_t      started;
+    // When a delayed restart is due, 0 if none
+    time_t      due;
+    int         delay;
+} respawn_t;
+
+static respawn_t *respawns = NULL;
+// The new binary started by a binary upgrade
+static pid_t    new_master = 0;
+// Where the pid of the process is written, empty for nowhere
+static char     pid_path[PATH_MAX];
 
 
 server_t* server_create() {
@@ -47,11 +127,20 @@ server_t* server_create() {
         return NULL;
     }
 
-    server->addr = "127.0.0.1";
+    server->addr = "0.0.0.0";
     server->port = 8000;
+    server->backlog = DEFAULT_BACKLOG;
+    server->accept_budget = DEFAULT_ACCEPT_BUDGET;
     server->ioloop = ioloop;
     server->state = SERVER_INIT;
     server->loglevel = INFO;
+    server->buffer_percentile = DEFAULT_BUF_PERCENTILE;
+    server->read_buf_min = MIN_READ_BUF_SIZE;
+    server->read_buf_max = MAX_READ_BUF_SIZE;
+    server->write_buf_min = MIN_WRITE_BUF_SIZE;
+    server->write_buf_max = MAX_WRITE_BUF_SIZE;
+    server->stats.read_buf_size = DEFAULT_READ_BUF_SIZE;
+    server->stats.write_buf_size = DEFAULT_WRITE_BUF_SIZE;
     return server;
 }
 
@@ -110,6 +199,8 @@ server_t* server_parse_conf(char *configfile) {
 }
 
 int server_destroy(server_t *server) {
+    connection_pool_destroy(&server->conn_pool);
+    iostream_pool_destroy(&server->stream_pool);
     ioloop_destroy(server->ioloop);
     if (server->conf != NULL)
         json_value_free(server->conf);
@@ -118,18 +209,38 @@ int server_destroy(server_t *server) {
 }
 
 int server_start(server_t *server) {
+    int     upgraded = getenv(LISTEN_FD_ENV) != NULL;
+    int     rc;
+
     configure_log(server->loglevel, server->logfile, !server->daemonize);
-    if (_server_init(server) < 0) {
+    if (_server_listen(server) < 0) {
         error("Error initializing server");
         return -1;
     }
+    // The new binary of an upgrade is already detached by the old one
+    if (server->daemonize && !upgraded && _daemonize() < 0) {
+        return -1;
+    }
+    if (server->pidfile != NULL && _write_pidfile(server->pidfile) < 0) {
+        return -1;
+    }
     // Block SIGPIPE
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
         error("Error blocking SIGPIPE");
     }
-    info("Start running server on %d", server->port);
-    server->state = SERVER_RUNNING;
-    return ioloop_start(server->ioloop);
+    if (server->workers > 0) {
+        rc = _run_master(server);
+    } else if (_server_init(server) < 0) {
+        error("Error initializing server");
+        rc = -1;
+    } else {
+        info("Start running server");
+        server->state = SERVER_RUNNING;
+        rc = ioloop_start(server->ioloop);
+    }
+    _close_listeners(server);
+    _remove_pidfile();
+    return rc;
 }
 
 int server_stop(server_t *server) {
@@ -142,55 +253,615 @@ int server_stop(server_t *server) {
     return 0;
 }
 
-static int _server_init(server_t *server) {
-    int                     listen_fd;
-    struct sockaddr_in      addr;
+/*
+ * Open the sockets of the listeners, or take those of the previous
+ * binary on upgrade.
+ */
+static int _server_listen(server_t *server) {
+    int         inherited[MAX_LISTENERS];
+    int         inherited_count = 0, i, j;
+    listener_t  *listener;
+    char        *env, *end;
+
+    if (server->listener_count == 0) {
+        listener = server->listeners;
+        bzero(listener, sizeof(listener_t));
+        snprintf(listener->address, sizeof(listener->address),
+                 strchr(server->addr, ':') != NULL ? "[%s]:%d" : "%s:%d",
+                 server->addr, server->port);
+        if (_parse_address(listener, listener->address) < 0) {
+            return -1;
+        }
+        listener->server = server;
+        server->listener_count = 1;
+    }
+
+    env = getenv(LISTEN_FD_ENV);
+    while (env != NULL && *env != '\0' && inherited_count < MAX_LISTENERS) {
+        inherited[inherited_count++] = (int) strtol(env, &end, 10);
+        env = *end == ',' ? end + 1 : NULL;
+    }
+    unsetenv(LISTEN_FD_ENV);
+
+    for (i = 0; i < server->listener_count; i++) {
+        listener = server->listeners + i;
+        listener->fd = -1;
+        for (j = 0; j < inherited_count; j++) {
+            if (inherited[j] >= 0 && _is_listening_on(inherited[j], listener)) {
+                listener->fd = inherited[j];
+                inherited[j] = -1;
+                break;
+            }
+        }
+        if (listener->fd < 0 && _open_listener(server, listener) < 0) {
+            return -1;
+        }
+        info("Listening on %s", listener->address);
+    }
+    // Listeners no longer configured
+    for (j = 0; j < inherited_count; j++) {
+        if (inherited[j] >= 0) {
+            close(inherited[j]);
+        }
+    }
+    return 0;
+}
+
+static int _open_listener(server_t *server, listener_t *listener) {
+    int     family = listener->sockaddr.ss_family;
+    int     listen_fd, backlog, defer_accept, fastopen;
+
+    backlog = listener->backlog > 0 ? listener->backlog : server->backlog;
+    defer_accept = listener->defer_accept > 0 ? listener->defer_accept
+                                              : server->defer_accept;
+    fastopen = listener->fastopen > 0 ? listener->fastopen : server->fastopen;
 
     // ---------- Create and bind listen socket fd --------------
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    listen_fd = socket(family, SOCK_STREAM, 0);
     if (listen_fd == -1) {
-        error("Error creating socket");
+        error("Error creating socket for %s", listener->address);
         return -1;
     }
 
-    bzero(&addr, sizeof(struct sockaddr_in));
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(server->port);
+    if (family == AF_UNIX) {
+        _remove_stale_socket((struct sockaddr_un*) &listener->sockaddr);
+    } else {
+        _set_listen_option(listen_fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+        // Inherited by the accepted sockets
+        _set_listen_option(listen_fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+        if (defer_accept > 0) {
+            _set_listen_option(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                               defer_accept, "TCP_DEFER_ACCEPT");
+        }
+    }
+    if (family == AF_INET6) {
+        _set_listen_option(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                           listener->ipv6only, "IPV6_V6ONLY");
+    }
 
     if (bind(listen_fd,
-             (struct sockaddr *)&addr,
-             sizeof(struct sockaddr_in)) == -1) {
-        error("Error binding address");
+             (struct sockaddr *) &listener->sockaddr,
+             listener->socklen) == -1) {
+        error("Error binding address %s", listener->address);
         close(listen_fd);
         return -1;
     }
 
     // ------------ Start listening ------------------------------
-    if (listen(listen_fd, MAX_BACKLOG) == -1) {
-        error("Error listening");
+    if (listen(listen_fd, backlog) == -1) {
+        error("Error listening on %s", listener->address);
         close(listen_fd);
         return -1;
     }
+    if (family != AF_UNIX && fastopen > 0) {
+        _set_listen_option(listen_fd, IPPROTO_TCP, TCP_FASTOPEN,
+                           fastopen, "TCP_FASTOPEN");
+    }
     if (set_nonblocking(listen_fd) < 0) {
         error("Error configuring non-blocking");
         close(listen_fd);
         return -1;
     }
-    server->listen_fd = listen_fd;
-    if (ioloop_add_handler(server->ioloop,
-                           listen_fd,
-                           EPOLLIN,
-                           _server_connection_handler,
-                           server) < 0) {
+    listener->fd = listen_fd;
+    return 0;
+}
+
+/*
+ * Whether the socket listens on the address of the listener.
+ */
+static int _is_listening_on(int fd, listener_t *listener) {
+    struct sockaddr_storage addr;
+    socklen_t               len = sizeof(addr);
+    struct sockaddr_in      *in, *l_in;
+    struct sockaddr_in6     *in6, *l_in6;
+
+    if (getsockname(fd, (struct sockaddr*) &addr, &len) < 0
+        || addr.ss_family != listener->sockaddr.ss_family) {
+        return 0;
+    }
+    switch (addr.ss_family) {
+    case AF_INET:
+        in = (struct sockaddr_in*) &addr;
+        l_in = (struct sockaddr_in*) &listener->sockaddr;
+        return in->sin_port == l_in->sin_port
+            && in->sin_addr.s_addr == l_in->sin_addr.s_addr;
+
+    case AF_INET6:
+        in6 = (struct sockaddr_in6*) &addr;
+        l_in6 = (struct sockaddr_in6*) &listener->sockaddr;
+        return in6->sin6_port == l_in6->sin6_port
+            && memcmp(&in6->sin6_addr, &l_in6->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+
+    case AF_UNIX:
+        return strcmp(((struct sockaddr_un*) &addr)->sun_path,
+                      ((struct sockaddr_un*) &listener->sockaddr)->sun_path) == 0;
+    }
+    return 0;
+}
+
+/*
+ * The file of a Unix socket outlives the server, it is removed before
+ * binding again once nothing accepts on it.
+ */
+static void _remove_stale_socket(struct sockaddr_un *addr) {
+    struct stat st;
+    int         fd;
+
+    if (stat(addr->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        return;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return;
+    }
+    if (connect(fd, (struct sockaddr*) addr, sizeof(struct sockaddr_un)) < 0
+        && errno == ECONNREFUSED) {
+        unlink(addr->sun_path);
+    }
+    close(fd);
+}
+
+static void _close_listeners(server_t *server) {
+    listener_t  *listener;
+    int         i;
+
+    for (i = 0; i < server->listener_count; i++) {
+        listener = server->listeners + i;
+        if (listener->fd < 0) {
+            continue;
+        }
+        close(listener->fd);
+        listener->fd = -1;
+        // Still listened on by the new binary after an upgrade
+        if (listener->sockaddr.ss_family == AF_UNIX && new_master == 0) {
+            unlink(((struct sockaddr_un*) &listener->sockaddr)->sun_path);
+        }
+    }
+}
+
+static int _server_init(server_t *server) {
+    if (_watch_listeners(server) < 0) {
         error("Error add connection handler");
         return -1;
     }
     return 0;
 }
 
+static int _watch_listeners(server_t *server) {
+    int     i;
+
+    server->listen_events = EPOLLIN;
+    // Only one of the workers sharing a socket is woken up for a
+    // connection
+    if (server->workers > 0) {
+        server->listen_events |= EPOLLEXCLUSIVE;
+    }
+    for (i = 0; i < server->listener_count; i++) {
+        if (ioloop_add_handler(server->ioloop, server->listeners[i].fd,
+                               server->listen_events,
+                               _server_connection_handler,
+                               server->listeners + i) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The master forks the workers, which share its listen socket, and
+ * starts them again when they crash.
+ *
+ *   SIGTERM, SIGINT  Stop the workers right away and exit
+ *   SIGQUIT          Let the workers finish their connections and exit
+ *   SIGUSR2          Start the binary again with the listen socket,
+ *                    the old master is then stopped with SIGQUIT
+ */
+static int _run_master(server_t *server) {
+    sigset_t        set;
+    struct timespec wait = {0, 0};
+    size_t          counts_size = server->workers * sizeof(unsigned long);
+    int             i, sig;
+
+    worker_pids = (pid_t*) calloc(server->workers, sizeof(pid_t));
+    respawns = (respawn_t*) calloc(server->workers, sizeof(respawn_t));
+    if (worker_pids == NULL || respawns == NULL) {
+        error("Error allocating memory for workers");
+        free(worker_pids);
+        worker_pids = NULL;
+        return -1;
+    }
+    if (server->max_connections > 0) {
+        server->conn_counts = (unsigned long*) mmap(NULL, counts_size,
+                                                    PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED | MAP_ANONYMOUS,
+                                                    -1, 0);
+        if (server->conn_counts == MAP_FAILED) {
+            error("Error mapping connection counts");
+            server->conn_counts = NULL;
+        }
+    }
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    server->state = SERVER_RUNNING;
+    for (i = 0; i < server->workers; i++) {
+        _spawn_worker(server, i);
+    }
+    info("Start running server with %d workers", server->workers);
+
+    while (_reap_children(server) > 0) {
+        // Woken up in time for the delayed restarts
+        wait.tv_sec = _respawn_timeout(server);
+        if (wait.tv_sec > 0) {
+            sig = sigtimedwait(&set, NULL, &wait);
+        } else {
+            sig = sigwaitinfo(&set, NULL);
+        }
+        switch (sig) {
+        case SIGCHLD:
+        case -1:
+            break;
+
+        case SIGUSR2:
+            if (server->state == SERVER_RUNNING) {
+                _upgrade_binary(server);
+            }
+            break;
+
+        default:
+            if (server->state == SERVER_RUNNING) {
+                info("Stopping server");
+                server->state = SERVER_STOPPING;
+            }
+            _signal_workers(server, sig == SIGQUIT ? SIGQUIT : SIGTERM);
+            break;
+        }
+    }
+    server->state = SERVER_STOPPED;
+    free(worker_pids);
+    worker_pids = NULL;
+    free(respawns);
+    respawns = NULL;
+    if (server->conn_counts != NULL) {
+        munmap(server->conn_counts, counts_size);
+        server->conn_counts = NULL;
+    }
+    return 0;
+}
+
+static int _spawn_worker(server_t *server, int slot) {
+    pid_t   pid;
+
+    // Or the child writes what is buffered again
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        error("Error forking worker");
+        return -1;
+    } else if (pid == 0) {
+        free(worker_pids);
+        worker_pids = NULL;
+        free(respawns);
+        respawns = NULL;
+        pid_path[0] = '\0';
+        server->worker_slot = slot;
+        exit(_run_worker(server));
+    }
+    worker_pids[slot] = pid;
+    respawns[slot].started = _monotonic_time();
+    respawns[slot].due = 0;
+    return 0;
+}
+
+static int _run_worker(server_t *server) {
+    sigset_t    set;
+    int         sig_fd;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    sig_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    // An upgrade is done by the master, a worker sent SIGUSR2 as well,
+    // as by killall, must not die of it
+    signal(SIGUSR2, SIG_IGN);
+
+    // The epoll instance of the master would be shared by all workers
+    ioloop_destroy(server->ioloop);
+    server->ioloop = ioloop_create(MAX_CONNECTIONS);
+    if (server->ioloop == NULL || sig_fd < 0 || _server_init(server) < 0
+        || ioloop_add_handler(server->ioloop, sig_fd, EPOLLIN,
+                              _worker_signal_handler, server) < 0) {
+        error("Error starting worker");
+        return EXIT_FAILURE;
+    }
+    server->state = SERVER_RUNNING;
+    ioloop_start(server->ioloop);
+    // The pools of connections and streams go with it
+    server_destroy(server);
+    return EXIT_SUCCESS;
+}
+
+static void _worker_signal_handler(ioloop_t *loop, int fd,
+                                   unsigned int events, void *args) {
+    server_t                *server = (server_t*) args;
+    struct signalfd_siginfo si;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGQUIT) {
+            _stop_gracefully(server);
+        } else {
+            server->state = SERVER_STOPPED;
+            ioloop_stop(loop);
+        }
+    }
+}
+
+/*
+ * Stop accepting, the worker exits when its last connection is done,
+ * or when WORKER_SHUTDOWN_TIMEOUT runs out.
+ */
+static void _stop_gracefully(server_t *server) {
+    int     i;
+
+    if (server->state != SERVER_RUNNING) {
+        return;
+    }
+    server->state = SERVER_STOPPING;
+    for (i = 0; i < server->listener_count; i++) {
+        if (server->paused_accept == NULL) {
+            ioloop_remove_handler(server->ioloop, server->listeners[i].fd);
+        }
+        close(server->listeners[i].fd);
+    }
+    alarm(WORKER_SHUTDOWN_TIMEOUT);
+    if (server->stats.conn_active == 0) {
+        ioloop_stop(server->ioloop);
+    }
+}
+
+/*
+ * Collect the children that exited, crashed workers are started again.
+ * Returns the number of workers still running, or waiting to be
+ * started again.
+ */
+static int _reap_children(server_t *server) {
+    pid_t   pid;
+    time_t  now = _monotonic_time();
+    int     status, i, running = 0;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == new_master) {
+            warn("New binary %d exited, the upgrade is given up", pid);
+            new_master = 0;
+            if (server->pidfile != NULL && rename(pid_path, server->pidfile) == 0) {
+                snprintf(pid_path, sizeof(pid_path), "%s", server->pidfile);
+            }
+            continue;
+        }
+        for (i = 0; i < server->workers; i++) {
+            if (worker_pids[i] != pid) {
+                continue;
+            }
+            worker_pids[i] = 0;
+            if (server->conn_counts != NULL) {
+                server->conn_counts[i] = 0;
+            }
+            if (server->state != SERVER_RUNNING) {
+                break;
+            }
+            if (WIFEXITED(status) && WEXITSTATUS(status) != EXIT_SUCCESS) {
+                // It failed to start, and would fail again
+                error("Worker %d exited with status %d", pid,
+                      WEXITSTATUS(status));
+            } else if (WIFSIGNALED(status)) {
+                warn("Worker %d killed by signal %d", pid, WTERMSIG(status));
+                _respawn_worker(server, i, now);
+            } else {
+                warn("Worker %d exited", pid);
+                _respawn_worker(server, i, now);
+            }
+            break;
+        }
+    }
+    for (i = 0; i < server->workers; i++) {
+        if (respawns[i].due > 0 && server->state != SERVER_RUNNING) {
+            respawns[i].due = 0;
+        } else if (respawns[i].due > 0 && respawns[i].due <= now) {
+            _spawn_worker(server, i);
+        }
+        if (worker_pids[i] > 0 || respawns[i].due > 0) {
+            running++;
+        }
+    }
+    return running;
+}
+
+/*
+ * Start the worker of the slot again, right away if it had been running
+ * for a while. One that keeps dying as it starts is started again less
+ * and less often, rather than forked in a loop.
+ */
+static void _respawn_worker(server_t *server, int slot, time_t now) {
+    respawn_t   *respawn = respawns + slot;
+
+    if (now - respawn->started >= WORKER_MIN_UPTIME) {
+        respawn->delay = 0;
+        info("Starting the worker again");
+        _spawn_worker(server, slot);
+        return;
+    }
+    respawn->delay = respawn->delay == 0 ? 1
+                   : MIN(respawn->delay * 2, WORKER_RESPAWN_MAX);
+    respawn->due = now + respawn->delay;
+    warn("The worker died right after it started, starting it again in %d s",
+         respawn->delay);
+}
+
+// Seconds until the next delayed restart is due, 0 if there is none
+static int _respawn_timeout(server_t *server) {
+    time_t  now = _monotonic_time(), due = 0;
+    int     i;
+
+    for (i = 0; i < server->workers; i++) {
+        if (respawns[i].due > 0 && (due == 0 || respawns[i].due < due)) {
+            due = respawns[i].due;
+        }
+    }
+    if (due == 0) {
+        return 0;
+    }
+    return due > now ? due - now : 1;
+}
+
+static time_t _monotonic_time() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void _signal_workers(server_t *server, int sig) {
+    int     i;
+
+    for (i = 0; i < server->workers; i++) {
+        if (worker_pids[i] > 0) {
+            kill(worker_pids[i], sig);
+        }
+    }
+}
+
+/*
+ * Run the binary again with the listen socket. Both masters serve side
+ * by side until one of them is stopped, the pid file of the old one is
+ * renamed with an .oldbin suffix meanwhile.
+ */
+static void _upgrade_binary(server_t *server) {
+    char        fds[MAX_LISTENERS * 12], oldbin[PATH_MAX];
+    sigset_t    set;
+    pid_t       pid;
+    int         i, len = 0;
+
+    if (new_master > 0) {
+        warn("Binary upgrade already in progress");
+        return;
+    }
+    if (server->argv == NULL) {
+        warn("Binary upgrade is not supported by the server");
+        return;
+    }
+    if (pid_path[0] != '\0') {
+        if (snprintf(oldbin, sizeof(oldbin), "%s.oldbin", pid_path)
+            >= (int) sizeof(oldbin) || rename(pid_path, oldbin) < 0) {
+            error("Error renaming pid file %s", pid_path);
+            return;
+        }
+        snprintf(pid_path, sizeof(pid_path), "%s", oldbin);
+    }
+
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        error("Error forking new binary");
+        return;
+    } else if (pid == 0) {
+        for (i = 0; i < server->listener_count; i++) {
+            len += snprintf(fds + len, sizeof(fds) - len, i > 0 ? ",%d" : "%d",
+                            server->listeners[i].fd);
+        }
+        setenv(LISTEN_FD_ENV, fds, 1);
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        execvp(server->argv[0], server->argv);
+        error("Error running %s", server->argv[0]);
+        _exit(EXIT_FAILURE);
+    }
+    info("Started new binary %d", pid);
+    new_master = pid;
+}
+
+static int _daemonize() {
+    int     fd;
+
+    fflush(NULL);
+    switch (fork()) {
+    case -1:
+        error("Error forking daemon");
+        return -1;
+    case 0:
+        break;
+    default:
+        _exit(EXIT_SUCCESS);
+    }
+    if (setsid() < 0) {
+        error("Error creating session");
+        return -1;
+    }
+    fd = open("/dev/null", O_RDWR);
+    if (fd < 0) {
+        error("Error opening /dev/null");
+        return -1;
+    }
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (fd > STDERR_FILENO) {
+        close(fd);
+    }
+    return 0;
+}
+
+static int _write_pidfile(const char *path) {
+    FILE    *file;
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        error("Error opening pid file %s", path);
+        return -1;
+    }
+    fprintf(file, "%d\n", getpid());
+    fclose(file);
+    snprintf(pid_path, sizeof(pid_path), "%s", path);
+    return 0;
+}
+
+static void _remove_pidfile() {
+    if (pid_path[0] != '\0') {
+        unlink(pid_path);
+        pid_path[0] = '\0';
+    }
+}
+
 static int _configure_server(server_t *server, json_value *conf_obj) {
     json_value *val;
-    char  *name, *port_str;
+    char  *name;
     site_conf_t  *site_conf = NULL;
     int i;
     int lvl = INFO;
@@ -198,16 +869,10 @@ static int _configure_server(server_t *server, json_value *conf_obj) {
     for (i = 0; i < conf_obj->u.object.length; i++) {
         name = conf_obj->u.object.values[i].name;
         val = conf_obj->u.object.values[i].value;
-        if (strcmp("listen", name) == 0 && val->type == json_string) {
-            port_str = strchr(val->u.string.ptr, ':');
-            if (port_str != NULL) {
-                *port_str = '\0';
-                port_str++;
-                server->port = (unsigned short) atoi(port_str);
-            } else {
-                server->port = 80;
+        if (strcmp("listen", name) == 0) {
+            if (_parse_listeners(server, val) < 0) {
+                return -1;
             }
-            server->addr = val->u.string.ptr;
         } else if(strcmp("sites", name) == 0) {
             site_conf = site_conf_parse(val);
             if (site_conf == NULL) {
@@ -220,6 +885,43 @@ static int _configure_server(server_t *server, json_value *conf_obj) {
             server->daemonize = val->u.boolean;
         } else if(strcmp("pidfile", name) == 0 && val->type == json_string) {
             server->pidfile = val->u.string.ptr;
+        } else if(strcmp("workers", name) == 0 && val->type == json_integer) {
+            server->workers = (int) val->u.integer;
+        } else if(strcmp("workers", name) == 0 && val->type == json_string
+                  && strcmp("auto", val->u.string.ptr) == 0) {
+            server->workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        } else if(strcmp("buffer_percentile", name) == 0 && val->type == json_integer) {
+            server->buffer_percentile = (int) val->u.integer;
+        } else if(strcmp("read_buffer_min", name) == 0 && val->type == json_integer) {
+            server->read_buf_min = (size_t) val->u.integer;
+        } else if(strcmp("read_buffer_max", name) == 0 && val->type == json_integer) {
+            server->read_buf_max = (size_t) val->u.integer;
+        } else if(strcmp("write_buffer_min", name) == 0 && val->type == json_integer) {
+            server->write_buf_min = (size_t) val->u.integer;
+        } else if(strcmp("write_buffer_max", name) == 0 && val->type == json_integer) {
+            server->write_buf_max = (size_t) val->u.integer;
+        } else if(strcmp("backlog", name) == 0 && val->type == json_integer) {
+            server->backlog = (int) val->u.integer;
+        } else if(strcmp("defer_accept", name) == 0 && val->type == json_integer) {
+            server->defer_accept = (int) val->u.integer;
+        } else if(strcmp("fastopen", name) == 0 && val->type == json_integer) {
+            server->fastopen = (int) val->u.integer;
+        } else if(strcmp("accept_budget", name) == 0 && val->type == json_integer) {
+            server->accept_budget = (int) val->u.integer;
+        } else if(strcmp("worker_connections", name) == 0 && val->type == json_integer) {
+            server->worker_connections = (unsigned long) val->u.integer;
+        } else if(strcmp("max_connections", name) == 0 && val->type == json_integer) {
+            server->max_connections = (unsigned long) val->u.integer;
+        } else if(strcmp("overload", name) == 0 && val->type == json_string) {
+            if (strcmp("pause", val->u.string.ptr) == 0) {
+                server->overload_pause = 1;
+            } else if (strcmp("reject", val->u.string.ptr) == 0) {
+                server->overload_pause = 0;
+            } else {
+                warn("Unknown overload action: %s", val->u.string.ptr);
+            }
+        } else if(strcmp("max_body_size", name) == 0 && val->type == json_integer) {
+            server->max_body_size = (size_t) val->u.integer;
         } else if(strcmp("loglevel", name) == 0 && val->type == json_string) {
             if (strcasecmp("debug", val->u.string.ptr) == 0) {
                 lvl = DEBUG;
@@ -243,6 +945,28 @@ static int _configure_server(server_t *server, json_value *conf_obj) {
         error("No site found");
         return -1;
     }
+    if (server->buffer_percentile < 0 || server->buffer_percentile > 100) {
+        error("buffer_percentile must be within [0, 100]");
+        return -1;
+    }
+    if (server->read_buf_min > server->read_buf_max
+        || server->write_buf_min > server->write_buf_max) {
+        error("Buffer size minimum is larger than the maximum");
+        return -1;
+    }
+    // The defaults are only a starting point, keep them within the limits
+    server->stats.read_buf_size = MAX(server->stats.read_buf_size, server->read_buf_min);
+    server->stats.read_buf_size = MIN(server->stats.read_buf_size, server->read_buf_max);
+    server->stats.write_buf_size = MAX(server->stats.write_buf_size, server->write_buf_min);
+    server->stats.write_buf_size = MIN(server->stats.write_buf_size, server->write_buf_max);
+    if (server->workers < 0) {
+        error("workers must not be negative");
+        return -1;
+    }
+    if (server->backlog <= 0 || server->accept_budget <= 0) {
+        error("backlog and accept_budget must be positive");
+        return -1;
+    }
     server->handler = site_handler;
     server->handler_conf = site_conf;
     return 0;
@@ -254,10 +978,231 @@ static void _server_connection_handler(ioloop_t *loop,
                                        void *args)
 {
     connection_t *conn;
-    server_t     *server = (server_t*) args;
+    listener_t   *listener = (listener_t*) args;
+    server_t     *server = listener->server;
+    int          i, j;
+
+    for (i = 0; i < server->accept_budget; i++) {
+        if (server->overload_pause && server->worker_connections > 0
+            && server->stats.conn_active >= server->worker_connections) {
+            debug("Reached %lu connections, pausing accepting",
+                  server->worker_connections);
+            // Added back as connections are closed
+            for (j = 0; j < server->listener_count; j++) {
+                server->paused_accept = ioloop_remove_handler(loop,
+                                                              server->listeners[j].fd);
+            }
+            server->stats.accept_pauses++;
+            return;
+        }
+        if (_overloaded(server)) {
+            if (_shed_connection(server, listen_fd) < 0) {
+                return;
+            }
+            continue;
+        }
+        if ((conn = connection_accept(server, listen_fd)) == NULL) {
+            return;
+        }
+        connection_run(conn);
+    }
+    // The listener is edge triggered, the connections still waiting are
+    // accepted after the events of the others are handled.
+    ioloop_add_callback(loop, _accept_more, listener);
+}
+
+static void _accept_more(ioloop_t *loop, void *args) {
+    listener_t  *listener = (listener_t*) args;
+    server_t    *server = listener->server;
 
-    while ((conn = connection_accept(server, listen_fd)) != NULL) {
-        connection_run(conn);        
+    if (server->state != SERVER_RUNNING || server->paused_accept != NULL) {
+        return;
     }
+    _server_connection_handler(loop, listener->fd, EPOLLIN, listener);
+}
+
+/*
+ * "listen" is an address, or a list of addresses and of objects with
+ * the address and the options of a listener.
+ */
+static int _parse_listeners(server_t *server, json_value *val) {
+    int     i;
+
+    if (val->type != json_array) {
+        return _parse_listener(server, val);
+    }
+    for (i = 0; i < val->u.array.length; i++) {
+        if (_parse_listener(server, val->u.array.values[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int _parse_listener(server_t *server, json_value *val) {
+    listener_t  *listener;
+    json_value  *opt;
+    char        *name;
+    int         i;
+
+    if (server->listener_count >= MAX_LISTENERS) {
+        error("Too many listeners, at most %d are supported", MAX_LISTENERS);
+        return -1;
+    }
+    listener = server->listeners + server->listener_count;
+    bzero(listener, sizeof(listener_t));
+    listener->server = server;
+
+    if (val->type == json_string) {
+        if (_parse_address(listener, val->u.string.ptr) < 0) {
+            return -1;
+        }
+        server->listener_count++;
+        return 0;
+    } else if (val->type != json_object) {
+        error("Invalid listener with type %d", val->type);
+        return -1;
+    }
+
+    for (i = 0; i < val->u.object.length; i++) {
+        name = val->u.object.values[i].name;
+        opt = val->u.object.values[i].value;
+        if (strcmp("address", name) == 0 && opt->type == json_string) {
+            if (_parse_address(listener, opt->u.string.ptr) < 0) {
+                return -1;
+            }
+        } else if (strcmp("backlog", name) == 0 && opt->type == json_integer) {
+            listener->backlog = (int) opt->u.integer;
+        } else if (strcmp("defer_accept", name) == 0 && opt->type == json_integer) {
+            listener->defer_accept = (int) opt->u.integer;
+        } else if (strcmp("fastopen", name) == 0 && opt->type == json_integer) {
+            listener->fastopen = (int) opt->u.integer;
+        } else if (strcmp("ipv6only", name) == 0 && opt->type == json_boolean) {
+            listener->ipv6only = opt->u.boolean;
+        } else {
+            warn("Unknown listener option %s with type %d", name, opt->type);
+        }
+    }
+    if (listener->socklen == 0) {
+        error("Listener without an address");
+        return -1;
+    }
+    server->listener_count++;
+    return 0;
+}
 
+/*
+ * Addresses look like "0.0.0.0:80", "[::]:80", "localhost:8080", or
+ * "unix:/run/breeze.sock", the port is 80 if not given.
+ */
+static int _parse_address(listener_t *listener, const char *address) {
+    struct addrinfo     hints, *res;
+    struct sockaddr_un  *un;
+    char                host[128], *name, *port, *end;
+    int                 rc;
+
+    if (listener->address != address) {
+        snprintf(listener->address, sizeof(listener->address), "%s", address);
+    }
+    if (strncmp(address, "unix:", 5) == 0) {
+        un = (struct sockaddr_un*) &listener->sockaddr;
+        if (strlen(address + 5) >= sizeof(un->sun_path)) {
+            error("Unix socket path too long: %s", address);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address + 5);
+        listener->socklen = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    snprintf(host, sizeof(host), "%s", address);
+    name = host;
+    port = "80";
+    if (host[0] == '[') {
+        end = strchr(host, ']');
+        if (end == NULL) {
+            error("Invalid listen address: %s", address);
+            return -1;
+        }
+        *end = '\0';
+        name = host + 1;
+        if (end[1] == ':') {
+            port = end + 2;
+        }
+    } else if ((end = strchr(host, ':')) != NULL) {
+        *end = '\0';
+        port = end + 1;
+    }
+    if (strcmp(name, "*") == 0) {
+        name = "0.0.0.0";
+    }
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    rc = getaddrinfo(name, port, &hints, &res);
+    if (rc != 0) {
+        error("Invalid listen address %s: %s", address, gai_strerror(rc));
+        return -1;
+    }
+    memcpy(&listener->sockaddr, res->ai_addr, res->ai_addrlen);
+    listener->socklen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int _overloaded(server_t *server) {
+    unsigned long   total = 0;
+    int             i;
+
+    if (server->worker_connections > 0
+        && server->stats.conn_active >= server->worker_connections) {
+        return 1;
+    }
+    if (server->max_connections == 0) {
+        return 0;
+    }
+    if (server->conn_counts == NULL) {
+        return server->stats.conn_active >= server->max_connections;
+    }
+    for (i = 0; i < server->workers; i++) {
+        total += server->conn_counts[i];
+    }
+    return total >= server->max_connections;
+}
+
+/*
+ * Accept a connection only to answer it with 503, none of the memory of
+ * a connection is taken. Returns -1 when no connection is waiting.
+ */
+static int _shed_connection(server_t *server, int listen_fd) {
+    char    buf[4096];
+    int     fd;
+
+    fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error("Error accepting new connection");
+        }
+        return -1;
+    }
+    send(fd, overload_response, sizeof(overload_response) - 1, MSG_NOSIGNAL);
+    // The FIN follows the response, the kernel goes on sending both
+    // after the close. Closing with unread data resets the connection
+    // instead, so what the client sent so far is read away, a request
+    // that comes later may still get a reset.
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, buf, sizeof(buf), 0) > 0);
+    close(fd);
+    server->stats.conn_shed++;
+    return 0;
+}
+
+static void _set_listen_option(int fd, int level, int name, int value,
+                               const char *desc) {
+    if (setsockopt(fd, level, name, (void*) &value, sizeof(value)) < 0) {
+        warn("Error setting %s on the listen socket", desc);
+    }
 }
@@ -85,6 +85,7 @@ ioloop_t *ioloop_create(unsigned int maxfds) {
 
 
 int ioloop_destroy(ioloop_t *loop) {
+    close(loop->epoll_fd);
     free(loop->handlers);
     free(loop);
     return 0;
@@ -194,7 +195,6 @@ int ioloop_start(ioloop_t *loop) {
         }
     }
 
-    close(epoll_fd);
     //TODO Other cleanup work here.
     return 0;
 }
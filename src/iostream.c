@@ -1,6 +1,7 @@
 #include "iostream.h"
 #include "ioloop.h"
 #include "buffer.h"
+#include "common.h"
 #include "log.h"
 
 #include <stdio.h>
@@ -12,8 +13,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 
+// Destroyed streams a pool keeps at most
+#define STREAM_POOL_MAX     256
+
 enum READ_OP_TYPES {
     READ_BYTES = 1,
     READ_UNTIL = 2
@@ -34,6 +41,10 @@ enum WRITE_STATE {
 #define is_writing(stream) ((stream)->write_callback != NULL)
 #define is_closed(stream)  ((stream)->state == CLOSED)
 
+#define last_write_req(stream)                                          \
+    ((stream)->write_queue                                              \
+     + ((stream)->write_queue_head + (stream)->write_queue_len - 1) % MAX_WRITE_QUEUE)
+
 #define check_reading(stream)  \
     if (is_reading(stream)) {  \
         return -1;             \
@@ -51,41 +62,89 @@ static int  _handle_write(iostream_t *stream);
 static int  _handle_sendfile(iostream_t *stream);
 static int _add_event(iostream_t *stream, unsigned int events);
 
+static int _grow_buffer(buffer_t **buf, size_t *cap, size_t needed, size_t max);
+
 static ssize_t _read_from_socket(iostream_t *stream);
 static int     _read_from_buffer(iostream_t *stream);
+static void    _schedule_read_callback(iostream_t *stream);
+static void    _schedule_write_finish(iostream_t *stream);
 static ssize_t _write_to_buffer(iostream_t *stream, void *data, size_t len);
+static int     _write_to_queue(iostream_t *stream, shared_buffer_t *sbuf,
+                               size_t offset, size_t len);
+static void    _consume_write_queue(iostream_t *stream, size_t len);
+static int     _flush_write_queue(iostream_t *stream, int flags);
 static int     _write_to_socket(iostream_t *stream);
-static ssize_t _write_to_socket_direct(iostream_t *stream, void *data, size_t len);
+static int     _write_queued(iostream_t *stream);
+static int     _flush_corked(iostream_t *stream);
+static ssize_t _write_to_socket_direct(iostream_t *stream,
+                                       const struct iovec *iov, int iovcnt);
 
 static void _finish_stream_callback(ioloop_t *loop, void *args);
+static void _resume_read_callback(ioloop_t *loop, void *args);
 static void _finish_read_callback(ioloop_t *loop, void *args);
 static void _finish_write_callback(ioloop_t *loop, void *args);
 static void _close_callback(ioloop_t *loop, void *args);
 static void _destroy_callback(ioloop_t *loop, void *args);
 
-static void _stream_consumer_func(void *data, size_t len, void *args);
+
+/*
+ * A buffer of the capacity asked for, the one given if it has it.
+ */
+static buffer_t *_reuse_buffer(buffer_t *buf, size_t capacity) {
+    if (buf != NULL && buffer_capacity(buf) == capacity) {
+        buffer_clear(buf);
+        return buf;
+    }
+    if (buf != NULL) {
+        buffer_destroy(buf);
+    }
+    return buffer_create(capacity);
+}
 
 iostream_t *iostream_create(ioloop_t *loop,
                             int sockfd,
                             size_t read_buf_capacity,
                             size_t write_buf_capacity,
                             void *user_data) {
+    return iostream_create_pooled(NULL, loop, sockfd, read_buf_capacity,
+                                  write_buf_capacity, user_data);
+}
+
+/*
+ * Create a stream from one destroyed in the pool if there is, it goes
+ * back to the pool when destroyed.
+ */
+iostream_t *iostream_create_pooled(iostream_pool_t *pool,
+                                   ioloop_t *loop,
+                                   int sockfd,
+                                   size_t read_buf_capacity,
+                                   size_t write_buf_capacity,
+                                   void *user_data) {
     iostream_t  *stream;
     buffer_t    *in_buf = NULL, *out_buf = NULL;
 
-    stream = (iostream_t*) calloc(1, sizeof(iostream_t));
-    if (stream == NULL) {
-        error("Error allocating memory for IO stream");
-        goto error;
+    if (pool != NULL && pool->free != NULL) {
+        // The buffers of a recycled stream are kept if they fit
+        stream = pool->free;
+        pool->free = (iostream_t*) stream->user_data;
+        pool->size--;
+        in_buf = stream->read_buf;
+        out_buf = stream->write_buf;
+    } else {
+        stream = (iostream_t*) malloc(sizeof(iostream_t));
+        if (stream == NULL) {
+            error("Error allocating memory for IO stream");
+            return NULL;
+        }
     }
     bzero(stream, sizeof(iostream_t));
 
-    in_buf = buffer_create(read_buf_capacity);
+    in_buf = _reuse_buffer(in_buf, read_buf_capacity);
     if (in_buf == NULL ) {
         error("Error creating read buffer");
         goto error;
     }
-    out_buf = buffer_create(write_buf_capacity);
+    out_buf = _reuse_buffer(out_buf, write_buf_capacity);
     if (out_buf == NULL) {
         error("Error creating write buffer");
         goto error;
@@ -94,8 +153,10 @@ iostream_t *iostream_create(ioloop_t *loop,
     stream->events = EPOLLERR;
     stream->write_buf = out_buf;
     stream->write_buf_cap = write_buf_capacity;
+    stream->write_buf_max = write_buf_capacity;
     stream->read_buf = in_buf;
     stream->read_buf_cap = read_buf_capacity;
+    stream->read_buf_max = read_buf_capacity;
     stream->fd = sockfd;
     stream->state = NORMAL;
     stream->ioloop = loop;
@@ -104,6 +165,7 @@ iostream_t *iostream_create(ioloop_t *loop,
     stream->close_callback = NULL;
     stream->error_callback = NULL;
     stream->sendfile_fd = -1;
+    stream->pool = pool;
     stream->user_data = user_data;
 
     if (ioloop_add_handler(stream->ioloop,
@@ -141,6 +203,10 @@ static void _close_callback(ioloop_t *loop, void *args) {
     iostream_t  *stream = (iostream_t*) args;
     ioloop_remove_handler(stream->ioloop, stream->fd);
     stream->close_callback(stream);
+    // The owner is gone, a read or write finished in the meantime must
+    // not call back into it
+    stream->read_callback = NULL;
+    stream->write_callback = NULL;
     close(stream->fd);
     // Defer the destroy action to next loop, in case there are
     // pending callbacks of this stream.
@@ -154,12 +220,41 @@ static void _destroy_callback(ioloop_t *loop, void *args) {
 }
     
 int iostream_destroy(iostream_t *stream) {
+    write_req_t *req;
+
+    // Release the shared buffers that were never sent
+    while (stream->write_queue_len > 0) {
+        req = stream->write_queue + stream->write_queue_head;
+        if (req->sbuf != NULL) {
+            shared_buffer_unref(req->sbuf);
+        }
+        stream->write_queue_head = (stream->write_queue_head + 1) % MAX_WRITE_QUEUE;
+        stream->write_queue_len--;
+    }
+    if (stream->pool != NULL && stream->pool->size < STREAM_POOL_MAX) {
+        stream->user_data = stream->pool->free;
+        stream->pool->free = stream;
+        stream->pool->size++;
+        return 0;
+    }
     buffer_destroy(stream->read_buf);
     buffer_destroy(stream->write_buf);
     free(stream);
     return 0;
 }
 
+void iostream_pool_destroy(iostream_pool_t *pool) {
+    iostream_t  *stream;
+
+    while ((stream = pool->free) != NULL) {
+        pool->free = (iostream_t*) stream->user_data;
+        buffer_destroy(stream->read_buf);
+        buffer_destroy(stream->write_buf);
+        free(stream);
+    }
+    pool->size = 0;
+}
+
 int iostream_read_bytes(iostream_t *stream,
                         size_t sz,
                         read_handler callback,
@@ -172,6 +267,9 @@ int iostream_read_bytes(iostream_t *stream,
     stream->stream_callback = stream_callback;
     stream->read_bytes = sz;
     stream->read_type = READ_BYTES;
+    if (stream->in_read_callback) {
+        return 0;
+    }
     for (;;) {
         if (_read_from_buffer(stream)) {
             return 0;
@@ -194,6 +292,9 @@ int iostream_read_until(iostream_t *stream, char *delimiter, read_handler callba
     stream->stream_callback = NULL;
     stream->read_delimiter = delimiter;
     stream->read_type = READ_UNTIL;
+    if (stream->in_read_callback) {
+        return 0;
+    }
     for (;;) {
         if (_read_from_buffer(stream)) {
             return 0;
@@ -210,19 +311,47 @@ int iostream_read_until(iostream_t *stream, char *delimiter, read_handler callba
 }
 
 int iostream_write(iostream_t *stream, void *data, size_t len, write_handler callback) {
+    struct iovec    iov;
+
+    iov.iov_base = data;
+    iov.iov_len = len;
+    return iostream_writev(stream, &iov, 1, callback);
+}
+
+/*
+ * Write the pieces in order as if they were one piece of data. They are
+ * sent with one system call if possible, only what could not be sent is
+ * copied into the write buffer.
+ */
+int iostream_writev(iostream_t *stream, const struct iovec *iov, int iovcnt,
+                    write_handler callback) {
     ssize_t     n;
+    size_t      len = 0;
+    int         i;
+
     // Allow appending data to existing writing action
     if (is_writing(stream) && callback != stream->write_callback) {
         return -1;
     }
 
-    if (len == 0) {
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (stream->write_state == SEND_FILE || is_closed(stream)) {
         return -1;
     }
 
     stream->write_callback = callback;
     stream->write_state = WRITE_BUFFER;
-    n = _write_to_socket_direct(stream, data, len);
+    if (len == 0) {
+        // Nothing to send, the callback still runs once what was
+        // queued before is out
+        if (stream->write_queue_len == 0 || stream->corked) {
+            _schedule_write_finish(stream);
+        }
+        return 0;
+    }
+    n = _write_to_socket_direct(stream, iov, iovcnt);
     if (n < 0) {
         return -1;
     } else if (n == len) {
@@ -230,25 +359,73 @@ int iostream_write(iostream_t *stream, void *data, size_t len, write_handler cal
         return 0;
     }
 
-    if (_write_to_buffer(stream, (char*)data + n, len - n) < 0) {
+    for (i = 0; i < iovcnt; i++) {
+        if (n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            continue;
+        }
+        if (_write_to_buffer(stream, (char*)iov[i].iov_base + n, iov[i].iov_len - n) < 0
+            && (_flush_corked(stream) < 0
+                || _write_to_buffer(stream, (char*)iov[i].iov_base + n,
+                                    iov[i].iov_len - n) < 0)) {
+            return -1;
+        }
+        n = 0;
+    }
+    return _write_queued(stream);
+}
+
+/*
+ * Like iostream_write, but the data is never copied into the write
+ * buffer. The stream holds a reference to the shared buffer until
+ * all of it has been sent.
+ */
+int iostream_write_shared(iostream_t *stream, shared_buffer_t *sbuf,
+                          write_handler callback) {
+    ssize_t         n;
+    size_t          len = shared_buffer_size(sbuf);
+    struct iovec    iov;
+
+    if (is_writing(stream) && callback != stream->write_callback) {
         return -1;
     }
 
-    // Try to write to the socket
-    if (_write_to_socket(stream) > 0) {
+    if (len == 0 || stream->write_state == SEND_FILE) {
+        return -1;
+    }
+
+    stream->write_callback = callback;
+    stream->write_state = WRITE_BUFFER;
+    iov.iov_base = (void*) shared_buffer_data(sbuf);
+    iov.iov_len = len;
+    n = _write_to_socket_direct(stream, &iov, 1);
+    if (n < 0) {
+        return -1;
+    } else if (n == len) {
         return 0;
     }
-    _add_event(stream, EPOLLOUT);
-    return 0;
+
+    if (_write_to_queue(stream, sbuf, n, len - n) < 0
+        && (_flush_corked(stream) < 0
+            || _write_to_queue(stream, sbuf, n, len - n) < 0)) {
+        return -1;
+    }
+    return _write_queued(stream);
 }
 
+/*
+ * Send a file. It may follow data written with the same callback, which
+ * is sent first, but nothing can be written after it until it is done.
+ */
 int iostream_sendfile(iostream_t *stream, int in_fd,
                       size_t offset, size_t len,
                       write_handler callback) {
     struct stat st;
     
-    check_writing(stream);
-    if (len == 0) {
+    if (is_writing(stream) && callback != stream->write_callback) {
+        return -1;
+    }
+    if (len == 0 || stream->write_state == SEND_FILE) {
         return -1;
     }
     if (fstat(in_fd, &st) < 0) {
@@ -278,6 +455,126 @@ int iostream_sendfile(iostream_t *stream, int in_fd,
     return 0;
 }
 
+/*
+ * Stop reading from the socket, data that is already buffered is not
+ * offered either. The peer is slowed down by TCP flow control once
+ * the buffers are full.
+ */
+int iostream_pause_read(iostream_t *stream) {
+    stream->read_paused = 1;
+    return 0;
+}
+
+int iostream_resume_read(iostream_t *stream) {
+    if (!stream->read_paused) {
+        return 0;
+    }
+    stream->read_paused = 0;
+    ioloop_add_callback(stream->ioloop, _resume_read_callback, stream);
+    return 0;
+}
+
+/*
+ * Find the delimiter in the data already read but not consumed yet,
+ * returns its offset or -1.
+ */
+int iostream_locate(iostream_t *stream, char *delimiter) {
+    return buffer_locate(stream->read_buf, delimiter);
+}
+
+/*
+ * Hold the written data back in the write buffer instead of sending it
+ * right away, the write callbacks are called as soon as the data has
+ * been taken. Used to send many small responses with one syscall.
+ */
+int iostream_cork(iostream_t *stream) {
+    stream->corked = 1;
+    return 0;
+}
+
+/*
+ * Send the data held back since iostream_cork. The callback, if any,
+ * is called once all of it has been written, right away when nothing
+ * was held back.
+ */
+int iostream_uncork(iostream_t *stream, write_handler callback) {
+    stream->corked = 0;
+    if (stream->write_queue_len == 0) {
+        if (callback != NULL) {
+            callback(stream);
+        }
+        return 0;
+    }
+    check_writing(stream);
+    stream->write_callback = callback;
+    stream->write_state = WRITE_BUFFER;
+    if (_write_to_socket(stream) == 0) {
+        _add_event(stream, EPOLLOUT);
+    }
+    return 0;
+}
+
+/*
+ * While held, a write that completes without waiting does not run its
+ * callback from the ioloop: the caller runs it with iostream_finish_write
+ * once it is ready for it, which saves a round of the ioloop. Returns
+ * the previous setting.
+ */
+int iostream_hold_finish(iostream_t *stream, int hold) {
+    int     prev = stream->hold_finish;
+
+    stream->hold_finish = hold;
+    return prev;
+}
+
+/*
+ * Run the callback of a write that has completed, returns 1 if there
+ * was one.
+ */
+int iostream_finish_write(iostream_t *stream) {
+    if (!stream->finish_pending || is_closed(stream)) {
+        return 0;
+    }
+    _finish_write_callback(stream->ioloop, stream);
+    return 1;
+}
+
+/*
+ * Allow the buffers to grow on demand up to the given capacities. By
+ * default the buffers never grow.
+ */
+int iostream_set_buffer_limits(iostream_t *stream,
+                               size_t read_buf_max, size_t write_buf_max) {
+    stream->read_buf_max = MAX(read_buf_max, stream->read_buf_cap);
+    stream->write_buf_max = MAX(write_buf_max, stream->write_buf_cap);
+    return 0;
+}
+
+/*
+ * Limit the amount of data that can sit unsent in the socket's send
+ * queue. When set, EPOLLOUT will not fire until the unsent part drops
+ * below the given number of bytes, and sendfile feeds the socket in
+ * chunks of at most that size. Passing 0 restores the system default.
+ */
+int iostream_set_notsent_lowat(iostream_t *stream, size_t lowat) {
+    int val = (int) lowat;
+
+    if (stream->notsent_lowat == lowat) {
+        return 0;
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (setsockopt(stream->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   (void*)&val, sizeof(val)) < 0) {
+        error("Error setting TCP_NOTSENT_LOWAT");
+        return -1;
+    }
+    stream->notsent_lowat = lowat;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 int iostream_set_error_handler(iostream_t *stream, error_handler callback) {
     stream->error_callback = callback;
     return 0;
@@ -329,11 +626,21 @@ static void _handle_io_events(ioloop_t *loop,
 }
 
 static int _handle_read(iostream_t *stream) {
-    if (!is_reading(stream)) {
+    ssize_t n;
+
+    if (!is_reading(stream) || stream->read_paused) {
         return 0;
     }
-    _read_from_socket(stream);
-    return _read_from_buffer(stream);
+    for (;;) {
+        n = _read_from_socket(stream);
+        if (_read_from_buffer(stream)) {
+            return 1;
+        }
+        // Keep reading if the buffer has grown, since we are edge triggered
+        if (n <= 0) {
+            return 0;
+        }
+    }
 }
 
 static int _handle_write(iostream_t *stream) {
@@ -351,34 +658,59 @@ static int _handle_write(iostream_t *stream) {
 
 static int _handle_sendfile(iostream_t *stream) {
     ssize_t  sz;
+    size_t   len;
+    int      rc;
+
+    if (stream->write_queue_len > 0) {
+        // Data held back goes first, in the same packets as the file
+        rc = _flush_write_queue(stream, MSG_MORE);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
 
-    sz = sendfile(stream->fd, stream->sendfile_fd,
-                  &stream->sendfile_offset, stream->sendfile_len);
+    for (;;) {
+        len = stream->sendfile_len;
+        if (stream->notsent_lowat > 0) {
+            // Streaming mode: only feed what the socket is about to
+            // send, the kernel refuses more once the unsent queue
+            // reaches the low watermark.
+            len = MIN(len, stream->notsent_lowat);
+        }
 
-    if (sz < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return 0;
-        } else {
-            iostream_close(stream);
-            return -1;
+        sz = sendfile(stream->fd, stream->sendfile_fd,
+                      &stream->sendfile_offset, len);
+
+        if (sz < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else {
+                iostream_close(stream);
+                return -1;
+            }
+        } else if (sz == 0 && stream->sendfile_len > 0) {
+            // The lengh maybe longer than the actual available size. In
+            // this case finish the write immediately.
+            stream->sendfile_offset = 0;
+            stream->sendfile_len = 0;
+            _schedule_write_finish(stream);
+            return 1;
         }
-    } else if (sz == 0 && stream->sendfile_len > 0) {
-        // The lengh maybe longer than the actual available size. In
-        // this case finish the write immediately.
-        stream->sendfile_offset = 0;
-        ioloop_add_callback(stream->ioloop, _finish_write_callback, stream);
-        return 1;
-    }
 
-    stream->sendfile_len -= sz;
+        stream->sendfile_len -= sz;
 
-    if (stream->sendfile_len == 0) {
-        stream->sendfile_offset = 0;
-        ioloop_add_callback(stream->ioloop, _finish_write_callback, stream);
-        return 1;
-    }
+        if (stream->sendfile_len == 0) {
+            stream->sendfile_offset = 0;
+            _schedule_write_finish(stream);
+            return 1;
+        }
 
-    return 0;
+        if (stream->notsent_lowat == 0) {
+            // A short write without EAGAIN means the socket buffer is
+            // full, wait for EPOLLOUT.
+            return 0;
+        }
+    }
 }
 
 static int _add_event(iostream_t *stream, unsigned int event) {
@@ -389,6 +721,27 @@ static int _add_event(iostream_t *stream, unsigned int event) {
     return -1;
 }
 
+static int _grow_buffer(buffer_t **buf, size_t *cap, size_t needed, size_t max) {
+    buffer_t    *new_buf;
+    size_t      new_cap = *cap;
+
+    while (new_cap < needed) {
+        new_cap *= 2;
+    }
+    new_cap = MIN(new_cap, max);
+    if (new_cap < needed || new_cap <= *cap) {
+        return -1;
+    }
+    new_buf = buffer_resize(*buf, new_cap);
+    if (new_buf == NULL) {
+        return -1;
+    }
+    debug("Buffer grown from %zu to %zu", *cap, new_cap);
+    *buf = new_buf;
+    *cap = new_cap;
+    return 0;
+}
+
 #define READ_SIZE 1024
 
 static ssize_t _read_from_socket(iostream_t *stream) {
@@ -403,7 +756,16 @@ static ssize_t _read_from_socket(iostream_t *stream) {
 }
 
 
-#define LOCAL_BUFSIZE 4096
+/*
+ * Deliver the requested data from the ioloop. Only one delivery is
+ * pending at a time, the socket may be read again before it runs.
+ */
+static void _schedule_read_callback(iostream_t *stream) {
+    if (!stream->read_scheduled) {
+        stream->read_scheduled = 1;
+        ioloop_add_callback(stream->ioloop, _finish_read_callback, stream);
+    }
+}
 
 static int _read_from_buffer(iostream_t *stream) {
     int     res = 0, idx;
@@ -414,26 +776,40 @@ static int _read_from_buffer(iostream_t *stream) {
                 // Streaming mode, offer data
                 if (stream->read_bytes <= 0) {
                     res = 1;
-                } else {
+                } else if (stream->read_buf_size > 0 && !stream->read_paused
+                           && !stream->read_scheduled) {
+                    stream->read_scheduled = 1;
                     ioloop_add_callback(stream->ioloop, _finish_stream_callback, stream);
                 }
+            } else if (stream->read_buf_size < stream->read_bytes
+                       && buffer_is_full(stream->read_buf)
+                       && _grow_buffer(&stream->read_buf, &stream->read_buf_cap,
+                                       stream->read_bytes, stream->read_buf_max) == 0) {
+                // Room for all of it now
+                break;
             } else if (stream->read_buf_size >= stream->read_bytes
                        || buffer_is_full(stream->read_buf)
                        || (stream->state == CLOSED && stream->read_buf_size > 0)) {
-                ioloop_add_callback(stream->ioloop, _finish_read_callback, stream);
+                _schedule_read_callback(stream);
                 res = 1;
             }
             break;
 
         case READ_UNTIL:
             idx = buffer_locate(stream->read_buf, stream->read_delimiter);
-            if (idx > 0
+            if (idx < 0 && buffer_is_full(stream->read_buf)
+                && _grow_buffer(&stream->read_buf, &stream->read_buf_cap,
+                                stream->read_buf_cap + 1, stream->read_buf_max) == 0) {
+                // Not found yet, but there is room to read more now
+                break;
+            }
+            if (idx >= 0
                 || buffer_is_full(stream->read_buf)
                 || (stream->state == CLOSED && stream->read_buf_size > 0)) {
-                stream->read_bytes = idx > 0
+                stream->read_bytes = idx >= 0
                     ? (idx + strlen(stream->read_delimiter))
                     : stream->read_buf_size;
-                ioloop_add_callback(stream->ioloop, _finish_read_callback, stream);
+                _schedule_read_callback(stream);
                 res = 1;
             }
             break;
@@ -444,38 +820,108 @@ static int _read_from_buffer(iostream_t *stream) {
 
 
 static void _finish_stream_callback(ioloop_t *loop, void *args) {
-    iostream_t  *stream = (iostream_t*) args;
+    iostream_t      *stream = (iostream_t*) args;
     read_handler    callback = stream->read_callback;
+    struct iovec    iov[2];
+    size_t          n;
 
-    buffer_consume(stream->read_buf, stream->read_bytes, _stream_consumer_func, stream);
+    stream->read_scheduled = 0;
+    if (callback == NULL || stream->stream_callback == NULL || is_closed(stream)) {
+        return;
+    }
+    // Offer the data piece by piece, the consumer may pause in between
+    while (stream->read_bytes > 0 && !stream->read_paused
+           && buffer_iovec(stream->read_buf, 0, stream->read_bytes, iov) > 0) {
+        n = iov[0].iov_len;
+        stream->read_bytes -= n;
+        stream->read_buf_size -= n;
+        stream->stream_callback(stream, iov[0].iov_base, n);
+        buffer_skip(stream->read_buf, n);
+        if (is_closed(stream)) {
+            return;
+        }
+    }
     if (stream->read_bytes <= 0) {
         stream->read_callback = NULL;
         stream->read_bytes = 0;
         // When streaming ends, call the read_callback with NULL to indicate the finish.
         callback(stream, NULL, 0);
+    } else if (!stream->read_paused && !_handle_read(stream)) {
+        // There is room in the buffer again
+        _add_event(stream, EPOLLIN);
+    }
+}
+
+static void _resume_read_callback(ioloop_t *loop, void *args) {
+    iostream_t  *stream = (iostream_t*) args;
+
+    if (is_reading(stream) && !is_closed(stream) && !_handle_read(stream)) {
+        _add_event(stream, EPOLLIN);
     }
 }
 
 static void _finish_read_callback(ioloop_t *loop, void *args) {
-    char            local_buf[LOCAL_BUFSIZE];
+    char            *data;
     iostream_t      *stream = (iostream_t*) args;
     read_handler    callback = stream->read_callback;
     size_t          n;
 
-    // Normal mode, call read callback
-    n = buffer_get(stream->read_buf, stream->read_bytes, local_buf, LOCAL_BUFSIZE);
-    // assert(n == stream->read_bytes);
+    stream->read_scheduled = 0;
+    if (callback == NULL) {
+        return;
+    }
+    // Hand out the data in place, it is only rotated when wrapped around
+    data = (char*) buffer_linearize(stream->read_buf);
+    if (data == NULL) {
+        error("Error allocating memory for read data");
+        iostream_close(stream);
+        return;
+    }
+    n = buffer_skip(stream->read_buf, stream->read_bytes);
     callback = stream->read_callback;
     stream->read_callback = NULL;
     stream->read_bytes = 0;
     stream->read_buf_size -= n;
-    callback(stream, local_buf, n);
+
+    // The skipped bytes stay untouched until the callback returns, so a
+    // read started from the callback is only carried out afterwards.
+    stream->in_read_callback = 1;
+    callback(stream, data, n);
+    stream->in_read_callback = 0;
+    if (is_reading(stream) && !is_closed(stream) && !_handle_read(stream)) {
+        _add_event(stream, EPOLLIN);
+    }
+}
+
+/*
+ * Run the write callback once the write is complete. When the stream
+ * holds the callback, iostream_finish_write runs it instead.
+ */
+static void _schedule_write_finish(iostream_t *stream) {
+    if (stream->finish_pending) {
+        return;
+    }
+    stream->finish_pending = 1;
+    if (!stream->hold_finish) {
+        ioloop_add_callback(stream->ioloop, _finish_write_callback, stream);
+    }
 }
 
 static void _finish_write_callback(ioloop_t *loop, void *args) {
     iostream_t      *stream = (iostream_t*) args;
     write_handler   callback = stream->write_callback;
 
+    if (!stream->finish_pending) {
+        // Run already by iostream_finish_write
+        return;
+    }
+    stream->finish_pending = 0;
+    if ((stream->write_queue_len > 0 && !stream->corked)
+        || (stream->write_state == SEND_FILE && stream->sendfile_len > 0)) {
+        // More data has been appended after this callback was
+        // scheduled, the callback will be run once it is flushed.
+        return;
+    }
     stream->write_callback = NULL;
     stream->write_state = NOT_WRITING;
     if (callback != NULL) {
@@ -483,53 +929,176 @@ static void _finish_write_callback(ioloop_t *loop, void *args) {
     }
 }
 
-static void _stream_consumer_func(void *data, size_t len, void *args) {
-    iostream_t  *stream = (iostream_t*) args;
-    stream->read_bytes -= len;
-    stream->read_buf_size -= len;
-    stream->stream_callback(stream, data, len);
-}
-
 static ssize_t _write_to_buffer(iostream_t *stream, void *data, size_t len) {
-    if (len > stream->write_buf_cap - stream->write_buf_size) {
+    write_req_t *last = NULL;
+
+    if (len > stream->write_buf_cap - stream->write_buf_size
+        && _grow_buffer(&stream->write_buf, &stream->write_buf_cap,
+                        stream->write_buf_size + len, stream->write_buf_max) < 0) {
         return -1;
     }
+    if (stream->write_queue_len > 0) {
+        last = last_write_req(stream);
+    }
+    if (last == NULL || last->sbuf != NULL) {
+        // Adjacent buffered data are merged into one request
+        if (_write_to_queue(stream, NULL, 0, 0) < 0) {
+            return -1;
+        }
+        last = last_write_req(stream);
+    }
     if (buffer_put(stream->write_buf, data, len) < 0) {
         return -1;
     }
+    last->len += len;
     stream->write_buf_size += len;
+    stream->write_buf_peak = MAX(stream->write_buf_peak, stream->write_buf_size);
     return 0;
 }
 
-#define WRITE_CHUNK_SIZE 1024
+static int _write_to_queue(iostream_t *stream, shared_buffer_t *sbuf,
+                           size_t offset, size_t len) {
+    write_req_t *req;
 
-static int _write_to_socket(iostream_t *stream) {
+    if (stream->write_queue_len >= MAX_WRITE_QUEUE) {
+        return -1;
+    }
+    req = stream->write_queue
+        + (stream->write_queue_head + stream->write_queue_len) % MAX_WRITE_QUEUE;
+    req->sbuf = sbuf != NULL ? shared_buffer_ref(sbuf) : NULL;
+    req->offset = offset;
+    req->len = len;
+    stream->write_queue_len++;
+    return 0;
+}
+
+static void _consume_write_queue(iostream_t *stream, size_t len) {
+    write_req_t *req;
+    size_t      n;
+
+    while (len > 0 && stream->write_queue_len > 0) {
+        req = stream->write_queue + stream->write_queue_head;
+        n = MIN(len, req->len);
+        if (req->sbuf == NULL) {
+            buffer_skip(stream->write_buf, n);
+            stream->write_buf_size -= n;
+        } else {
+            req->offset += n;
+        }
+        req->len -= n;
+        len -= n;
+        if (req->len == 0) {
+            if (req->sbuf != NULL) {
+                shared_buffer_unref(req->sbuf);
+                req->sbuf = NULL;
+            }
+            stream->write_queue_head = (stream->write_queue_head + 1) % MAX_WRITE_QUEUE;
+            stream->write_queue_len--;
+        }
+    }
+}
+
+/*
+ * Gather all the pending requests and write them with one syscall.
+ * Returns 1 if the queue is drained, 0 if the socket is full, or -1 on
+ * error. MSG_MORE tells the kernel more data follows right away.
+ */
+static int _flush_write_queue(iostream_t *stream, int flags) {
+    struct iovec    iov[MAX_WRITE_QUEUE * 2];
+    struct msghdr   msg;
+    write_req_t     *req;
     ssize_t         n;
+    size_t          skip = 0;
+    int             i, iovcnt = 0;
+
+    for (i = 0; i < stream->write_queue_len; i++) {
+        req = stream->write_queue + (stream->write_queue_head + i) % MAX_WRITE_QUEUE;
+        if (req->sbuf == NULL) {
+            iovcnt += buffer_iovec(stream->write_buf, skip, req->len, iov + iovcnt);
+            skip += req->len;
+        } else {
+            iov[iovcnt].iov_base = (char*) shared_buffer_data(req->sbuf) + req->offset;
+            iov[iovcnt].iov_len = req->len;
+            iovcnt++;
+        }
+    }
 
-    n = buffer_flush(stream->write_buf, stream->fd);
-    if (n < 0) {
-        iostream_close(stream);
-        return -1;
+    if (iovcnt > 0) {
+        if (flags == 0) {
+            n = writev(stream->fd, iov, iovcnt);
+        } else {
+            bzero(&msg, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            n = sendmsg(stream->fd, &msg, flags);
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            iostream_close(stream);
+            return -1;
+        }
+        _consume_write_queue(stream, n);
     }
-    stream->write_buf_size -= n;
+    return stream->write_queue_len == 0;
+}
 
-    if (stream->write_buf_size == 0) {
-        ioloop_add_callback(stream->ioloop, _finish_write_callback, stream);
-        return 1;
-    } else {
+static int _write_to_socket(iostream_t *stream) {
+    int     rc;
+
+    rc = _flush_write_queue(stream, 0);
+    if (rc > 0) {
+        _schedule_write_finish(stream);
+    }
+    return rc;
+}
+
+/*
+ * Called after data has been queued by a write: send it, unless the
+ * stream is corked.
+ */
+static int _write_queued(iostream_t *stream) {
+    if (stream->corked) {
+        _schedule_write_finish(stream);
         return 0;
     }
+    // Try to write to the socket
+    if (_write_to_socket(stream) != 0) {
+        return 0;
+    }
+    _add_event(stream, EPOLLOUT);
+    return 0;
+}
+
+/*
+ * There is no room left to hold back more data, stop holding and send
+ * what we can to make room.
+ */
+static int _flush_corked(iostream_t *stream) {
+    if (!stream->corked) {
+        return -1;
+    }
+    stream->corked = 0;
+    return _flush_write_queue(stream, 0) < 0 ? -1 : 0;
 }
 
-static ssize_t _write_to_socket_direct(iostream_t *stream, void *data, size_t len) {
+static ssize_t _write_to_socket_direct(iostream_t *stream,
+                                       const struct iovec *iov, int iovcnt) {
     ssize_t         n;
+    size_t          len = 0;
+    int             i;
 
-    if (stream->write_buf_size > 0) {
-        // If there is data in the buffer, we could not write to socket directly.
+    if (stream->write_queue_len > 0 || stream->corked) {
+        // If there is data queued or held back, we could not write to
+        // socket directly.
         return 0;
     }
 
-    n = write(stream->fd, data, len);
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    n = writev(stream->fd, iov, iovcnt);
     if (n < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             return 0;
@@ -541,7 +1110,7 @@ static ssize_t _write_to_socket_direct(iostream_t *stream, void *data, size_t le
 
     if (n == len) {
         // If we could write all the data once, call the callback function now.
-        ioloop_add_callback(stream->ioloop, _finish_write_callback, stream);
+        _schedule_write_finish(stream);
     }
 
     return n;
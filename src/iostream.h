@@ -7,9 +7,30 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#define MAX_WRITE_QUEUE 64
+
 struct _iostream;
 typedef struct _iostream iostream_t;
 
+/*
+ * A pending write. The data either lives in the write buffer of the
+ * stream (sbuf is NULL), or is a reference to a shared buffer.
+ */
+typedef struct _write_req {
+    shared_buffer_t *sbuf;
+    size_t          offset;
+    size_t          len;
+} write_req_t;
+
+/*
+ * Destroyed streams kept with their buffers for reuse, linked through
+ * user_data. The owner frees them with iostream_pool_destroy.
+ */
+typedef struct _iostream_pool {
+    iostream_t      *free;
+    size_t          size;
+} iostream_pool_t;
+
 typedef void (*read_handler)(iostream_t *stream, void *data, size_t len);
 typedef void (*write_handler)(iostream_t *stream);
 typedef void (*error_handler)(iostream_t *stream, unsigned int events);
@@ -29,36 +50,79 @@ struct _iostream {
     int         read_type;
     size_t      read_bytes;
     char        *read_delimiter;
+    // Set while a read callback runs on data still in the read buffer
+    int         in_read_callback;
+    int         read_paused;
+    // Set while a callback delivering read data is pending in the ioloop
+    int         read_scheduled;
 
     unsigned int    events;
 
     buffer_t    *read_buf;
     size_t      read_buf_size;
     size_t      read_buf_cap;
+    size_t      read_buf_max;
     buffer_t    *write_buf;
     size_t      write_buf_size;
     size_t      write_buf_cap;
+    size_t      write_buf_max;
+    // Max bytes ever held in the write buffer, reset by the user
+    size_t      write_buf_peak;
+
+    write_req_t write_queue[MAX_WRITE_QUEUE];
+    int         write_queue_head;
+    int         write_queue_len;
 
     int         write_state;
+    // Written data is held back until uncorked
+    int         corked;
     int         sendfile_fd;
     off_t       sendfile_offset;
     size_t      sendfile_len;
 
+    // TCP_NOTSENT_LOWAT value of the socket, 0 means the system default
+    size_t      notsent_lowat;
+
+    // The write is complete and its callback is yet to run
+    int         finish_pending;
+    // See iostream_hold_finish
+    int         hold_finish;
+
+    // Where the stream goes once destroyed, NULL to free it
+    iostream_pool_t *pool;
+
     void        *user_data;
 };
 
 iostream_t  *iostream_create(ioloop_t *loop, int sockfd,
                              size_t read_buf_size, size_t write_buf_size,
                              void *user_data);
+iostream_t  *iostream_create_pooled(iostream_pool_t *pool, ioloop_t *loop,
+                                    int sockfd, size_t read_buf_size,
+                                    size_t write_buf_size, void *user_data);
+void         iostream_pool_destroy(iostream_pool_t *pool);
 
 int     iostream_close(iostream_t *stream);
 int     iostream_destroy(iostream_t *stream);
 int     iostream_read_bytes(iostream_t *stream, size_t sz, read_handler callback, read_handler stream_callback);
 int     iostream_read_until(iostream_t *stream, char *delimiter, read_handler callback);
 int     iostream_write(iostream_t *stream, void *data, size_t len, write_handler callback);
+int     iostream_writev(iostream_t *stream, const struct iovec *iov, int iovcnt,
+                        write_handler callback);
+int     iostream_write_shared(iostream_t *stream, shared_buffer_t *sbuf, write_handler callback);
 int     iostream_sendfile(iostream_t *stream, int in_fd,
                           size_t offset, size_t len,
                           write_handler callback);
+int     iostream_pause_read(iostream_t *stream);
+int     iostream_resume_read(iostream_t *stream);
+int     iostream_locate(iostream_t *stream, char *delimiter);
+int     iostream_cork(iostream_t *stream);
+int     iostream_uncork(iostream_t *stream, write_handler callback);
+int     iostream_hold_finish(iostream_t *stream, int hold);
+int     iostream_finish_write(iostream_t *stream);
+int     iostream_set_buffer_limits(iostream_t *stream,
+                                   size_t read_buf_max, size_t write_buf_max);
+int     iostream_set_notsent_lowat(iostream_t *stream, size_t lowat);
 int     iostream_set_error_handler(iostream_t *stream, error_handler callback);
 int     iostream_set_close_handler(iostream_t *stream, close_handler callback);
 
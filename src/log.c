@@ -27,6 +27,9 @@ int configure_log(int lvl, const char* file, int use_console) {
             error("Error opening log file");
             res = 1;
         } else {
+            // Nothing is left buffered to be written again by a forked
+            // process
+            setvbuf(stream, NULL, _IOLBF, 0);
             log_stream = stream;
         }
     }
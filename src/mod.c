@@ -1,12 +1,14 @@
 #include "mod.h"
 #include "mod_static.h"
+#include "mod_stats.h"
 #include "http.h"
 #include "log.h"
 #include <string.h>
 #include <stdio.h>
 
 static module_t *modules[] = {
-    &mod_static
+    &mod_static,
+    &mod_stats
 };
 
 static int modules_inited = 0;
@@ -7,8 +7,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
+#include <search.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
@@ -22,6 +25,13 @@ typedef struct _mime_type {
     char *exts[FILE_TYPE_COUNT];
 } mime_type_t;
 
+// The file being sent, kept across the steps of static_file_send
+typedef struct _static_file {
+    int     fd;
+    size_t  offset;
+    size_t  size;
+} static_file_t;
+
 mime_type_t standard_types[] = {
     {"text/html",                {"html", "htm", "shtml", NULL}},
     {"text/css",                 {"css", NULL}},
@@ -50,20 +60,17 @@ static int show_hidden_file = 0;
 static void *mod_static_conf_create(json_value *conf_value);
 static void  mod_static_conf_destroy(void *conf);
 
-static int static_file_write_content(request_t *req,
-                                     response_t *resp,
-                                     handler_ctx_t *ctx);
-static int static_file_cleanup(request_t *req,
-                               response_t *resp,
-                               handler_ctx_t *ctx);
+static int static_file_send(request_t *req,
+                            response_t *resp,
+                            handler_ctx_t *ctx);
 
 static int static_file_handle_error(response_t *resp, int fd);
-static void handle_content_type(response_t *resp, const char *filepath);
+static void handle_content_type(response_t *resp, str_t filepath);
 static int handle_cache(request_t *req, response_t *resp,
                         const struct stat *st, const mod_static_conf_t *conf);
 static int handle_range(request_t *req, response_t *resp,
                         size_t *offset, size_t *size);
-static char* generate_etag(const struct stat *st);
+static char* generate_etag(response_t *resp, const struct stat *st);
 static int try_open_file(const char *path, int *fd, struct stat *st);
 static int static_file_listdir(response_t *resp, const char *path,
                                const char *realpath);
@@ -124,6 +131,7 @@ static void *mod_static_conf_create(json_value *conf_value) {
     ON_INTEGER_CONF("expires", conf->expire_hours)
     ON_BOOLEAN_CONF("etag", conf->enable_etag)
     ON_BOOLEAN_CONF("range_request", conf->enable_range_req)
+    ON_INTEGER_CONF("notsent_lowat", conf->notsent_lowat)
     END_CONF_HANDLE()
     return conf;
 }
@@ -187,8 +195,7 @@ static int static_file_listdir(response_t *resp, const char *path,
         return static_file_handle_error(resp, -1);
     }
     resp->status = STATUS_OK;
-    resp->connection = CONN_CLOSE;
-    response_set_header(resp, "Content-Type", "text/html; charset=UTF-8");
+    response_set_header_id(resp, HTTP_HEADER_CONTENT_TYPE, "text/html; charset=UTF-8");
     response_send_headers(resp, NULL);
     pos += snprintf(buf, 2048, listdir_header, path, path);
     for (i = 0; i < ent_len; i++) {
@@ -229,24 +236,32 @@ int static_file_handle(request_t *req, response_t *resp,
     int               fd = -1, res, use_301;
     struct stat       st;
     size_t            len, pathlen, filesize, fileoffset;
-    ctx_state_t       val;
+    str_t             file;
+    static_file_t     *sending;
 
     conf = (mod_static_conf_t*) ctx->conf;
     len = strlen(conf->root);
-    strncpy(path, conf->root, 2048);
-    if (path[len - 1] == '/') {
-        path[len - 1] = '\0';
+    if (len > 0 && conf->root[len - 1] == '/') {
+        len--;
     }
     if (req->path[0] != '/') {
         return response_send_status(resp, STATUS_BAD_REQUEST);
     }
-    strncat(path, req->path, 2048 - len);
+    // The path is normalized, it stays under the root. Leave room for
+    // the '/' added to a directory.
+    if (len + req->path_len + 1 >= sizeof(path)) {
+        return response_send_status(resp, STATUS_NOT_FOUND);
+    }
+    memcpy(path, conf->root, len);
+    memcpy(path + len, req->path, req->path_len + 1);
     debug("Request path: %s, real file path: %s", req->path, path);
+    file.ptr = path;
+    file.len = len + req->path_len;
     res = try_open_file(path, &fd, &st);
     if (res < 0) {
         return static_file_handle_error(resp, fd);
     } else if (res > 0) { // Is a directory, try index files.
-        pathlen = strlen(path);
+        pathlen = len + req->path_len;
         use_301 = 0;
         if (path[pathlen - 1] != '/') {
             path[pathlen] = '/';
@@ -261,14 +276,15 @@ int static_file_handle(request_t *req, response_t *resp,
         //}
         path[pathlen] = '\0';
         strncat(path, conf->index, 2048 - pathlen);
+        file.len = strlen(path);
         res = try_open_file(path, &fd, &st);
-        path[pathlen] = '\0';
         if (res != 0) {
+            path[pathlen] = '\0';
             if (conf->enable_list_dir) {
                 if (use_301) {
                     // TODO Support HTTPS
                     snprintf(path, 2048, "http://%s%s/", req->host, req->path);
-                    response_set_header(resp, "Location", path);
+                    response_set_header_id(resp, HTTP_HEADER_LOCATION, path);
                     resp->status = STATUS_MOVED;
                     resp->content_length = 0;
                     response_send_headers(resp, NULL);
@@ -294,20 +310,20 @@ int static_file_handle(request_t *req, response_t *resp,
     }
 
     resp->content_length = filesize;
-    handle_content_type(resp, path);
+    handle_content_type(resp, file);
     if (handle_cache(req, resp, &st, conf)) {
         return response_send_status(resp, STATUS_NOT_MODIFIED);
     }
     
-    val.as_int = fd;
-    context_push(ctx, val);
-    val.as_long = fileoffset;
-    context_push(ctx, val);
-    val.as_long = filesize;
-    context_push(ctx, val);
-    debug("sending headers");
-    response_send_headers(resp, static_file_write_content);
-    return HANDLER_UNFISHED;
+    sending = (static_file_t*) coro_locals(ctx, resp, sizeof(static_file_t));
+    if (sending == NULL) {
+        close(fd);
+        return response_send_status(resp, STATUS_INTERNAL_ERROR);
+    }
+    sending->fd = fd;
+    sending->offset = fileoffset;
+    sending->size = filesize;
+    return static_file_send(req, resp, ctx);
 }
 
 /*
@@ -323,7 +339,7 @@ static int handle_range(request_t *req, response_t *resp,
     size_t       len, total_size = *size, off, sz, end;
     int          idx;
 
-    range_spec = request_get_header(req, "range");
+    range_spec = request_get_header_id(req, HTTP_HEADER_RANGE);
     if (range_spec == NULL) {
         return -1;
     }
@@ -375,27 +391,26 @@ static int handle_range(request_t *req, response_t *resp,
     return 0;
 }
 
-static void handle_content_type(response_t *resp, const char *filepath) {
-    char  *content_type = NULL, ext[20];
-    int   dot_pos = -1;
-    int   i;
-    size_t  len = strlen(filepath);
+static void handle_content_type(response_t *resp, str_t filepath) {
+    char    *content_type = NULL, ext[20];
+    const char *dot;
+    size_t  ext_len, i;
     ENTRY   item, *ret;
 
-    for (i = len - 1; i > 0; i--) {
-        if (filepath[i] == '.') {
-            dot_pos = i;
-            break;
-        }
-    }
-
-    if (dot_pos < 0) {
+    dot = memrchr(filepath.ptr, '.', filepath.len);
+    if (dot == NULL || memchr(dot, '/', filepath.ptr + filepath.len - dot) != NULL) {
         // No '.' found in the file name (no extension part)
         return;
     }
 
-    strncpy(ext, filepath + 1 + dot_pos, 20);
-    strlowercase(ext, ext, 20);
+    ext_len = filepath.ptr + filepath.len - dot - 1;
+    if (ext_len >= sizeof(ext)) {
+        return;
+    }
+    for (i = 0; i < ext_len; i++) {
+        ext[i] = tolower(dot[1 + i]);
+    }
+    ext[ext_len] = '\0';
     debug("File extension: %s", ext);
     
     item.key = ext;
@@ -405,7 +420,7 @@ static void handle_content_type(response_t *resp, const char *filepath) {
     content_type = (char*) ret->data;
     if (content_type != NULL) {
         debug("Content type: %s", content_type);
-        response_set_header(resp, "Content-Type", content_type); 
+        response_set_header_id(resp, HTTP_HEADER_CONTENT_TYPE, content_type); 
     }
 }
 
@@ -419,8 +434,9 @@ static int handle_cache(request_t *req, response_t *resp,
     char   *cache_control;
 
     mtime = st->st_mtime;
-    if_mod_since = request_get_header(req, "if-modified-since");
-    if (if_mod_since != NULL &&
+    if_mod_since = request_get_header_id(req, HTTP_HEADER_IF_MODIFIED_SINCE);
+    if_none_match = request_get_header_id(req, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_mod_since != NULL && if_none_match == NULL &&
         parse_http_date(if_mod_since, &req_mtime) == 0 &&
         req_mtime == mtime) {
         debug("Resource not modified");
@@ -428,62 +444,82 @@ static int handle_cache(request_t *req, response_t *resp,
     }
     buf = response_alloc(resp, 32);
     format_http_date(&mtime, buf, 32);
-    response_set_header(resp, "Last-Modified", buf);
+    response_set_header_id(resp, HTTP_HEADER_LAST_MODIFIED, buf);
 
     if (conf->enable_etag) {
-        etag = generate_etag(st);
-        if (not_modified) {
-            if_none_match = request_get_header(req, "if-none-match");
-            if (if_none_match == NULL ||
-                strcmp(etag, if_none_match) != 0) {
-                not_modified = 0;
-            }
+        etag = generate_etag(resp, st);
+        // If-None-Match is used instead of the date when both are sent,
+        // the tag may have been made weak by a filter, see filter_gzip.c
+        if (if_none_match != NULL && etag != NULL
+            && etag_matches(if_none_match, etag)) {
+            debug("Resource not modified");
+            not_modified = 1;
+        }
+        if (etag != NULL) {
+            response_set_header_id(resp, HTTP_HEADER_ETAG, etag);
         }
-        response_set_header(resp, "ETag", etag);
     }
 
     if (conf->expire_hours >= 0) {
         buf = response_alloc(resp, 32);
         mtime += conf->expire_hours * 3600;
         format_http_date(&mtime, buf, 32);
-        response_set_header(resp, "Expires", buf);
+        response_set_header_id(resp, HTTP_HEADER_EXPIRES, buf);
         cache_control = response_alloc(resp, 20);
         snprintf(cache_control, 20, "max-age=%d", conf->expire_hours * 3600);
     } else {
         cache_control = "no-cache";
     }
-    response_set_header(resp, "Cache-Control", cache_control);
+    response_set_header_id(resp, HTTP_HEADER_CACHE_CONTROL, cache_control);
     return not_modified;
 }
 
-static char* generate_etag(const struct stat *st) {
-    char tag_buf[128];
+static char* generate_etag(response_t *resp, const struct stat *st) {
+    char tag_buf[128], *hash, *etag;
+    size_t len;
+
     snprintf(tag_buf, 128, "etag-%ld-%zu", st->st_mtime, st->st_size);
-    return crypt(tag_buf, "$1$breeze") + 10; // Skip the $id$salt part
+    hash = crypt(tag_buf, "$1$breeze") + 10; // Skip the $id$salt part
+    len = strlen(hash);
+    etag = response_alloc(resp, len + 3);
+    if (etag == NULL) {
+        return NULL;
+    }
+    // An entity tag is a quoted string
+    etag[0] = '"';
+    memcpy(etag + 1, hash, len);
+    etag[len + 1] = '"';
+    etag[len + 2] = '\0';
+    return etag;
 }
 
-static int static_file_write_content(request_t *req, response_t *resp, handler_ctx_t *ctx) {
-    int fd;
-    size_t size, offset;
+/*
+ * Send the headers and then the file opened by static_file_handle.
+ */
+static int static_file_send(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    mod_static_conf_t *conf;
+    static_file_t     *file;
+
+    conf = (mod_static_conf_t*) ctx->conf;
+    file = (static_file_t*) coro_locals(ctx, resp, sizeof(static_file_t));
 
-    size = context_pop(ctx)->as_long;
-    offset = context_pop(ctx)->as_long;
-    fd = context_peek(ctx)->as_int;
-    debug("writing file");
-    if (response_send_file(resp, fd, offset, size, static_file_cleanup) < 0) {
+    CORO_BEGIN(ctx, static_file_send);
+    debug("sending headers");
+    CORO_AWAIT(ctx, response_send_headers(resp, coro_resume));
+    if (!CORO_FAILED(ctx)) {
+        if (conf->notsent_lowat > 0 && resp->_conn->family != AF_UNIX) {
+            iostream_set_notsent_lowat(resp->_conn->stream, conf->notsent_lowat);
+        }
+        debug("writing file");
+        CORO_AWAIT(ctx, response_send_file(resp, file->fd, file->offset,
+                                           file->size, coro_resume));
+    }
+    if (CORO_FAILED(ctx)) {
         error("Error sending file");
-        return response_send_status(resp, STATUS_NOT_FOUND);
     }
-    return HANDLER_UNFISHED;
-}
-
-static int static_file_cleanup(request_t *req, response_t *resp, handler_ctx_t *ctx) {
-    int fd;
-
     debug("cleaning up");
-    fd = context_pop(ctx)->as_int;
-    close(fd);
-    return HANDLER_DONE;
+    close(file->fd);
+    CORO_END(ctx);
 }
 
 static int static_file_handle_error(response_t *resp, int fd) {
@@ -15,6 +15,10 @@ typedef struct _mod_static_conf {
     // -1 means not set expires header; other means
     // the expiration time (in hours)
     int  expire_hours;
+
+    // Stream files with TCP_NOTSENT_LOWAT set to this many bytes,
+    // 0 means pushing as much as the kernel accepts.
+    int  notsent_lowat;
 } mod_static_conf_t;
 
 extern module_t mod_static;
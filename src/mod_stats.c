@@ -0,0 +1,72 @@
+#include "mod.h"
+#include "mod_stats.h"
+#include "common.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATS_BUFFER_SIZE 1024
+
+static void *mod_stats_conf_create(json_value *conf_value);
+static void  mod_stats_conf_destroy(void *conf);
+
+/* Module descriptor */
+module_t mod_stats = {
+    "stats",
+    NULL,
+    mod_stats_conf_create,
+    mod_stats_conf_destroy,
+    stats_handle
+};
+
+static void *mod_stats_conf_create(json_value *conf_value) {
+    // Nothing to configure yet
+    return NULL;
+}
+
+static void mod_stats_conf_destroy(void *conf) {
+}
+
+/*
+ * Report the server counters and the learned buffer sizes as plain
+ * text, one "name: value" pair per line.
+ */
+int stats_handle(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    server_t        *server = resp->_conn->server;
+    server_stats_t  *stats = &server->stats;
+    char            *buf;
+    int             len;
+
+    buf = response_alloc(resp, STATS_BUFFER_SIZE);
+    if (buf == NULL) {
+        return response_send_status(resp, STATUS_INTERNAL_ERROR);
+    }
+    len = snprintf(buf, STATS_BUFFER_SIZE,
+                   "Accepted connections: %lu\n"
+                   "Active connections: %lu\n"
+                   "Shed connections: %lu\n"
+                   "Accept pauses: %lu\n"
+                   "Header size p%d: %zu\n"
+                   "Response burst size p%d: %zu\n"
+                   "Read buffer size: %zu\n"
+                   "Write buffer size: %zu\n",
+                   stats->conn_accepted,
+                   stats->conn_active,
+                   stats->conn_shed,
+                   stats->accept_pauses,
+                   server->buffer_percentile,
+                   size_hist_percentile(&stats->header_sizes, server->buffer_percentile),
+                   server->buffer_percentile,
+                   size_hist_percentile(&stats->burst_sizes, server->buffer_percentile),
+                   stats->read_buf_size,
+                   stats->write_buf_size);
+
+    resp->status = STATUS_OK;
+    resp->content_length = len;
+    response_set_header_id(resp, HTTP_HEADER_CONTENT_TYPE, "text/plain");
+    response_set_header_id(resp, HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    response_send_headers(resp, NULL);
+    response_write(resp, buf, len, NULL);
+    return HANDLER_DONE;
+}
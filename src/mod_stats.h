@@ -0,0 +1,11 @@
+#ifndef __MOD_STATS_H_
+#define __MOD_STATS_H_
+
+#include "http.h"
+#include "mod.h"
+
+extern module_t mod_stats;
+
+int stats_handle(request_t *req, response_t *resp, handler_ctx_t *ctx);
+
+#endif /* __MOD_STATS_H_ */
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "mod.h"
+#include "filter.h"
 #include "site.h"
 #include "json.h"
 #include "log.h"
@@ -9,8 +10,13 @@
 #include <assert.h>
 
 static site_t     *find_site(site_conf_t *conf, char *host);
-static location_t *find_location(site_t *site, const char *path);
+static location_t *find_location(site_t *site, str_t path);
 static int         parse_locations(site_t *site, json_value *location_objs);
+static early_hints_t *parse_early_hints(json_value *hint_objs);
+static location_t  *add_location(site_t *site, int type,
+                                 char *prefix_or_regex,
+                                 handler_func handler,
+                                 void *handler_conf);
 
 site_conf_t *site_conf_create() {
     site_conf_t  *conf;
@@ -157,6 +163,10 @@ int parse_locations(site_t *site, json_value *location_objs) {
     int        type = URI_PREFIX;
     json_value *val, *inner_val;
     module_t   *mod;
+    location_t *loc;
+    early_hints_t *hints = NULL;
+    filter_chain_t *filters = NULL;
+    int        internal = 0;
     
     for (i = 0; i < location_objs->u.array.length; i++) {
         val = location_objs->u.array.values[i];
@@ -176,21 +186,68 @@ int parse_locations(site_t *site, json_value *location_objs) {
                     type = URI_REGEX;
                     do {path++;} while (*path == ' ' || *path == '\t');
                 }
+            } else if (strcmp("early_hints", name) == 0) {
+                hints = parse_early_hints(inner_val);
+                if (hints == NULL) {
+                    goto ERROR;
+                }
+            } else if (strcmp("internal", name) == 0 && inner_val->type == json_boolean) {
+                internal = inner_val->u.boolean;
+            } else if (strcmp("filters", name) == 0) {
+                filters = filter_chain_parse(inner_val, val);
+                if (filters == NULL) {
+                    goto ERROR;
+                }
             }
         }
         
         mod = find_module(mod_name);
         if (mod == NULL) {
             error("Unknown mod: %s", mod_name);
-            return -1;
+            goto ERROR;
         }
         handler_conf = mod->create(val);
-        if (site_add_location(site, type, path, mod->handler, handler_conf) != 0) {
+        loc = add_location(site, type, path, mod->handler, handler_conf);
+        if (loc == NULL) {
             error("Error adding location %s to site", path);
-            return -1;
+            goto ERROR;
         }
+        loc->early_hints = hints;
+        loc->filters = filters;
+        loc->internal = internal;
+        hints = NULL;
+        filters = NULL;
+        internal = 0;
     }
     return 0;
+
+    ERROR:
+    early_hints_destroy(hints);
+    filter_chain_destroy(filters);
+    return -1;
+}
+
+/*
+ * The hints are the values of the Link headers to send, e.g.
+ * "</app.css>; rel=preload; as=style".
+ */
+static early_hints_t *parse_early_hints(json_value *hint_objs) {
+    const char      *links[MAX_HEADER_SIZE];
+    unsigned int    i;
+
+    if (hint_objs->type != json_array || hint_objs->u.array.length == 0
+        || hint_objs->u.array.length > MAX_HEADER_SIZE) {
+        error("'early_hints' must be an array of 1 to %d strings", MAX_HEADER_SIZE);
+        return NULL;
+    }
+    for (i = 0; i < hint_objs->u.array.length; i++) {
+        if (hint_objs->u.array.values[i]->type != json_string) {
+            error("The elements of 'early_hints' must be strings");
+            return NULL;
+        }
+        links[i] = hint_objs->u.array.values[i]->u.string.ptr;
+    }
+    return early_hints_create(links, hint_objs->u.array.length);
 }
 
 int site_destroy(site_t *site) {
@@ -199,6 +256,8 @@ int site_destroy(site_t *site) {
     while (loc != NULL) {
         prev = loc;
         loc = loc->next;
+        early_hints_destroy(prev->early_hints);
+        filter_chain_destroy(prev->filters);
         free(prev);
     }
     free(site);
@@ -209,18 +268,28 @@ int site_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
     site_conf_t *conf;
     site_t      *site;
     location_t  *loc;
+    str_t       path;
 
     conf = (site_conf_t*) ctx->conf;
     site = find_site(conf, req->host);
     if (site == NULL) {
         goto NOT_FOUND;
     }
-    loc = find_location(site, req->path);
-    if (loc == NULL) {
+    path.ptr = req->path;
+    path.len = req->path_len;
+    loc = find_location(site, path);
+    if (loc == NULL || (loc->internal && req->internal_redirects == 0)) {
         goto NOT_FOUND;
     }
 
+    // The client can fetch these while the handler opens the file
+    if (loc->early_hints != NULL && strcmp(req->method, "GET") == 0
+        && response_send_early_hints(resp, loc->early_hints) < 0) {
+        return HANDLER_DONE;
+    }
+
     ctx->conf = loc->handler_conf;
+    resp->filter_chain = loc->filters;
     return loc->handler(req, resp, ctx);
 
     NOT_FOUND:
@@ -231,6 +300,14 @@ int site_add_location(site_t *site, int type,
                       char *prefix_or_regex,
                       handler_func handler,
                       void *handler_conf) {
+    return add_location(site, type, prefix_or_regex,
+                        handler, handler_conf) != NULL ? 0 : -1;
+}
+
+static location_t *add_location(site_t *site, int type,
+                                char *prefix_or_regex,
+                                handler_func handler,
+                                void *handler_conf) {
     location_t  *loc = NULL, *pos;
     regex_t     *reg;
     void        *mem;
@@ -241,19 +318,20 @@ int site_add_location(site_t *site, int type,
 
     if (len == 0) {
         error("Empty prefix/regex");
-        return -1;
+        return NULL;
     }
     if (type == URI_PREFIX) {
         if (prefix_or_regex[0] != '/') {
             error("URI Prefix must starts with /");
-            return -1;
+            return NULL;
         }
         loc = (location_t*) calloc(1, sizeof(location_t));
         if (loc == NULL) {
             error("Error allocating memory for new location");
-            return -1;
+            return NULL;
         }
-        loc->uri.prefix = prefix_or_regex;        
+        loc->uri.prefix = prefix_or_regex;
+        loc->prefix_len = len;
     } else if (type == URI_REGEX) {
         mem = calloc(1, sizeof(location_t) + sizeof(regex_t));
         if (mem != NULL) {
@@ -262,17 +340,17 @@ int site_add_location(site_t *site, int type,
             reg = (regex_t*) mem;
         } else {
             error("Error allocating memory for new location");
-            return -1;
+            return NULL;
         }
         if (regcomp(reg, prefix_or_regex, REG_EXTENDED | REG_NOSUB) != 0) {
             error("Invalid regex: %s", prefix_or_regex);
             free(loc);
-            return -1;
+            return NULL;
         }
         loc->uri.regex = reg;
     } else {
         error("Unknown location type: %d", type);
-        return -1;
+        return NULL;
     }
     
     loc->match_type = type;
@@ -285,7 +363,7 @@ int site_add_location(site_t *site, int type,
             break;
         } else if (type == URI_PREFIX
                    && pos->next->match_type == URI_PREFIX
-                   && len > strlen(pos->next->uri.prefix)) {
+                   && len > pos->next->prefix_len) {
             break;
         }
         pos = pos->next;
@@ -293,7 +371,7 @@ int site_add_location(site_t *site, int type,
     
     loc->next = pos->next;
     pos->next = loc;
-    return 0;
+    return loc;
 }
 
 
@@ -314,17 +392,25 @@ static site_t *find_site(site_conf_t *conf, char *host) {
     }
 }
 
-static location_t *find_location(site_t *site, const char *path) {
+/*
+ * The path is the one of the request, it is NUL-terminated too as
+ * regexec needs it.
+ */
+static location_t *find_location(site_t *site, str_t path) {
     location_t *loc = site->location_head->next;
+    str_t      prefix;
 
     while (loc != NULL) {
         switch (loc->match_type) {
         case URI_REGEX:
-            if (regexec(loc->uri.regex, path, 0, NULL, 0) == 0)
+            if (regexec(loc->uri.regex, path.ptr, 0, NULL, 0) == 0)
                 return loc;
+            break;
 
         case URI_PREFIX:
-            if (path_starts_with(loc->uri.prefix, path) > 0)
+            prefix.ptr = loc->uri.prefix;
+            prefix.len = loc->prefix_len;
+            if (path_starts_with_str(prefix, path) > 0)
                 return loc;
         }
 
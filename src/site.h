@@ -21,9 +21,16 @@ struct _location {
         char     *prefix;
         regex_t  *regex;
     } uri;
+    size_t              prefix_len;
     int                 match_type;
     handler_func        handler;
     void                *handler_conf;
+    // Sent before the handler runs for a GET, NULL if there is none
+    early_hints_t       *early_hints;
+    // The output filters of the responses, NULL if there is none
+    filter_chain_t      *filters;
+    // Only reached through an internal redirect, not by the client
+    int                 internal;
     struct _location    *next;
 };
 
@@ -0,0 +1,233 @@
+/*
+ * Compare the request header parser with the byte-at-a-time state
+ * machine it replaced, on a browser style and an API style request.
+ *
+ * Build it optimized from a clean tree:
+ *     make clean && make CFLAGS="-O2 -Wall -I. -I./json" bench_http
+ */
+#include "http.h"
+#include "common.h"
+#include "log.h"
+#include <assert.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS  1000000
+
+static char *browser_request =
+    "GET /wp-content/uploads/2010/03/hello-kitty-darth-vader-pink.jpg HTTP/1.1\r\n"
+    "Host: www.kittyhell.com\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10.6; ja-JP-mac; rv:1.9.2.3) Gecko/20100401 Firefox/3.6.3 Pathtraq/0.9\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: ja,en-us;q=0.7,en;q=0.3\r\n"
+    "Accept-Encoding: gzip,deflate\r\n"
+    "Accept-Charset: Shift_JIS,utf-8;q=0.7,*;q=0.7\r\n"
+    "Keep-Alive: 115\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: wp_ozh_wsa_visits=2; wp_ozh_wsa_visit_lasttime=xxxxxxxxxx; __utma=xxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.x; __utmz=xxxxxxxxx.xxxxxxxxxx.x.x.utmccn=(referral)|utmcsr=reader.livedoor.com|utmcct=/reader/|utmcmd=referral\r\n"
+    "\r\n";
+
+static char *api_request =
+    "POST /api/v1/items?limit=20 HTTP/1.1\r\n"
+    "Host: api.example.com\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 42\r\n"
+    "\r\n";
+
+/*
+ * The replaced parser, it copies the tokens byte by byte into a fixed
+ * buffer and looks the headers up the same way.
+ */
+typedef struct _legacy_request {
+    char                *method;
+    char                *path;
+    char                *query_str;
+    http_header_t       headers[MAX_HEADER_SIZE];
+    size_t              header_count;
+    struct hsearch_data header_hash;
+    char                buffer[REQUEST_BUFFER_SIZE];
+    int                 buf_idx;
+} legacy_request_t;
+
+static struct hsearch_data legacy_std_hash;
+
+static char *legacy_std_headers[] = {
+    "accept", "accept-charset", "accept-encoding", "accept-language",
+    "connection", "content-length", "content-type", "cookie", "host",
+    "keep-alive", "user-agent",
+};
+
+enum {
+    L_BAD = -1, L_COMPLETE = 0, L_METHOD, L_PATH, L_QUERY, L_VERSION,
+    L_NAME, L_COLON, L_VALUE, L_CR, L_LF, L_END_CR
+};
+
+static void legacy_handle_header(legacy_request_t *req, http_header_t *header) {
+    ENTRY   ent, *ret;
+    char    lower[64];
+
+    strlowercase(header->name, lower, 64);
+    ent.key = lower;
+    if (hsearch_r(ent, FIND, &ret, &legacy_std_hash) == 0) {
+        return;
+    }
+    ent.key = ret->key;
+    ent.data = header;
+    hsearch_r(ent, ENTER, &ret, &req->header_hash);
+}
+
+static int legacy_parse(legacy_request_t *req, const char *data, size_t len) {
+    size_t  i;
+    char    ch, *tok = req->buffer;
+    int     state = L_METHOD;
+
+#define FILL(c)     (req->buffer[req->buf_idx++] = (c))
+#define FINISH()    (req->buffer[req->buf_idx++] = '\0')
+#define START()     (tok = req->buffer + req->buf_idx)
+#define EXPECT(c, expected, next) state = (c) == (expected) ? (next) : L_BAD
+
+    req->buf_idx = 0;
+    req->header_count = 0;
+    for (i = 0; i < len && state > L_COMPLETE;) {
+        if (req->buf_idx >= REQUEST_BUFFER_SIZE - 1
+            || req->header_count >= MAX_HEADER_SIZE) {
+            return L_BAD;
+        }
+        ch = data[i++];
+        switch (state) {
+            case L_METHOD:
+                if (ch == ' ') {
+                    FINISH(); req->method = tok; START(); state = L_PATH;
+                } else if (ch < 'A' || ch > 'Z') {
+                    state = L_BAD;
+                } else {
+                    FILL(ch);
+                }
+                break;
+            case L_PATH:
+                if (ch == '?' || ch == ' ') {
+                    FINISH(); req->path = tok; START();
+                    state = ch == '?' ? L_QUERY : L_VERSION;
+                } else {
+                    FILL(ch);
+                }
+                break;
+            case L_QUERY:
+                if (ch == ' ') {
+                    FINISH(); req->query_str = tok; START(); state = L_VERSION;
+                } else {
+                    FILL(ch);
+                }
+                break;
+            case L_VERSION:
+                if (ch == '/') {
+                    FINISH(); START();
+                } else if (ch == '\r') {
+                    FINISH(); START(); state = L_CR;
+                } else {
+                    FILL(ch);
+                }
+                break;
+            case L_NAME:
+                if (ch == ':') {
+                    FINISH(); req->headers[req->header_count].name = tok;
+                    START(); state = L_COLON;
+                } else {
+                    FILL(ch);
+                }
+                break;
+            case L_COLON:
+                EXPECT(ch, ' ', L_VALUE);
+                break;
+            case L_VALUE:
+                if (ch == '\r') {
+                    FINISH(); req->headers[req->header_count].value = tok;
+                    legacy_handle_header(req, req->headers + req->header_count);
+                    req->header_count++;
+                    START(); state = L_CR;
+                } else {
+                    FILL(ch);
+                }
+                break;
+            case L_CR:
+                EXPECT(ch, '\n', L_LF);
+                break;
+            case L_LF:
+                if (ch == '\r') {
+                    state = L_END_CR;
+                } else {
+                    FILL(ch); state = L_NAME;
+                }
+                break;
+            case L_END_CR:
+                EXPECT(ch, '\n', L_COMPLETE);
+                break;
+        }
+    }
+    return state;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_legacy(const char *name, const char *data) {
+    legacy_request_t    *req;
+    size_t              len = strlen(data);
+    int                 i;
+    double              start;
+
+    req = (legacy_request_t*) calloc(1, sizeof(legacy_request_t));
+    assert(hcreate_r(MAX_HEADER_SIZE, &req->header_hash) != 0);
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        assert(legacy_parse(req, data, len) == L_COMPLETE);
+    }
+    printf("%-8s legacy: %7.1f ns/request\n", name, (now() - start) * 1e9 / ROUNDS);
+    hdestroy_r(&req->header_hash);
+    free(req);
+}
+
+static void bench_current(const char *name, const char *data) {
+    request_t   *req;
+    size_t      len = strlen(data), consumed;
+    int         i;
+    double      start;
+
+    req = request_create(NULL);
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        // Start over, keeping the header block like request_reset does
+        req->_block_len = 0;
+        req->_parse_pos = 0;
+        req->_parse_state = 0;
+        req->header_count = 0;
+        memset(req->_header_slots, 0, sizeof(req->_header_slots));
+        assert(request_parse_headers(req, data, len, &consumed) == STATUS_COMPLETE);
+    }
+    printf("%-8s simd:   %7.1f ns/request\n", name, (now() - start) * 1e9 / ROUNDS);
+    request_destroy(req);
+}
+
+int main(int argc, const char *argv[]) {
+    ENTRY   item, *ret;
+    size_t  i;
+
+    assert(hcreate_r(64, &legacy_std_hash) != 0);
+    for (i = 0; i < sizeof(legacy_std_headers) / sizeof(char*); i++) {
+        item.key = legacy_std_headers[i];
+        item.data = NULL;
+        hsearch_r(item, ENTER, &ret, &legacy_std_hash);
+    }
+
+    bench_legacy("browser", browser_request);
+    bench_current("browser", browser_request);
+    bench_legacy("api", api_request);
+    bench_current("api", api_request);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "arena.h"
+#include <string.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+static char *printf_arena(arena_t *arena, const char *fmt, ...) {
+    va_list ap;
+    char    *res;
+
+    va_start(ap, fmt);
+    res = arena_vprintf(arena, fmt, ap);
+    va_end(ap);
+    return res;
+}
+
+void test_alloc() {
+    arena_t *arena = arena_create(64);
+    char    *a, *b;
+
+    assert(arena != NULL);
+    a = arena_alloc(arena, 10);
+    b = arena_alloc(arena, 10);
+    assert(a != NULL && b != NULL);
+    // Aligned, and not overlapping
+    assert(((size_t) a) % sizeof(void*) == 0);
+    assert(((size_t) b) % sizeof(void*) == 0);
+    assert(b >= a + 10);
+    assert(arena_used(arena) == 32);
+    arena_destroy(arena);
+}
+
+void test_grow() {
+    arena_t *arena = arena_create(64);
+    char    *p[10], *big;
+    int     i;
+
+    // Past the first chunk
+    for (i = 0; i < 10; i++) {
+        p[i] = arena_alloc(arena, 24);
+        assert(p[i] != NULL);
+        memset(p[i], 'a' + i, 24);
+    }
+    for (i = 0; i < 10; i++) {
+        assert(p[i][0] == 'a' + i && p[i][23] == 'a' + i);
+    }
+
+    // Larger than a chunk
+    big = arena_alloc(arena, 1000);
+    assert(big != NULL);
+    memset(big, 'x', 1000);
+    assert(p[9][23] == 'a' + 9);
+    arena_destroy(arena);
+}
+
+void test_reset() {
+    arena_t *arena = arena_create(64);
+    char    *first, *p;
+    int     i;
+
+    first = arena_alloc(arena, 8);
+    for (i = 0; i < 20; i++) {
+        assert(arena_alloc(arena, 32) != NULL);
+    }
+    assert(arena_alloc(arena, 500) != NULL);
+
+    // Memory is handed out again from the start
+    arena_reset(arena);
+    assert(arena_used(arena) == 0);
+    p = arena_alloc(arena, 8);
+    assert(p == first);
+
+    // The chunks allocated before are used again, the large one too
+    for (i = 0; i < 20; i++) {
+        assert(arena_alloc(arena, 32) != NULL);
+    }
+    assert(arena_alloc(arena, 500) != NULL);
+    arena_destroy(arena);
+}
+
+void test_strings() {
+    arena_t *arena = arena_create(16);
+    char    *s;
+    char    expected[200];
+
+    s = arena_strdup(arena, "hello");
+    assert(strcmp(s, "hello") == 0);
+
+    s = printf_arena(arena, "bytes %d-%d/%d", 0, 99, 1000);
+    assert(strcmp(s, "bytes 0-99/1000") == 0);
+
+    // Longer than a chunk
+    memset(expected, 'z', 199);
+    expected[199] = '\0';
+    s = printf_arena(arena, "%s", expected);
+    assert(strcmp(s, expected) == 0);
+    arena_destroy(arena);
+}
+
+int main(int argc, char *argv[]) {
+    test_alloc();
+    test_grow();
+    test_reset();
+    test_strings();
+    return 0;
+}
@@ -191,6 +191,92 @@ void test_locate() {
     assert(buffer_destroy(buf) == 0);
 }
 
+void test_resize() {
+    char        data[] = "1234567890";
+    char        result[12];
+    buffer_t    *buf = create_buffer(10);
+
+    // Make the content wrap around
+    assert(buffer_put(buf, data, 6) == 0);
+    assert(buffer_skip(buf, 6) == 6);
+    assert(buffer_put(buf, data, 10) == 0);
+    assert(buffer_is_full(buf));
+
+    assert(buffer_resize(buf, 5) == NULL);
+    buf = buffer_resize(buf, 20);
+    assert(buf != NULL);
+    assert(buffer_capacity(buf) == 20);
+    assert(!buffer_is_full(buf));
+    assert(buffer_put(buf, "ab", 2) == 0);
+    assert(buffer_get(buf, 12, result, 12) == 12);
+    assert_equals("1234567890ab", result, 12);
+    assert(buffer_is_empty(buf));
+    assert(buffer_destroy(buf) == 0);
+}
+
+void test_iovec() {
+    char         data[] = "12345678";
+    struct iovec iov[2];
+    buffer_t     *buf = create_buffer(10);
+
+    assert(buffer_put(buf, data, 6) == 0);
+    assert(buffer_iovec(buf, 0, 6, iov) == 1);
+    assert(iov[0].iov_len == 6);
+    assert_equals("123456", iov[0].iov_base, 6);
+    assert(buffer_iovec(buf, 2, 10, iov) == 1);
+    assert(iov[0].iov_len == 4);
+    assert_equals("3456", iov[0].iov_base, 4);
+
+    // Wrap around the end of the buffer
+    assert(buffer_skip(buf, 6) == 6);
+    assert(buffer_put(buf, data, 8) == 0);
+    assert(buffer_iovec(buf, 1, 7, iov) == 2);
+    assert(iov[0].iov_len == 3);
+    assert_equals("234", iov[0].iov_base, 3);
+    assert(iov[1].iov_len == 4);
+    assert_equals("5678", iov[1].iov_base, 4);
+    assert(buffer_iovec(buf, 8, 1, iov) == 0);
+    assert(buffer_destroy(buf) == 0);
+}
+
+void test_linearize() {
+    char         data[] = "12345678";
+    char         *p;
+    buffer_t     *buf = create_buffer(10);
+
+    assert(buffer_put(buf, data, 4) == 0);
+    p = buffer_linearize(buf);
+    assert_equals("1234", p, 4);
+
+    // Wrap around the end of the buffer
+    assert(buffer_skip(buf, 4) == 4);
+    assert(buffer_put(buf, data, 8) == 0);
+    p = buffer_linearize(buf);
+    assert(p != NULL);
+    assert_equals("12345678", p, 8);
+    assert(buffer_put(buf, "90", 2) == 0);
+    assert(buffer_is_full(buf));
+    assert_equals("1234567890", buffer_linearize(buf), 10);
+    assert(buffer_destroy(buf) == 0);
+}
+
+void test_shared_buffer() {
+    char            data[] = "shared";
+    shared_buffer_t *sbuf;
+
+    sbuf = shared_buffer_create(data, strlen(data));
+    assert(sbuf != NULL);
+    assert(shared_buffer_size(sbuf) == strlen(data));
+    assert_equals(data, (char*) shared_buffer_data(sbuf), strlen(data));
+    assert(shared_buffer_data(sbuf) != data);
+
+    assert(shared_buffer_ref(sbuf) == sbuf);
+    assert(shared_buffer_ref(sbuf) == sbuf);
+    assert(shared_buffer_unref(sbuf) == 0);
+    assert(shared_buffer_unref(sbuf) == 0);
+    assert(shared_buffer_unref(sbuf) == 1);
+}
+
 int main(int argc, char *argv[]) {
     test_basic_case();
     test_overflow();
@@ -201,5 +287,9 @@ int main(int argc, char *argv[]) {
     test_fill_overflow();
     test_consume();
     test_locate();
+    test_resize();
+    test_iovec();
+    test_linearize();
+    test_shared_buffer();
     return 0;
 }
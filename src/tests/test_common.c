@@ -30,6 +30,20 @@ void test_path_starts_with() {
     assert(path_starts_with("/bar/", "/bar/11") > 0);
 }
 
+void test_str_slices() {
+    str_t   path = {"/bar/11?x", 7};
+
+    assert(str_equals(STR("abc"), str_from_cstr("abc")));
+    assert(!str_equals(STR("abc"), STR("ab")));
+    assert(str_case_equals(STR("Content-Type"), STR("content-type")));
+    assert(!str_case_equals(STR("Content-Type"), STR("content-typ")));
+    // The slice ends before the '?'
+    assert(path_starts_with_str(STR("/bar"), path) == 4);
+    assert(path_starts_with_str(STR("/bar/11"), path) == 7);
+    assert(path_starts_with_str(STR("/bar/11?"), path) == 0);
+    assert(path_starts_with_str(STR("/ba"), path) == 0);
+}
+
 void test_url_decode() {
     char buf[20];
     url_decode(buf, "/foo%20bar");
@@ -40,10 +54,80 @@ void test_url_decode() {
     assert(strcmp("/中国人", buf) == 0);
 }
 
+static int normalize(const char *path, const char *expected) {
+    char    buf[256];
+    ssize_t len;
+
+    strcpy(buf, path);
+    len = url_normalize_path(buf, strlen(buf));
+    if (len < 0) {
+        return expected == NULL;
+    }
+    return expected != NULL && strcmp(buf, expected) == 0 && len == strlen(expected);
+}
+
+void test_url_normalize_path() {
+    assert(normalize("/", "/"));
+    assert(normalize("/index.html", "/index.html"));
+    assert(normalize("/static/css/site.min.css", "/static/css/site.min.css"));
+    assert(normalize("/.well-known/x", "/.well-known/x"));
+    assert(normalize("/foo%20bar", "/foo bar"));
+    assert(normalize("/a//b///c", "/a/b/c"));
+    assert(normalize("/a/./b/.", "/a/b/"));
+    assert(normalize("/a/b/../c", "/a/c"));
+    assert(normalize("/a/b/..", "/a/"));
+    assert(normalize("/a/..", "/"));
+    assert(normalize("/a/...", "/a/..."));
+    assert(normalize("/a/..b/c", "/a/..b/c"));
+    assert(normalize("/a%2Fb", "/a/b"));
+    assert(normalize("/100%", "/100%"));
+    assert(normalize("/%zz", "/%zz"));
+    // Long enough for the vector loop to find it
+    assert(normalize("/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa//b", "/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/b"));
+    assert(normalize("/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa%41", "/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaA"));
+
+    // Above the root, escaped or not
+    assert(normalize("/..", NULL));
+    assert(normalize("/../etc/passwd", NULL));
+    assert(normalize("/a/../../etc/passwd", NULL));
+    assert(normalize("/%2e%2e/etc/passwd", NULL));
+    assert(normalize("/a/%2E%2E%2f%2e./etc", NULL));
+    assert(normalize("/a%00b", NULL));
+    assert(normalize("a/b", NULL));
+    assert(normalize("", NULL));
+}
+
+void test_size_hist() {
+    size_hist_t hist;
+    int i;
+
+    bzero(&hist, sizeof(hist));
+    assert(size_hist_percentile(&hist, 90) == 0);
+
+    for (i = 0; i < 90; i++) {
+        size_hist_add(&hist, 100);
+    }
+    for (i = 0; i < 10; i++) {
+        size_hist_add(&hist, 3000);
+    }
+    assert(hist.count == 100);
+    assert(size_hist_percentile(&hist, 50) == 256);
+    assert(size_hist_percentile(&hist, 90) == 256);
+    assert(size_hist_percentile(&hist, 91) == 4096);
+    assert(size_hist_percentile(&hist, 100) == 4096);
+
+    // Sizes beyond the last bucket
+    size_hist_add(&hist, (size_t) 1 << 30);
+    assert(size_hist_percentile(&hist, 100)
+           == (size_t) 1 << (SIZE_HIST_MIN_SHIFT + SIZE_HIST_BUCKETS - 1));
+}
 
 int main(int argc, char *argv[]) {
     test_date_functions();
     test_path_starts_with();
+    test_str_slices();
     test_url_decode();
+    test_url_normalize_path();
+    test_size_hist();
     return 0;
 }
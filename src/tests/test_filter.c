@@ -0,0 +1,227 @@
+#include "filter.h"
+#include "filter_gzip.h"
+#include "stacktrace.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+static ioloop_t       *loop;
+static connection_t   conn;
+static int            peer_fd;
+static filter_chain_t chain;
+
+static void setup(const char *accept_encoding) {
+    int     fds[2];
+    char    buf[256];
+    size_t  consumed;
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    peer_fd = fds[1];
+    bzero(&conn, sizeof(connection_t));
+    conn.stream = iostream_create(loop, fds[0], 1024, 65536, &conn);
+    conn.arena = arena_create(ARENA_CHUNK_SIZE);
+    conn.request = request_create(&conn);
+    conn.response = response_create(&conn);
+    conn.context = context_create();
+
+    snprintf(buf, sizeof(buf), "GET / HTTP/1.1\r\nAccept-Encoding: %s\r\n\r\n",
+             accept_encoding);
+    assert(request_parse_headers(conn.request, buf, strlen(buf),
+                                 &consumed) == STATUS_COMPLETE);
+    conn.response->version = HTTP_VERSION_1_1;
+    conn.response->status = STATUS_OK;
+    conn.response->filter_chain = &chain;
+    response_set_header_id(conn.response, HTTP_HEADER_CONTENT_TYPE, "text/plain");
+}
+
+static void teardown() {
+    response_reset(conn.response);
+    request_destroy(conn.request);
+    response_destroy(conn.response);
+    context_destroy(conn.context);
+    arena_destroy(conn.arena);
+    iostream_destroy(conn.stream);
+    close(peer_fd);
+}
+
+/*
+ * Read what was written until the last chunk, returns the headers, and
+ * the body without its chunk framing.
+ */
+static char *read_response(char *body, size_t *body_len) {
+    static char buf[1 << 20];
+    size_t      len = 0, n;
+    ssize_t     rc;
+    char        *p, *end;
+
+    do {
+        rc = read(peer_fd, buf + len, sizeof(buf) - 1 - len);
+        assert(rc > 0);
+        len += rc;
+        buf[len] = '\0';
+    } while (len < 5 || strcmp(buf + len - 5, "0\r\n\r\n") != 0);
+
+    p = strstr(buf, "\r\n\r\n");
+    assert(p != NULL);
+    p[2] = '\0';
+    p += 4;
+    *body_len = 0;
+    while ((n = strtoul(p, &end, 16)) > 0) {
+        memcpy(body + *body_len, end + 2, n);
+        *body_len += n;
+        p = end + 2 + n + 2;
+    }
+    return buf;
+}
+
+static size_t gunzip(const char *src, size_t len, char *dst, size_t cap) {
+    z_stream    zs;
+
+    bzero(&zs, sizeof(z_stream));
+    assert(inflateInit2(&zs, 15 + 16) == Z_OK);
+    zs.next_in = (Bytef*) src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*) dst;
+    zs.avail_out = cap;
+    assert(inflate(&zs, Z_FINISH) == Z_STREAM_END);
+    inflateEnd(&zs);
+    return cap - zs.avail_out;
+}
+
+static void test_gzip_writes() {
+    static char body[1 << 16], plain[1 << 16];
+    char        *headers, *text = "hello hello hello hello world\n";
+    size_t      len, i;
+
+    info("Testing gzip over writes");
+    setup("deflate, gzip");
+    assert(response_send_headers(conn.response, NULL) == 0);
+    for (i = 0; i < 100; i++) {
+        assert(response_write(conn.response, text, strlen(text), NULL) == 0);
+    }
+    assert(response_end(conn.response) == 0);
+
+    headers = read_response(body, &len);
+    assert(strstr(headers, "Content-Encoding: gzip\r\n") != NULL);
+    assert(strstr(headers, "Transfer-Encoding: chunked\r\n") != NULL);
+    assert(strstr(headers, "Vary: Accept-Encoding\r\n") != NULL);
+    assert(len < 100 * strlen(text));
+    assert(gunzip(body, len, plain, sizeof(plain)) == 100 * strlen(text));
+    for (i = 0; i < 100; i++) {
+        assert(memcmp(plain + i * strlen(text), text, strlen(text)) == 0);
+    }
+    teardown();
+}
+
+static void test_gzip_file() {
+    static char body[1 << 16], plain[1 << 18];
+    char        path[] = "/tmp/test_filter_XXXXXX", line[64], *headers;
+    size_t      len, size = 0;
+    int         fd, i, rounds = 0;
+
+    info("Testing gzip over a file");
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    for (i = 0; i < 5000; i++) {
+        size += snprintf(line, sizeof(line), "line %d\n", i);
+        assert(write(fd, line, strlen(line)) == strlen(line));
+    }
+
+    setup("gzip");
+    assert(response_send_headers(conn.response, NULL) == 0);
+    assert(response_send_file(conn.response, fd, 0, size, NULL) == 0);
+    // The rest of the file is read as the output is written
+    while (conn.response->_next_handler != NULL) {
+        conn.response->_next_handler(conn.request, conn.response, conn.context);
+        rounds++;
+    }
+    assert(rounds > 0);
+    assert(response_end(conn.response) == 0);
+
+    headers = read_response(body, &len);
+    assert(strstr(headers, "Content-Encoding: gzip\r\n") != NULL);
+    assert(gunzip(body, len, plain, sizeof(plain)) == size);
+    assert(strncmp(plain, "line 0\nline 1\n", 14) == 0);
+    assert(strncmp(plain + size - 10, "line 4999\n", 10) == 0);
+    teardown();
+    close(fd);
+}
+
+static void test_gzip_refused() {
+    static char body[1 << 16];
+    char        *headers, *text = "not compressed";
+    size_t      len;
+
+    info("Testing gzip refused by the client");
+    setup("gzip;q=0, identity");
+    assert(response_send_headers(conn.response, NULL) == 0);
+    assert(conn.response->_filter == NULL);
+    assert(response_write(conn.response, text, strlen(text), NULL) == 0);
+    assert(response_end(conn.response) == 0);
+
+    headers = read_response(body, &len);
+    assert(strstr(headers, "Content-Encoding") == NULL);
+    assert(strstr(headers, "Vary: Accept-Encoding\r\n") != NULL);
+    assert(len == strlen(text) && memcmp(body, text, len) == 0);
+    teardown();
+}
+
+static void test_gzip_etag() {
+    static char body[1 << 16];
+    char        *headers;
+    size_t      len;
+
+    info("Testing the ETag of a gzip response");
+    setup("gzip");
+    response_set_header_id(conn.response, HTTP_HEADER_ETAG, "\"abc\"");
+    assert(response_send_headers(conn.response, NULL) == 0);
+    assert(response_write(conn.response, "abc", 3, NULL) == 0);
+    assert(response_end(conn.response) == 0);
+
+    headers = read_response(body, &len);
+    assert(strstr(headers, "ETag: W/\"abc\"\r\n") != NULL);
+    teardown();
+
+    // What the client sends back still matches the tag of the file
+    assert(etag_matches("W/\"abc\"", "\"abc\""));
+    assert(etag_matches("\"abc\"", "W/\"abc\""));
+    assert(etag_matches("\"x\", W/\"abc\"", "\"abc\""));
+    assert(etag_matches("\"a,b\", \"abc\"", "\"abc\""));
+    assert(etag_matches("*", "\"abc\""));
+    assert(!etag_matches("W/\"abcd\"", "\"abc\""));
+    assert(!etag_matches("\"a,b\"", "\"a\""));
+    assert(!etag_matches("", "\"abc\""));
+}
+
+int main(int argc, const char *argv[]) {
+    const char  *location = "{\"path\": \"/\", \"filters\": [\"gzip\"], "
+                            "\"gzip_min_length\": 0}";
+    json_value  *val, *names;
+
+    print_stacktrace_on_error();
+    loop = ioloop_create(16);
+    val = json_parse(location, strlen(location));
+    assert(val != NULL);
+    names = val->u.object.values[1].value;
+    assert(find_filter("gzip") == &filter_gzip);
+    assert(find_filter("nope") == NULL);
+
+    chain = *filter_chain_parse(names, val);
+    assert(chain.count == 1);
+    assert(((filter_gzip_conf_t*) chain.confs[0])->min_length == 0);
+
+    test_gzip_writes();
+    test_gzip_file();
+    test_gzip_refused();
+    test_gzip_etag();
+
+    json_value_free(val);
+    ioloop_destroy(loop);
+    return 0;
+}
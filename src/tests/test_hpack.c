@@ -0,0 +1,103 @@
+#include "hpack.h"
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+static char fields[1024];
+
+static void collect(void *args, const char *name, size_t name_len,
+                    const char *value, size_t value_len) {
+    size_t  len = strlen(fields);
+
+    snprintf(fields + len, sizeof(fields) - len, "%.*s: %.*s\n",
+             (int) name_len, name, (int) value_len, value);
+}
+
+static int decode(hpack_table_t *table, const char *data, size_t len) {
+    fields[0] = '\0';
+    return hpack_decode(table, data, len, collect, NULL);
+}
+
+// RFC 7541 C.3, requests without Huffman coding
+void test_decode_requests() {
+    hpack_table_t   *table = hpack_table_create(HPACK_TABLE_SIZE);
+
+    assert(decode(table,
+                  "\x82\x86\x84\x41\x0f" "www.example.com", 20) == 0);
+    assert(strcmp(fields,
+                  ":method: GET\n:scheme: http\n:path: /\n"
+                  ":authority: www.example.com\n") == 0);
+
+    // The authority comes from the dynamic table now
+    assert(decode(table,
+                  "\x82\x86\x84\xbe\x58\x08" "no-cache", 14) == 0);
+    assert(strcmp(fields,
+                  ":method: GET\n:scheme: http\n:path: /\n"
+                  ":authority: www.example.com\ncache-control: no-cache\n") == 0);
+
+    assert(decode(table,
+                  "\x82\x87\x85\xbf\x40\x0a" "custom-key" "\x0c" "custom-value", 29) == 0);
+    assert(strcmp(fields,
+                  ":method: GET\n:scheme: https\n:path: /index.html\n"
+                  ":authority: www.example.com\ncustom-key: custom-value\n") == 0);
+    hpack_table_destroy(table);
+}
+
+// RFC 7541 C.4.1, the same request with Huffman coding
+void test_decode_huffman() {
+    hpack_table_t   *table = hpack_table_create(HPACK_TABLE_SIZE);
+    char            buf[64];
+
+    assert(decode(table,
+                  "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff",
+                  17) == 0);
+    assert(strcmp(fields,
+                  ":method: GET\n:scheme: http\n:path: /\n"
+                  ":authority: www.example.com\n") == 0);
+
+    assert(hpack_huffman_decode("\xa8\xeb\x10\x64\x9c\xbf", 6, buf, sizeof(buf)) == 8);
+    assert(memcmp(buf, "no-cache", 8) == 0);
+    // Padding longer than 7 bits
+    assert(hpack_huffman_decode("\xa8\xeb\x10\x64\x9c\xbf\xff", 7, buf, sizeof(buf)) < 0);
+    hpack_table_destroy(table);
+}
+
+void test_decode_errors() {
+    hpack_table_t   *table = hpack_table_create(HPACK_TABLE_SIZE);
+
+    // Index 0, and past the end of the tables
+    assert(decode(table, "\x80", 1) < 0);
+    assert(decode(table, "\xbe", 1) < 0);
+    // Truncated string
+    assert(decode(table, "\x41\x0f" "www", 5) < 0);
+    // Size update above the limit
+    assert(decode(table, "\x3f\xe1\x7f", 3) < 0);
+    hpack_table_destroy(table);
+}
+
+void test_encode() {
+    hpack_table_t   *table = hpack_table_create(HPACK_TABLE_SIZE);
+    char            buf[256];
+    size_t          len;
+
+    len = hpack_encode_status(buf, 200);
+    assert(len == 1 && (unsigned char) buf[0] == 0x88);
+    len += hpack_encode_status(buf + len, 302);
+    len += hpack_encode_field(buf + len, HTTP_HEADER_CONTENT_TYPE,
+                              "Content-Type", 12, "text/html", 9);
+    len += hpack_encode_field(buf + len, HTTP_HEADER_UNKNOWN,
+                              "X-Custom", 8, "1", 1);
+    assert(decode(table, buf, len) == 0);
+    assert(strcmp(fields,
+                  ":status: 200\n:status: 302\n"
+                  "content-type: text/html\nx-custom: 1\n") == 0);
+    hpack_table_destroy(table);
+}
+
+int main(int argc, char *argv[]) {
+    test_decode_requests();
+    test_decode_huffman();
+    test_decode_errors();
+    test_encode();
+    return 0;
+}
@@ -1,10 +1,19 @@
 #include "http.h"
+#include "hpack.h"
+#include "http2.h"
 #include "common.h"
 #include "log.h"
 #include "stacktrace.h"
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 
 char* test_request = 
@@ -134,6 +143,54 @@ void test_parse_multiple_times() {
     dump_request(req);
     assert(rc == STATUS_INCOMPLETE);
     assert(consumed_size == part1_size);
+
+    // The rest of it
+    rc = request_parse_headers(req, data + part1_size, req_size - part1_size,
+                               &consumed_size);
+    info("Second Time: Request size: %zu, consumed size: %zu, return status: %d",
+         req_size, consumed_size, rc);
+    dump_request(req);
+    assert(rc == STATUS_COMPLETE);
+    assert(consumed_size == req_size - part1_size);
+    assert_headers(req);
+    assert(request_destroy(req) == 0);
+}
+
+
+void test_parse_large_header_in_pieces() {
+    request_t  *req;
+    char       data[4096];
+    size_t     req_size, consumed_size, i, n;
+    int        rc = STATUS_INCOMPLETE;
+
+    req = request_create(NULL);
+    assert(req != NULL);
+    info("\n\nTesting parsing a large header in small pieces");
+    strcpy(data, "GET /big HTTP/1.0\r\nHost: example.com\r\nX-Big: ");
+    n = strlen(data);
+    memset(data + n, 'x', 3000);
+    strcpy(data + n + 3000, "\r\nConnection: keep-alive\r\n\r\n");
+    req_size = strlen(data);
+
+    for (i = 0; i < req_size && rc == STATUS_INCOMPLETE; i += 7) {
+        n = req_size - i < 7 ? req_size - i : 7;
+        rc = request_parse_headers(req, data + i, n, &consumed_size);
+    }
+    assert(rc == STATUS_COMPLETE);
+    assert(i >= req_size);
+    assert_equals("GET", req->method);
+    assert_equals("/big", req->path);
+    assert(req->version == HTTP_VERSION_1_0);
+    assert(req->header_count == 3);
+    assert_equals("example.com", req->host);
+    assert(req->headers[1].value_len == 3000);
+    assert(req->connection == CONN_KEEP_ALIVE);
+
+    // The header block is reused by the next request
+    assert(request_reset(req) == 0);
+    rc = request_parse_headers(req, test_request, strlen(test_request), &consumed_size);
+    assert(rc == STATUS_COMPLETE);
+    assert_headers(req);
     assert(request_destroy(req) == 0);
 }
 
@@ -237,8 +294,12 @@ void dump_response(response_t *resp) {
 
 
 void test_response_set_header_basic() {
-    response_t *response;
-    response = response_create(NULL);
+    response_t   *response;
+    connection_t conn;
+
+    bzero(&conn, sizeof(connection_t));
+    conn.arena = arena_create(ARENA_CHUNK_SIZE);
+    response = response_create(&conn);
     assert(response != NULL);
 
     // Basic tests
@@ -275,10 +336,1054 @@ void test_response_set_header_basic() {
     assert_equals(response->headers[2].value, "foobar");
     assert_equals(response_get_header(response, "x-Foobar"), "foobar");
 
-    assert_equals(response->_buffer, "x-foobar");
-    assert(response->_buf_idx == strlen("x-foobar") + 1);
+    // Header names are not copied
+    assert(arena_used(conn.arena) == 0);
+
+    // Standard headers by ID
+    assert(response_set_header_id(response, HTTP_HEADER_CONTENT_TYPE, "text/plain") == 0);
+    assert(response_set_header_id(response, HTTP_HEADER_ETAG, "\"abc\"") == 0);
+    assert(response->header_count == 4);
+    assert_equals(response->headers[1].value, "text/plain");
+    assert_equals(response->headers[3].name, "ETag");
+    assert_equals(response_get_header(response, "etag"), "\"abc\"");
+    assert_equals(response_get_header_id(response, HTTP_HEADER_CONTENT_LENGTH), "1024");
+    assert(response_get_header_id(response, HTTP_HEADER_LOCATION) == NULL);
+    assert(response_get_header(response, "X-Other") == NULL);
+
+    assert(response_destroy(response) == 0);
+    arena_destroy(conn.arena);
+}
+
+void test_response_alloc() {
+    response_t   *response;
+    connection_t conn;
+    char         value[3001], *buf;
+    int          i;
+
+    bzero(&conn, sizeof(connection_t));
+    conn.arena = arena_create(ARENA_CHUNK_SIZE);
+    response = response_create(&conn);
+
+    // Far more than what used to fit in the response
+    for (i = 0; i < 100; i++) {
+        buf = response_alloc(response, 64);
+        assert(buf != NULL);
+        memset(buf, 'a', 64);
+    }
+    memset(value, 'v', 3000);
+    value[3000] = '\0';
+    assert(response_set_header_printf(response, "X-Large", "%s", value) == 0);
+    assert_equals(response_get_header(response, "X-Large"), value);
+    assert(response_set_header_printf(response, "Content-Range", "bytes %d-%d/%d",
+                                      0, 99, 1000) == 0);
+    assert_equals(response_get_header(response, "Content-Range"), "bytes 0-99/1000");
+
+    assert(response_destroy(response) == 0);
+    arena_destroy(conn.arena);
+}
+
+void test_header_slices() {
+    request_t    *req;
+    response_t   *response;
+    connection_t conn;
+    str_t        value;
+    size_t       consumed_size;
+    char         *data;
+
+    info("\n\nTesting header slices");
+    bzero(&conn, sizeof(connection_t));
+    conn.arena = arena_create(ARENA_CHUNK_SIZE);
+    req = request_create(&conn);
+    response = response_create(&conn);
+    response_reset(response);
+
+    assert(request_parse_headers(req, test_request, strlen(test_request),
+                                 &consumed_size) == STATUS_COMPLETE);
+    value = request_get_header_str(req, STR("accept-charset"));
+    assert(str_equals(value, STR("GBK,utf-8;q=0.7,*;q=0.3")));
+    value = request_get_header_id_str(req, HTTP_HEADER_HOST);
+    assert(str_equals(value, STR("www.javaeye.com")));
+    value = request_get_header_str(req, STR("X-Missing"));
+    assert(value.ptr == NULL && value.len == 0);
+
+    // Values that are not NUL-terminated
+    data = "text/plainXXX";
+    value.ptr = data;
+    value.len = 10;
+    assert(response_set_header_str(response, STR("Content-Type"), value) == 0);
+    assert(response_set_header_str(response, STR("X-Foo"), STR("1")) == 0);
+    assert(response_set_header_str(response, STR("x-foo"), STR("22")) == 0);
+    assert(response->header_count == 2);
+    assert(str_equals(response_get_header_id_str(response, HTTP_HEADER_CONTENT_TYPE),
+                      STR("text/plain")));
+    assert(str_equals(response_get_header_str(response, STR("X-FOO")), STR("22")));
+    assert_equals(response_get_header(response, "X-Foo"), "22");
+
+    assert(request_destroy(req) == 0);
+    assert(response_destroy(response) == 0);
+    arena_destroy(conn.arena);
+}
+
+void test_header_lookup() {
+    request_t  *req;
+    size_t     consumed_size;
+
+    info("\n\nTesting header ID lookup");
+    assert(http_header_lookup("Content-Length", 14) == HTTP_HEADER_CONTENT_LENGTH);
+    assert(http_header_lookup("content-LENGTH", 14) == HTTP_HEADER_CONTENT_LENGTH);
+    assert(http_header_lookup("Content-Lengthy", 15) == HTTP_HEADER_UNKNOWN);
+    assert(http_header_lookup("Content-Lengt", 13) == HTTP_HEADER_UNKNOWN);
+    assert(http_header_lookup("X-Foobar", 8) == HTTP_HEADER_UNKNOWN);
+    assert(http_header_lookup("x-xss-protection", 16) == HTTP_HEADER_X_XSS_PROTECTION);
+    assert_equals(http_header_names[HTTP_HEADER_WWW_AUTHENTICATE], "WWW-Authenticate");
+
+    req = request_create(NULL);
+    assert(request_parse_headers(req, test_request, strlen(test_request),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert_equals(request_get_header_id(req, HTTP_HEADER_IF_NONE_MATCH), "\"3922745954\"");
+    assert(request_get_header_id(req, HTTP_HEADER_RANGE) == NULL);
+    assert(req->headers[0].id == HTTP_HEADER_HOST);
+    assert(request_reset(req) == 0);
+    assert(request_get_header_id(req, HTTP_HEADER_HOST) == NULL);
+    assert(request_destroy(req) == 0);
+}
+
+void test_query_and_cookies() {
+    request_t    *req;
+    connection_t conn;
+    const char   *data;
+    size_t       consumed_size;
+
+    info("\n\nTesting query parameters and cookies");
+    bzero(&conn, sizeof(connection_t));
+    conn.arena = arena_create(ARENA_CHUNK_SIZE);
+    req = request_create(&conn);
+
+    data = "GET /search?q=a%26b+c&empty&x=&q=2&n=%3D1 HTTP/1.1\r\n"
+           "Cookie: sid=abc; theme=\"dark\";lang=en ; sid=def\r\n\r\n";
+    assert(request_parse_headers(req, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert(request_decode_url(req) == 0);
+    // Nothing is parsed until asked for
+    assert(arena_used(conn.arena) == 0);
+
+    assert_equals(request_get_query_param(req, "q"), "a&b c");
+    assert_equals(request_get_query_param(req, "empty"), "");
+    assert_equals(request_get_query_param(req, "x"), "");
+    assert_equals(request_get_query_param(req, "n"), "=1");
+    assert(request_get_query_param(req, "missing") == NULL);
+    // The raw query string is left alone
+    assert_equals(req->query_str, "q=a%26b+c&empty&x=&q=2&n=%3D1");
+
+    assert_equals(request_get_cookie(req, "sid"), "abc");
+    assert_equals(request_get_cookie(req, "theme"), "dark");
+    assert_equals(request_get_cookie(req, "lang"), "en");
+    assert(request_get_cookie(req, "Sid") == NULL);
+
+    // No query, no cookie
+    assert(request_reset(req) == 0);
+    arena_reset(conn.arena);
+    data = "GET /plain HTTP/1.1\r\nHost: a\r\n\r\n";
+    assert(request_parse_headers(req, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert(request_get_query_param(req, "q") == NULL);
+    assert(request_get_cookie(req, "sid") == NULL);
+
+    assert(request_destroy(req) == 0);
+    arena_destroy(conn.arena);
+}
+
+void test_expect_header() {
+    request_t  *req;
+    size_t     consumed_size;
+    char       *data;
+
+    info("\n\nTesting Expect header");
+    req = request_create(NULL);
+    data = "POST /up HTTP/1.1\r\nExpect: 100-Continue\r\nContent-Length: 10\r\n\r\n";
+    assert(request_parse_headers(req, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert(req->expect_continue == 1);
+    assert(request_has_body(req));
+
+    assert(request_reset(req) == 0);
+    data = "POST /up HTTP/1.1\r\nExpect: something-else\r\n\r\n";
+    assert(request_parse_headers(req, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert(req->expect_continue == -1);
+
+    assert(request_reset(req) == 0);
+    data = "POST /up HTTP/1.1\r\nContent-Length: 10\r\n\r\n";
+    assert(request_parse_headers(req, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert(req->expect_continue == 0);
+    assert(request_destroy(req) == 0);
+}
+
+static int fake_op(int rc) {
+    return rc;
+}
+
+static int steps_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    int     *steps = coro_locals(ctx, resp, sizeof(int));
+
+    CORO_BEGIN(ctx, steps_handler);
+    (*steps)++;
+    CORO_AWAIT(ctx, fake_op(0));
+    assert(!CORO_FAILED(ctx));
+    (*steps)++;
+    // A failed operation does not wait
+    CORO_AWAIT(ctx, fake_op(-1));
+    assert(CORO_FAILED(ctx));
+    (*steps)++;
+    CORO_END(ctx);
+}
+
+void test_coroutine_handler() {
+    response_t    *response;
+    handler_ctx_t *ctx;
+    connection_t  conn;
+    int           *steps;
+
+    info("\n\nTesting coroutine handlers");
+    bzero(&conn, sizeof(connection_t));
+    conn.arena = arena_create(ARENA_CHUNK_SIZE);
+    response = response_create(&conn);
+    ctx = context_create();
 
+    assert(steps_handler(NULL, response, ctx) == HANDLER_UNFISHED);
+    steps = coro_locals(ctx, response, sizeof(int));
+    assert(*steps == 1);
+    assert(coro_resume(NULL, response, ctx) == HANDLER_DONE);
+    assert(*steps == 3);
+
+    // Starts over once the context is reset
+    assert(context_reset(ctx) == 0);
+    assert(steps_handler(NULL, response, ctx) == HANDLER_UNFISHED);
+    assert(*(int*) coro_locals(ctx, response, sizeof(int)) == 1);
+
+    context_destroy(ctx);
     assert(response_destroy(response) == 0);
+    arena_destroy(conn.arena);
+}
+
+static int hint_fields;
+
+static void on_hint_field(void *args, const char *name, size_t name_len,
+                          const char *value, size_t value_len) {
+    const char  **links = (const char**) args;
+
+    if (hint_fields == 0) {
+        assert(name_len == 7 && memcmp(name, ":status", 7) == 0);
+        assert(value_len == 3 && memcmp(value, "103", 3) == 0);
+    } else {
+        assert(name_len == 4 && memcmp(name, "link", 4) == 0);
+        assert(value_len == strlen(links[hint_fields - 1]));
+        assert(memcmp(value, links[hint_fields - 1], value_len) == 0);
+    }
+    hint_fields++;
+}
+
+void test_early_hints() {
+    const char      *links[] = {"</a.css>; rel=preload; as=style",
+                                "</b.js>; rel=preload; as=script"};
+    const char      *bad[] = {"</a.css>\r\nSet-Cookie: x=1"};
+    const char      *h1 = "HTTP/1.1 103 Early Hints\r\n"
+                          "Link: </a.css>; rel=preload; as=style\r\n"
+                          "Link: </b.js>; rel=preload; as=script\r\n\r\n";
+    early_hints_t   *hints;
+    hpack_table_t   *table;
+
+    info("\n\nTesting early hints");
+    hints = early_hints_create(links, 2);
+    assert(hints != NULL);
+    assert(hints->h1.len == strlen(h1));
+    assert(memcmp(hints->h1.ptr, h1, hints->h1.len) == 0);
+
+    table = hpack_table_create(HPACK_TABLE_SIZE);
+    hint_fields = 0;
+    assert(hpack_decode(table, hints->h2.ptr, hints->h2.len,
+                        on_hint_field, links) == 0);
+    assert(hint_fields == 3);
+    hpack_table_destroy(table);
+    early_hints_destroy(hints);
+
+    assert(early_hints_create(links, 0) == NULL);
+    assert(early_hints_create(bad, 1) == NULL);
+}
+
+/*
+ * A connection of a made-up server, driven over loopback. What the
+ * client gets back is collected until the server closes, or until it
+ * ends with what is expected, then the client closes too and the loop
+ * runs until the server is done with the connection.
+ */
+static server_t     test_server;
+static char         client_buf[65536];
+static size_t       client_len;
+static const char   *client_until;
+// Tells when the client has got all it waits for, by default when what
+// it got ends with client_until
+static int          (*client_done)();
+static int          client_fd;
+static int          server_fd;
+// Writes made to the socket of the server, counted by the wrappers below
+static int          server_writes;
+// max_body_size of the server, 0 for no limit
+static size_t       server_max_body;
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    if (fd == server_fd) {
+        server_writes++;
+    }
+    return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    if (fd == server_fd) {
+        server_writes++;
+    }
+    return syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+static void wait_server_closed(ioloop_t *loop, void *args) {
+    // One more round once closed, for the stream to be destroyed
+    if (test_server.stats.conn_active > 0 || args == NULL) {
+        ioloop_add_callback(loop, wait_server_closed,
+                            test_server.stats.conn_active == 0 ? loop : NULL);
+        return;
+    }
+    ioloop_stop(loop);
+}
+
+static int ends_with_until() {
+    size_t  until_len;
+
+    if (client_until == NULL) {
+        return 0;
+    }
+    until_len = strlen(client_until);
+    return client_len >= until_len
+        && strcmp(client_buf + client_len - until_len, client_until) == 0;
+}
+
+static void on_client_data(ioloop_t *loop, int fd, unsigned int events, void *args) {
+    ssize_t     n;
+
+    while ((n = read(fd, client_buf + client_len,
+                     sizeof(client_buf) - 1 - client_len)) > 0) {
+        client_len += n;
+    }
+    client_buf[client_len] = '\0';
+    if (n < 0 && errno == EAGAIN && !client_done()) {
+        return;
+    }
+    ioloop_remove_handler(loop, fd);
+    close(fd);
+    wait_server_closed(loop, NULL);
+}
+
+/*
+ * Send the data at once and run the handler on the requests, until the
+ * client is done or the server closes.
+ */
+static void run_client(handler_func handler, const char *data, size_t len,
+                       int (*done)()) {
+    struct sockaddr_in  addr;
+    socklen_t           addr_len = sizeof(addr);
+    connection_t        *conn;
+    int                 listen_fd;
+
+    bzero(&test_server, sizeof(server_t));
+    test_server.ioloop = ioloop_create(64);
+    test_server.handler = handler;
+    test_server.state = SERVER_RUNNING;
+    test_server.stats.read_buf_size = 1024;
+    test_server.stats.write_buf_size = 4096;
+    test_server.read_buf_max = 65536;
+    test_server.write_buf_max = 65536;
+    test_server.max_body_size = server_max_body;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listen_fd >= 0);
+    assert(bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert(listen(listen_fd, 1) == 0);
+    assert(getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len) == 0);
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(client_fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    conn = connection_accept(&test_server, listen_fd);
+    assert(conn != NULL);
+    close(listen_fd);
+
+    server_fd = conn->stream->fd;
+    server_writes = 0;
+    client_len = 0;
+    client_done = done;
+    assert(write(client_fd, data, len) == len);
+    set_nonblocking(client_fd);
+    ioloop_add_handler(test_server.ioloop, client_fd, EPOLLIN, on_client_data, NULL);
+
+    connection_run(conn);
+    // A hung connection fails the test
+    alarm(5);
+    ioloop_start(test_server.ioloop);
+    alarm(0);
+    assert(test_server.stats.conn_active == 0);
+
+    ioloop_destroy(test_server.ioloop);
+    connection_pool_destroy(&test_server.conn_pool);
+    iostream_pool_destroy(&test_server.stream_pool);
+    server_fd = -1;
+}
+
+/*
+ * Send the requests at once, until the responses end with the given
+ * string, or the server closes if NULL.
+ */
+static void run_requests(handler_func handler, const char *requests,
+                         const char *until) {
+    client_until = until;
+    run_client(handler, requests, strlen(requests), ends_with_until);
+}
+
+// Answers with the path of the request as the body
+static int path_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->status = STATUS_OK;
+    resp->content_length = req->path_len;
+    response_send_headers(resp, NULL);
+    response_write(resp, req->path, req->path_len, NULL);
+    return HANDLER_DONE;
+}
+
+/*
+ * The bodies of the responses in what the client got, one after
+ * another in the buffer given.
+ */
+static void collect_bodies(char *out, size_t size) {
+    char    *p = client_buf, *end;
+    size_t  len, used = 0;
+
+    out[0] = '\0';
+    while ((p = strstr(p, "Content-Length: ")) != NULL) {
+        len = strtoul(p + 16, NULL, 10);
+        end = strstr(p, "\r\n\r\n");
+        assert(end != NULL && used + len < size);
+        memcpy(out + used, end + 4, len);
+        used += len;
+        out[used] = '\0';
+        p = end + 4 + len;
+    }
+}
+
+static size_t   piece_pos;
+
+static int piece_next(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    if (piece_pos == req->path_len) {
+        return HANDLER_DONE;
+    }
+    response_write(resp, req->path + piece_pos++, 1, piece_next);
+    return HANDLER_UNFISHED;
+}
+
+// Answers with the path too, a byte per write
+static int pieces_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->status = STATUS_OK;
+    resp->content_length = req->path_len;
+    piece_pos = 0;
+    response_send_headers(resp, NULL);
+    return piece_next(req, resp, ctx);
+}
+
+void test_pipelined_responses() {
+    char    bodies[256], expected[256], requests[1024];
+    int     i;
+
+    info("\n\nTesting pipelined responses");
+    run_requests(path_handler,
+                 "GET /1 HTTP/1.1\r\nHost: a\r\n\r\n"
+                 "GET /2 HTTP/1.1\r\nHost: a\r\n\r\n"
+                 "GET /3 HTTP/1.1\r\nHost: a\r\n\r\n"
+                 "GET /4 HTTP/1.1\r\nHost: a\r\n\r\n", "/4");
+    collect_bodies(bodies, sizeof(bodies));
+    assert_equals("/1/2/3/4", bodies);
+    // Held back while the others were waiting, then sent together
+    assert(server_writes == 1);
+
+    // A request on its own is answered right away
+    run_requests(path_handler, "GET /5 HTTP/1.1\r\nHost: a\r\n\r\n", "/5");
+    collect_bodies(bodies, sizeof(bodies));
+    assert_equals("/5", bodies);
+
+    // Written a byte at a time, the writes of a response go deeper than
+    // the inline nesting allows, the rest go through the ioloop and the
+    // responses still come out whole and in order.
+    requests[0] = expected[0] = '\0';
+    for (i = 0; i < 20; i++) {
+        sprintf(requests + strlen(requests),
+                "GET /%02d-pieces HTTP/1.1\r\nHost: a\r\n\r\n", i);
+        sprintf(expected + strlen(expected), "/%02d-pieces", i);
+    }
+    run_requests(pieces_handler, requests, "/19-pieces");
+    collect_bodies(bodies, sizeof(bodies));
+    assert_equals(expected, bodies);
+}
+
+void test_connection_release() {
+    static connection_t *conns[200];
+    server_t        server;
+    connection_t    *conn;
+    char            *block;
+    size_t          consumed_size;
+    int             i;
+    char            *data = "GET /a?b=c HTTP/1.1\r\nHost: a\r\n\r\n";
+
+    info("\n\nTesting connection release");
+    bzero(&server, sizeof(server_t));
+    conn = connection_alloc(&server);
+    assert(conn != NULL);
+    assert(request_parse_headers(conn->request, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert_equals("c", request_get_query_param(conn->request, "b"));
+    block = conn->request->_block;
+    assert(block != NULL);
+    conn->response->status = STATUS_NOT_FOUND;
+    response_set_header(conn->response, "X-Test", "1");
+    conn->context->conf = &server;
+    conn->context->_coro_line = 3;
+    assert(arena_alloc(conn->arena, 100) != NULL);
+    connection_release(conn);
+
+    // The same one comes back as good as new, with the header block of
+    // the request and the arena kept
+    assert(connection_alloc(&server) == conn);
+    assert(conn->server == &server && conn->stream == NULL);
+    assert(conn->request->path == NULL && conn->request->header_count == 0);
+    assert(conn->request->_query_index == NULL);
+    assert(conn->request->_conn == conn && conn->request->_block == block);
+    assert(conn->response->status.code == 0);
+    assert(conn->response->header_count == 0);
+    assert(conn->response->content_length == -1);
+    assert(conn->response->_conn == conn);
+    assert(conn->context->conf == NULL && conn->context->_coro_line == 0);
+    assert(conn->arena != NULL && arena_used(conn->arena) == 0);
+    connection_release(conn);
+
+    // The batches left free after a burst are given back
+    for (i = 0; i < 200; i++) {
+        conns[i] = connection_alloc(&server);
+        assert(conns[i] != NULL);
+    }
+    assert(server.conn_pool.size >= 200);
+    for (i = 0; i < 200; i++) {
+        connection_release(conns[i]);
+    }
+    assert(server.conn_pool.size < 200);
+    assert(server.conn_pool.free_count == server.conn_pool.size);
+    connection_pool_destroy(&server.conn_pool);
+    assert(server.conn_pool.batches == NULL);
+}
+
+static int parse_request(const char *data) {
+    request_t   *req;
+    size_t      consumed_size;
+    int         rc;
+
+    req = request_create(NULL);
+    rc = request_parse_headers(req, data, strlen(data), &consumed_size);
+    assert(request_destroy(req) == 0);
+    return rc;
+}
+
+void test_body_framing() {
+    request_t   *req;
+    size_t      consumed_size;
+    char        *data;
+
+    info("\n\nTesting body framing");
+    req = request_create(NULL);
+    data = "POST /up HTTP/1.1\r\nContent-Length: 10\r\nContent-Length: 10\r\n\r\n";
+    assert(request_parse_headers(req, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert(req->content_length == 10);
+
+    assert(request_reset(req) == 0);
+    data = "POST /up HTTP/1.1\r\nTransfer-Encoding: gzip\r\n"
+           "Transfer-Encoding: Chunked\r\n\r\n";
+    assert(request_parse_headers(req, data, strlen(data),
+                                 &consumed_size) == STATUS_COMPLETE);
+    assert(req->chunked);
+    assert(request_destroy(req) == 0);
+
+    // Lengths a proxy in front may read differently
+    assert(parse_request("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nContent-Length: +1\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nContent-Length:\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\n"
+                         "Content-Length: 99999999999999999999999\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nContent-Length: 1\r\n"
+                         "Content-Length: 2\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nContent-Length: 5\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                         "Content-Length: 5\r\n\r\n") == STATUS_ERROR);
+    // Without chunked last the body has no end
+    assert(parse_request("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                         "Transfer-Encoding: identity\r\n\r\n") == STATUS_ERROR);
+    assert(parse_request("POST / HTTP/1.1\r\nTransfer-Encoding: xchunked\r\n\r\n") == STATUS_ERROR);
+
+    // Refused with 400, and nothing after it is taken as a request
+    run_requests(path_handler,
+                 "POST / HTTP/1.1\r\nContent-Length: 5\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n"
+                 "0\r\n\r\nGET /smuggled HTTP/1.1\r\n\r\n", NULL);
+    assert(strncmp(client_buf, "HTTP/1.1 400 ", 13) == 0);
+    assert(strstr(client_buf, "Connection: close\r\n") != NULL);
+    assert(strstr(client_buf, "/smuggled") == NULL);
+}
+
+static int chunks_done(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    return HANDLER_DONE;
+}
+
+static int chunk_second(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    response_write(resp, req->path, req->path_len, chunks_done);
+    return HANDLER_UNFISHED;
+}
+
+static int chunk_empty(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    // Writes nothing, the next handler still runs
+    response_write(resp, "", 0, chunk_second);
+    return HANDLER_UNFISHED;
+}
+
+static int chunks_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->status = STATUS_OK;
+    response_send_headers(resp, NULL);
+    response_write(resp, "hello", 5, chunk_empty);
+    return HANDLER_UNFISHED;
+}
+
+void test_chunked_response() {
+    char    *body, *first;
+
+    info("\n\nTesting chunked responses");
+    run_requests(chunks_handler, "GET /first HTTP/1.1\r\nHost: a\r\n\r\n"
+                                 "GET /second HTTP/1.1\r\nHost: a\r\n\r\n",
+                 "/second\r\n0\r\n\r\n");
+    assert(strstr(client_buf, "Transfer-Encoding: chunked\r\n") != NULL);
+    assert(strstr(client_buf, "Content-Length") == NULL);
+    first = "5\r\nhello\r\n6\r\n/first\r\n0\r\n\r\nHTTP/1.1 200 ";
+    body = strstr(client_buf, "\r\n\r\n") + 4;
+    assert(strncmp(body, first, strlen(first)) == 0);
+    body = strstr(body + strlen(first), "\r\n\r\n") + 4;
+    assert_equals("5\r\nhello\r\n7\r\n/second\r\n0\r\n\r\n", body);
+}
+
+static char     body_read[256];
+static size_t   body_read_len;
+
+static void on_body(request_t *req, response_t *resp, handler_ctx_t *ctx,
+                    const char *data, size_t len) {
+    assert(body_read_len + len < sizeof(body_read));
+    memcpy(body_read + body_read_len, data, len);
+    body_read_len += len;
+}
+
+static int body_done(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->status = STATUS_OK;
+    resp->content_length = body_read_len;
+    response_send_headers(resp, NULL);
+    response_write(resp, body_read, body_read_len, NULL);
+    return HANDLER_DONE;
+}
+
+// Answers with the body of the request
+static int echo_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    body_read_len = 0;
+    request_read_body(req, on_body, body_done);
+    return HANDLER_UNFISHED;
+}
+
+void test_max_body_size() {
+    char    bodies[256];
+
+    info("\n\nTesting max_body_size");
+    server_max_body = 8;
+    run_requests(echo_handler,
+                 "POST /a HTTP/1.1\r\nHost: a\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n"
+                 "3\r\nabc\r\n5\r\ndefgh\r\n0\r\n\r\n", "abcdefgh");
+    collect_bodies(bodies, sizeof(bodies));
+    assert_equals("abcdefgh", bodies);
+
+    // Refused at the chunk past the limit, the rest is not read
+    run_requests(echo_handler,
+                 "POST /a HTTP/1.1\r\nHost: a\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n"
+                 "3\r\nabc\r\n6\r\ndefghi\r\n0\r\n\r\n"
+                 "GET /b HTTP/1.1\r\nHost: a\r\n\r\n", NULL);
+    assert(strncmp(client_buf, "HTTP/1.1 413 ", 13) == 0);
+    assert(strstr(client_buf, "Connection: close\r\n") != NULL);
+    assert(strstr(client_buf, "HTTP/1.1 200 ") == NULL);
+
+    run_requests(echo_handler,
+                 "POST /a HTTP/1.1\r\nHost: a\r\n"
+                 "Content-Length: 9\r\n\r\nabcdefghi", NULL);
+    assert(strncmp(client_buf, "HTTP/1.1 413 ", 13) == 0);
+    assert(strstr(client_buf, "Connection: close\r\n") != NULL);
+    server_max_body = 0;
+}
+
+void test_chunk_sizes() {
+    const char  *bad[] = {"0x10", " 10", "-1", "+5", "10000000000000000",
+                          "5 ", "", "g"};
+    char        request[256], bodies[256];
+    size_t      i;
+
+    info("\n\nTesting chunk sizes");
+    run_requests(echo_handler,
+                 "POST /a HTTP/1.1\r\nHost: a\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n"
+                 "5 ;name=value\r\nabcde\r\nA\r\n0123456789\r\n"
+                 "000\r\n\r\n", "0123456789");
+    collect_bodies(bodies, sizeof(bodies));
+    assert_equals("abcde0123456789", bodies);
+
+    // Refused rather than read another way than a strict proxy would
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        snprintf(request, sizeof(request),
+                 "POST /a HTTP/1.1\r\nHost: a\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n"
+                 "%s\r\nabcde\r\n0\r\n\r\n"
+                 "GET /b HTTP/1.1\r\nHost: a\r\n\r\n", bad[i]);
+        run_requests(echo_handler, request, NULL);
+        assert(strncmp(client_buf, "HTTP/1.1 400 ", 13) == 0);
+        assert(strstr(client_buf, "Connection: close\r\n") != NULL);
+        assert(strstr(client_buf, "HTTP/1.1 200 ") == NULL);
+    }
+}
+
+static int headers_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->status = STATUS_OK;
+    response_set_header(resp, "Content-Type", "text/plain");
+    response_set_header(resp, "X-Path", req->path);
+    resp->content_length = 2;
+    response_send_headers(resp, NULL);
+    response_write(resp, "ok", 2, NULL);
+    return HANDLER_DONE;
+}
+
+static int not_modified_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    resp->status = STATUS_NOT_MODIFIED;
+    response_send_headers(resp, NULL);
+    return HANDLER_DONE;
+}
+
+/*
+ * Take the values of the Date headers out of what the client got, they
+ * are the only part of the response that is not known in advance.
+ */
+static void strip_dates() {
+    char    *p = client_buf, *eol;
+
+    while ((p = strstr(p, "\r\nDate: ")) != NULL) {
+        p += 8;
+        eol = strstr(p, "\r\n");
+        assert(eol - p == 29);
+        memmove(p, eol, client_buf + client_len + 1 - eol);
+        client_len -= eol - p;
+    }
+}
+
+#define SERVER_LINE     "Server: " _BREEZE_NAME "\r\n"
+
+void test_response_serialization() {
+    info("\n\nTesting response serialization");
+    // The headers of the handler first, then those of the server
+    run_requests(headers_handler, "GET /a HTTP/1.1\r\nHost: a\r\n\r\n", "ok");
+    strip_dates();
+    assert_equals("HTTP/1.1 200 OK\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "X-Path: /a\r\n"
+                  "Content-Length: 2\r\n"
+                  "Connection: keep-alive\r\n"
+                  SERVER_LINE
+                  "Date: \r\n"
+                  "\r\n"
+                  "ok", client_buf);
+
+    // Closed after the response when asked
+    run_requests(headers_handler, "GET /b HTTP/1.1\r\nConnection: close\r\n\r\n", NULL);
+    strip_dates();
+    assert_equals("HTTP/1.1 200 OK\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "X-Path: /b\r\n"
+                  "Content-Length: 2\r\n"
+                  "Connection: close\r\n"
+                  SERVER_LINE
+                  "Date: \r\n"
+                  "\r\n"
+                  "ok", client_buf);
+
+    // Other options leave the default of the version
+    run_requests(headers_handler, "GET /c HTTP/1.1\r\nConnection: Upgrade\r\n\r\n", "ok");
+    assert(strstr(client_buf, "Connection: keep-alive\r\n") != NULL);
+
+    // HTTP/1.0 closes unless asked not to
+    run_requests(headers_handler, "GET /d HTTP/1.0\r\n\r\n", NULL);
+    strip_dates();
+    assert_equals("HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "X-Path: /d\r\n"
+                  "Content-Length: 2\r\n"
+                  "Connection: close\r\n"
+                  SERVER_LINE
+                  "Date: \r\n"
+                  "\r\n"
+                  "ok", client_buf);
+    run_requests(headers_handler, "GET /e HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n", "ok");
+    assert(strncmp(client_buf, "HTTP/1.0 200 OK\r\n", 17) == 0);
+    assert(strstr(client_buf, "Connection: keep-alive\r\n") != NULL);
+
+    // No body, nothing to delimit
+    run_requests(not_modified_handler, "GET /f HTTP/1.1\r\n\r\n", "\r\n\r\n");
+    strip_dates();
+    assert_equals("HTTP/1.1 304 Not Modified\r\n"
+                  "Connection: keep-alive\r\n"
+                  SERVER_LINE
+                  "Date: \r\n"
+                  "\r\n", client_buf);
+}
+
+/*
+ * HTTP/2 seen from the client: frames built by hand, and what the
+ * frames the server sent add up to for each stream.
+ */
+#define H2_STREAMS      8
+
+typedef struct {
+    char            body[H2_STREAMS][256];
+    size_t          data[H2_STREAMS];
+    int             ended[H2_STREAMS];
+    // The error code of RST_STREAM plus 1, 0 if there was none
+    int             reset[H2_STREAMS];
+    unsigned int    max_header_list;
+} h2_seen_t;
+
+static h2_seen_t    h2_seen;
+static unsigned int h2_last_stream;
+
+static size_t h2_frame(char *buf, int type, int flags, unsigned int id,
+                       const char *payload, size_t len) {
+    buf[0] = len >> 16;
+    buf[1] = len >> 8;
+    buf[2] = len;
+    buf[3] = type;
+    buf[4] = flags;
+    buf[5] = id >> 24;
+    buf[6] = id >> 16;
+    buf[7] = id >> 8;
+    buf[8] = id;
+    memcpy(buf + 9, payload, len);
+    return 9 + len;
+}
+
+static size_t h2_request_fields(char *buf, const char *method, const char *path) {
+    size_t  n;
+
+    n = hpack_encode_field(buf, HTTP_HEADER_UNKNOWN, ":method", 7, method, strlen(method));
+    n += hpack_encode_field(buf + n, HTTP_HEADER_UNKNOWN, ":scheme", 7, "http", 4);
+    n += hpack_encode_field(buf + n, HTTP_HEADER_UNKNOWN, ":path", 5, path, strlen(path));
+    n += hpack_encode_field(buf + n, HTTP_HEADER_UNKNOWN, ":authority", 10, "a", 1);
+    return n;
+}
+
+// The preface and the SETTINGS of the client, with the settings given
+static size_t h2_preface(char *buf, const char *settings, size_t len) {
+    memcpy(buf, HTTP2_PREFACE, HTTP2_PREFACE_LEN);
+    return HTTP2_PREFACE_LEN + h2_frame(buf + HTTP2_PREFACE_LEN, 4, 0, 0, settings, len);
+}
+
+static void h2_scan() {
+    const unsigned char *p = (const unsigned char*) client_buf;
+    const unsigned char *end = p + client_len, *payload;
+    size_t              len, i;
+    unsigned int        id;
+
+    bzero(&h2_seen, sizeof(h2_seen));
+    while (end - p >= 9) {
+        len = (p[0] << 16) | (p[1] << 8) | p[2];
+        id = ((p[5] & 0x7f) << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+        payload = p + 9;
+        if (end - payload < len) {
+            break;
+        }
+        assert(id < H2_STREAMS);
+        switch (p[3]) {
+        case 0:
+            if (h2_seen.data[id] + len < sizeof(h2_seen.body[id])) {
+                memcpy(h2_seen.body[id] + h2_seen.data[id], payload, len);
+            }
+            h2_seen.data[id] += len;
+        // fall through
+        case 1:
+            h2_seen.ended[id] |= p[4] & 0x1;
+            break;
+        case 3:
+            h2_seen.reset[id] = payload[3] + 1;
+            break;
+        case 4:
+            for (i = 0; i + 6 <= len; i += 6) {
+                if (payload[i] == 0 && payload[i + 1] == 6) {
+                    h2_seen.max_header_list = (payload[i + 2] << 24) | (payload[i + 3] << 16)
+                                              | (payload[i + 4] << 8) | payload[i + 5];
+                }
+            }
+            break;
+        }
+        p = payload + len;
+    }
+}
+
+// The last stream is answered or reset
+static int h2_last_done() {
+    h2_scan();
+    return h2_seen.ended[h2_last_stream] || h2_seen.reset[h2_last_stream];
+}
+
+// Answers with the cookies of the request as the body
+static int cookie_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    const char  *cookie = request_get_header_id(req, HTTP_HEADER_COOKIE);
+
+    resp->status = STATUS_OK;
+    resp->content_length = strlen(cookie);
+    response_send_headers(resp, NULL);
+    response_write(resp, (char*) cookie, strlen(cookie), NULL);
+    return HANDLER_DONE;
+}
+
+void test_http2_headers() {
+    char    data[8192], block[4096];
+    size_t  n, len, i;
+
+    info("\n\nTesting HTTP/2 header blocks");
+    // A block split over CONTINUATION, with cookie crumbs
+    n = h2_preface(data, NULL, 0);
+    len = h2_request_fields(block, "GET", "/split");
+    len += hpack_encode_field(block + len, HTTP_HEADER_COOKIE, "cookie", 6, "a=1", 3);
+    len += hpack_encode_field(block + len, HTTP_HEADER_UNKNOWN, "x-other", 7, "y", 1);
+    len += hpack_encode_field(block + len, HTTP_HEADER_COOKIE, "cookie", 6, "b=2", 3);
+    len += hpack_encode_field(block + len, HTTP_HEADER_COOKIE, "cookie", 6, "c=3", 3);
+    n += h2_frame(data + n, 1, 0x1, 1, block, 10);
+    n += h2_frame(data + n, 9, 0x4, 1, block + 10, len - 10);
+    h2_last_stream = 1;
+    run_client(cookie_handler, data, n, h2_last_done);
+    h2_scan();
+    assert(h2_seen.max_header_list == 65536);
+    assert_equals("a=1; b=2; c=3", h2_seen.body[1]);
+
+    // A small block referring to a large field again and again is
+    // refused, the stream after it is served
+    n = h2_preface(data, NULL, 0);
+    len = h2_request_fields(block, "GET", "/big");
+    block[len++] = 0x40;
+    block[len++] = 5;
+    memcpy(block + len, "x-big", 5);
+    len += 5;
+    block[len++] = 100;
+    memset(block + len, 'a', 100);
+    len += 100;
+    for (i = 0; i < 500; i++) {
+        // The newest entry of the dynamic table
+        block[len++] = 0x80 | 62;
+    }
+    n += h2_frame(data + n, 1, 0x1 | 0x4, 1, block, len);
+    len = h2_request_fields(block, "GET", "/after");
+    n += h2_frame(data + n, 1, 0x1 | 0x4, 3, block, len);
+    h2_last_stream = 3;
+    run_client(path_handler, data, n, h2_last_done);
+    h2_scan();
+    assert(h2_seen.reset[1] == 1 + 1);
+    assert(h2_seen.data[1] == 0);
+    assert_equals("/after", h2_seen.body[3]);
+}
+
+// A body of 100 bytes
+static int hundred_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    static char body[100];
+
+    memset(body, 'z', sizeof(body));
+    resp->status = STATUS_OK;
+    resp->content_length = sizeof(body);
+    response_send_headers(resp, NULL);
+    response_write(resp, body, sizeof(body), NULL);
+    return HANDLER_DONE;
+}
+
+static int window_updated;
+
+// Opens the window once the first 16 bytes are in
+static int h2_flow_done() {
+    char    frame[16];
+
+    h2_scan();
+    assert(window_updated || h2_seen.data[1] <= 16);
+    if (!window_updated && h2_seen.data[1] == 16) {
+        window_updated = 1;
+        assert(write(client_fd, frame, h2_frame(frame, 8, 0, 1, "\0\0\0\x54", 4)) == 13);
+    }
+    return h2_seen.ended[1];
+}
+
+void test_http2_flow_control() {
+    char    data[1024], block[256];
+    size_t  n, len;
+
+    info("\n\nTesting HTTP/2 flow control");
+    // SETTINGS_INITIAL_WINDOW_SIZE of 16
+    n = h2_preface(data, "\0\x04\0\0\0\x10", 6);
+    len = h2_request_fields(block, "GET", "/");
+    n += h2_frame(data + n, 1, 0x1 | 0x4, 1, block, len);
+    window_updated = 0;
+    run_client(hundred_handler, data, n, h2_flow_done);
+    assert(window_updated);
+    assert(h2_seen.data[1] == 100);
+}
+
+// Leaves /a unanswered, as if waiting for something
+static int stalled_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    if (strcmp(req->path, "/a") == 0) {
+        return HANDLER_UNFISHED;
+    }
+    return path_handler(req, resp, ctx);
+}
+
+void test_http2_reset() {
+    char    data[1024], block[256];
+    size_t  n, len;
+
+    info("\n\nTesting HTTP/2 RST_STREAM");
+    // The client gives up on a request still being handled
+    n = h2_preface(data, NULL, 0);
+    len = h2_request_fields(block, "POST", "/a");
+    n += h2_frame(data + n, 1, 0x4, 1, block, len);
+    n += h2_frame(data + n, 0, 0, 1, "part", 4);
+    // CANCEL
+    n += h2_frame(data + n, 3, 0, 1, "\0\0\0\x08", 4);
+    len = h2_request_fields(block, "GET", "/b");
+    n += h2_frame(data + n, 1, 0x1 | 0x4, 3, block, len);
+    h2_last_stream = 3;
+    run_client(stalled_handler, data, n, h2_last_done);
+    h2_scan();
+    // Nothing is sent on the stream reset by the client
+    assert(h2_seen.data[1] == 0 && !h2_seen.ended[1] && h2_seen.reset[1] == 0);
+    assert_equals("/b", h2_seen.body[3]);
 }
 
 int main(int argc, const char *argv[])
@@ -288,8 +1393,26 @@ int main(int argc, const char *argv[])
     test_parse_once();
     test_parse_once_with_extra_data();
     test_parse_multiple_times();
+    test_parse_large_header_in_pieces();
     test_parse_invalid_version();
     test_common_header_handling();
     test_response_set_header_basic();
+    test_response_alloc();
+    test_header_slices();
+    test_header_lookup();
+    test_query_and_cookies();
+    test_expect_header();
+    test_coroutine_handler();
+    test_early_hints();
+    test_pipelined_responses();
+    test_connection_release();
+    test_body_framing();
+    test_chunked_response();
+    test_max_body_size();
+    test_chunk_sizes();
+    test_response_serialization();
+    test_http2_headers();
+    test_http2_flow_control();
+    test_http2_reset();
     return 0;
 }
@@ -53,6 +53,57 @@ int foobar_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
     return HANDLER_DONE;
 }
 
+/*
+ * Requests with a body get the size of it back, counted by a coroutine
+ * handler.
+ */
+int body_size_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    struct {
+        size_t  bytes;
+        char    response[32];
+        size_t  len;
+    }       *state;
+    str_t   chunk;
+
+    state = coro_locals(ctx, resp, sizeof(*state));
+    if (state == NULL) {
+        return response_send_status(resp, STATUS_INTERNAL_ERROR);
+    }
+
+    CORO_BEGIN(ctx, body_size_handler);
+    do {
+        CORO_AWAIT_BODY(ctx, req, chunk);
+        state->bytes += chunk.len;
+    } while (chunk.ptr != NULL && !CORO_FAILED(ctx));
+
+    state->len = snprintf(state->response, sizeof(state->response),
+                          "%zu\n", state->bytes);
+    resp->status = STATUS_OK;
+    resp->content_length = state->len;
+    response_set_header(resp, "Content-Type", "text/plain");
+    CORO_AWAIT(ctx, response_send_headers(resp, coro_resume));
+    CORO_AWAIT(ctx, response_write(resp, state->response, state->len, coro_resume));
+    CORO_END(ctx);
+}
+
+int dispatch_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    // Refused from the header, the body is not even sent by a client
+    // that expects 100-continue
+    if (strcmp(req->path, "/private") == 0
+        && request_get_header_id(req, HTTP_HEADER_AUTHORIZATION) == NULL) {
+        return response_send_status(resp, STATUS_UNAUTHORIZED);
+    }
+    if (request_has_body(req)) {
+        return body_size_handler(req, resp, ctx);
+    }
+    // Authorized, the page is served from another path
+    if (strcmp(req->path, "/download") == 0) {
+        response_set_header(resp, "X-Accel-Redirect", "/granted?from=download");
+        return HANDLER_DONE;
+    }
+    return foobar_handler(req, resp, ctx);
+}
+
 int main(int argc, char** args) {
     server_t *server;
     server = server_create();
@@ -62,8 +113,9 @@ int main(int argc, char** args) {
         return -1;
     }
 
-    server->handler = foobar_handler;
+    server->handler = dispatch_handler;
     server->handler_conf = msg;
+    server->max_body_size = 16 * 1024 * 1024;
     server_start(server);
     return 0;
 }
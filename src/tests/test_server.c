@@ -0,0 +1,348 @@
+#include "http.h"
+#include "log.h"
+#include "stacktrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+static int ok_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    return response_send_status(resp, STATUS_OK);
+}
+
+// A port nobody listens on right now
+static int free_port() {
+    struct sockaddr_in  addr;
+    socklen_t           len = sizeof(addr);
+    int                 fd;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert(getsockname(fd, (struct sockaddr*) &addr, &len) == 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+    nanosleep(&ts, NULL);
+}
+
+// The only child of the master, 0 if there is none
+static pid_t worker_of(pid_t master) {
+    char    path[64];
+    FILE    *f;
+    int     pid = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", master, master);
+    f = fopen(path, "r");
+    assert(f != NULL);
+    if (fscanf(f, "%d", &pid) != 1) {
+        pid = 0;
+    }
+    fclose(f);
+    return pid;
+}
+
+// Waits up to the given time for a worker other than the one given
+static pid_t wait_worker(pid_t master, pid_t old, long ms) {
+    pid_t   pid;
+
+    for (; ms > 0; ms -= 50) {
+        pid = worker_of(master);
+        if (pid > 0 && pid != old) {
+            return pid;
+        }
+        sleep_ms(50);
+    }
+    return 0;
+}
+
+/*
+ * Run a server on the port in a child process, with the given workers
+ * and limits.
+ */
+static pid_t start_server(int port, int workers, unsigned long worker_connections,
+                          unsigned long max_connections, int pause) {
+    server_t    *server;
+    pid_t       pid;
+
+    fflush(NULL);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // Not left running when a test fails
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        server = server_create();
+        assert(server != NULL);
+        server->addr = "127.0.0.1";
+        server->port = port;
+        server->workers = workers;
+        server->worker_connections = worker_connections;
+        server->max_connections = max_connections;
+        server->overload_pause = pause;
+        server->loglevel = ERROR;
+        server->handler = ok_handler;
+        exit(server_start(server) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    int     status;
+
+    assert(kill(pid, SIGTERM) == 0);
+    assert(waitpid(pid, &status, 0) == pid);
+}
+
+// Connects once the server listens
+static int connect_to(int port) {
+    struct sockaddr_in  addr;
+    int                 fd, i;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 40; i++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        sleep_ms(50);
+    }
+    assert(0);
+    return -1;
+}
+
+/*
+ * Wait for the status line of a response, returns its code, or 0 if
+ * none came in time.
+ */
+static int read_status(int fd, int timeout_ms) {
+    char            buf[512];
+    struct pollfd   pfd = {fd, POLLIN, 0};
+    ssize_t         n;
+
+    if (poll(&pfd, 1, timeout_ms) != 1) {
+        return 0;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    if (n < 12 || strncmp(buf, "HTTP/1.1 ", 9) != 0) {
+        return 0;
+    }
+    return atoi(buf + 9);
+}
+
+static int request_status(int fd, int timeout_ms) {
+    static const char   request[] = "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
+
+    assert(write(fd, request, sizeof(request) - 1) == sizeof(request) - 1);
+    return read_status(fd, timeout_ms);
+}
+
+void test_worker_signals() {
+    pid_t   master, worker, next;
+    int     status;
+
+    info("Testing the signals of the workers");
+    master = start_server(free_port(), 1, 0, 0, 0);
+    worker = wait_worker(master, 0, 2000);
+    assert(worker > 0);
+
+    // SIGUSR2 is for the master, a worker goes on
+    assert(kill(worker, SIGUSR2) == 0);
+    sleep_ms(300);
+    assert(kill(worker, 0) == 0);
+    assert(worker_of(master) == worker);
+
+    // Killed as it started, it is started again only after a delay
+    assert(kill(worker, SIGKILL) == 0);
+    sleep_ms(300);
+    assert(worker_of(master) == 0);
+    next = wait_worker(master, worker, 3000);
+    assert(next > 0);
+
+    assert(kill(master, SIGTERM) == 0);
+    assert(waitpid(master, &status, 0) == master);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+void test_overload() {
+    pid_t   pid;
+    int     port, held, fd;
+    char    c;
+
+    info("Testing connections past the limits");
+    // Shed with 503 right away once the worker is full
+    port = free_port();
+    pid = start_server(port, 0, 1, 0, 0);
+    held = connect_to(port);
+    assert(request_status(held, 2000) == 200);
+    fd = connect_to(port);
+    assert(request_status(fd, 2000) == 503);
+    // And closed after it, without a reset
+    assert(read(fd, &c, 1) == 0);
+    close(fd);
+    close(held);
+    stop_server(pid);
+
+    // Left waiting until a connection is closed
+    port = free_port();
+    pid = start_server(port, 0, 1, 0, 1);
+    held = connect_to(port);
+    assert(request_status(held, 2000) == 200);
+    fd = connect_to(port);
+    assert(request_status(fd, 300) == 0);
+    close(held);
+    assert(read_status(fd, 2000) == 200);
+    close(fd);
+    stop_server(pid);
+
+    // The cap counts the connections of all the workers
+    port = free_port();
+    pid = start_server(port, 2, 0, 1, 0);
+    held = connect_to(port);
+    assert(request_status(held, 2000) == 200);
+    fd = connect_to(port);
+    assert(request_status(fd, 2000) == 503);
+    close(fd);
+    // Served again once the worker that had it is done with it
+    close(held);
+    sleep_ms(200);
+    fd = connect_to(port);
+    assert(request_status(fd, 2000) == 200);
+    close(fd);
+    stop_server(pid);
+}
+
+/*
+ * The server of a configuration with the given "listen", NULL if it is
+ * refused.
+ */
+static server_t *parse_listen(const char *listen) {
+    char        path[] = "/tmp/test_server_XXXXXX", conf[1024];
+    server_t    *server;
+    int         fd;
+
+    snprintf(conf, sizeof(conf), "{\"listen\": %s, \"sites\": [{\"host\": \"*\", "
+             "\"locations\": [{\"path\": \"/\", \"module\": \"static\", "
+             "\"root\": \"/tmp\"}]}]}", listen);
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, conf, strlen(conf)) == strlen(conf));
+    close(fd);
+    server = server_parse_conf(path);
+    unlink(path);
+    return server;
+}
+
+static int listener_port(listener_t *listener) {
+    if (listener->sockaddr.ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6*) &listener->sockaddr)->sin6_port);
+    }
+    return ntohs(((struct sockaddr_in*) &listener->sockaddr)->sin_port);
+}
+
+void test_listen_addresses() {
+    server_t            *server;
+    listener_t          *listener;
+    struct sockaddr_in  *in;
+    struct sockaddr_in6 *in6;
+    char                listen[256];
+
+    info("Testing listen addresses");
+    server = parse_listen("\"127.0.0.1:8081\"");
+    assert(server != NULL && server->listener_count == 1);
+    listener = server->listeners;
+    in = (struct sockaddr_in*) &listener->sockaddr;
+    assert(in->sin_family == AF_INET && listener_port(listener) == 8081);
+    assert(in->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+    assert(strcmp(listener->address, "127.0.0.1:8081") == 0);
+    server_destroy(server);
+
+    server = parse_listen("\"[::1]:8082\"");
+    assert(server != NULL);
+    in6 = (struct sockaddr_in6*) &server->listeners[0].sockaddr;
+    assert(in6->sin6_family == AF_INET6);
+    assert(listener_port(server->listeners) == 8082);
+    assert(IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr));
+    server_destroy(server);
+
+    // Without a port it is 80
+    server = parse_listen("\"127.0.0.1\"");
+    assert(server != NULL && listener_port(server->listeners) == 80);
+    server_destroy(server);
+    server = parse_listen("\"[::1]\"");
+    assert(server != NULL && listener_port(server->listeners) == 80);
+    server_destroy(server);
+
+    server = parse_listen("\"unix:/run/breeze.sock\"");
+    assert(server != NULL);
+    assert(server->listeners[0].sockaddr.ss_family == AF_UNIX);
+    assert(strcmp(((struct sockaddr_un*) &server->listeners[0].sockaddr)->sun_path,
+                  "/run/breeze.sock") == 0);
+    server_destroy(server);
+
+    // A path longer than sun_path can hold
+    snprintf(listen, sizeof(listen), "\"unix:/%0*d\"", 120, 0);
+    assert(parse_listen(listen) == NULL);
+    assert(parse_listen("\"[::1:80\"") == NULL);
+}
+
+void test_listeners() {
+    server_t    *server;
+    listener_t  *listener;
+
+    info("Testing listeners");
+    server = parse_listen("[\"127.0.0.1:8083\", {\"address\": \"[::1]:8084\", "
+                          "\"backlog\": 16, \"defer_accept\": 3, "
+                          "\"fastopen\": 5, \"ipv6only\": true}]");
+    assert(server != NULL && server->listener_count == 2);
+    assert(listener_port(server->listeners) == 8083);
+    assert(server->listeners[0].backlog == 0);
+    listener = server->listeners + 1;
+    assert(listener->sockaddr.ss_family == AF_INET6);
+    assert(listener_port(listener) == 8084);
+    assert(listener->backlog == 16 && listener->defer_accept == 3);
+    assert(listener->fastopen == 5 && listener->ipv6only == 1);
+    assert(listener->server == server);
+    server_destroy(server);
+
+    server = parse_listen("{\"address\": \"unix:/run/breeze.sock\"}");
+    assert(server != NULL && server->listener_count == 1);
+    assert(server->listeners[0].sockaddr.ss_family == AF_UNIX);
+    server_destroy(server);
+
+    assert(parse_listen("{\"backlog\": 16}") == NULL);
+    assert(parse_listen("8080") == NULL);
+    assert(parse_listen("[\"127.0.0.1:8085\", 8086]") == NULL);
+}
+
+int main(int argc, char *argv[]) {
+    print_stacktrace_on_error();
+    test_worker_signals();
+    test_overload();
+    test_listen_addresses();
+    test_listeners();
+    info("All tests finished.");
+    return 0;
+}
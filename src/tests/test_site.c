@@ -6,6 +6,12 @@
 #include <string.h>
 #include <assert.h>
 
+// The site handler routes on the decoded path and its length
+static void set_path(request_t *req, char *path) {
+    req->path = path;
+    req->path_len = strlen(path);
+}
+
 static void test_create_site_conf() {
     site_conf_t  *conf = site_conf_create();
     assert(conf != NULL);
@@ -150,27 +156,27 @@ void test_handler_single_site() {
     req.host = "jerrypeng.me";
 
     ctx.conf = conf;
-    req.path = "/foo/bar";
+    set_path(&req, "/foo/bar");
     assert(site_handler(&req, &resp, &ctx) == FOOBAR_VAL);
 
     ctx.conf = conf;
-    req.path = "/foo/bar1";
+    set_path(&req, "/foo/bar1");
     assert(site_handler(&req, &resp, &ctx) == FOO_VAL);
     
     ctx.conf = conf;
-    req.path = "/bar/1";
+    set_path(&req, "/bar/1");
     assert(site_handler(&req, &resp, &ctx) == BAR_VAL);
     
     ctx.conf = conf;
-    req.path = "/foo/bar/foo.jpg";
+    set_path(&req, "/foo/bar/foo.jpg");
     assert(site_handler(&req, &resp, &ctx) == JPG_VAL);
 
     ctx.conf = conf;    
-    req.path = "/foo.jpg";
+    set_path(&req, "/foo.jpg");
     assert(site_handler(&req, &resp, &ctx) == JPG_VAL);
 
     ctx.conf = conf;    
-    req.path = "/";
+    set_path(&req, "/");
     assert(site_handler(&req, &resp, &ctx) == ROOT_VAL);
 
 }
@@ -197,20 +203,81 @@ void test_handler_multi_site() {
     req.host = "jerrypeng.me"; // Unknown host will go to the first
                                // one configured.
     ctx.conf = conf;
-    req.path = "/foo/bar";
+    set_path(&req, "/foo/bar");
     assert(site_handler(&req, &resp, &ctx) == FOO_VAL);
 
     req.host = "foo.com";
     ctx.conf = conf;
-    req.path = "/foo/bar";
+    set_path(&req, "/foo/bar");
     assert(site_handler(&req, &resp, &ctx) == FOO_VAL);
 
     req.host = "bar.com";
     ctx.conf = conf;
-    req.path = "/";
+    set_path(&req, "/");
     assert(site_handler(&req, &resp, &ctx) == BAR_VAL);
 }
 
+#define FILES_VAL  95
+
+int app_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    // Authorized, the file is served by another location
+    return request_internal_redirect(req, resp, ctx, "/files/a/../b.bin?part=2");
+}
+
+int files_handler(request_t *req, response_t *resp, handler_ctx_t *ctx) {
+    assert(strcmp(req->path, "/files/b.bin") == 0);
+    assert(strcmp(request_get_query_param(req, "part"), "2") == 0);
+    assert(ctx->conf == (void*) "files");
+    return FILES_VAL;
+}
+
+void test_internal_redirect() {
+    site_conf_t   *conf = site_conf_create();
+    site_t        *site = site_create("jerrypeng.me");
+    server_t      server;
+    connection_t  conn;
+    request_t     *req;
+    response_t    *resp;
+    handler_ctx_t *ctx;
+    location_t    *loc;
+    char          *data = "GET /app/download?part=1 HTTP/1.1\r\nHost: jerrypeng.me\r\n\r\n";
+    size_t        consumed;
+
+    bzero(&server, sizeof(server_t));
+    bzero(&conn, sizeof(connection_t));
+    server.handler = site_handler;
+    server.handler_conf = conf;
+    conn.server = &server;
+    conn.arena = arena_create(ARENA_CHUNK_SIZE);
+    req = request_create(&conn);
+    resp = response_create(&conn);
+    ctx = context_create();
+    conn.request = req;
+    conn.response = resp;
+
+    assert(site_conf_add_site(conf, site) == 0);
+    assert(site_add_location(site, URI_PREFIX, "/app", app_handler, NULL) == 0);
+    assert(site_add_location(site, URI_PREFIX, "/files", files_handler, "files") == 0);
+    for (loc = site->location_head->next; loc != NULL; loc = loc->next) {
+        if (loc->handler == files_handler) {
+            loc->internal = 1;
+        }
+    }
+
+    assert(request_parse_headers(req, data, strlen(data), &consumed) == STATUS_COMPLETE);
+    assert(request_decode_url(req) == 0);
+    ctx->conf = conf;
+    assert(site_handler(req, resp, ctx) == FILES_VAL);
+    assert(req->internal_redirects == 1);
+    // The request is not parsed again
+    assert(strcmp(req->host, "jerrypeng.me") == 0);
+
+    context_destroy(ctx);
+    response_destroy(resp);
+    request_destroy(req);
+    arena_destroy(conn.arena);
+}
+
 int main(int argc, char *argv[]) {
     print_stacktrace_on_error();
     test_create_site_conf();
@@ -219,6 +286,7 @@ int main(int argc, char *argv[]) {
     test_add_location();
     test_handler_single_site();
     test_handler_multi_site();
+    test_internal_redirect();
     info("All tests finished.");
     return 0;
 }
@@ -0,0 +1,206 @@
+#!/usr/bin/env python
+#
+# Generate src/http_headers.h and src/http_headers.c: the IDs of the
+# standard HTTP headers and a perfect hash to find them by name.
+#
+# The hash is FNV-1a over the lowercased name, the top bits of it index
+# a slot table. A seed is searched so that no two headers share a slot.
+#
+# Usage: tools/gen_http_headers.py [output dir]
+
+import os
+import sys
+
+HEADERS = [
+    "Accept",
+    "Accept-Charset",
+    "Accept-Datetime",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Accept-Ranges",
+    "Access-Control-Allow-Origin",
+    "Age",
+    "Allow",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Disposition",
+    "Content-Encoding",
+    "Content-Language",
+    "Content-Length",
+    "Content-Location",
+    "Content-MD5",
+    "Content-Range",
+    "Content-Security-Policy",
+    "Content-Type",
+    "Cookie",
+    "DNT",
+    "Date",
+    "ETag",
+    "Expect",
+    "Expires",
+    "From",
+    "Front-End-Https",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Last-Modified",
+    "Link",
+    "Location",
+    "Max-Forwards",
+    "Origin",
+    "P3P",
+    "Pragma",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "Proxy-Connection",
+    "Range",
+    "Referer",
+    "Refresh",
+    "Retry-After",
+    "Server",
+    "Set-Cookie",
+    "Status",
+    "Strict-Transport-Security",
+    "TE",
+    "Trailer",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "Vary",
+    "Via",
+    "WWW-Authenticate",
+    "Warning",
+    "X-ATT-DeviceId",
+    "X-Content-Security-Policy",
+    "X-Content-Type-Options",
+    "X-Forwarded-For",
+    "X-Forwarded-Proto",
+    "X-Frame-Options",
+    "X-Powered-By",
+    "X-Requested-With",
+    "X-WAP-Profile",
+    "X-WebKit-CSP",
+    "X-XSS-Protection",
+    "X-UA-Compatible",
+]
+
+HASH_BITS = 9
+FNV_PRIME = 16777619
+
+
+def header_hash(name, seed):
+    h = seed
+    for c in name:
+        h = ((h ^ (ord(c) | 0x20)) * FNV_PRIME) & 0xffffffff
+    return h >> (32 - HASH_BITS)
+
+
+def find_seed():
+    for seed in range(2166136261, 2166136261 + 1000000):
+        slots = set(header_hash(name, seed) for name in HEADERS)
+        if len(slots) == len(HEADERS):
+            return seed
+    raise Exception("No perfect hash seed found, raise HASH_BITS")
+
+
+def const_name(name):
+    return "HTTP_HEADER_" + name.upper().replace("-", "_")
+
+
+BANNER = "/* Generated by tools/gen_http_headers.py, do not edit. */\n"
+
+
+def gen_header():
+    out = [BANNER,
+           "#ifndef __HTTP_HEADERS_H",
+           "#define __HTTP_HEADERS_H",
+           "",
+           "#include <stddef.h>",
+           "",
+           "typedef enum _http_header_id {",
+           "    HTTP_HEADER_UNKNOWN = -1,"]
+    for i, name in enumerate(HEADERS):
+        out.append("    %s = %d," % (const_name(name), i))
+    out += ["    HTTP_HEADER_COUNT",
+            "} http_header_id_e;",
+            "",
+            "extern const char   *http_header_names[HTTP_HEADER_COUNT];",
+            "extern const size_t http_header_lens[HTTP_HEADER_COUNT];",
+            "",
+            "/*",
+            " * Find the ID of a standard header by its name, case insensitively.",
+            " * Returns HTTP_HEADER_UNKNOWN for the other headers.",
+            " */",
+            "http_header_id_e http_header_lookup(const char *name, size_t len);",
+            "",
+            "#endif /* end of include guard: __HTTP_HEADERS_H */",
+            ""]
+    return "\n".join(out)
+
+
+def gen_source(seed):
+    slots = [-1] * (1 << HASH_BITS)
+    for i, name in enumerate(HEADERS):
+        slots[header_hash(name, seed)] = i
+    max_len = max(len(name) for name in HEADERS)
+
+    out = [BANNER,
+           '#include "http_headers.h"',
+           "#include <stdint.h>",
+           "#include <strings.h>",
+           "",
+           "#define HEADER_HASH_SEED    %du" % seed,
+           "#define HEADER_HASH_BITS    %d" % HASH_BITS,
+           "#define HEADER_MAX_LEN      %d" % max_len,
+           "",
+           "const char *http_header_names[HTTP_HEADER_COUNT] = {"]
+    for name in HEADERS:
+        out.append('    "%s",' % name)
+    out += ["};", "",
+            "const size_t http_header_lens[HTTP_HEADER_COUNT] = {"]
+    for name in HEADERS:
+        out.append("    %d," % len(name))
+    out += ["};", "",
+            "static const signed char header_slots[1 << HEADER_HASH_BITS] = {"]
+    for i in range(0, len(slots), 16):
+        out.append("    " + " ".join("%d," % s for s in slots[i:i + 16]))
+    out += ["};",
+            "",
+            "http_header_id_e http_header_lookup(const char *name, size_t len) {",
+            "    uint32_t    h = HEADER_HASH_SEED;",
+            "    size_t      i;",
+            "    int         id;",
+            "",
+            "    if (len > HEADER_MAX_LEN) {",
+            "        return HTTP_HEADER_UNKNOWN;",
+            "    }",
+            "    for (i = 0; i < len; i++) {",
+            "        h = (h ^ ((unsigned char) name[i] | 0x20)) * %du;" % FNV_PRIME,
+            "    }",
+            "    id = header_slots[h >> (32 - HEADER_HASH_BITS)];",
+            "    if (id < 0 || http_header_lens[id] != len",
+            "        || strncasecmp(name, http_header_names[id], len) != 0) {",
+            "        return HTTP_HEADER_UNKNOWN;",
+            "    }",
+            "    return (http_header_id_e) id;",
+            "}",
+            ""]
+    return "\n".join(out)
+
+
+def main():
+    outdir = sys.argv[1] if len(sys.argv) > 1 else \
+        os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src")
+    seed = find_seed()
+    with open(os.path.join(outdir, "http_headers.h"), "w") as f:
+        f.write(gen_header())
+    with open(os.path.join(outdir, "http_headers.c"), "w") as f:
+        f.write(gen_source(seed))
+
+
+if __name__ == "__main__":
+    main()